@@ -22,19 +22,14 @@ VrtsVideoServer::VrtsVideoServer(const std::string& upstream_ip, int upstream_po
 VrtsVideoServer::~VrtsVideoServer()
 {
     shutdown();
-    if (_log_file.is_open()) {
-        _log_file.close();
+    if (_logging_enabled) {
+        vrts::Tracer::instance().openTraceFile("");
     }
 }
 
 std::string VrtsVideoServer::getVRTSLogs() {
-    std::lock_guard<std::mutex> lock(_log_mutex);
-
-    std::ostringstream logs;  // Declare logs as a local variable here
-    for (const auto& message : _vrts_log_buffer) {
-        logs << message << "\n";
-    }
-    return logs.str();  // Return the collected log messages as a single string
+    // Formatted here, on the caller's thread, not where they were logged.
+    return vrts::Tracer::instance().drainText();
 }
 
 
@@ -115,33 +110,23 @@ void VrtsVideoServer::shutdown()
 
 void VrtsVideoServer::enableLogging(const std::string& path)
 {
-    std::lock_guard<std::mutex> lock(_log_mutex);
-    _log_file.open(path, std::ios::out | std::ios::app);
-    if (_log_file.is_open()) {
-        _logging_enabled = true;
-        _log_file << "Logging started.\n";
-        std::cout << "Logging enabled at: " << path << std::endl;
+    // Binary trace of the server and VRTS, read with vrts-tracedump.
+    if (vrts::Tracer::instance().openTraceFile(path)) {
+        _logging_enabled = !path.empty();
+        vrc_log("Logging enabled at: " + path);
     } else {
         std::cerr << "Failed to open log file: " << path << std::endl;
     }
 }
 
-void VrtsVideoServer::vrc_log(const std::string& message) {
-    std::lock_guard<std::mutex> lock(_log_mutex);
-
-    // Write to file if logging is enabled
-    if (_logging_enabled && _log_file.is_open()) {
-        _log_file << message << std::endl;
-    }
-
-    // Store in the VRTS log buffer
-    _vrts_log_buffer.push_back(message);
-    if (_vrts_log_buffer.size() > _vrts_log_buffer_size) {
-        _vrts_log_buffer.erase(_vrts_log_buffer.begin());  // Remove the oldest log if buffer is full
-    }
+void VrtsVideoServer::enableCapture(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(_forward_mutex);
+    _capture_path = path;
+}
 
-    // Also output to console
-    std::cout << message << std::endl;
+void VrtsVideoServer::vrc_log(const std::string& message) {
+    VRTS_TRACE(INFO, "{}", message);
 }
 
 
@@ -152,24 +137,56 @@ void VrtsVideoServer::run()
     _vrts = std::make_shared<vrts::VRTS>(_dnstream_port, _upstream_port, _dnstream_ip, _upstream_ip, 100);
     vrc_log("VRTS up stream IP: " + _upstream_ip + " port: " + std::to_string(_upstream_port));
     vrc_log("VRTS dn stream IP: " + _dnstream_ip + " port: " + std::to_string(_dnstream_port));
+    std::string capture_path;
+    {
+        std::lock_guard<std::mutex> lock(_forward_mutex);
+        capture_path = _capture_path;
+    }
+    if (!capture_path.empty()) {
+        if (_vrts->startCapture(capture_path)) {
+            vrc_log("Capturing link at: " + capture_path);
+        } else {
+            vrc_log("Failed to open capture file: " + capture_path);
+        }
+    }
+    // Sleep until a stream has data rather than polling all of them.
+    _vrts->setDataReadyCallback([this](uint8_t) {
+        {
+            std::lock_guard<std::mutex> lock(_data_mutex);
+            _data_pending = true;
+        }
+        _data_cv.notify_one();
+    });
 
     int time_nodata_received = 0;
     while (_keep_running) {
-        if (_vrts->dataReady()) {
-            const auto nal_in = _vrts->getDataAsMPEGTS();
+        bool received = false;
+        // Each stream goes to its own port, counting up from the forward port.
+        for (uint8_t stream = 0; stream < vrts::vrts_max_streams; stream++) {
+            if (!_vrts->dataReady(stream)) {
+                continue;
+            }
+            const auto nal_in = _vrts->getDataAsMPEGTS(stream);
             _packets_received++;
+            received = true;
+            udpSend(const_cast<uint8_t*>(nal_in.data()),
+                    static_cast<uint16_t>(nal_in.size()), _forward_port + stream);
+        }
+        if (received) {
             if (_connections == 0) {
                 _connections = 1;
                 _disconnects = 0;
                 vrc_log("VRTS client connected");
             }
             time_nodata_received = 0;
-
-            udpSend(const_cast<uint8_t*>(nal_in.data()),
-                    static_cast<uint16_t>(nal_in.size()), _forward_port);
         } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(2));
-            time_nodata_received += 2;
+            auto wait_start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(_data_mutex);
+            _data_cv.wait_for(lock, std::chrono::milliseconds(100),
+                              [this] { return _data_pending; });
+            _data_pending = false;
+            time_nodata_received += std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - wait_start).count();
             if (_connections && time_nodata_received > 1000) {
                 _disconnects += 1;
                 _connections = 0;
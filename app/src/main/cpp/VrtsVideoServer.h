@@ -4,25 +4,19 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <atomic>
-#include <fstream>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 #include "VRTS.h"
-#include <sstream>
 
 using VRTSSp = std::shared_ptr<vrts::VRTS>;
 
 class VrtsVideoServer
-{private:
-    std::ostringstream logs;
-    std::vector<std::string> _vrts_log_buffer;  // Buffer to store recent VRTS log entries
-    const size_t _vrts_log_buffer_size = 1000;  // Maximum size for the VRTS log buffer
-
-
-
+{
 public:
+    /// Log lines of the server and VRTS since the last call.
     std::string getVRTSLogs();
 
     // Add this method declaration in the public section
@@ -41,6 +35,9 @@ public:
     int forwardingErrors() const { return _forward_errors; }
 
     void enableLogging(const std::string& path = "");
+    /// Record the link to a pcapng file for vrts-replay, from the next
+    /// startup() on. An empty path turns it off again.
+    void enableCapture(const std::string& path = "");
 
 protected:
     struct StatData
@@ -67,6 +64,10 @@ protected:
     std::atomic<bool> _keep_running;
     std::thread run_thread;
     std::mutex _forward_mutex;
+    // Set by VRTS when a block was queued for any stream.
+    std::mutex _data_mutex;
+    std::condition_variable _data_cv;
+    bool _data_pending = false;
     struct sockaddr_in _forward_addr;
     uint16_t _forward_port;
     int _tx_socket = -1;
@@ -77,9 +78,8 @@ protected:
     int _forward_errors = 0;
 
     // Logging variables
-    std::ofstream _log_file;                 // Log file stream
-    std::mutex _log_mutex;                   // Mutex for thread-safe logging
-    bool _logging_enabled = false;           // Flag to check if logging is enabled
+    bool _logging_enabled = false;           // Flag to check if a trace file is open
+    std::string _capture_path;               // Read when the session starts
 };
 
 #endif // VRTS_VIDEO_SERVER_H
@@ -183,6 +183,8 @@ Java_com_example_vantageradioui_ui_main_ScrollingFragment_getRadioLog(JNIEnv *en
     for (int i = 0; i < entries; i++) {
         output += radio_control::get_vrc_log();
     }
+    // Then whatever the video link traced since the last call.
+    output += vrts::Tracer::instance().drainText();
 
     const char *str = output.c_str();
     jobject bb = env->NewDirectByteBuffer((void *) str, strlen(str));
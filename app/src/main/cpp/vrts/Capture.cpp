@@ -0,0 +1,418 @@
+#include "Capture.h"
+#include <algorithm>
+#include <string.h>
+
+namespace vrts {
+
+// pcapng block types and the option codes used here, see
+// draft-ietf-opsawg-pcapng.
+static constexpr uint32_t block_section_header = 0x0A0D0D0A;
+static constexpr uint32_t block_interface = 0x00000001;
+static constexpr uint32_t block_enhanced_packet = 0x00000006;
+static constexpr uint32_t byte_order_magic = 0x1A2B3C4D;
+static constexpr uint16_t option_end = 0;
+static constexpr uint16_t option_if_name = 2;
+static constexpr uint16_t option_if_tsresol = 9;
+static constexpr uint16_t option_epb_flags = 2;
+static constexpr uint32_t epb_inbound = 1;
+static constexpr uint32_t epb_outbound = 2;
+static constexpr uint32_t epb_direction_mask = 3;
+static constexpr uint16_t linktype_ipv4 = 228;
+static constexpr uint16_t linktype_user0 = 147;
+static constexpr uint32_t snap_length = 65535;
+// Interfaces as CaptureWriter lays them out.
+static constexpr uint32_t datagram_interface = 0;
+static constexpr uint32_t input_interface = 1;
+static constexpr size_t ip_header_bytes = 20;
+static constexpr size_t udp_header_bytes = 8;
+// Anything bigger is a damaged file rather than a packet.
+static constexpr uint32_t max_block_bytes = 16 * 1024 * 1024;
+static constexpr uint64_t ns_per_second = 1000000000ull;
+
+static void put16(std::vector<uint8_t> &out, uint16_t value) {
+  out.insert(out.end(), reinterpret_cast<uint8_t *>(&value),
+             reinterpret_cast<uint8_t *>(&value) + sizeof(value));
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t value) {
+  out.insert(out.end(), reinterpret_cast<uint8_t *>(&value),
+             reinterpret_cast<uint8_t *>(&value) + sizeof(value));
+}
+
+static void pad32(std::vector<uint8_t> &out) {
+  out.resize((out.size() + 3) & ~size_t(3), 0);
+}
+
+static void putOption(std::vector<uint8_t> &out, uint16_t code,
+                      const void *value, uint16_t len) {
+  put16(out, code);
+  put16(out, len);
+  auto bytes = static_cast<const uint8_t *>(value);
+  out.insert(out.end(), bytes, bytes + len);
+  pad32(out);
+}
+
+static void putBigEndian16(uint8_t *out, uint16_t value) {
+  out[0] = value >> 8;
+  out[1] = value & 0xff;
+}
+
+static void putBigEndian32(uint8_t *out, uint32_t value) {
+  putBigEndian16(out, value >> 16);
+  putBigEndian16(out + 2, value & 0xffff);
+}
+
+static uint16_t getBigEndian16(const uint8_t *in) {
+  return static_cast<uint16_t>(in[0] << 8 | in[1]);
+}
+
+template <typename T> static T get(const uint8_t *in) {
+  T value;
+  memcpy(&value, in, sizeof(value));
+  return value;
+}
+
+/// @brief A block is its type and total length, the body, padded to 32
+/// bits, and the total length again.
+static bool writeBlock(FILE *file, uint32_t type,
+                       const std::vector<uint8_t> &body) {
+  uint32_t total = static_cast<uint32_t>(body.size() + 3 * sizeof(uint32_t));
+  return fwrite(&type, sizeof(type), 1, file) == 1 &&
+         fwrite(&total, sizeof(total), 1, file) == 1 &&
+         fwrite(body.data(), 1, body.size(), file) == body.size() &&
+         fwrite(&total, sizeof(total), 1, file) == 1;
+}
+
+static std::vector<uint8_t> interfaceBlock(uint16_t link_type,
+                                           const char *name) {
+  std::vector<uint8_t> body;
+  put16(body, link_type);
+  put16(body, 0);
+  put32(body, snap_length);
+  putOption(body, option_if_name, name, static_cast<uint16_t>(strlen(name)));
+  uint8_t nanoseconds = 9;
+  putOption(body, option_if_tsresol, &nanoseconds, sizeof(nanoseconds));
+  putOption(body, option_end, nullptr, 0);
+  return body;
+}
+
+static uint64_t toNs(std::chrono::system_clock::time_point time) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                time.time_since_epoch())
+                .count();
+  return ns > 0 ? static_cast<uint64_t>(ns) : 0;
+}
+
+CaptureWriter::CaptureWriter()
+    : capturing{false}, written{0}, file{nullptr}, endpoints{}, ip_id{0} {}
+
+CaptureWriter::~CaptureWriter() { close(); }
+
+bool CaptureWriter::open(const std::string &path,
+                         const capture_endpoints_t &new_endpoints) {
+  close();
+  std::lock_guard<std::mutex> lock{file_mutex};
+  file = fopen(path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  endpoints = new_endpoints;
+  ip_id = 0;
+  written = 0;
+
+  std::vector<uint8_t> section;
+  put32(section, byte_order_magic);
+  put16(section, 1);
+  put16(section, 0);
+  // Section length unknown.
+  put32(section, 0xffffffff);
+  put32(section, 0xffffffff);
+  if (!writeBlock(file, block_section_header, section) ||
+      !writeBlock(file, block_interface,
+                  interfaceBlock(linktype_ipv4, "vrts")) ||
+      !writeBlock(file, block_interface,
+                  interfaceBlock(linktype_user0, "vrts-input"))) {
+    fclose(file);
+    file = nullptr;
+    return false;
+  }
+  capturing = true;
+  return true;
+}
+
+void CaptureWriter::close(void) {
+  std::lock_guard<std::mutex> lock{file_mutex};
+  capturing = false;
+  if (file) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+void CaptureWriter::datagram(capture_kind_t kind, const struct iovec *iov,
+                             size_t iovcnt,
+                             std::chrono::system_clock::time_point time) {
+  if (!isOpen()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{file_mutex};
+  if (!file) {
+    return;
+  }
+  size_t payload = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    payload += iov[i].iov_len;
+  }
+  bool inbound = kind == CAPTURE_RX;
+  packet.assign(ip_header_bytes + udp_header_bytes, 0);
+  uint8_t *ip = packet.data();
+  ip[0] = 0x45;
+  putBigEndian16(ip + 2, static_cast<uint16_t>(ip_header_bytes +
+                                               udp_header_bytes + payload));
+  putBigEndian16(ip + 4, ip_id++);
+  // Don't fragment.
+  ip[6] = 0x40;
+  ip[8] = 64;
+  ip[9] = 17;
+  putBigEndian32(ip + 12, inbound ? endpoints.remote_ip : endpoints.local_ip);
+  putBigEndian32(ip + 16, inbound ? endpoints.local_ip : endpoints.remote_ip);
+  uint32_t sum = 0;
+  for (size_t i = 0; i < ip_header_bytes; i += 2) {
+    sum += getBigEndian16(ip + i);
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  putBigEndian16(ip + 10, static_cast<uint16_t>(~sum));
+  // UDP checksum left out, which IPv4 allows.
+  uint8_t *udp = ip + ip_header_bytes;
+  putBigEndian16(udp,
+                 inbound ? endpoints.remote_port : endpoints.local_port);
+  putBigEndian16(udp + 2,
+                 inbound ? endpoints.local_port : endpoints.remote_port);
+  putBigEndian16(udp + 4, static_cast<uint16_t>(udp_header_bytes + payload));
+  for (size_t i = 0; i < iovcnt; i++) {
+    auto base = static_cast<const uint8_t *>(iov[i].iov_base);
+    packet.insert(packet.end(), base, base + iov[i].iov_len);
+  }
+  writePacket(datagram_interface, inbound ? epb_inbound : epb_outbound, time);
+}
+
+void CaptureWriter::input(uint8_t stream_id, const uint8_t *data, size_t len,
+                          std::chrono::system_clock::time_point time) {
+  if (!isOpen()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{file_mutex};
+  if (!file) {
+    return;
+  }
+  packet.assign(1, stream_id);
+  packet.insert(packet.end(), data, data + len);
+  writePacket(input_interface, epb_inbound, time);
+}
+
+/// @details Caller holds file_mutex, the packet is in packet.
+void CaptureWriter::writePacket(uint32_t interface_id, uint32_t flags,
+                                std::chrono::system_clock::time_point time) {
+  uint64_t ns = toNs(time);
+  std::vector<uint8_t> body;
+  body.reserve(packet.size() + 40);
+  put32(body, interface_id);
+  put32(body, static_cast<uint32_t>(ns >> 32));
+  put32(body, static_cast<uint32_t>(ns & 0xffffffff));
+  put32(body, static_cast<uint32_t>(packet.size()));
+  put32(body, static_cast<uint32_t>(packet.size()));
+  body.insert(body.end(), packet.begin(), packet.end());
+  pad32(body);
+  putOption(body, option_epb_flags, &flags, sizeof(flags));
+  putOption(body, option_end, nullptr, 0);
+  if (!writeBlock(file, block_enhanced_packet, body)) {
+    // Most likely out of space. Better a short capture than a broken one.
+    fclose(file);
+    file = nullptr;
+    capturing = false;
+    return;
+  }
+  written++;
+}
+
+CaptureReader::CaptureReader() : file{nullptr}, damaged{false} {}
+
+CaptureReader::~CaptureReader() { close(); }
+
+bool CaptureReader::open(const std::string &path) {
+  close();
+  file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  uint32_t type;
+  if (!readBlock(type) || type != block_section_header) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CaptureReader::close(void) {
+  if (file) {
+    fclose(file);
+    file = nullptr;
+  }
+  damaged = false;
+  interfaces.clear();
+}
+
+/// @details Leaves the body, without the trailing length, in block. Only
+/// sections in host byte order are understood.
+bool CaptureReader::readBlock(uint32_t &type) {
+  uint32_t header[2];
+  size_t got = fread(header, 1, sizeof(header), file);
+  if (got != sizeof(header)) {
+    damaged = got != 0;
+    return false;
+  }
+  type = header[0];
+  uint32_t total = header[1];
+  if (total < 3 * sizeof(uint32_t) || total % 4 != 0 ||
+      total > max_block_bytes) {
+    damaged = true;
+    return false;
+  }
+  block.resize(total - sizeof(header));
+  if (fread(block.data(), 1, block.size(), file) != block.size() ||
+      get<uint32_t>(&block[block.size() - sizeof(uint32_t)]) != total) {
+    damaged = true;
+    return false;
+  }
+  block.resize(block.size() - sizeof(uint32_t));
+  if (type == block_section_header) {
+    if (block.size() < sizeof(uint32_t) ||
+        get<uint32_t>(block.data()) != byte_order_magic) {
+      damaged = true;
+      return false;
+    }
+    interfaces.clear();
+  }
+  return true;
+}
+
+void CaptureReader::addInterface(void) {
+  interface_t interface = {0, 1000000};
+  if (block.size() >= 8) {
+    interface.link_type = get<uint16_t>(block.data());
+  }
+  size_t pos = 8;
+  while (pos + 4 <= block.size()) {
+    uint16_t code = get<uint16_t>(&block[pos]);
+    uint16_t len = get<uint16_t>(&block[pos + 2]);
+    pos += 4;
+    if (code == option_end || pos + len > block.size()) {
+      break;
+    }
+    if (code == option_if_tsresol && len >= 1) {
+      uint8_t resolution = block[pos];
+      uint64_t units = 1;
+      // High bit set: a power of two, otherwise of ten.
+      for (int i = 0; i < (resolution & 0x7f) && units < ns_per_second * 10;
+           i++) {
+        units *= (resolution & 0x80) ? 2 : 10;
+      }
+      interface.units_per_second = units;
+    }
+    pos += (len + 3) & ~3u;
+  }
+  interfaces.push_back(interface);
+}
+
+bool CaptureReader::decodePacket(capture_event_t &event) {
+  if (block.size() < 20) {
+    return false;
+  }
+  uint32_t interface_id = get<uint32_t>(&block[0]);
+  uint64_t stamp = static_cast<uint64_t>(get<uint32_t>(&block[4])) << 32 |
+                   get<uint32_t>(&block[8]);
+  uint32_t captured = get<uint32_t>(&block[12]);
+  if (interface_id >= interfaces.size() || 20 + captured > block.size()) {
+    return false;
+  }
+  const uint8_t *data = &block[20];
+
+  uint32_t flags = epb_inbound;
+  size_t pos = 20 + ((captured + 3) & ~3u);
+  while (pos + 4 <= block.size()) {
+    uint16_t code = get<uint16_t>(&block[pos]);
+    uint16_t len = get<uint16_t>(&block[pos + 2]);
+    pos += 4;
+    if (code == option_end || pos + len > block.size()) {
+      break;
+    }
+    if (code == option_epb_flags && len == sizeof(flags)) {
+      flags = get<uint32_t>(&block[pos]);
+    }
+    pos += (len + 3) & ~3u;
+  }
+
+  auto &interface = interfaces[interface_id];
+  uint64_t units = interface.units_per_second;
+  if (units > ns_per_second) {
+    stamp /= units / ns_per_second;
+    units = ns_per_second;
+  }
+  uint64_t ns = stamp / units * ns_per_second +
+                stamp % units * ns_per_second / units;
+  event.time = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(ns)));
+
+  if (interface.link_type == linktype_user0) {
+    if (captured < 1) {
+      return false;
+    }
+    event.kind = CAPTURE_INPUT;
+    event.stream_id = data[0];
+    event.data.assign(data + 1, data + captured);
+    return true;
+  }
+  if (interface.link_type != linktype_ipv4) {
+    return false;
+  }
+  if (captured < ip_header_bytes || (data[0] >> 4) != 4 || data[9] != 17) {
+    return false;
+  }
+  size_t ip_len = (data[0] & 0x0f) * 4;
+  if (ip_len < ip_header_bytes || ip_len + udp_header_bytes > captured) {
+    return false;
+  }
+  const uint8_t *udp = data + ip_len;
+  size_t udp_len = getBigEndian16(udp + 4);
+  if (udp_len < udp_header_bytes) {
+    return false;
+  }
+  size_t payload = std::min(udp_len - udp_header_bytes,
+                            captured - ip_len - udp_header_bytes);
+  event.kind = (flags & epb_direction_mask) == epb_outbound ? CAPTURE_TX
+                                                            : CAPTURE_RX;
+  event.stream_id = 0;
+  event.data.assign(udp + udp_header_bytes,
+                    udp + udp_header_bytes + payload);
+  return true;
+}
+
+bool CaptureReader::next(capture_event_t &event) {
+  if (!file) {
+    return false;
+  }
+  uint32_t type;
+  while (readBlock(type)) {
+    if (type == block_interface) {
+      addInterface();
+    } else if (type == block_enhanced_packet && decodePacket(event)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace vrts
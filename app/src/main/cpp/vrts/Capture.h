@@ -0,0 +1,121 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+namespace vrts {
+
+typedef enum : uint8_t {
+  // Datagram off the link.
+  CAPTURE_RX = 0,
+  // Datagram handed to the link.
+  CAPTURE_TX = 1,
+  // Encoder output given to parse().
+  CAPTURE_INPUT = 2,
+} capture_kind_t;
+
+/// @brief One entry of a capture file.
+/// @details stream_id is only meaningful for CAPTURE_INPUT.
+typedef struct {
+  capture_kind_t kind;
+  std::chrono::system_clock::time_point time;
+  uint8_t stream_id;
+  std::vector<uint8_t> data;
+} capture_event_t;
+
+/// @brief Addresses written into the synthetic IPv4/UDP headers, host order.
+typedef struct {
+  uint32_t local_ip;
+  uint16_t local_port;
+  uint32_t remote_ip;
+  uint16_t remote_port;
+} capture_endpoints_t;
+
+/// @brief Records a session to a pcapng file.
+/// @details Datagrams go on interface 0 as raw IPv4 with made up IP/UDP
+/// headers, so the file opens in Wireshark as is; encoder input goes on
+/// interface 1 (LINKTYPE_USER0) as the stream id followed by the buffer.
+/// Timestamps have nanosecond resolution. Direction is in epb_flags.
+///
+/// Thread safe: the reactor writes datagrams while parse threads write
+/// input.
+class CaptureWriter {
+public:
+  CaptureWriter();
+  ~CaptureWriter();
+
+  bool open(const std::string &path, const capture_endpoints_t &endpoints);
+  void close(void);
+  bool isOpen(void) const { return capturing.load(std::memory_order_relaxed); }
+
+  /// @brief Record a datagram gathered from iovcnt pieces.
+  void datagram(capture_kind_t kind, const struct iovec *iov, size_t iovcnt,
+                std::chrono::system_clock::time_point time);
+  /// @brief Record a buffer of encoder output.
+  void input(uint8_t stream_id, const uint8_t *data, size_t len,
+             std::chrono::system_clock::time_point time);
+
+  /// @brief Entries written since open().
+  uint64_t entries(void) const { return written.load(); }
+
+private:
+  std::atomic<bool> capturing;
+  std::atomic<uint64_t> written;
+  std::mutex file_mutex;
+  FILE *file;
+  capture_endpoints_t endpoints;
+  uint16_t ip_id;
+  // Scratch for one packet, file_mutex.
+  std::vector<uint8_t> packet;
+
+  void writePacket(uint32_t interface_id, uint32_t flags,
+                   std::chrono::system_clock::time_point time);
+};
+
+/// @brief Reads back what CaptureWriter wrote.
+/// @details Also takes other pcapng files with raw IPv4 interfaces, e.g.
+/// converted tcpdump captures: non-UDP packets, unknown interfaces and
+/// other block types are skipped. Packets without epb_flags count as
+/// received.
+class CaptureReader {
+public:
+  CaptureReader();
+  ~CaptureReader();
+
+  bool open(const std::string &path);
+  void close(void);
+
+  /// @brief Next entry in file order, false at the end or on a bad block.
+  bool next(capture_event_t &event);
+  /// @brief Whether next() stopped on a damaged or cut off block.
+  bool truncated(void) const { return damaged; }
+
+private:
+  typedef struct {
+    uint16_t link_type;
+    // Time units per second.
+    uint64_t units_per_second;
+  } interface_t;
+
+  FILE *file;
+  bool damaged;
+  std::vector<interface_t> interfaces;
+  std::vector<uint8_t> block;
+
+  bool readBlock(uint32_t &type);
+  void addInterface(void);
+  bool decodePacket(capture_event_t &event);
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,323 @@
+#include "CongestionController.h"
+#include <algorithm>
+#include <math.h>
+
+namespace vrts {
+
+// Delay trend, values as in GCC.
+constexpr float delay_smoothing = 0.9f;
+constexpr size_t trend_window = 20;
+constexpr uint32_t trend_max_deltas = 60;
+constexpr float trend_gain = 4.0f;
+constexpr float overuse_time_ms = 10.0f;
+constexpr float threshold_initial = 12.5f;
+constexpr float threshold_min = 6.0f;
+constexpr float threshold_max = 600.0f;
+constexpr float threshold_k_up = 0.0087f;
+constexpr float threshold_k_down = 0.039f;
+// A queue this deep is overuse even if it built up too slowly to trend.
+constexpr float queue_delay_limit_ms = 150.0f;
+constexpr auto min_rtt_window = std::chrono::seconds(10);
+
+// Rate control.
+constexpr float decrease_factor = 0.85f;
+constexpr float increase_per_second = 1.08f;
+constexpr float ack_rate_headroom = 1.5f;
+constexpr uint64_t ack_rate_slack = 10000 / 8;
+constexpr float packet_bytes = 1200.0f;
+constexpr float response_time_extra_ms = 100.0f;
+constexpr float min_decrease_interval_ms = 100.0f;
+constexpr auto acked_rate_interval = std::chrono::milliseconds(50);
+
+// Loss.
+constexpr auto loss_window = std::chrono::milliseconds(200);
+constexpr uint32_t loss_min_packets = 20;
+constexpr float loss_decrease_threshold = 0.10f;
+
+static float msBetween(CongestionController::time_point a,
+                       CongestionController::time_point b) {
+  return std::chrono::duration<float, std::milli>(b - a).count();
+}
+
+CongestionController::CongestionController(uint64_t min_rate,
+                                           uint64_t start_rate,
+                                           uint64_t max_rate)
+    : min_rate{min_rate}, start_rate{start_rate}, max_rate{max_rate},
+      acked_rate{acked_rate_interval} {
+  reset();
+}
+
+void CongestionController::reset(void) {
+  estimate = start_rate;
+  rate_state = CC_STATE_INCREASE;
+  link_usage = CC_USAGE_NORMAL;
+  acked_rate.reset();
+  group_has_rtt = false;
+  group_rtt_ms = 0;
+  first_sample_time = {};
+  last_sample_time = {};
+  has_sample = false;
+  smoothed_delay_ms = 0;
+  delay_history.clear();
+  delay_deltas = 0;
+  previous_slope = 0;
+  modified_trend = 0;
+  trend_threshold = threshold_initial;
+  overuse_ms = -1;
+  overuse_count = 0;
+  rtt_minima.clear();
+  smoothed_rtt_ms = 0;
+  queue_delay_ms = 0;
+  last_update = {};
+  last_decrease = {};
+  max_rate_average = -1;
+  max_rate_variance = 0.4f;
+  loss_window_start = {};
+  window_acked = 0;
+  window_lost = 0;
+  clamp();
+}
+
+void CongestionController::onAck(size_t bytes, time_point sent,
+                                 time_point acked, bool retransmitted) {
+  acked_rate.onAcked(bytes, acked);
+  window_acked++;
+  if (retransmitted) {
+    return;
+  }
+  float rtt_ms = msBetween(sent, acked);
+  if (!group_has_rtt || rtt_ms < group_rtt_ms) {
+    group_rtt_ms = rtt_ms;
+    group_has_rtt = true;
+  }
+}
+
+void CongestionController::onLoss(void) { window_lost++; }
+
+void CongestionController::onFeedback(time_point now) {
+  if (group_has_rtt) {
+    feedDelaySample(group_rtt_ms, now);
+    group_has_rtt = false;
+  }
+  applyLoss(now);
+  updateRate(now);
+  clamp();
+}
+
+void CongestionController::feedDelaySample(float rtt_ms, time_point now) {
+  if (!has_sample) {
+    has_sample = true;
+    first_sample_time = now;
+    last_sample_time = now;
+    smoothed_delay_ms = rtt_ms;
+    smoothed_rtt_ms = rtt_ms;
+    rtt_minima.emplace_back(now, rtt_ms);
+    delay_history.emplace_back(0.0f, smoothed_delay_ms);
+    return;
+  }
+  while (!rtt_minima.empty() && rtt_minima.back().second >= rtt_ms) {
+    rtt_minima.pop_back();
+  }
+  rtt_minima.emplace_back(now, rtt_ms);
+  while (now - rtt_minima.front().first > min_rtt_window) {
+    rtt_minima.pop_front();
+  }
+  smoothed_rtt_ms = 0.9f * smoothed_rtt_ms + 0.1f * rtt_ms;
+  queue_delay_ms = std::max(0.0f, smoothed_rtt_ms - rtt_minima.front().second);
+
+  smoothed_delay_ms =
+      delay_smoothing * smoothed_delay_ms + (1 - delay_smoothing) * rtt_ms;
+  delay_history.emplace_back(msBetween(first_sample_time, now),
+                             smoothed_delay_ms);
+  if (delay_history.size() > trend_window) {
+    delay_history.pop_front();
+  }
+  delay_deltas = std::min(delay_deltas + 1, trend_max_deltas);
+
+  float dt_ms = msBetween(last_sample_time, now);
+  last_sample_time = now;
+  link_usage = detect(dt_ms);
+}
+
+/// @details Slope of the smoothed delay over the sample window by least
+/// squares, scaled by the number of samples it rests on. It has to stay above
+/// the threshold for a while, and not be falling already, to count as
+/// overuse.
+cc_usage_t CongestionController::detect(float dt_ms) {
+  float slope = previous_slope;
+  if (delay_history.size() >= 2) {
+    float x_avg = 0, y_avg = 0;
+    for (auto &sample : delay_history) {
+      x_avg += sample.first;
+      y_avg += sample.second;
+    }
+    x_avg /= delay_history.size();
+    y_avg /= delay_history.size();
+    float numerator = 0, denominator = 0;
+    for (auto &sample : delay_history) {
+      numerator += (sample.first - x_avg) * (sample.second - y_avg);
+      denominator += (sample.first - x_avg) * (sample.first - x_avg);
+    }
+    if (denominator != 0) {
+      slope = numerator / denominator;
+    }
+  }
+
+  cc_usage_t usage = link_usage;
+  modified_trend = std::min(delay_deltas, trend_max_deltas) * slope *
+                   trend_gain;
+  if (modified_trend > trend_threshold) {
+    overuse_ms = overuse_ms < 0 ? dt_ms / 2 : overuse_ms + dt_ms;
+    overuse_count++;
+    if (overuse_ms > overuse_time_ms && overuse_count > 1 &&
+        slope >= previous_slope) {
+      overuse_ms = 0;
+      overuse_count = 0;
+      usage = CC_USAGE_OVERUSE;
+    }
+  } else if (modified_trend < -trend_threshold) {
+    overuse_ms = -1;
+    overuse_count = 0;
+    usage = CC_USAGE_UNDERUSE;
+  } else {
+    overuse_ms = -1;
+    overuse_count = 0;
+    usage = CC_USAGE_NORMAL;
+  }
+  if (queue_delay_ms > queue_delay_limit_ms && usage != CC_USAGE_UNDERUSE) {
+    usage = CC_USAGE_OVERUSE;
+  }
+  previous_slope = slope;
+  updateThreshold(dt_ms);
+  return usage;
+}
+
+void CongestionController::updateThreshold(float dt_ms) {
+  float magnitude = fabsf(modified_trend);
+  // Spikes (e.g. a radio retrying) would drag the threshold up for good.
+  if (magnitude > trend_threshold + 15.0f) {
+    return;
+  }
+  float k = magnitude < trend_threshold ? threshold_k_down : threshold_k_up;
+  trend_threshold += k * (magnitude - trend_threshold) *
+                     std::min(dt_ms, 100.0f);
+  trend_threshold = std::min(std::max(trend_threshold, threshold_min),
+                             threshold_max);
+}
+
+void CongestionController::updateRate(time_point now) {
+  float dt_ms = last_update == time_point{} ? 0 : msBetween(last_update, now);
+  last_update = now;
+
+  switch (link_usage) {
+  case CC_USAGE_OVERUSE:
+    rate_state = CC_STATE_DECREASE;
+    break;
+  case CC_USAGE_UNDERUSE:
+    rate_state = CC_STATE_HOLD;
+    break;
+  case CC_USAGE_NORMAL:
+    if (rate_state == CC_STATE_HOLD) {
+      rate_state = CC_STATE_INCREASE;
+    }
+    break;
+  }
+
+  uint64_t acked = acked_rate.valid() ? acked_rate.average() : 0;
+  float acked_kbps = acked * 8.0f / 1000.0f;
+  float estimate_kbps = estimate * 8.0f / 1000.0f;
+  float max_rate_std =
+      max_rate_average < 0 ? 0 : sqrtf(max_rate_variance * max_rate_average);
+
+  switch (rate_state) {
+  case CC_STATE_HOLD:
+    break;
+  case CC_STATE_INCREASE: {
+    if (max_rate_average >= 0 &&
+        estimate_kbps > max_rate_average + 3 * max_rate_std) {
+      // Past where it backed off last time, the link has changed.
+      max_rate_average = -1;
+    }
+    float increase;
+    if (max_rate_average >= 0) {
+      float response_ms = response_time_extra_ms + smoothed_rtt_ms;
+      increase = std::max(packet_bytes / 2,
+                          packet_bytes * dt_ms / response_ms);
+    } else {
+      increase = estimate *
+                 (powf(increase_per_second,
+                       std::min(dt_ms, 1000.0f) / 1000.0f) -
+                  1.0f);
+    }
+    // Don't grow far past what gets through, but an app-limited stretch
+    // doesn't take away what was already there either.
+    uint64_t increased = estimate + static_cast<uint64_t>(increase);
+    uint64_t ceiling = ack_rate_headroom * acked + ack_rate_slack;
+    if (acked && increased > ceiling) {
+      increased = std::max(estimate, ceiling);
+    }
+    estimate = increased;
+    break;
+  }
+  case CC_STATE_DECREASE:
+    // At most once per RTT, the ACKed rate needs that long to show the cut.
+    if (last_decrease == time_point{} ||
+        msBetween(last_decrease, now) >=
+            std::max(min_decrease_interval_ms, smoothed_rtt_ms)) {
+      uint64_t decreased =
+          decrease_factor * (acked ? acked : estimate);
+      if (decreased < estimate) {
+        estimate = decreased;
+      }
+      if (acked) {
+        if (max_rate_average >= 0 &&
+            acked_kbps < max_rate_average - 3 * max_rate_std) {
+          max_rate_average = -1;
+        }
+        updateMaxRate(acked_kbps);
+      }
+      last_decrease = now;
+    }
+    rate_state = CC_STATE_HOLD;
+    break;
+  }
+}
+
+void CongestionController::updateMaxRate(float rate_kbps) {
+  const float alpha = 0.05f;
+  if (max_rate_average < 0) {
+    max_rate_average = rate_kbps;
+  } else {
+    max_rate_average = (1 - alpha) * max_rate_average + alpha * rate_kbps;
+  }
+  float norm = std::max(max_rate_average, 1.0f);
+  max_rate_variance = (1 - alpha) * max_rate_variance +
+                      alpha * (max_rate_average - rate_kbps) *
+                          (max_rate_average - rate_kbps) / norm;
+  max_rate_variance = std::min(std::max(max_rate_variance, 0.4f), 2.5f);
+}
+
+void CongestionController::applyLoss(time_point now) {
+  if (loss_window_start == time_point{}) {
+    loss_window_start = now;
+  }
+  if (now - loss_window_start < loss_window) {
+    return;
+  }
+  uint32_t total = window_acked + window_lost;
+  if (total >= loss_min_packets) {
+    float loss = static_cast<float>(window_lost) / total;
+    if (loss > loss_decrease_threshold) {
+      estimate = static_cast<uint64_t>(estimate * (1.0f - 0.5f * loss));
+    }
+  }
+  loss_window_start = now;
+  window_acked = 0;
+  window_lost = 0;
+}
+
+void CongestionController::clamp(void) {
+  estimate = std::min(std::max(estimate, min_rate), max_rate);
+}
+
+} // namespace vrts
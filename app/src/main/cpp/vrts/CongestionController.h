@@ -0,0 +1,130 @@
+#ifndef CONGESTIONCONTROLLER_H
+#define CONGESTIONCONTROLLER_H
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <stdint.h>
+#include <utility>
+
+#include "Pacer.h"
+
+namespace vrts {
+
+typedef enum {
+  CC_USAGE_NORMAL = 0,
+  CC_USAGE_OVERUSE,
+  CC_USAGE_UNDERUSE,
+} cc_usage_t;
+
+typedef enum {
+  CC_STATE_HOLD = 0,
+  CC_STATE_INCREASE,
+  CC_STATE_DECREASE,
+} cc_state_t;
+
+/// @brief Delay-based rate control after GCC.
+/// @details Every feedback datagram yields one delay sample: the smallest RTT
+/// among the packets it acknowledged, i.e. the most recently sent one, which
+/// carries the least ACK batching delay. A least-squares trend over the last
+/// samples of the smoothed delay is compared to an adaptive threshold to
+/// classify the link as over-, under- or normally used.
+///
+/// The estimate drops to 85% of the ACKed rate on overuse, holds while the
+/// queue drains and otherwise grows 8% a second, or by about a packet per
+/// RTT once it is back near the rate it last had to back off from. Heavy loss
+/// (more than 10% over 200ms) also cuts it. It never runs far ahead of what
+/// the peer actually ACKs, so an app-limited stream doesn't build up credit.
+///
+/// VRTS only has sender timestamps, so the trend is taken over RTTs rather
+/// than one-way delays; the return path is just ACKs and adds little.
+///
+/// Times are passed in so the simulated link in vrts-bench can drive it.
+/// Not thread safe.
+class CongestionController {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+
+  /// @param min_rate, start_rate, max_rate bytes/s.
+  CongestionController(uint64_t min_rate, uint64_t start_rate,
+                       uint64_t max_rate);
+
+  /// @brief A sent packet was acknowledged for the first time.
+  /// @param retransmitted its RTT is ambiguous and isn't used.
+  void onAck(size_t bytes, time_point sent, time_point acked,
+             bool retransmitted);
+  /// @brief A sent packet was reported or timed out as lost.
+  void onLoss(void);
+  /// @brief Close out one feedback datagram and update the estimate.
+  void onFeedback(time_point now);
+
+  /// @brief Rate the sender should aim for, bytes/s.
+  uint64_t targetRate(void) const { return estimate; }
+  /// @brief ACKed bytes/s over the last 500ms.
+  uint64_t ackedRate(void) const { return acked_rate.average(); }
+
+  cc_state_t state(void) const { return rate_state; }
+  cc_usage_t usage(void) const { return link_usage; }
+  /// @brief Smoothed RTT above the lowest seen in the last 10s, ms.
+  float queueDelay(void) const { return queue_delay_ms; }
+  /// @brief Trend of the delay as compared to the threshold.
+  float trend(void) const { return modified_trend; }
+  float threshold(void) const { return trend_threshold; }
+
+  void reset(void);
+
+private:
+  uint64_t min_rate;
+  uint64_t start_rate;
+  uint64_t max_rate;
+  uint64_t estimate;
+  cc_state_t rate_state;
+  cc_usage_t link_usage;
+  DeliveryRateEstimator acked_rate;
+
+  // Current feedback datagram.
+  bool group_has_rtt;
+  float group_rtt_ms;
+
+  // Delay trend.
+  time_point first_sample_time;
+  time_point last_sample_time;
+  bool has_sample;
+  float smoothed_delay_ms;
+  std::deque<std::pair<float, float>> delay_history;
+  uint32_t delay_deltas;
+  float previous_slope;
+  float modified_trend;
+  float trend_threshold;
+  float overuse_ms;
+  uint32_t overuse_count;
+
+  // Base RTT as a sliding window minimum, and the smoothed RTT above it.
+  std::deque<std::pair<time_point, float>> rtt_minima;
+  float smoothed_rtt_ms;
+  float queue_delay_ms;
+
+  // Rate control.
+  time_point last_update;
+  time_point last_decrease;
+  float max_rate_average;
+  float max_rate_variance;
+
+  // Loss.
+  time_point loss_window_start;
+  uint32_t window_acked;
+  uint32_t window_lost;
+
+  void feedDelaySample(float rtt_ms, time_point now);
+  cc_usage_t detect(float dt_ms);
+  void updateThreshold(float dt_ms);
+  void updateRate(time_point now);
+  void updateMaxRate(float rate);
+  void applyLoss(time_point now);
+  void clamp(void);
+};
+
+} // namespace vrts
+
+#endif
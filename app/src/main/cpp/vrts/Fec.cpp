@@ -0,0 +1,280 @@
+#include "Fec.h"
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VRTS_FEC_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VRTS_FEC_NEON 1
+#endif
+
+namespace vrts {
+namespace gf256 {
+
+namespace {
+
+typedef struct tables_s {
+  uint8_t exp[512];
+  uint8_t log[256];
+
+  tables_s() {
+    uint16_t x = 1;
+    for (int i = 0; i < 255; i++) {
+      exp[i] = static_cast<uint8_t>(x);
+      log[x] = static_cast<uint8_t>(i);
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= 0x11d;
+      }
+    }
+    for (int i = 255; i < 512; i++) {
+      exp[i] = exp[i - 255];
+    }
+    log[0] = 0;
+  }
+} tables_t;
+
+const tables_t &tables(void) {
+  static const tables_t t;
+  return t;
+}
+
+/// Products of c with every low and every high nibble. A byte's product is
+/// low[b & 15] ^ high[b >> 4], which maps onto 16-entry shuffles.
+void nibbleTables(uint8_t c, uint8_t *low, uint8_t *high) {
+  for (int i = 0; i < 16; i++) {
+    low[i] = mul(c, static_cast<uint8_t>(i));
+    high[i] = mul(c, static_cast<uint8_t>(i << 4));
+  }
+}
+
+void xorRegion(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t low[16], high[16];
+  nibbleTables(c, low, high);
+  for (size_t i = 0; i < len; i++) {
+    dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+  }
+}
+
+#if defined(VRTS_FEC_X86)
+__attribute__((target("ssse3"))) void
+mulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t low[16], high[16];
+  nibbleTables(c, low, high);
+  const __m128i low_table = _mm_loadu_si128(reinterpret_cast<__m128i *>(low));
+  const __m128i high_table =
+      _mm_loadu_si128(reinterpret_cast<__m128i *>(high));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+    __m128i lo = _mm_shuffle_epi8(low_table, _mm_and_si128(s, mask));
+    __m128i hi = _mm_shuffle_epi8(
+        high_table, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    d = _mm_xor_si128(d, _mm_xor_si128(lo, hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), d);
+  }
+  if (i < len) {
+    mulAddScalar(dst + i, src + i, c, len - i);
+  }
+}
+#endif
+
+#if defined(VRTS_FEC_NEON)
+void mulAddNeon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t low[16], high[16];
+  nibbleTables(c, low, high);
+  const uint8x16_t low_table = vld1q_u8(low);
+  const uint8x16_t high_table = vld1q_u8(high);
+  const uint8x16_t mask = vdupq_n_u8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t s = vld1q_u8(src + i);
+    uint8x16_t d = vld1q_u8(dst + i);
+    uint8x16_t lo = vqtbl1q_u8(low_table, vandq_u8(s, mask));
+    uint8x16_t hi = vqtbl1q_u8(high_table, vshrq_n_u8(s, 4));
+    vst1q_u8(dst + i, veorq_u8(d, veorq_u8(lo, hi)));
+  }
+  if (i < len) {
+    mulAddScalar(dst + i, src + i, c, len - i);
+  }
+}
+#endif
+
+typedef void (*mul_add_fn)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+typedef struct {
+  mul_add_fn fn;
+  const char *name;
+} mul_add_impl_t;
+
+mul_add_impl_t bestImpl(void) {
+#if defined(VRTS_FEC_X86)
+  if (__builtin_cpu_supports("ssse3")) {
+    return {mulAddSsse3, "ssse3"};
+  }
+#elif defined(VRTS_FEC_NEON)
+  return {mulAddNeon, "neon"};
+#endif
+  return {mulAddScalar, "scalar"};
+}
+
+mul_add_impl_t &activeImpl(void) {
+  static mul_add_impl_t impl = bestImpl();
+  return impl;
+}
+
+} // namespace
+
+uint8_t mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  auto &t = tables();
+  return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t inv(uint8_t a) {
+  auto &t = tables();
+  return t.exp[255 - t.log[a]];
+}
+
+void mulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    xorRegion(dst, src, len);
+    return;
+  }
+  activeImpl().fn(dst, src, c, len);
+}
+
+const char *simdPath(void) { return activeImpl().name; }
+
+void useSimd(bool enable) {
+  activeImpl() =
+      enable ? bestImpl() : mul_add_impl_t{mulAddScalar, "scalar"};
+}
+
+} // namespace gf256
+
+uint8_t FecCodec::coefficient(int k, int j, int i) {
+  // Cauchy element 1 / (x_j + y_i) with y_i = i and x_j = k + j, divided by
+  // the row 0 element 1 / (x_0 + y_i) of the same column.
+  uint8_t cauchy = gf256::inv(static_cast<uint8_t>((k + j) ^ i));
+  return gf256::mul(cauchy, static_cast<uint8_t>(k ^ i));
+}
+
+void FecCodec::encode(const uint8_t *const *data, int k,
+                      uint8_t *const *parity, int m, size_t len) {
+  for (int j = 0; j < m; j++) {
+    memset(parity[j], 0, len);
+    for (int i = 0; i < k; i++) {
+      gf256::mulAddRegion(parity[j], data[i], coefficient(k, j, i), len);
+    }
+  }
+}
+
+bool FecCodec::decode(uint8_t *const *data, const bool *present, int k,
+                      const uint8_t *const *parity, const uint8_t *parity_index,
+                      int parity_count, size_t len) {
+  std::vector<int> missing;
+  for (int i = 0; i < k; i++) {
+    if (!present[i]) {
+      missing.push_back(i);
+    }
+  }
+  int e = static_cast<int>(missing.size());
+  if (e == 0) {
+    return true;
+  }
+  if (e > parity_count) {
+    return false;
+  }
+
+  // Syndromes: each used parity row with the known data taken out leaves
+  // a combination of the missing shards only.
+  std::vector<uint8_t> syndrome(static_cast<size_t>(e) * len);
+  for (int r = 0; r < e; r++) {
+    uint8_t *s = &syndrome[static_cast<size_t>(r) * len];
+    memcpy(s, parity[r], len);
+    for (int i = 0; i < k; i++) {
+      if (present[i]) {
+        gf256::mulAddRegion(s, data[i], coefficient(k, parity_index[r], i),
+                            len);
+      }
+    }
+  }
+
+  // Invert the e x e system by Gauss-Jordan. Any square sub-matrix of a
+  // Cauchy matrix is invertible, so a pivot always exists.
+  std::vector<uint8_t> a(static_cast<size_t>(e) * e);
+  std::vector<uint8_t> b(static_cast<size_t>(e) * e, 0);
+  for (int r = 0; r < e; r++) {
+    for (int c = 0; c < e; c++) {
+      a[r * e + c] = coefficient(k, parity_index[r], missing[c]);
+    }
+    b[r * e + r] = 1;
+  }
+  for (int col = 0; col < e; col++) {
+    int pivot = col;
+    while (pivot < e && a[pivot * e + col] == 0) {
+      pivot++;
+    }
+    if (pivot == e) {
+      return false;
+    }
+    if (pivot != col) {
+      for (int c = 0; c < e; c++) {
+        std::swap(a[pivot * e + c], a[col * e + c]);
+        std::swap(b[pivot * e + c], b[col * e + c]);
+      }
+    }
+    uint8_t scale = gf256::inv(a[col * e + col]);
+    for (int c = 0; c < e; c++) {
+      a[col * e + c] = gf256::mul(a[col * e + c], scale);
+      b[col * e + c] = gf256::mul(b[col * e + c], scale);
+    }
+    for (int r = 0; r < e; r++) {
+      uint8_t factor = a[r * e + col];
+      if (r == col || factor == 0) {
+        continue;
+      }
+      for (int c = 0; c < e; c++) {
+        a[r * e + c] ^= gf256::mul(factor, a[col * e + c]);
+        b[r * e + c] ^= gf256::mul(factor, b[col * e + c]);
+      }
+    }
+  }
+
+  for (int c = 0; c < e; c++) {
+    uint8_t *out = data[missing[c]];
+    memset(out, 0, len);
+    for (int r = 0; r < e; r++) {
+      gf256::mulAddRegion(out, &syndrome[static_cast<size_t>(r) * len],
+                          b[c * e + r], len);
+    }
+  }
+  return true;
+}
+
+} // namespace vrts
@@ -0,0 +1,60 @@
+#ifndef FEC_H
+#define FEC_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vrts {
+
+/// @brief GF(2^8) arithmetic over the 0x11d polynomial.
+namespace gf256 {
+
+uint8_t mul(uint8_t a, uint8_t b);
+/// @brief Multiplicative inverse, a must be non-zero.
+uint8_t inv(uint8_t a);
+
+/// @brief dst[i] ^= c * src[i] for len bytes.
+/// @details Uses SSSE3 (picked at runtime) or NEON when available.
+void mulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/// @brief Name of the region multiply in use, "scalar" without SIMD.
+const char *simdPath(void);
+
+/// @brief Force the scalar path, for benchmarking. Not thread safe.
+void useSimd(bool enable);
+
+} // namespace gf256
+
+/// @brief Systematic Reed-Solomon erasure code over GF(256).
+/// @details Parity rows come from a Cauchy matrix whose columns are scaled so
+/// that the first parity row is all ones. One parity shard is therefore plain
+/// XOR, and any k of the k + m shards rebuild the data. Needs k + m <= 256.
+///
+/// Shards are equal length; callers pad short ones with zeros.
+class FecCodec {
+public:
+  static constexpr int max_shards = 256;
+
+  /// @brief Coefficient of data shard i in parity shard j.
+  static uint8_t coefficient(int k, int j, int i);
+
+  /// @brief Compute m parity shards from k data shards of len bytes.
+  static void encode(const uint8_t *const *data, int k, uint8_t *const *parity,
+                     int m, size_t len);
+
+  /// @brief Rebuild missing data shards in place.
+  /// @param data k shard buffers; the missing ones are written.
+  /// @param present which data shards are valid.
+  /// @param parity available parity shards.
+  /// @param parity_index row of each available parity shard.
+  /// @returns false if fewer shards than k are available.
+  static bool decode(uint8_t *const *data, const bool *present, int k,
+                     const uint8_t *const *parity, const uint8_t *parity_index,
+                     int parity_count, size_t len);
+};
+
+} // namespace vrts
+
+#endif
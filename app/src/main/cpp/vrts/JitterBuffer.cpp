@@ -0,0 +1,84 @@
+#include "JitterBuffer.h"
+#include "Timestamp.h"
+#include <algorithm>
+#include <vector>
+
+namespace vrts {
+
+// Share of recent blocks that should make their deadline. One retransmit
+// in a hundred blocks already raises the target to what it takes.
+static constexpr double target_percentile = 0.99;
+// Added to the target for scheduling slop on our side.
+static constexpr int64_t target_margin_us = 2000;
+static constexpr int64_t default_max_delay_us = 100000;
+
+JitterEstimator::JitterEstimator()
+    : min_delay_us{0}, max_delay_us{default_max_delay_us} {
+  reset();
+}
+
+void JitterEstimator::setLimits(std::chrono::microseconds min_delay,
+                                std::chrono::microseconds max_delay) {
+  min_delay_us = min_delay.count();
+  max_delay_us = std::max(max_delay.count(), min_delay_us);
+}
+
+void JitterEstimator::reset(void) {
+  samples = 0;
+  last_sent_us = 0;
+  last_transit_us = 0;
+  base_us = 0;
+  transits.clear();
+  target_us = min_delay_us;
+  jitter_us = 0;
+}
+
+int64_t JitterEstimator::unwrap(uint32_t sent_us) const {
+  if (samples == 0) {
+    return sent_us;
+  }
+  // Blocks complete out of order by far less than the 71 minutes it takes
+  // the stamp to wrap.
+  return last_sent_us +
+         static_cast<int32_t>(sent_us - static_cast<uint32_t>(last_sent_us));
+}
+
+void JitterEstimator::sample(uint32_t sent_us, time_point complete) {
+  int64_t sent = unwrap(sent_us);
+  int64_t transit = toMicroseconds(complete) - sent;
+  if (samples > 0) {
+    int64_t d = transit - last_transit_us;
+    int64_t jitter = jitter_us.load(std::memory_order_relaxed);
+    jitter_us.store(jitter + ((d < 0 ? -d : d) - jitter) / 16,
+                    std::memory_order_relaxed);
+  }
+  last_sent_us = samples == 0 ? sent : std::max(last_sent_us, sent);
+  last_transit_us = transit;
+  samples++;
+
+  transits.push_back(transit);
+  if (transits.size() > window) {
+    transits.pop_front();
+  }
+  base_us = *std::min_element(transits.begin(), transits.end());
+  std::vector<int64_t> excess(transits.begin(), transits.end());
+  auto nth = excess.begin() +
+             static_cast<size_t>(target_percentile * (excess.size() - 1));
+  std::nth_element(excess.begin(), nth, excess.end());
+  int64_t target = *nth - base_us + target_margin_us;
+  target_us.store(std::min(std::max(target, min_delay_us), max_delay_us),
+                  std::memory_order_relaxed);
+}
+
+JitterEstimator::time_point
+JitterEstimator::deadline(uint32_t sent_us) const {
+  return time_point(std::chrono::microseconds(
+      unwrap(sent_us) + base_us + target_us.load(std::memory_order_relaxed)));
+}
+
+JitterEstimator::time_point JitterEstimator::limit(uint32_t sent_us) const {
+  return time_point(
+      std::chrono::microseconds(unwrap(sent_us) + base_us + max_delay_us));
+}
+
+} // namespace vrts
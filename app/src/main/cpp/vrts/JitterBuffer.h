@@ -0,0 +1,87 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vrts {
+
+// Receive jitter buffer.
+//
+// The sender puts the time it was fed each NAL block into the timestamp
+// extension of the block's first fragment (see WireHeader.h), in us on its
+// clock modulo 2^32. When the block is complete here, its transit is our
+// clock minus that. Transits are offset by the difference of the two
+// clocks, which cancels out: only how much longer one block took than the
+// fastest does, and that is what the buffer has to absorb. Retransmits and
+// pacing count as much as the link's own jitter.
+//
+// A block is due for playout at its send time plus the shortest transit
+// seen plus the target delay, a high percentile of how much longer than
+// the shortest blocks recently took. Blocks complete by then leave evenly
+// spaced, as they were fed; the ones that aren't are late.
+
+/// @brief Playout deadlines from measured transit times of one stream.
+/// @details sample() and deadline() belong to one thread, the gauges may be
+/// read from any.
+class JitterEstimator {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+
+  /// @brief Blocks the percentiles are taken over.
+  static constexpr size_t window = 128;
+  /// @brief Samples before deadlines are given out.
+  static constexpr size_t min_samples = 8;
+
+  JitterEstimator();
+
+  /// @brief Bounds of the target delay.
+  void setLimits(std::chrono::microseconds min_delay,
+                 std::chrono::microseconds max_delay);
+  void reset(void);
+
+  /// @brief A block the sender stamped sent_us was complete at complete.
+  void sample(uint32_t sent_us, time_point complete);
+
+  bool sampled(void) const { return samples > 0; }
+  bool valid(void) const { return samples >= min_samples; }
+  /// @brief When a block stamped sent_us is due. Only if valid().
+  time_point deadline(uint32_t sent_us) const;
+  /// @brief Latest a block stamped sent_us may be handed out, delayed by
+  /// the most allowed. Only if sampled().
+  time_point limit(uint32_t sent_us) const;
+
+  /// @brief Delay added on top of the shortest transit.
+  std::chrono::microseconds target(void) const {
+    return std::chrono::microseconds(
+        target_us.load(std::memory_order_relaxed));
+  }
+  /// @brief Interarrival jitter as in RFC 3550, smoothed over 16 blocks.
+  std::chrono::microseconds jitter(void) const {
+    return std::chrono::microseconds(
+        jitter_us.load(std::memory_order_relaxed));
+  }
+
+private:
+  int64_t min_delay_us;
+  int64_t max_delay_us;
+  size_t samples;
+  // Last stamp seen, extended to 64 bits.
+  int64_t last_sent_us;
+  int64_t last_transit_us;
+  int64_t base_us;
+  std::deque<int64_t> transits;
+  std::atomic<int64_t> target_us;
+  std::atomic<int64_t> jitter_us;
+
+  int64_t unwrap(uint32_t sent_us) const;
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vrts {
+
+constexpr size_t counter_shards = 8;
+
+/// @brief Thread's shard of every Counter, handed out round robin.
+inline size_t counterShard(void) {
+  static std::atomic<size_t> next_shard{0};
+  thread_local size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % counter_shards;
+  return shard;
+}
+
+/// @brief Event counter that any thread may bump without contention.
+/// @details Each thread adds to its own cache line, value() sums them up.
+/// The sum isn't a snapshot across shards, which is fine for statistics.
+class Counter {
+public:
+  Counter() { reset(); }
+
+  void add(uint64_t n = 1) {
+    shards[counterShard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+  /// @brief Take back what was counted too early. Wraps per shard, the sum
+  /// comes out right.
+  void sub(uint64_t n) {
+    shards[counterShard()].value.fetch_sub(n, std::memory_order_relaxed);
+  }
+  Counter &operator++(int) {
+    add(1);
+    return *this;
+  }
+  Counter &operator+=(uint64_t n) {
+    add(n);
+    return *this;
+  }
+
+  uint64_t value(void) const {
+    uint64_t sum = 0;
+    for (auto &shard : shards) {
+      sum += shard.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  void reset(void) {
+    for (auto &shard : shards) {
+      shard.value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  struct alignas(64) shard_t {
+    std::atomic<uint64_t> value;
+  };
+  std::array<shard_t, counter_shards> shards;
+};
+
+/// @brief Bucket counts of a LatencyHistogram at one point in time.
+/// @details Log-linear buckets as in HdrHistogram: values below 32us each
+/// get their own, above that every power of two is split into 16, so a
+/// percentile is off by at most 1/16 of its value. Values are microseconds,
+/// anything from about 67s on lands in the last bucket. Counts are kept
+/// modulo 2^32, differences between two copies come out right regardless.
+class HistogramCounts {
+public:
+  static constexpr uint32_t sub_buckets = 16;
+  static constexpr uint32_t octaves = 22;
+  static constexpr size_t bucket_count = (octaves + 1) * sub_buckets;
+
+  HistogramCounts() { buckets.fill(0); }
+
+  static size_t bucketOf(uint64_t value_us) {
+    if (value_us < 2 * sub_buckets) {
+      return static_cast<size_t>(value_us);
+    }
+    int msb = 63 - __builtin_clzll(value_us);
+    int shift = msb - 4;
+    size_t bucket = (shift + 1) * sub_buckets + ((value_us >> shift) - sub_buckets);
+    return bucket < bucket_count ? bucket : bucket_count - 1;
+  }
+  /// @brief Highest value that lands in a bucket.
+  static uint64_t highestOf(size_t bucket) {
+    if (bucket < 2 * sub_buckets) {
+      return bucket;
+    }
+    int shift = static_cast<int>(bucket / sub_buckets) - 1;
+    uint64_t sub = bucket % sub_buckets + sub_buckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  uint64_t count(void) const {
+    uint64_t total = 0;
+    for (auto n : buckets) {
+      total += n;
+    }
+    return total;
+  }
+
+  /// @brief Smallest value at least q of the samples are at or below, in
+  /// microseconds. 0 when empty.
+  uint64_t percentile(double q) const {
+    uint64_t total = count();
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+    rank = rank < 1 ? 1 : rank > total ? total : rank;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return highestOf(i);
+      }
+    }
+    return highestOf(bucket_count - 1);
+  }
+
+  HistogramCounts &operator-=(const HistogramCounts &other) {
+    for (size_t i = 0; i < bucket_count; i++) {
+      buckets[i] -= other.buckets[i];
+    }
+    return *this;
+  }
+
+  std::array<uint32_t, bucket_count> buckets;
+};
+
+/// @brief Lock-free latency histogram with percentiles over recent windows.
+/// @details record() is a relaxed increment and may come from any thread.
+/// Once a second tick() files a copy of all counts in a ring; the counts of
+/// the last n seconds are the current ones minus the copy from n seconds
+/// ago. Seconds tick() missed (nothing woke the caller) get the copy of
+/// the next one, which only moves samples into the later second.
+class LatencyHistogram {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+  static constexpr size_t window_seconds = 60;
+
+  LatencyHistogram() { reset(); }
+
+  void record(std::chrono::microseconds latency) {
+    uint64_t us = latency.count() < 0 ? 0 : latency.count();
+    buckets[HistogramCounts::bucketOf(us)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  void tick(time_point now) {
+    int64_t second =
+        std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch())
+            .count();
+    if (second <= last_second.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock{ring_mutex};
+    fileSeconds(second);
+  }
+
+  /// @brief Counts recorded over the last seconds, up to window_seconds,
+  /// plus the current second so far.
+  HistogramCounts window(time_point now, size_t seconds) {
+    int64_t second =
+        std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch())
+            .count();
+    std::lock_guard<std::mutex> lock{ring_mutex};
+    fileSeconds(second);
+    HistogramCounts counts = snapshot();
+    if (seconds > window_seconds) {
+      seconds = window_seconds;
+    }
+    // Copies older than the ring, or from before the first tick, are the
+    // empty one.
+    if (filed_seconds >= seconds) {
+      counts -= ring[(second - seconds) % (window_seconds + 1)];
+    }
+    return counts;
+  }
+
+  void reset(void) {
+    std::lock_guard<std::mutex> lock{ring_mutex};
+    for (auto &bucket : buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    for (auto &copy : ring) {
+      copy = HistogramCounts{};
+    }
+    last_second = 0;
+    filed_seconds = 0;
+  }
+
+private:
+  std::array<std::atomic<uint32_t>, HistogramCounts::bucket_count> buckets;
+  std::mutex ring_mutex;
+  // Counts as of the start of each second, by second modulo the ring size.
+  std::array<HistogramCounts, window_seconds + 1> ring;
+  std::atomic<int64_t> last_second;
+  size_t filed_seconds;
+
+  HistogramCounts snapshot(void) const {
+    HistogramCounts counts;
+    for (size_t i = 0; i < HistogramCounts::bucket_count; i++) {
+      counts.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+  }
+
+  /// @details Caller holds ring_mutex.
+  void fileSeconds(int64_t second) {
+    int64_t last = last_second.load(std::memory_order_relaxed);
+    if (second <= last) {
+      return;
+    }
+    HistogramCounts counts = snapshot();
+    int64_t first = last == 0 ? second
+                              : std::max<int64_t>(last + 1,
+                                                  second - window_seconds);
+    for (int64_t s = first; s <= second; s++) {
+      ring[s % (window_seconds + 1)] = counts;
+    }
+    filed_seconds = last == 0 ? 0 : filed_seconds + (second - last);
+    last_second.store(second, std::memory_order_relaxed);
+  }
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef PACER_H
+#define PACER_H
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdint.h>
+
+namespace vrts {
+
+/// @brief Token bucket between the tx tree and the socket.
+/// @details Tokens are bytes, refilled at rate() up to the burst allowance.
+/// A packet may go whenever the bucket isn't empty and takes its full size,
+/// so the bucket can dip below zero; the debt is paid back before the next
+/// one. Rate 0 disables pacing.
+///
+/// Not thread safe.
+class Pacer {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+
+  Pacer()
+      : bytes_per_second{0}, burst_bytes{0}, tokens{0}, last_refill{},
+        released_bytes{0} {}
+
+  void setRate(uint64_t rate_bytes_per_second) {
+    bytes_per_second = rate_bytes_per_second;
+  }
+  uint64_t rate(void) const { return bytes_per_second; }
+
+  void setBurst(uint32_t bytes) {
+    burst_bytes = bytes;
+    tokens = std::min<int64_t>(tokens, burst_bytes);
+  }
+
+  /// @brief Whether the next packet may be sent at now.
+  bool ready(time_point now) {
+    refill(now);
+    return bytes_per_second == 0 || tokens > 0;
+  }
+
+  /// @brief Account for a packet that went out, paced or not.
+  void consume(size_t bytes) {
+    released_bytes += bytes;
+    if (bytes_per_second) {
+      tokens -= static_cast<int64_t>(bytes);
+    }
+  }
+
+  /// @brief When ready() turns true again, now if it already is.
+  time_point nextReady(time_point now) const {
+    if (bytes_per_second == 0 || tokens > 0) {
+      return now;
+    }
+    auto wait_ns = ((1 - tokens) * 1000000000ll) /
+                       static_cast<int64_t>(bytes_per_second) +
+                   1;
+    return last_refill +
+           std::chrono::duration_cast<time_point::duration>(
+               std::chrono::nanoseconds(wait_ns));
+  }
+
+  /// @brief Total bytes passed through consume().
+  uint64_t released(void) const { return released_bytes; }
+
+private:
+  uint64_t bytes_per_second;
+  uint32_t burst_bytes;
+  int64_t tokens;
+  time_point last_refill;
+  uint64_t released_bytes;
+
+  void refill(time_point now) {
+    if (now <= last_refill) {
+      return;
+    }
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now - last_refill)
+                          .count();
+    last_refill = now;
+    if (bytes_per_second == 0) {
+      tokens = burst_bytes;
+      return;
+    }
+    // Long idle gaps only ever fill the bucket, don't let the product wrap.
+    int64_t earned = elapsed_ns >= 1000000000ll
+                         ? static_cast<int64_t>(burst_bytes)
+                         : elapsed_ns * static_cast<int64_t>(bytes_per_second) /
+                               1000000000ll;
+    tokens = std::min<int64_t>(tokens + earned, burst_bytes);
+  }
+};
+
+/// @brief Delivery rate from ACKed bytes, max filtered.
+/// @details ACKed bytes are binned into fixed intervals; rate() is the best
+/// interval among the last few, so a quiet stretch of an app-limited
+/// stream doesn't drag the estimate down right away. average() is what was
+/// actually delivered over the same span.
+class DeliveryRateEstimator {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+  using duration = std::chrono::system_clock::duration;
+
+  DeliveryRateEstimator(duration interval = std::chrono::milliseconds(100))
+      : interval{interval}, interval_start{}, interval_bytes{0}, next{0},
+        filled{0}, has_sample{false} {
+    samples.fill(0);
+  }
+
+  void onAcked(size_t bytes, time_point now) {
+    if (interval_start == time_point{}) {
+      interval_start = now;
+    }
+    if (now - interval_start >= interval) {
+      auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - interval_start)
+                            .count();
+      samples[next] = interval_bytes * 1000000000ull / elapsed_ns;
+      next = (next + 1) % samples.size();
+      filled = std::min(filled + 1, samples.size());
+      has_sample = true;
+      interval_start = now;
+      interval_bytes = 0;
+    }
+    interval_bytes += bytes;
+  }
+
+  /// @brief Bytes per second, 0 until the first interval closed.
+  uint64_t rate(void) const {
+    return *std::max_element(samples.begin(), samples.end());
+  }
+  /// @brief Mean of the closed intervals, bytes per second.
+  uint64_t average(void) const {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < filled; i++) {
+      sum += samples[i];
+    }
+    return filled ? sum / filled : 0;
+  }
+  bool valid(void) const { return has_sample; }
+
+  void reset(void) {
+    samples.fill(0);
+    interval_start = time_point{};
+    interval_bytes = 0;
+    filled = 0;
+    has_sample = false;
+  }
+
+private:
+  duration interval;
+  time_point interval_start;
+  uint64_t interval_bytes;
+  std::array<uint64_t, 10> samples;
+  size_t next;
+  size_t filled;
+  bool has_sample;
+};
+
+} // namespace vrts
+
+#endif
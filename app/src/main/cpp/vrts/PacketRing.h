@@ -0,0 +1,218 @@
+#ifndef PACKETRING_H
+#define PACKETRING_H
+
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+namespace vrts {
+
+/// @brief Orders packet ids by serial-number arithmetic (RFC 1982): a is
+/// older than b if it is less than 2^31 behind. For sorting ids and keying
+/// maps by them across the 32-bit wrap, as long as the ids in question are
+/// less than 2^31 apart.
+struct PacketIdOrder {
+  bool operator()(uint32_t a, uint32_t b) const {
+    return static_cast<int32_t>(a - b) < 0;
+  }
+};
+
+/// @brief Packet store indexed directly by packet id.
+/// @details Packet ids handed out by VRTS are dense and monotonically
+/// increasing, so instead of a tree we keep a power-of-two ring where the slot
+/// of an id is simply (id & mask). Per-packet state is split in two parallel
+/// arrays: a small "hot" metadata array (flags, counters, timestamps) that is
+/// walked on every service pass, and a "cold" payload slab that is only
+/// touched when a packet is actually sent or reassembled.
+///
+/// The ring grows (doubling) whenever an insert would make the live id span
+/// exceed the current capacity, up to max_capacity. Ids are compared with
+/// serial arithmetic so a 32-bit wrap of the id counter is harmless.
+template <typename HotT, typename ColdT> class PacketRing {
+public:
+  PacketRing(uint32_t initial_capacity = 256, uint32_t max_capacity = 1 << 15)
+      : max_capacity{max_capacity}, head_id{0}, tail_id{0}, count{0} {
+    allocate(roundUpPow2(initial_capacity));
+  }
+
+  /// @brief Number of live packets in the ring.
+  size_t size(void) const { return count; }
+  bool empty(void) const { return count == 0; }
+  uint32_t capacity(void) const { return static_cast<uint32_t>(ids.size()); }
+
+  /// @brief Lowest live packet id. Only valid when not empty.
+  uint32_t front(void) const { return head_id; }
+  /// @brief Highest live packet id. Only valid when not empty.
+  uint32_t back(void) const { return tail_id; }
+
+  /// @brief Check if the id could be inserted without exceeding max_capacity.
+  bool canInsert(uint32_t id) const {
+    if (count == 0) {
+      return true;
+    }
+    return spanWith(id) <= max_capacity;
+  }
+
+  /// @brief Insert a packet id, growing the ring if required.
+  /// @returns Pointer to the value-initialized hot metadata of the slot, or
+  /// nullptr if the id does not fit into max_capacity. Inserting an id that is
+  /// already live resets its metadata.
+  HotT *insert(uint32_t id) {
+    if (count == 0) {
+      head_id = id;
+      tail_id = id;
+    } else {
+      uint64_t span = spanWith(id);
+      if (span > max_capacity) {
+        return nullptr;
+      }
+      if (span > capacity()) {
+        grow(roundUpPow2(static_cast<uint32_t>(span)));
+      }
+      if (before(id, head_id)) {
+        head_id = id;
+      }
+      if (before(tail_id, id)) {
+        tail_id = id;
+      }
+    }
+
+    uint32_t slot = id & mask;
+    if (!occupied[slot]) {
+      occupied[slot] = 1;
+      count++;
+    }
+    ids[slot] = id;
+    hot_meta[slot] = HotT{};
+    return &hot_meta[slot];
+  }
+
+  bool contains(uint32_t id) const {
+    uint32_t slot = id & mask;
+    return occupied[slot] && ids[slot] == id;
+  }
+
+  /// @brief O(1) access to the hot metadata of a live id, nullptr if absent.
+  HotT *hot(uint32_t id) {
+    uint32_t slot = id & mask;
+    return (occupied[slot] && ids[slot] == id) ? &hot_meta[slot] : nullptr;
+  }
+
+  /// @brief O(1) access to the payload of a live id, nullptr if absent.
+  ColdT *cold(uint32_t id) {
+    uint32_t slot = id & mask;
+    return (occupied[slot] && ids[slot] == id) ? &cold_data[slot] : nullptr;
+  }
+
+  void erase(uint32_t id) {
+    uint32_t slot = id & mask;
+    if (!occupied[slot] || ids[slot] != id) {
+      return;
+    }
+    occupied[slot] = 0;
+    count--;
+    if (count == 0) {
+      return;
+    }
+    // Keep head/tail pointing at live ids. Both loops are bounded by the
+    // span, and erasing oldest-first (the common case) advances by one.
+    if (id == head_id) {
+      do {
+        head_id++;
+      } while (!occupied[head_id & mask]);
+    }
+    if (id == tail_id) {
+      do {
+        tail_id--;
+      } while (!occupied[tail_id & mask]);
+    }
+  }
+
+  void clear(void) {
+    std::fill(occupied.begin(), occupied.end(), 0);
+    count = 0;
+  }
+
+  /// @brief Serial-number comparison: true if id a is older than id b.
+  static bool before(uint32_t a, uint32_t b) {
+    return PacketIdOrder()(a, b);
+  }
+
+  /// @brief Visit every live packet in ascending id order.
+  /// @param f callable as f(uint32_t id, HotT &hot, ColdT &cold). The payload
+  /// reference is only dereferenced if the callable uses it.
+  template <typename F> void forEach(F &&f) {
+    if (count == 0) {
+      return;
+    }
+    uint32_t end_id = tail_id + 1;
+    for (uint32_t id = head_id; id != end_id; id++) {
+      uint32_t slot = id & mask;
+      if (occupied[slot]) {
+        f(id, hot_meta[slot], cold_data[slot]);
+      }
+    }
+  }
+
+private:
+  uint32_t max_capacity;
+  uint32_t mask;
+  uint32_t head_id;
+  uint32_t tail_id;
+  size_t count;
+  std::vector<uint8_t> occupied;
+  std::vector<uint32_t> ids;
+  std::vector<HotT> hot_meta;
+  std::vector<ColdT> cold_data;
+
+  static uint32_t roundUpPow2(uint32_t v) {
+    uint32_t p = 1;
+    while (p < v) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  /// @brief Live id span if id were inserted.
+  uint64_t spanWith(uint32_t id) const {
+    uint32_t lo = before(id, head_id) ? id : head_id;
+    uint32_t hi = before(tail_id, id) ? id : tail_id;
+    return static_cast<uint64_t>(hi - lo) + 1;
+  }
+
+  void allocate(uint32_t new_capacity) {
+    mask = new_capacity - 1;
+    occupied.assign(new_capacity, 0);
+    ids.assign(new_capacity, 0);
+    hot_meta.resize(new_capacity);
+    cold_data.resize(new_capacity);
+  }
+
+  void grow(uint32_t new_capacity) {
+    std::vector<uint8_t> old_occupied;
+    std::vector<uint32_t> old_ids;
+    std::vector<HotT> old_hot;
+    std::vector<ColdT> old_cold;
+    old_occupied.swap(occupied);
+    old_ids.swap(ids);
+    old_hot.swap(hot_meta);
+    old_cold.swap(cold_data);
+
+    allocate(new_capacity);
+    for (uint32_t old_slot = 0; old_slot < old_ids.size(); old_slot++) {
+      if (old_occupied[old_slot]) {
+        uint32_t slot = old_ids[old_slot] & mask;
+        occupied[slot] = 1;
+        ids[slot] = old_ids[old_slot];
+        hot_meta[slot] = old_hot[old_slot];
+        cold_data[slot] = old_cold[old_slot];
+      }
+    }
+  }
+};
+
+} // namespace vrts
+
+#endif
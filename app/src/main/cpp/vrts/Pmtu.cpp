@@ -0,0 +1,85 @@
+#include "Pmtu.h"
+#include <algorithm>
+
+namespace vrts {
+
+constexpr uint16_t PmtuSearch::base;
+constexpr int PmtuSearch::max_probes;
+constexpr uint16_t PmtuSearch::resolution;
+
+PmtuSearch::PmtuSearch(uint16_t max_bytes)
+    : max_size{max_bytes}, in_use{max_bytes}, confirmed_size{0},
+      active{false}, floor{0}, ceiling{0}, floor_acked{false}, tries{0} {
+  restart(max_bytes);
+}
+
+void PmtuSearch::restart(uint16_t max_bytes) {
+  max_size = max_bytes;
+  in_use = std::min(in_use, max_size);
+  floor = std::min(base, max_size);
+  // Nothing failed yet, so the first probe goes for max_size.
+  ceiling = max_size + 1;
+  floor_acked = false;
+  tries = 0;
+  active = true;
+}
+
+uint16_t PmtuSearch::candidate(void) const {
+  if (!active) {
+    return 0;
+  }
+  if (ceiling > max_size) {
+    return max_size;
+  }
+  return floor + (ceiling - floor) / 2;
+}
+
+void PmtuSearch::acked(uint16_t bytes) {
+  if (!active || bytes < floor || bytes >= ceiling) {
+    return;
+  }
+  floor = bytes;
+  floor_acked = true;
+  tries = 0;
+  finishIfNarrow();
+}
+
+void PmtuSearch::lost(uint16_t bytes) {
+  if (!active || bytes != candidate()) {
+    return;
+  }
+  if (++tries < max_probes) {
+    return;
+  }
+  failed(bytes);
+}
+
+void PmtuSearch::tooBig(uint16_t bytes) {
+  if (active && bytes < ceiling) {
+    failed(bytes);
+  }
+}
+
+void PmtuSearch::failed(uint16_t bytes) {
+  tries = 0;
+  ceiling = bytes;
+  if (bytes <= in_use) {
+    // What we send with doesn't get through any more, fall back to what
+    // does as far as we know.
+    in_use = floor;
+  }
+  finishIfNarrow();
+}
+
+void PmtuSearch::finishIfNarrow(void) {
+  if (floor < max_size && ceiling > floor + resolution) {
+    return;
+  }
+  active = false;
+  in_use = floor;
+  if (floor_acked) {
+    confirmed_size = floor;
+  }
+}
+
+} // namespace vrts
@@ -0,0 +1,81 @@
+#ifndef PMTU_H
+#define PMTU_H
+
+#pragma once
+
+#include <stdint.h>
+
+namespace vrts {
+
+// Path MTU discovery, datagram packetization layer style (RFC 8899).
+//
+// A VRTS_PMTU probe is a datagram padded to the size being tried, sent with
+// DF set so that no router fragments it. The header's fragments is 0 on a
+// probe, packet_id numbers it and length covers the padding. The reply has
+// fragments 1, the probe's packet_id and a vrts_pmtu_reply_t. Sizes are UDP
+// payload bytes, VRTS header included.
+
+typedef struct {
+  uint16_t probe_bytes;
+} vrts_pmtu_reply_t;
+
+/// @brief Search for the largest datagram a path delivers.
+/// @details Tries the largest size allowed first, which is all it takes on
+/// a path that carries it, and otherwise narrows down between what got
+/// through and what didn't. A size only counts as lost after max_probes
+/// tries without a reply. The size in use only changes when a search ends,
+/// or right away if a size no larger than it is lost: then the path got
+/// smaller and the largest size that got through this search stands in,
+/// base if none did yet, which every path is assumed to carry. Not thread
+/// safe.
+class PmtuSearch {
+public:
+  static constexpr uint16_t base = 1200;
+  static constexpr int max_probes = 3;
+  // Searches stop once the sizes that got through and didn't are this close.
+  static constexpr uint16_t resolution = 8;
+
+  /// @param max_bytes largest size to try, and the one in use until a
+  /// search says otherwise.
+  PmtuSearch(uint16_t max_bytes);
+
+  /// @brief Start over below max_bytes, e.g. to notice the path grew. The
+  /// size in use is kept until the search says otherwise.
+  void restart(uint16_t max_bytes);
+  bool searching(void) const { return active; }
+  /// @brief Size to probe next, 0 once the search is done.
+  uint16_t candidate(void) const;
+
+  /// @brief A probe of bytes was answered.
+  void acked(uint16_t bytes);
+  /// @brief A probe of bytes went unanswered.
+  void lost(uint16_t bytes);
+  /// @brief The host won't even send bytes, there is nothing to retry.
+  void tooBig(uint16_t bytes);
+
+  /// @brief Datagram size to send with.
+  uint16_t current(void) const { return in_use; }
+  /// @brief Size in use as of the last search that got a probe through, 0
+  /// if none did yet.
+  uint16_t confirmed(void) const { return confirmed_size; }
+  uint16_t limit(void) const { return max_size; }
+
+private:
+  uint16_t max_size;
+  uint16_t in_use;
+  uint16_t confirmed_size;
+  bool active;
+  // Largest size known to get through and smallest known not to, this
+  // search.
+  uint16_t floor;
+  uint16_t ceiling;
+  bool floor_acked;
+  int tries;
+
+  void failed(uint16_t bytes);
+  void finishIfNarrow(void);
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,131 @@
+#include "Reactor.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+
+namespace vrts {
+
+// Fallback poll period when epoll can't be used, matching the old tx loop.
+static constexpr auto fallback_poll_period = std::chrono::microseconds(500);
+static constexpr int max_events = 8;
+
+Reactor::Reactor()
+    : wakeups{0}, socket_wakeups{0}, notify_wakeups{0}, timer_wakeups{0},
+      idle_ns{0}, epoll_fd{-1}, event_fd{-1}, timer_fd{-1} {}
+
+Reactor::~Reactor() { close(); }
+
+bool Reactor::open(void) {
+  close();
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd < 0 || event_fd < 0 || timer_fd < 0 || !watch(event_fd) ||
+      !watch(timer_fd)) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void Reactor::close(void) {
+  for (int *fd : {&epoll_fd, &event_fd, &timer_fd}) {
+    if (*fd >= 0) {
+      ::close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+bool Reactor::watch(int fd) {
+  if (epoll_fd < 0 || fd < 0) {
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 || errno == EEXIST;
+}
+
+void Reactor::unwatch(int fd) {
+  if (epoll_fd >= 0 && fd >= 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+void Reactor::notify(void) {
+  if (event_fd >= 0) {
+    uint64_t one = 1;
+    // A full counter still leaves the fd readable, so a failed write is fine.
+    (void)!write(event_fd, &one, sizeof(one));
+  }
+}
+
+void Reactor::armTimer(std::chrono::nanoseconds delay) {
+  if (timer_fd < 0) {
+    return;
+  }
+  // An all-zero it_value disarms the timer, so clamp to 1ns.
+  auto ns = std::max<int64_t>(1, delay.count());
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+void Reactor::disarmTimer(void) {
+  if (timer_fd >= 0) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+  }
+}
+
+uint32_t Reactor::wait(void) {
+  auto idle_start = std::chrono::steady_clock::now();
+  uint32_t sources = WAKE_NONE;
+
+  if (epoll_fd < 0) {
+    std::this_thread::sleep_for(fallback_poll_period);
+    sources = WAKE_SOCKET | WAKE_NOTIFY | WAKE_TIMER;
+  } else {
+    struct epoll_event events[max_events];
+    int count = epoll_wait(epoll_fd, events, max_events, -1);
+    for (int i = 0; i < count; i++) {
+      uint64_t drained;
+      if (events[i].data.fd == event_fd) {
+        (void)!read(event_fd, &drained, sizeof(drained));
+        sources |= WAKE_NOTIFY;
+      } else if (events[i].data.fd == timer_fd) {
+        (void)!read(timer_fd, &drained, sizeof(drained));
+        sources |= WAKE_TIMER;
+      } else {
+        sources |= WAKE_SOCKET;
+      }
+    }
+  }
+
+  idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - idle_start)
+                 .count();
+  wakeups++;
+  if (sources & WAKE_SOCKET) {
+    socket_wakeups++;
+  }
+  if (sources & WAKE_NOTIFY) {
+    notify_wakeups++;
+  }
+  if (sources & WAKE_TIMER) {
+    timer_wakeups++;
+  }
+  return sources;
+}
+
+} // namespace vrts
@@ -0,0 +1,64 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace vrts {
+
+/// @brief Why a Reactor::wait() call returned. Bits may be combined.
+typedef enum {
+  WAKE_NONE = 0,
+  WAKE_SOCKET = 1,
+  WAKE_NOTIFY = 2,
+  WAKE_TIMER = 4
+} wake_source_t;
+
+/// @brief Minimal epoll loop for one VRTS session.
+/// @details Wakes on a readable socket, on notify() from any thread (eventfd)
+/// or when the one-shot deadline timer (timerfd) fires. If epoll isn't
+/// available, wait() degrades to a short sleep so the caller still polls.
+class Reactor {
+public:
+  Reactor();
+  ~Reactor();
+
+  bool open(void);
+  void close(void);
+  bool isOpen(void) const { return epoll_fd >= 0; }
+
+  /// @brief Wake wait() when fd becomes readable.
+  bool watch(int fd);
+  void unwatch(int fd);
+
+  /// @brief Wake the loop from another thread. Coalesces.
+  void notify(void);
+
+  /// @brief Arm the one-shot timer to fire after delay. Replaces any
+  /// previous deadline; a delay <= 0 fires immediately.
+  void armTimer(std::chrono::nanoseconds delay);
+  void disarmTimer(void);
+
+  /// @brief Block until something happens.
+  /// @returns combination of wake_source_t bits.
+  uint32_t wait(void);
+
+  // Running totals, safe to read from other threads.
+  std::atomic<uint64_t> wakeups;
+  std::atomic<uint64_t> socket_wakeups;
+  std::atomic<uint64_t> notify_wakeups;
+  std::atomic<uint64_t> timer_wakeups;
+  std::atomic<uint64_t> idle_ns;
+
+private:
+  int epoll_fd;
+  int event_fd;
+  int timer_fd;
+};
+
+} // namespace vrts
+
+#endif
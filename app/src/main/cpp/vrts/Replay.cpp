@@ -0,0 +1,122 @@
+#include "Replay.h"
+#include <algorithm>
+
+namespace vrts {
+
+// A pass that made progress asks for another right away. After this many at
+// one instant the replay moves on by min_step, so a deadline that never
+// clears can't stall it.
+static constexpr int max_passes_per_instant = 16;
+static constexpr auto min_step = std::chrono::microseconds(100);
+static constexpr auto default_linger = std::chrono::milliseconds(1000);
+static constexpr uint64_t fnv_offset_basis = 0xcbf29ce484222325ull;
+static constexpr uint64_t fnv_prime = 0x100000001b3ull;
+
+CaptureReplay::CaptureReplay(uint16_t sync_rate_hz)
+    : sync_hz{sync_rate_hz}, linger{default_linger} {}
+
+void CaptureReplay::setConfigure(std::function<void(VRTS &)> new_configure) {
+  configure = std::move(new_configure);
+}
+
+void CaptureReplay::setOutput(
+    std::function<void(uint8_t, const std::vector<uint8_t> &)> new_output) {
+  output = std::move(new_output);
+}
+
+void CaptureReplay::setLinger(std::chrono::milliseconds new_linger) {
+  linger = new_linger;
+}
+
+void CaptureReplay::drain(VRTS &session, replay_result_t &result) {
+  std::vector<uint8_t> nal;
+  for (uint8_t stream_id = 0; stream_id < vrts_max_streams; stream_id++) {
+    while (session.popData(nal, stream_id)) {
+      result.nal_blocks++;
+      result.nal_bytes += nal.size();
+      result.output_hash = (result.output_hash ^ stream_id) * fnv_prime;
+      for (uint8_t byte : nal) {
+        result.output_hash = (result.output_hash ^ byte) * fnv_prime;
+      }
+      if (output) {
+        output(stream_id, nal);
+      }
+    }
+  }
+}
+
+vrts_clock_time_t CaptureReplay::runUntil(VRTS &session,
+                                          vrts_clock_time_t deadline,
+                                          vrts_clock_time_t until,
+                                          replay_result_t &result) {
+  int passes = 0;
+  while (deadline <= until) {
+    auto next = session.step(deadline);
+    drain(session, result);
+    if (next > deadline) {
+      passes = 0;
+      deadline = next;
+    } else if (++passes >= max_passes_per_instant) {
+      passes = 0;
+      deadline += min_step;
+    }
+  }
+  return deadline;
+}
+
+bool CaptureReplay::run(const std::string &path, replay_result_t &result) {
+  result = {};
+  result.output_hash = fnv_offset_basis;
+  CaptureReader reader;
+  capture_event_t event;
+  if (!reader.open(path) || !reader.next(event)) {
+    return false;
+  }
+
+  auto start = event.time;
+  VRTS session(
+      [&result](const uint8_t *, size_t len) {
+        result.sent_datagrams++;
+        result.sent_bytes += len;
+      },
+      start, sync_hz);
+  if (configure) {
+    configure(session);
+  }
+
+  auto now = start;
+  auto deadline = session.step(now);
+  do {
+    deadline = runUntil(session, deadline, event.time, result);
+    // Sends are stamped when queued and receives by the kernel, so entries
+    // can be a little out of order. The session's clock never goes back.
+    now = std::max(now, event.time);
+    switch (event.kind) {
+    case CAPTURE_RX:
+      result.captured_rx++;
+      session.receive(event.data.data(), event.data.size(), event.time);
+      break;
+    case CAPTURE_TX:
+      result.captured_tx++;
+      continue;
+    case CAPTURE_INPUT:
+      result.captured_input++;
+      session.parse(event.data.data(), event.data.size(), event.stream_id);
+      break;
+    }
+    deadline = session.step(now);
+    drain(session, result);
+  } while (reader.next(event));
+
+  auto end = now + linger;
+  runUntil(session, deadline, end, result);
+  session.step(end);
+  drain(session, result);
+  result.duration_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+          .count();
+  session.getStatistics(result.stats);
+  return true;
+}
+
+} // namespace vrts
@@ -0,0 +1,72 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "VRTS.h"
+
+namespace vrts {
+
+/// @brief What a replayed session did.
+typedef struct {
+  // Entries of the capture.
+  uint64_t captured_rx;
+  uint64_t captured_tx;
+  uint64_t captured_input;
+  // Datagrams the replayed session sent, to compare with captured_tx.
+  uint64_t sent_datagrams;
+  uint64_t sent_bytes;
+  // NAL blocks it handed out, over all streams, and a hash of them in order.
+  uint64_t nal_blocks;
+  uint64_t nal_bytes;
+  uint64_t output_hash;
+  // Virtual time from the first entry to the end of the run, in ms.
+  uint64_t duration_ms;
+  vrts_stat_t stats;
+} replay_result_t;
+
+/// @brief Feeds a capture back into a session on a virtual link.
+/// @details Received datagrams and encoder input are delivered at their
+/// captured times, and the session is stepped through every deadline in
+/// between, so a replay doesn't take as long as the capture did and comes
+/// out the same every time. Captured sends are only counted: the session
+/// makes its own.
+class CaptureReplay {
+public:
+  CaptureReplay(uint16_t sync_rate_hz = 100);
+
+  /// @brief Called on the new session before anything is fed, to apply the
+  /// tunables the capture was made with.
+  void setConfigure(std::function<void(VRTS &session)> configure);
+  /// @brief Called with every NAL block the session hands out.
+  void setOutput(
+      std::function<void(uint8_t stream_id, const std::vector<uint8_t> &nal)>
+          output);
+  /// @brief How long to keep the session running after the last entry.
+  void setLinger(std::chrono::milliseconds linger);
+
+  /// @returns false if path is not a capture.
+  bool run(const std::string &path, replay_result_t &result);
+
+private:
+  uint16_t sync_hz;
+  std::chrono::milliseconds linger;
+  std::function<void(VRTS &)> configure;
+  std::function<void(uint8_t, const std::vector<uint8_t> &)> output;
+
+  void drain(VRTS &session, replay_result_t &result);
+  /// @brief Step the session through its deadlines up to until.
+  /// @returns the deadline after that.
+  vrts_clock_time_t runUntil(VRTS &session, vrts_clock_time_t deadline,
+                             vrts_clock_time_t until,
+                             replay_result_t &result);
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,369 @@
+#include "Sack.h"
+#include <algorithm>
+#include <string.h>
+
+namespace vrts {
+
+size_t putVarint(uint8_t *out, size_t cap, uint32_t v) {
+  size_t n = 0;
+  do {
+    if (n >= cap) {
+      return 0;
+    }
+    uint8_t byte = v & 0x7f;
+    v >>= 7;
+    out[n++] = byte | (v ? 0x80 : 0);
+  } while (v);
+  return n;
+}
+
+bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p >= end) {
+      return false;
+    }
+    uint8_t byte = *p++;
+    v |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool getU32(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+  if (end - p < 4) {
+    return false;
+  }
+  memcpy(&v, p, sizeof(v));
+  p += 4;
+  return true;
+}
+
+bool decodeSack(const uint8_t *data, size_t len, vrts_sack_t &sack) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  uint32_t run_count;
+  sack.runs.clear();
+  if (!getU32(p, end, sack.base) || !getVarint(p, end, run_count)) {
+    return false;
+  }
+  uint32_t missing = 0;
+  for (uint32_t i = 0; i < run_count; i++) {
+    uint32_t run;
+    if (!getVarint(p, end, run)) {
+      return false;
+    }
+    if (i & 1) {
+      sack.runs.emplace_back(missing, run);
+    } else {
+      missing = run;
+    }
+  }
+  // A trailing missing run says nothing useful; drop it.
+  sack.given_up.clear();
+  uint32_t gone_count;
+  if (p == end || !getVarint(p, end, gone_count)) {
+    return true;
+  }
+  for (uint32_t i = 0; i < gone_count; i++) {
+    uint32_t back;
+    uint32_t length;
+    if (!getVarint(p, end, back) || !getVarint(p, end, length)) {
+      // Better none than some of them.
+      sack.given_up.clear();
+      break;
+    }
+    sack.given_up.emplace_back(sack.base - back, length);
+  }
+  return true;
+}
+
+size_t encodeNackRanges(const std::vector<uint32_t> &ids, uint8_t *out,
+                        size_t cap, size_t &consumed) {
+  consumed = 0;
+  if (ids.empty() || cap < 5) {
+    return 0;
+  }
+  // Worst case varint for the count, filled in once we know it.
+  const size_t count_room = 5;
+  uint32_t first = ids[0];
+  memcpy(out, &first, sizeof(first));
+  size_t header = 4 + count_room;
+  size_t n = header;
+  uint32_t ranges = 0;
+  uint32_t prev_end = first;
+  size_t i = 0;
+  while (i < ids.size()) {
+    size_t j = i + 1;
+    while (j < ids.size() && ids[j] == ids[j - 1] + 1) {
+      j++;
+    }
+    uint32_t start = ids[i];
+    uint32_t length = static_cast<uint32_t>(j - i);
+    uint8_t scratch[10];
+    size_t used = 0;
+    if (ranges > 0) {
+      used += putVarint(scratch, sizeof(scratch), start - prev_end);
+    }
+    used += putVarint(scratch + used, sizeof(scratch) - used, length);
+    if (n + used > cap) {
+      break;
+    }
+    memcpy(out + n, scratch, used);
+    n += used;
+    ranges++;
+    prev_end = start + length;
+    consumed = j;
+    i = j;
+  }
+  if (ranges == 0) {
+    return 0;
+  }
+  // Close the gap left for the count.
+  uint8_t count_bytes[5];
+  size_t count_len = putVarint(count_bytes, sizeof(count_bytes), ranges);
+  memmove(out + 4 + count_len, out + header, n - header);
+  memcpy(out + 4, count_bytes, count_len);
+  return n - (count_room - count_len);
+}
+
+bool decodeNackRanges(const uint8_t *data, size_t len,
+                      std::vector<std::pair<uint32_t, uint32_t>> &ranges) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  uint32_t start, count;
+  ranges.clear();
+  if (!getU32(p, end, start) || !getVarint(p, end, count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t gap = 0, length;
+    if (i > 0 && !getVarint(p, end, gap)) {
+      return false;
+    }
+    if (!getVarint(p, end, length)) {
+      return false;
+    }
+    start += gap;
+    ranges.emplace_back(start, length);
+    start += length;
+  }
+  return true;
+}
+
+SackTracker::SackTracker(uint32_t max_window)
+    : max_window{max_window}, has_base{false}, base_id{0}, missing_count{0} {}
+
+void SackTracker::reset(void) {
+  has_base = false;
+  base_id = 0;
+  missing_count = 0;
+  slots.clear();
+  given_up.clear();
+}
+
+void SackTracker::receive(uint32_t id, time_point now) {
+  if (!has_base) {
+    has_base = true;
+    base_id = id;
+  }
+  int32_t offset = static_cast<int32_t>(id - base_id);
+  if (offset < 0) {
+    // Either an old duplicate, or the sender started over far behind us.
+    if (static_cast<uint32_t>(-offset) <= max_window) {
+      return;
+    }
+    reset();
+    has_base = true;
+    base_id = id;
+    offset = 0;
+  }
+  if (static_cast<uint32_t>(offset) >= max_window) {
+    // Too far ahead to track the holes in between; give up on them.
+    uint32_t drop = static_cast<uint32_t>(offset) - max_window + 1;
+    offset -= drop;
+    for (; drop > 0 && !slots.empty(); drop--) {
+      popFront();
+    }
+    // Ids past the window that never showed up.
+    if (drop > 0) {
+      giveUp(base_id, drop);
+      base_id += drop;
+    }
+  }
+  while (slots.size() <= static_cast<size_t>(offset)) {
+    slots.push_back(sack_slot_t{false, false, now});
+    missing_count++;
+  }
+  if (!slots[offset].received) {
+    slots[offset].received = true;
+    if (!slots[offset].abandoned) {
+      missing_count--;
+    }
+  }
+  advance();
+}
+
+void SackTracker::expire(time_point cutoff) {
+  while (!slots.empty() &&
+         (slots.front().received || slots.front().noticed < cutoff)) {
+    popFront();
+  }
+}
+
+void SackTracker::abandon(uint32_t first, uint32_t count) {
+  if (!has_base) {
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset = static_cast<int32_t>(first + i - base_id);
+    if (offset < 0) {
+      continue;
+    }
+    if (static_cast<size_t>(offset) >= slots.size()) {
+      break;
+    }
+    auto &slot = slots[offset];
+    if (!slot.received && !slot.abandoned) {
+      slot.abandoned = true;
+      missing_count--;
+    }
+  }
+  advance();
+}
+
+void SackTracker::holes(std::vector<uint32_t> &out, size_t max) const {
+  if (missing_count == 0) {
+    return;
+  }
+  size_t found = 0;
+  for (size_t i = 0; i < slots.size() && found < missing_count && max > 0;
+       i++) {
+    if (!slots[i].received && !slots[i].abandoned) {
+      out.push_back(base_id + static_cast<uint32_t>(i));
+      found++;
+      max--;
+    }
+  }
+}
+
+bool SackTracker::hole(uint32_t id) const {
+  if (!has_base) {
+    return false;
+  }
+  int32_t offset = static_cast<int32_t>(id - base_id);
+  if (offset < 0 || static_cast<size_t>(offset) >= slots.size()) {
+    return false;
+  }
+  return !slots[offset].received && !slots[offset].abandoned;
+}
+
+void SackTracker::advance(void) {
+  while (!slots.empty() &&
+         (slots.front().received || slots.front().abandoned)) {
+    popFront();
+  }
+}
+
+void SackTracker::popFront(void) {
+  const auto &slot = slots.front();
+  if (!slot.received) {
+    if (!slot.abandoned) {
+      missing_count--;
+    }
+    giveUp(base_id, 1);
+  }
+  slots.pop_front();
+  base_id++;
+}
+
+void SackTracker::giveUp(uint32_t first, uint32_t count) {
+  if (!given_up.empty() &&
+      given_up.back().first + given_up.back().count == first) {
+    given_up.back().count += count;
+    given_up.back().repeats = given_up_repeats;
+    return;
+  }
+  given_up.push_back(sack_gone_t{first, count, given_up_repeats});
+  if (given_up.size() > max_given_up) {
+    given_up.pop_front();
+  }
+}
+
+size_t SackTracker::encode(uint8_t *out, size_t cap) {
+  const size_t count_room = 5;
+  if (cap < 4 + count_room) {
+    return 0;
+  }
+  // Runs left out now are in the next SACK, given up holes the sender took
+  // for received are lost to it for good. Up to half the room goes to those,
+  // newest first.
+  uint8_t gone[5 + max_given_up * 10];
+  size_t gone_len = 0;
+  uint32_t gone_count = 0;
+  size_t gone_room = std::min(sizeof(gone), (cap - 4 - count_room) / 2);
+  for (auto range = given_up.rbegin(); range != given_up.rend(); range++) {
+    uint8_t scratch[10];
+    size_t used = putVarint(scratch, sizeof(scratch), base_id - range->first);
+    used += putVarint(scratch + used, sizeof(scratch) - used, range->count);
+    if (5 + gone_len + used > gone_room) {
+      break;
+    }
+    memcpy(gone + 5 + gone_len, scratch, used);
+    gone_len += used;
+    gone_count++;
+    range->repeats--;
+  }
+  if (gone_count > 0) {
+    size_t count_len = putVarint(gone, 5, gone_count);
+    memmove(gone + count_len, gone + 5, gone_len);
+    gone_len += count_len;
+    given_up.erase(std::remove_if(given_up.begin(), given_up.end(),
+                                  [](const sack_gone_t &range) {
+                                    return range.repeats == 0;
+                                  }),
+                   given_up.end());
+  }
+  cap -= gone_len;
+  memcpy(out, &base_id, sizeof(base_id));
+  size_t n = 4 + count_room;
+  uint32_t run_count = 0;
+
+  // The window always starts with a hole (received ids at the front are
+  // folded into base) and ends with a received id.
+  size_t i = 0;
+  while (i < slots.size()) {
+    size_t missing_end = i;
+    while (missing_end < slots.size() && !slots[missing_end].received) {
+      missing_end++;
+    }
+    size_t received_end = missing_end;
+    while (received_end < slots.size() && slots[received_end].received) {
+      received_end++;
+    }
+    uint8_t scratch[10];
+    size_t used = putVarint(scratch, sizeof(scratch),
+                            static_cast<uint32_t>(missing_end - i));
+    used += putVarint(scratch + used, sizeof(scratch) - used,
+                      static_cast<uint32_t>(received_end - missing_end));
+    if (n + used > cap) {
+      break;
+    }
+    memcpy(out + n, scratch, used);
+    n += used;
+    run_count += 2;
+    i = received_end;
+  }
+
+  uint8_t count_bytes[5];
+  size_t count_len = putVarint(count_bytes, sizeof(count_bytes), run_count);
+  memmove(out + 4 + count_len, out + 4 + count_room, n - 4 - count_room);
+  memcpy(out + 4, count_bytes, count_len);
+  n -= count_room - count_len;
+  memcpy(out + n, gone, gone_len);
+  return n + gone_len;
+}
+
+} // namespace vrts
@@ -0,0 +1,139 @@
+#ifndef SACK_H
+#define SACK_H
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace vrts {
+
+// Selective ACK / ranged NACK payloads.
+//
+// SACK payload:
+//   uint32_t base         every id before base is received or given up on
+//   varint   run_count    number of runs that follow
+//   varint   runs...      alternating missing / received run lengths,
+//                         starting with a missing run at base
+//   varint   gone_count   optional: holes before base that were given up on,
+//   varint   back0        newest first; ids [base - back0, + length0) never
+//   varint   length0      arrived
+//   ...                   anything after that is ignored (extensions)
+//
+// NACK range payload:
+//   uint32_t first        first missing id
+//   varint   range_count
+//   varint   length0      ids [first, first + length0) are missing
+//   varint   gap1         next range starts gap1 ids after the previous end
+//   varint   length1
+//   ...                   anything after the ranges is ignored
+//
+// Multi-byte fixed fields are little endian like the rest of the header.
+
+/// @brief Append v as a LEB128 varint.
+/// @returns bytes written, 0 if it doesn't fit into cap.
+size_t putVarint(uint8_t *out, size_t cap, uint32_t v);
+
+/// @brief Read a LEB128 varint, advancing p. False on truncation/overflow.
+bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v);
+
+/// @brief Decoded SACK. Runs are (missing, received) length pairs from base,
+/// given_up (first id, count) ranges before it.
+typedef struct {
+  uint32_t base;
+  std::vector<std::pair<uint32_t, uint32_t>> runs;
+  std::vector<std::pair<uint32_t, uint32_t>> given_up;
+} vrts_sack_t;
+
+bool decodeSack(const uint8_t *data, size_t len, vrts_sack_t &sack);
+
+/// @brief Encode sorted, unique ids as NACK ranges.
+/// @param consumed set to how many ids made it into the payload.
+/// @returns payload bytes, 0 if nothing fit.
+size_t encodeNackRanges(const std::vector<uint32_t> &ids, uint8_t *out,
+                        size_t cap, size_t &consumed);
+
+/// @brief Decode NACK ranges as (first id, count) pairs.
+bool decodeNackRanges(const uint8_t *data, size_t len,
+                      std::vector<std::pair<uint32_t, uint32_t>> &ranges);
+
+/// @brief Receiver side record of which data ids arrived.
+/// @details Tracks a window from base up to the highest id received. base
+/// moves past ids as soon as they (and everything before them) arrived, and
+/// past holes once they've been open longer than the caller's cutoff. Every
+/// SACK describes the whole window, so a lost SACK is covered by the next.
+/// The holes base moved past are listed as given up in the next few SACKs,
+/// so the sender doesn't take them for received.
+class SackTracker {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+
+  SackTracker(uint32_t max_window = 1 << 15);
+
+  /// @brief Record a received id.
+  void receive(uint32_t id, time_point now);
+
+  /// @brief Give up on holes noticed before cutoff.
+  void expire(time_point cutoff);
+
+  /// @brief Write the SACK payload. Up to half the room goes to the given up
+  /// holes, newest first, runs that don't fit are left out.
+  size_t encode(uint8_t *out, size_t cap);
+
+  /// @brief Give up on the holes among count ids from first right away,
+  /// as expire() would once they're old enough: holes() no longer lists
+  /// them and base moves past them.
+  void abandon(uint32_t first, uint32_t count);
+
+  /// @brief Append up to max ids that are still missing, oldest first.
+  void holes(std::vector<uint32_t> &out, size_t max) const;
+  /// @brief Whether id is one of the holes() still waited for.
+  bool hole(uint32_t id) const;
+
+  bool started(void) const { return has_base; }
+  uint32_t base(void) const { return base_id; }
+  size_t window(void) const { return slots.size(); }
+  /// @brief Holes not abandoned.
+  size_t missing(void) const { return missing_count; }
+  void reset(void);
+
+private:
+  typedef struct {
+    bool received;
+    // Not to be NACKed any more, see abandon().
+    bool abandoned;
+    time_point noticed;
+  } sack_slot_t;
+
+  typedef struct {
+    uint32_t first;
+    uint32_t count;
+    // SACKs still to list it in.
+    uint8_t repeats;
+  } sack_gone_t;
+
+  // A range goes out this many times, so it takes as many lost SACKs in a
+  // row for the sender to miss it.
+  static constexpr uint8_t given_up_repeats = 8;
+  static constexpr size_t max_given_up = 256;
+
+  uint32_t max_window;
+  bool has_base;
+  uint32_t base_id;
+  size_t missing_count;
+  std::deque<sack_slot_t> slots;
+  // Holes base moved past, newest last.
+  std::deque<sack_gone_t> given_up;
+
+  void advance(void);
+  /// @brief Drop the front slot, base moves past it.
+  void popFront(void);
+  void giveUp(uint32_t first, uint32_t count);
+};
+
+} // namespace vrts
+
+#endif
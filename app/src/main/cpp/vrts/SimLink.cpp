@@ -0,0 +1,248 @@
+#include "SimLink.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+namespace vrts {
+
+// As in CaptureReplay: a pass that made progress asks for another right
+// away, but after this many at one instant time moves on by min_step.
+static constexpr int max_passes_per_instant = 16;
+static constexpr auto min_step = std::chrono::microseconds(100);
+
+SimPath::SimPath(uint32_t seed)
+    : path{sim_path_ideal}, random{seed}, bad_state{false}, last_lost{false},
+      busy_until{}, last_arrival{}, sequence{0}, counts{} {}
+
+void SimPath::setProfile(const sim_path_t &profile) { path = profile; }
+
+double SimPath::uniform(void) {
+  return (random() >> 5) * (1.0 / 134217728.0);
+}
+
+void SimPath::send(const uint8_t *data, size_t len,
+                   std::chrono::system_clock::time_point now) {
+  counts.offered++;
+  if (path.mtu_bytes && len > path.mtu_bytes) {
+    counts.oversize++;
+    return;
+  }
+  if (bad_state) {
+    bad_state = !(path.to_good > 0 && uniform() < path.to_good);
+  } else {
+    bad_state = path.to_bad > 0 && uniform() < path.to_bad;
+  }
+  float loss = bad_state ? path.loss_bad : path.loss_good;
+  if (loss > 0 && uniform() < loss) {
+    counts.lost++;
+    if (!last_lost) {
+      counts.loss_bursts++;
+    }
+    last_lost = true;
+    return;
+  }
+  last_lost = false;
+
+  auto departure = now;
+  if (path.rate_kbps) {
+    auto start = std::max(now, busy_until);
+    // Bytes still waiting ahead of this one.
+    uint64_t backlog =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - now)
+            .count() *
+        path.rate_kbps / 8000000;
+    if (start > now && backlog + len > path.queue_bytes) {
+      counts.queue_drops++;
+      return;
+    }
+    busy_until = start + std::chrono::nanoseconds(len * 8000000ull /
+                                                  path.rate_kbps);
+    departure = busy_until;
+  }
+  auto arrival = departure + std::chrono::microseconds(path.delay_us);
+  if (path.jitter_us) {
+    arrival += std::chrono::microseconds(
+        static_cast<int64_t>(uniform() * path.jitter_us));
+  }
+  arrival = std::max(arrival, last_arrival);
+  last_arrival = arrival;
+  if (path.reorder > 0 && uniform() < path.reorder) {
+    arrival += std::chrono::microseconds(path.reorder_us);
+    counts.reordered++;
+  }
+
+  auto copy = std::make_shared<std::vector<uint8_t>>(data, data + len);
+  in_flight.push({arrival, sequence++, copy});
+  if (path.duplicate > 0 && uniform() < path.duplicate) {
+    in_flight.push({arrival, sequence++, copy});
+    counts.duplicated++;
+  }
+}
+
+std::chrono::system_clock::time_point SimPath::nextArrival(void) const {
+  return in_flight.empty() ? std::chrono::system_clock::time_point::max()
+                           : in_flight.top().arrival;
+}
+
+bool SimPath::receive(std::chrono::system_clock::time_point now,
+                      datagram_t &datagram) {
+  if (in_flight.empty() || in_flight.top().arrival > now) {
+    return false;
+  }
+  auto &next = in_flight.top();
+  datagram.arrival = next.arrival;
+  datagram.data = *next.data;
+  in_flight.pop();
+  counts.delivered++;
+  counts.delivered_bytes += datagram.data.size();
+  return true;
+}
+
+SimLink::SimLink(std::chrono::system_clock::time_point start, uint32_t seed,
+                 uint16_t sync_rate_hz)
+    : clock{start}, sync_hz{sync_rate_hz}, clock_offsets{}, wall_start{},
+      sim_start{start}, real_time{false},
+      paths{SimPath(seed * 2), SimPath(seed * 2 + 1)},
+      deadlines{start, start} {
+  createEndpoint(SIM_SIDE_A);
+  createEndpoint(SIM_SIDE_B);
+}
+
+void SimLink::createEndpoint(int side) {
+  endpoints[side] = std::unique_ptr<VRTS>(new VRTS(
+      [this, side](const uint8_t *data, size_t len) {
+        paths[side].send(data, len, clock);
+      },
+      clock + clock_offsets[side], sync_hz));
+}
+
+void SimLink::setClockOffset(sim_side_t side,
+                             std::chrono::microseconds offset) {
+  clock_offsets[side] = offset;
+  createEndpoint(side);
+}
+
+void SimLink::setOutput(
+    std::function<void(sim_side_t, uint8_t, std::vector<uint8_t> &)>
+        new_output) {
+  output = std::move(new_output);
+}
+
+void SimLink::setRealTime(bool enable) {
+  real_time = enable;
+  wall_start = std::chrono::steady_clock::now();
+  sim_start = clock;
+}
+
+void SimLink::step(sim_side_t side) {
+  auto deadline = endpoints[side]->step(clock + clock_offsets[side]);
+  deadlines[side] = deadline == std::chrono::system_clock::time_point::max()
+                        ? deadline
+                        : deadline - clock_offsets[side];
+  if (!output) {
+    return;
+  }
+  std::vector<uint8_t> nal;
+  for (uint8_t stream_id = 0; stream_id < vrts_max_streams; stream_id++) {
+    while (endpoints[side]->popData(nal, stream_id)) {
+      output(side, stream_id, nal);
+    }
+  }
+}
+
+void SimLink::runUntil(std::chrono::system_clock::time_point until) {
+  // Whatever was fed since the last run may want to go out now.
+  step(SIM_SIDE_A);
+  step(SIM_SIDE_B);
+  int passes = 0;
+  SimPath::datagram_t datagram;
+  while (true) {
+    auto next = std::min({deadlines[0], deadlines[1], paths[0].nextArrival(),
+                          paths[1].nextArrival()});
+    if (next > clock) {
+      passes = 0;
+    } else if (++passes >= max_passes_per_instant) {
+      next = clock + min_step;
+    } else {
+      next = clock;
+    }
+    if (next > until) {
+      break;
+    }
+    if (real_time) {
+      std::this_thread::sleep_until(
+          wall_start + std::chrono::duration_cast<
+                           std::chrono::steady_clock::duration>(next -
+                                                                sim_start));
+    }
+    clock = next;
+    // Hand over what has arrived, then let both sides act on it.
+    for (int side = 0; side < 2; side++) {
+      auto &peer = *endpoints[1 - side];
+      while (paths[side].receive(clock, datagram)) {
+        peer.receive(datagram.data.data(), datagram.data.size(),
+                     datagram.arrival + clock_offsets[1 - side]);
+      }
+    }
+    step(SIM_SIDE_A);
+    step(SIM_SIDE_B);
+  }
+  // Bring both sessions up to until, so whatever is fed before the next run
+  // is fed at now().
+  if (clock < until) {
+    clock = until;
+    step(SIM_SIDE_A);
+    step(SIM_SIDE_B);
+  }
+}
+
+std::vector<std::vector<uint8_t>> loadAccessUnits(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  std::vector<size_t> starts;
+  for (size_t i = 0; i + 3 < data.size(); i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      starts.push_back(i + 3);
+      i += 2;
+    }
+  }
+  static const uint8_t aud[] = {0, 0, 0, 1, 0x46, 0x01, 0x50};
+  static const uint8_t start_code[] = {0, 0, 0, 1};
+  std::vector<std::vector<uint8_t>> units;
+  std::vector<uint8_t> unit;
+  bool last_vcl = false;
+  for (size_t k = 0; k < starts.size(); k++) {
+    size_t begin = starts[k];
+    size_t end = k + 1 < starts.size() ? starts[k + 1] - 3 : data.size();
+    while (end > begin && data[end - 1] == 0) {
+      end--;
+    }
+    if (end - begin < 3) {
+      continue;
+    }
+    int nal_type = (data[begin] >> 1) & 0x3f;
+    bool vcl = nal_type < 32;
+    bool first_slice = vcl && (data[begin + 2] & 0x80);
+    // A new picture starts with its first slice or a non-VCL NAL after
+    // the slices of the last one.
+    if ((first_slice || !vcl) && last_vcl && !unit.empty()) {
+      units.push_back(std::move(unit));
+      unit.clear();
+    }
+    if (unit.empty()) {
+      unit.insert(unit.end(), aud, aud + sizeof(aud));
+    }
+    unit.insert(unit.end(), start_code, start_code + sizeof(start_code));
+    unit.insert(unit.end(), data.begin() + begin, data.begin() + end);
+    last_vcl = vcl;
+  }
+  if (!unit.empty()) {
+    units.push_back(std::move(unit));
+    units.emplace_back(aud, aud + sizeof(aud));
+  }
+  return units;
+}
+
+} // namespace vrts
@@ -0,0 +1,185 @@
+#ifndef SIMLINK_H
+#define SIMLINK_H
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "VRTS.h"
+
+namespace vrts {
+
+/// @brief Behaviour of one direction of a simulated link.
+/// @details Loss follows a Gilbert-Elliott model: each datagram first moves
+/// the chain between its good and bad state, then is lost with that state's
+/// probability. With to_bad 0 it is plain uniform loss at loss_good.
+typedef struct {
+  float loss_good;
+  float loss_bad;
+  // Per datagram chance of switching state.
+  float to_bad;
+  float to_good;
+  // Bottleneck rate, 0 for none, and the bytes its drop-tail queue holds.
+  // A queue_bytes of 0 with a rate set holds nothing but the datagram on
+  // the wire.
+  uint32_t rate_kbps;
+  uint32_t queue_bytes;
+  // Propagation delay plus up to jitter_us more, uniformly. Jitter alone
+  // never reorders.
+  uint32_t delay_us;
+  uint32_t jitter_us;
+  // Chance a datagram is held back by reorder_us, letting later ones pass.
+  float reorder;
+  uint32_t reorder_us;
+  // Chance a datagram arrives twice.
+  float duplicate;
+  // Largest datagram the path carries, as if DF were set on every one, 0
+  // for any.
+  uint32_t mtu_bytes;
+} sim_path_t;
+
+/// @brief A path that loses, queues and delays nothing.
+constexpr sim_path_t sim_path_ideal = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/// @brief What happened to the datagrams offered to one direction.
+typedef struct {
+  uint64_t offered;
+  uint64_t delivered;
+  uint64_t delivered_bytes;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t reordered;
+  uint64_t duplicated;
+  // Dropped for being larger than mtu_bytes.
+  uint64_t oversize;
+  // Lost datagrams in runs, for checking burst lengths.
+  uint64_t loss_bursts;
+} sim_path_stats_t;
+
+/// @brief One direction of a simulated link.
+/// @details Datagrams are timed on arrival at send() and come out of
+/// receive() once their time has come, in arrival order; ties keep send
+/// order. The randomness is seeded, so a path does the same thing every
+/// time it is fed the same way.
+class SimPath {
+public:
+  typedef struct {
+    std::chrono::system_clock::time_point arrival;
+    std::vector<uint8_t> data;
+  } datagram_t;
+
+  SimPath(uint32_t seed = 1);
+
+  void setProfile(const sim_path_t &profile);
+  const sim_path_t &profile(void) const { return path; }
+
+  /// @brief Offer a datagram to the path at now.
+  void send(const uint8_t *data, size_t len,
+            std::chrono::system_clock::time_point now);
+  /// @brief Earliest arrival still in flight, time_point::max() if none.
+  std::chrono::system_clock::time_point nextArrival(void) const;
+  /// @brief Take the next datagram that has arrived by now.
+  bool receive(std::chrono::system_clock::time_point now,
+               datagram_t &datagram);
+
+  const sim_path_stats_t &stats(void) const { return counts; }
+
+private:
+  typedef struct {
+    std::chrono::system_clock::time_point arrival;
+    uint64_t sequence;
+    std::shared_ptr<std::vector<uint8_t>> data;
+  } in_flight_t;
+  struct LaterFirst {
+    bool operator()(const in_flight_t &a, const in_flight_t &b) const {
+      return a.arrival > b.arrival ||
+             (a.arrival == b.arrival && a.sequence > b.sequence);
+    }
+  };
+
+  sim_path_t path;
+  std::mt19937 random;
+  bool bad_state;
+  bool last_lost;
+  // When the bottleneck has finished sending what it holds.
+  std::chrono::system_clock::time_point busy_until;
+  // Latest in-order arrival, so jitter doesn't reorder.
+  std::chrono::system_clock::time_point last_arrival;
+  uint64_t sequence;
+  std::priority_queue<in_flight_t, std::vector<in_flight_t>, LaterFirst>
+      in_flight;
+  sim_path_stats_t counts;
+
+  /// @brief Uniform in [0, 1), the same on every standard library.
+  double uniform(void);
+};
+
+typedef enum : uint8_t { SIM_SIDE_A = 0, SIM_SIDE_B = 1 } sim_side_t;
+
+/// @brief Two VRTS sessions on virtual links joined by a SimPath each way.
+/// @details Time only moves in runUntil(), from deadline to deadline and
+/// arrival to arrival, so a session runs as fast as the host allows and
+/// the same way for the same seed. Set setRealTime() to pace it to the
+/// wall clock instead, e.g. to watch it. Everything, including feeding and
+/// draining the endpoints, happens on the caller's thread.
+class SimLink {
+public:
+  SimLink(std::chrono::system_clock::time_point start, uint32_t seed = 1,
+          uint16_t sync_rate_hz = 100);
+
+  VRTS &endpoint(sim_side_t side) { return *endpoints[side]; }
+  /// @brief The path datagrams sent by side take.
+  SimPath &path(sim_side_t side) { return paths[side]; }
+  void setProfile(sim_side_t side, const sim_path_t &profile) {
+    paths[side].setProfile(profile);
+  }
+  /// @brief Run a side's clock this far ahead of the simulation's, to try
+  /// out clock sync. Replaces the side's session, so set it first.
+  void setClockOffset(sim_side_t side, std::chrono::microseconds offset);
+
+  /// @brief Called with every NAL block an endpoint hands out, right after
+  /// the step it was queued in. Without it, blocks wait for popData().
+  void setOutput(std::function<void(sim_side_t side, uint8_t stream_id,
+                                    std::vector<uint8_t> &nal)>
+                     output);
+  /// @brief Sleep so simulated time passes no faster than the wall clock.
+  void setRealTime(bool enable);
+
+  std::chrono::system_clock::time_point now(void) const { return clock; }
+  /// @brief Run both endpoints and the link up to until.
+  void runUntil(std::chrono::system_clock::time_point until);
+  void runFor(std::chrono::system_clock::duration duration) {
+    runUntil(clock + duration);
+  }
+
+private:
+  std::chrono::system_clock::time_point clock;
+  uint16_t sync_hz;
+  std::chrono::microseconds clock_offsets[2];
+  std::chrono::steady_clock::time_point wall_start;
+  std::chrono::system_clock::time_point sim_start;
+  bool real_time;
+  SimPath paths[2];
+  std::unique_ptr<VRTS> endpoints[2];
+  std::chrono::system_clock::time_point deadlines[2];
+  std::function<void(sim_side_t, uint8_t, std::vector<uint8_t> &)> output;
+
+  void step(sim_side_t side);
+  void createEndpoint(int side);
+};
+
+/// @brief Access units of an Annex B file, each led by an AUD like the
+/// encoder puts out, for feeding a simulated session. The AUD at the end
+/// flushes the last one.
+std::vector<std::vector<uint8_t>> loadAccessUnits(const std::string &path);
+
+} // namespace vrts
+
+#endif
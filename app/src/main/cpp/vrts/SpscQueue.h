@@ -0,0 +1,146 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+
+namespace vrts {
+
+/// @brief Bounded lock-free queue with one producer and one consumer.
+/// @details A power-of-two ring where every slot carries a sequence number
+/// telling whether it is free for the push of lap n or holds the value for
+/// the pop of lap n. Only the producer ever writes a value. Pops claim the
+/// head with a compare and swap, so besides the consumer the producer may
+/// pop as well, which is how it sheds the oldest entries when full.
+///
+/// pop() with a timeout yields a few times before it blocks on a condition
+/// variable, a sleeping consumer costs the producer a wake-up per entry.
+/// push() only takes the mutex when a consumer is actually waiting.
+template <typename T> class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity = 128)
+      : mask{roundUpPow2(capacity) - 1},
+        slots{new slot_t[mask + 1]}, head{0}, tail{0}, waiters{0} {
+    for (size_t i = 0; i <= mask; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  size_t capacity(void) const { return mask + 1; }
+  /// @brief Entries queued, a snapshot when called from the other side.
+  size_t size(void) const {
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_acquire);
+    return t - h <= capacity() ? t - h : 0;
+  }
+  bool empty(void) const { return size() == 0; }
+
+  /// @brief Producer only.
+  /// @returns false, leaving value alone, when the queue is full.
+  bool push(T &&value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    slot_t &slot = slots[pos & mask];
+    if (slot.sequence.load(std::memory_order_acquire) != pos) {
+      return false;
+    }
+    slot.value = std::move(value);
+    slot.sequence.store(pos + 1, std::memory_order_release);
+    tail.store(pos + 1, std::memory_order_release);
+    // Pairs with the fence in pop(), so either the waiter sees the value or
+    // we see the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed)) {
+      { std::lock_guard<std::mutex> lock{wait_mutex}; }
+      wait_cv.notify_one();
+    }
+    return true;
+  }
+
+  /// @brief Take the oldest entry without waiting.
+  bool tryPop(T &value) {
+    return popIf(value, [](const T &) { return true; });
+  }
+
+  /// @brief Take the oldest entry, waiting up to timeout for one.
+  template <typename Rep, typename Period>
+  bool pop(T &value, std::chrono::duration<Rep, Period> timeout) {
+    for (int spin = 0; spin < pop_spins; spin++) {
+      if (tryPop(value)) {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock{wait_mutex};
+    waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool popped = wait_cv.wait_for(lock, timeout, [&] { return tryPop(value); });
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return popped;
+  }
+
+  /// @brief Take the oldest entry if pred accepts it.
+  /// @details pred may run while the other side pops the same entry and must
+  /// only look at fields neither side changes once pushed.
+  template <typename P> bool popIf(T &value, P &&pred) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      slot_t &slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t lap = static_cast<intptr_t>(sequence - (pos + 1));
+      if (lap < 0) {
+        return false;
+      }
+      if (lap > 0) {
+        // The other side took it in the meantime.
+        pos = head.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (!pred(slot.value)) {
+        return false;
+      }
+      if (head.compare_exchange_weak(pos, pos + 1,
+                                     std::memory_order_relaxed)) {
+        value = std::move(slot.value);
+        slot.sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+private:
+  typedef struct {
+    std::atomic<size_t> sequence;
+    T value;
+  } slot_t;
+
+  static constexpr int pop_spins = 16;
+
+  static size_t roundUpPow2(size_t v) {
+    size_t p = 1;
+    while (p < v) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  const size_t mask;
+  std::unique_ptr<slot_t[]> slots;
+  // Apart so the two sides don't share a cache line.
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<uint32_t> waiters;
+  std::mutex wait_mutex;
+  std::condition_variable wait_cv;
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+namespace vrts {
+
+/// @brief Hierarchical timing wheel for per-packet deadlines.
+/// @details Four levels of 64 slots. Level 0 slots are one tick wide (1 ms by
+/// default) and each level up is 64x coarser, covering ~4.6 hours at 1 ms.
+/// Entries further out than that are parked on the top level and re-cascaded
+/// until they come into range.
+///
+/// Entries are never cancelled. The owner re-validates a packet when its
+/// entry fires and simply ignores entries that no longer apply (packet gone,
+/// resent since, ...). advance() only touches entries that are due, plus the
+/// occasional cascade from a coarser level.
+///
+/// Not thread safe.
+class TimerWheel {
+public:
+  using time_point = std::chrono::system_clock::time_point;
+  using duration = std::chrono::system_clock::duration;
+
+  TimerWheel(duration resolution = std::chrono::milliseconds(1))
+      : resolution{resolution}, origin{std::chrono::system_clock::now()},
+        current_tick{0}, count{0} {
+    occupied.fill(0);
+  }
+
+  /// @brief Number of pending entries, including ones that went stale.
+  size_t size(void) const { return count; }
+  bool empty(void) const { return count == 0; }
+
+  /// @brief Fire (id, kind) once when is reached. Never fires early.
+  void schedule(time_point when, uint32_t id, uint8_t kind = 0) {
+    timer_entry_t entry = {ceilTick(when), id, kind};
+    count++;
+    if (entry.tick <= current_tick) {
+      expired.push_back(entry);
+    } else {
+      place(entry);
+    }
+  }
+
+  /// @brief Fire everything due at now, in roughly deadline order.
+  /// @details fire(uint32_t id, uint8_t kind) may schedule() again. Entries
+  /// it schedules in the past fire on the next advance().
+  /// @returns number of entries fired.
+  template <typename F> size_t advance(time_point now, F &&fire) {
+    size_t fired = 0;
+    if (!expired.empty()) {
+      std::vector<timer_entry_t> due;
+      due.swap(expired);
+      for (auto &entry : due) {
+        count--;
+        fired++;
+        fire(entry.id, entry.kind);
+      }
+    }
+
+    uint64_t target = floorTick(now);
+    while (current_tick < target) {
+      if (occupied[0] == 0) {
+        // Nothing on the finest level: jump to the tick before the next
+        // level 1 cascade.
+        uint64_t last_in_block = current_tick | slot_mask;
+        if (last_in_block >= target) {
+          current_tick = target;
+          break;
+        }
+        current_tick = last_in_block;
+      }
+      current_tick++;
+
+      for (int level = 1; level < levels; level++) {
+        if ((current_tick & ((1ull << (slot_bits * level)) - 1)) != 0) {
+          break;
+        }
+        cascade(level);
+      }
+
+      auto &slot = slots[0][current_tick & slot_mask];
+      if (slot.empty()) {
+        continue;
+      }
+      std::vector<timer_entry_t> due;
+      due.swap(slot);
+      occupied[0] &= ~(1ull << (current_tick & slot_mask));
+      for (auto &entry : due) {
+        if (entry.tick <= current_tick) {
+          count--;
+          fired++;
+          fire(entry.id, entry.kind);
+        } else {
+          place(entry);
+        }
+      }
+    }
+    return fired;
+  }
+
+  /// @brief Earliest time anything may fire, time_point::max() if empty.
+  /// @details Exact for entries less than 64 ticks out; for coarser levels
+  /// it is the start of their slot, so the loop can wake a little early,
+  /// cascade, and go back to sleep.
+  time_point nextDeadline(void) const {
+    if (!expired.empty()) {
+      return timeOf(current_tick);
+    }
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < levels; level++) {
+      if (occupied[level] == 0) {
+        continue;
+      }
+      int shift = slot_bits * level;
+      uint32_t next_slot = ((current_tick >> shift) + 1) & slot_mask;
+      uint64_t bits = occupied[level];
+      uint64_t rotated =
+          (bits >> next_slot) | (bits << ((slots_per_level - next_slot) & 63));
+      uint64_t distance = __builtin_ctzll(rotated) + 1;
+      uint64_t start = ((current_tick >> shift) + distance) << shift;
+      if (start < best) {
+        best = start;
+      }
+    }
+    return best == UINT64_MAX ? time_point::max() : timeOf(best);
+  }
+
+  /// @brief Empty the wheel and count ticks from origin on, for callers
+  /// that run on a clock of their own.
+  void restart(time_point new_origin) {
+    clear();
+    origin = new_origin;
+    current_tick = 0;
+  }
+
+  void clear(void) {
+    for (auto &level : slots) {
+      for (auto &slot : level) {
+        slot.clear();
+      }
+    }
+    occupied.fill(0);
+    expired.clear();
+    count = 0;
+  }
+
+private:
+  typedef struct {
+    uint64_t tick;
+    uint32_t id;
+    uint8_t kind;
+  } timer_entry_t;
+
+  static constexpr int levels = 4;
+  static constexpr int slot_bits = 6;
+  static constexpr uint32_t slots_per_level = 1u << slot_bits;
+  static constexpr uint64_t slot_mask = slots_per_level - 1;
+
+  duration resolution;
+  time_point origin;
+  uint64_t current_tick;
+  size_t count;
+  std::array<std::array<std::vector<timer_entry_t>, slots_per_level>, levels>
+      slots;
+  std::array<uint64_t, levels> occupied;
+  std::vector<timer_entry_t> expired;
+
+  uint64_t floorTick(time_point t) const {
+    return t <= origin ? 0 : static_cast<uint64_t>((t - origin) / resolution);
+  }
+
+  uint64_t ceilTick(time_point t) const {
+    if (t == time_point::max()) {
+      return UINT64_MAX;
+    }
+    if (t <= origin) {
+      return 0;
+    }
+    auto elapsed = t - origin;
+    return static_cast<uint64_t>((elapsed + resolution - duration(1)) /
+                                 resolution);
+  }
+
+  time_point timeOf(uint64_t tick) const {
+    return origin + resolution * static_cast<int64_t>(tick);
+  }
+
+  /// @brief File an entry by how far out it is; due entries go in the
+  /// current level 0 slot.
+  void place(const timer_entry_t &entry) {
+    uint64_t delta = entry.tick > current_tick ? entry.tick - current_tick : 0;
+    int level = 0;
+    while (level < levels - 1 &&
+           delta >= (1ull << (slot_bits * (level + 1)))) {
+      level++;
+    }
+    uint32_t index = (entry.tick >> (slot_bits * level)) & slot_mask;
+    slots[level][index].push_back(entry);
+    occupied[level] |= 1ull << index;
+  }
+
+  /// @brief Redistribute the level slot that current_tick just entered.
+  void cascade(int level) {
+    uint32_t index = (current_tick >> (slot_bits * level)) & slot_mask;
+    if (slots[level][index].empty()) {
+      return;
+    }
+    std::vector<timer_entry_t> moving;
+    moving.swap(slots[level][index]);
+    occupied[level] &= ~(1ull << index);
+    for (auto &entry : moving) {
+      place(entry);
+    }
+  }
+};
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,103 @@
+#include "Timestamp.h"
+#include <string.h>
+
+namespace vrts {
+
+const uint8_t vrts_sei_uuid[16] = {0x56, 0x52, 0x54, 0x53, 0x2d, 0x74, 0x69,
+                                   0x6d, 0x65, 0x9c, 0x4e, 0x21, 0xb7, 0x0f,
+                                   0x63, 0xd5};
+
+static constexpr uint8_t sei_nal_type = 39; // PREFIX_SEI_NUT
+static constexpr uint8_t sei_user_data_unregistered = 5;
+static constexpr uint8_t sei_version = 1;
+static constexpr size_t sei_payload_bytes = sizeof(vrts_sei_uuid) + 1 + 8 + 8;
+// SEI message header, payload and trailing bits, unescaped.
+static constexpr size_t sei_rbsp_bytes = 2 + sei_payload_bytes + 1;
+// A stamped block starts with the AUD and then the SEI, leave some room for
+// an encoder that puts something in between.
+static constexpr size_t sei_search_bytes = 96;
+
+static void putBigEndian(uint8_t *out, int64_t value) {
+  for (int i = 7; i >= 0; i--) {
+    out[i] = static_cast<uint8_t>(value);
+    value >>= 8;
+  }
+}
+
+static int64_t getBigEndian(const uint8_t *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | in[i];
+  }
+  return static_cast<int64_t>(value);
+}
+
+size_t buildTimestampSei(const vrts_sei_timestamp_t &stamp, uint8_t *out) {
+  uint8_t rbsp[sei_rbsp_bytes];
+  rbsp[0] = sei_user_data_unregistered;
+  rbsp[1] = sei_payload_bytes;
+  uint8_t *payload = rbsp + 2;
+  memcpy(payload, vrts_sei_uuid, sizeof(vrts_sei_uuid));
+  payload[16] = sei_version;
+  putBigEndian(payload + 17, stamp.capture_us);
+  putBigEndian(payload + 25, stamp.ingest_us);
+  rbsp[sei_rbsp_bytes - 1] = 0x80;
+
+  size_t n = 0;
+  out[n++] = 0;
+  out[n++] = 0;
+  out[n++] = 0;
+  out[n++] = 1;
+  out[n++] = sei_nal_type << 1;
+  out[n++] = 1;
+  // Emulation prevention: no 00 00 followed by 00..03 inside the NAL.
+  int zeros = 0;
+  for (auto byte : rbsp) {
+    if (zeros >= 2 && byte <= 3) {
+      out[n++] = 3;
+      zeros = 0;
+    }
+    out[n++] = byte;
+    zeros = byte == 0 ? zeros + 1 : 0;
+  }
+  return n;
+}
+
+bool findTimestampSei(const uint8_t *data, size_t len,
+                      vrts_sei_timestamp_t &stamp) {
+  size_t end = std::min(len, sei_search_bytes);
+  for (size_t i = 0; i + 3 < end; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+    size_t nal = i + 3;
+    i += 2;
+    if (nal + 2 >= len || ((data[nal] >> 1) & 0x3f) != sei_nal_type) {
+      continue;
+    }
+    // Undo emulation prevention for as much as the message takes.
+    uint8_t rbsp[sei_rbsp_bytes];
+    size_t n = 0;
+    int zeros = 0;
+    for (size_t k = nal + 2; k < len && n < sizeof(rbsp); k++) {
+      if (zeros >= 2 && data[k] == 3) {
+        zeros = 0;
+        continue;
+      }
+      rbsp[n++] = data[k];
+      zeros = data[k] == 0 ? zeros + 1 : 0;
+    }
+    if (n < sizeof(rbsp) - 1 || rbsp[0] != sei_user_data_unregistered ||
+        rbsp[1] != sei_payload_bytes ||
+        memcmp(rbsp + 2, vrts_sei_uuid, sizeof(vrts_sei_uuid)) != 0 ||
+        rbsp[2 + 16] != sei_version) {
+      continue;
+    }
+    stamp.capture_us = getBigEndian(rbsp + 2 + 17);
+    stamp.ingest_us = getBigEndian(rbsp + 2 + 25);
+    return true;
+  }
+  return false;
+}
+
+} // namespace vrts
@@ -0,0 +1,134 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vrts {
+
+// Glass to glass timing.
+//
+// The sender can stamp each access unit with a user data unregistered SEI
+// (payloadType 5) right after its AUD:
+//   uuid[16]     vrts_sei_uuid
+//   uint8_t      version, 1
+//   int64_t      capture_us   when the picture was taken
+//   int64_t      ingest_us    when parse() got it
+// Times are microseconds since the epoch on the sender's clock, big endian,
+// and the NAL is emulation prevented like any other. Decoders skip SEIs
+// with a uuid they don't know.
+//
+// VRTS_CLOCK payload, a vrts_clock_probe_t in host order like the ids of an
+// ACK. The header's fragments is 0 on a request and 1 on the reply, which
+// copies origin_us and adds when the request came in and the reply left,
+// on the replier's clock.
+
+/// @brief Identifies our SEI among whatever else an encoder puts out.
+extern const uint8_t vrts_sei_uuid[16];
+
+/// @brief Times carried by a timestamp SEI, in us on the sender's clock.
+typedef struct {
+  int64_t capture_us;
+  int64_t ingest_us;
+} vrts_sei_timestamp_t;
+
+/// @brief Longest timestamp SEI, start code and emulation prevention
+/// included.
+constexpr size_t vrts_sei_max_bytes = 64;
+
+/// @brief Write a timestamp SEI NAL, led by a 4 byte start code.
+/// @returns bytes written, at most vrts_sei_max_bytes.
+size_t buildTimestampSei(const vrts_sei_timestamp_t &stamp, uint8_t *out);
+
+/// @brief Find a timestamp SEI among the first NALs of a block.
+/// @details Only the head of the block is looked at, where the sender puts
+/// it, so this costs nothing on unstamped streams.
+bool findTimestampSei(const uint8_t *data, size_t len,
+                      vrts_sei_timestamp_t &stamp);
+
+typedef struct {
+  int64_t origin_us;
+  int64_t receive_us;
+  int64_t transmit_us;
+} vrts_clock_probe_t;
+
+inline int64_t toMicroseconds(std::chrono::system_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+/// @brief Offset of the peer's clock from ours, from probe round trips.
+/// @details Each probe gives the offset NTP style, exact if both ways took
+/// equally long. Queueing only ever adds delay, mostly to one side, so of
+/// the recent probes the one with the shortest round trip is trusted.
+/// sample() belongs to one thread, the results may be read from any.
+class ClockSync {
+public:
+  static constexpr size_t window = 8;
+
+  ClockSync() { reset(); }
+
+  void reset(void) {
+    samples = 0;
+    offset_us = 0;
+    rtt_us = -1;
+  }
+
+  /// @brief One round trip: we sent at t1, the peer got it at t2 and
+  /// answered at t3, and the answer came in at t4.
+  void sample(int64_t t1, int64_t t2, int64_t t3, int64_t t4) {
+    int64_t rtt = (t4 - t1) - (t3 - t2);
+    if (rtt < 0) {
+      return;
+    }
+    ring[samples % window] = {((t2 - t1) + (t3 - t4)) / 2, rtt};
+    samples++;
+    size_t best = 0;
+    size_t held = std::min<size_t>(samples, window);
+    for (size_t i = 1; i < held; i++) {
+      if (ring[i].rtt_us < ring[best].rtt_us) {
+        best = i;
+      }
+    }
+    offset_us.store(ring[best].offset_us, std::memory_order_relaxed);
+    rtt_us.store(ring[best].rtt_us, std::memory_order_relaxed);
+  }
+
+  /// @brief Probes answered so far.
+  size_t count(void) const { return samples; }
+  bool valid(void) const { return rtt_us.load(std::memory_order_relaxed) >= 0; }
+  /// @brief The peer's clock minus ours.
+  int64_t offset(void) const {
+    return offset_us.load(std::memory_order_relaxed);
+  }
+  /// @brief Round trip of the probe the offset is from.
+  int64_t rtt(void) const { return rtt_us.load(std::memory_order_relaxed); }
+
+  /// @brief A time on the peer's clock, on ours.
+  std::chrono::system_clock::time_point toLocal(int64_t peer_us) const {
+    return std::chrono::system_clock::time_point(
+        std::chrono::microseconds(peer_us - offset()));
+  }
+
+private:
+  typedef struct {
+    int64_t offset_us;
+    int64_t rtt_us;
+  } probe_t;
+
+  std::array<probe_t, window> ring;
+  size_t samples;
+  std::atomic<int64_t> offset_us;
+  std::atomic<int64_t> rtt_us;
+};
+
+} // namespace vrts
+
+#endif
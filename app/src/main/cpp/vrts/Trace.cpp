@@ -0,0 +1,304 @@
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <time.h>
+
+namespace vrts {
+
+// How often the background thread empties the rings.
+static constexpr auto drain_period = std::chrono::milliseconds(20);
+static const char trace_file_magic[8] = {'V', 'R', 'T', 'S',
+                                         'T', 'R', 'C', '1'};
+
+static const char *levelName(trace_level_t level) {
+  switch (level) {
+  case TRACE_LEVEL_DEBUG:
+    return "D";
+  case TRACE_LEVEL_INFO:
+    return "I";
+  case TRACE_LEVEL_WARN:
+    return "W";
+  case TRACE_LEVEL_ERROR:
+    return "E";
+  }
+  return "?";
+}
+
+Tracer &Tracer::instance(void) {
+  static Tracer tracer;
+  return tracer;
+}
+
+Tracer::Tracer()
+    : level_threshold{TRACE_LEVEL_DEBUG}, echo_enabled{false},
+      dropped_records{0}, trace_file{nullptr},
+      history(trace_history_depth), history_head{0}, history_size{0},
+      keep_running{true} {
+  drain_thread = std::thread([this] { run(); });
+}
+
+Tracer::~Tracer() {
+  {
+    std::lock_guard<std::mutex> lock{run_mutex};
+    keep_running = false;
+  }
+  run_cv.notify_one();
+  if (drain_thread.joinable()) {
+    drain_thread.join();
+  }
+  flush();
+  openTraceFile("");
+}
+
+uint16_t Tracer::registerFormat(trace_level_t level, const char *format,
+                                const char *file, int line) {
+  std::lock_guard<std::mutex> lock{formats_mutex};
+  formats.push_back({level, static_cast<uint16_t>(line), file, format});
+  return static_cast<uint16_t>(formats.size() - 1);
+}
+
+bool Tracer::openTraceFile(const std::string &path) {
+  std::lock_guard<std::mutex> lock{move_mutex};
+  if (trace_file) {
+    fclose(trace_file);
+    trace_file = nullptr;
+  }
+  formats_written.clear();
+  if (path.empty()) {
+    return true;
+  }
+  trace_file = fopen(path.c_str(), "wb");
+  if (!trace_file) {
+    return false;
+  }
+  fwrite(trace_file_magic, sizeof(trace_file_magic), 1, trace_file);
+  return true;
+}
+
+uint64_t Tracer::nowNs(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+Tracer::ring_t &Tracer::threadRing(void) {
+  thread_local std::shared_ptr<ring_t> ring;
+  if (!ring) {
+    ring = std::make_shared<ring_t>(trace_ring_depth);
+    std::lock_guard<std::mutex> lock{rings_mutex};
+    rings.push_back(ring);
+  }
+  return *ring;
+}
+
+void Tracer::commit(trace_record_t &record) {
+  if (!threadRing().push(std::move(record))) {
+    dropped_records.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Tracer::addText(trace_record_t &record, uint8_t i, const char *text,
+                     size_t len) {
+  size_t offset = record.text_used;
+  size_t room = trace_text_bytes - offset - 1;
+  len = std::min(len, room);
+  memcpy(record.text + offset, text, len);
+  record.text[offset + len] = '\0';
+  record.text_used = static_cast<uint8_t>(std::min<size_t>(
+      offset + len + 1, trace_text_bytes - 1));
+  record.arg_types[i] = TRACE_ARG_TEXT;
+  record.args[i] = offset;
+}
+
+void Tracer::run(void) {
+  std::unique_lock<std::mutex> lock{run_mutex};
+  while (keep_running) {
+    run_cv.wait_for(lock, drain_period);
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
+
+void Tracer::flush(void) {
+  std::lock_guard<std::mutex> lock{move_mutex};
+  moveRecords();
+}
+
+size_t Tracer::ringCount(void) {
+  std::lock_guard<std::mutex> lock{rings_mutex};
+  return rings.size();
+}
+
+void Tracer::moveRecords(void) {
+  std::vector<std::shared_ptr<ring_t>> sources;
+  {
+    std::lock_guard<std::mutex> lock{rings_mutex};
+    sources = rings;
+  }
+  batch.clear();
+  trace_record_t record;
+  for (auto &ring : sources) {
+    while (ring->tryPop(record)) {
+      batch.push_back(record);
+    }
+  }
+  // Our references would keep every ring looking in use.
+  sources.clear();
+  {
+    // Forget rings of threads that are gone once they are empty.
+    std::lock_guard<std::mutex> lock{rings_mutex};
+    rings.erase(std::remove_if(rings.begin(), rings.end(),
+                               [](const std::shared_ptr<ring_t> &ring) {
+                                 return ring.use_count() == 1 && ring->empty();
+                               }),
+                rings.end());
+  }
+  if (batch.empty()) {
+    return;
+  }
+  // Each ring is in order, interleave them.
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const trace_record_t &a, const trace_record_t &b) {
+                     return a.time_ns < b.time_ns;
+                   });
+  for (auto &entry : batch) {
+    writeRecord(entry);
+    if (echo_enabled) {
+      std::cout << format(entry) << '\n';
+    }
+  }
+  if (trace_file) {
+    fflush(trace_file);
+  }
+  if (echo_enabled) {
+    std::cout.flush();
+  }
+  std::lock_guard<std::mutex> lock{history_mutex};
+  for (auto &entry : batch) {
+    if (history_size == trace_history_depth) {
+      history_head = (history_head + 1) % trace_history_depth;
+      history_size--;
+      dropped_records.fetch_add(1, std::memory_order_relaxed);
+    }
+    history[(history_head + history_size) % trace_history_depth] = entry;
+    history_size++;
+  }
+}
+
+/// @details A format goes into the file ahead of its first record:
+/// 'F', id, level, line, file and format length, file, format. Records
+/// follow as 'R' and the raw trace_record_t.
+void Tracer::writeRecord(const trace_record_t &record) {
+  if (!trace_file) {
+    return;
+  }
+  if (record.format_id >= formats_written.size()) {
+    formats_written.resize(record.format_id + 1, false);
+  }
+  if (!formats_written[record.format_id]) {
+    trace_format_t format;
+    {
+      std::lock_guard<std::mutex> lock{formats_mutex};
+      format = formats[record.format_id];
+    }
+    uint16_t file_len = static_cast<uint16_t>(strlen(format.file));
+    uint16_t format_len = static_cast<uint16_t>(strlen(format.format));
+    uint8_t level = format.level;
+    fputc('F', trace_file);
+    fwrite(&record.format_id, sizeof(record.format_id), 1, trace_file);
+    fwrite(&level, sizeof(level), 1, trace_file);
+    fwrite(&format.line, sizeof(format.line), 1, trace_file);
+    fwrite(&file_len, sizeof(file_len), 1, trace_file);
+    fwrite(&format_len, sizeof(format_len), 1, trace_file);
+    fwrite(format.file, 1, file_len, trace_file);
+    fwrite(format.format, 1, format_len, trace_file);
+    formats_written[record.format_id] = true;
+  }
+  fputc('R', trace_file);
+  fwrite(&record, sizeof(record), 1, trace_file);
+}
+
+size_t Tracer::drain(std::vector<trace_record_t> &records, size_t max) {
+  std::lock_guard<std::mutex> lock{history_mutex};
+  size_t count = std::min(max, history_size);
+  for (size_t i = 0; i < count; i++) {
+    records.push_back(history[history_head]);
+    history_head = (history_head + 1) % trace_history_depth;
+  }
+  history_size -= count;
+  return count;
+}
+
+std::string Tracer::drainText(size_t max) {
+  std::vector<trace_record_t> records;
+  drain(records, max);
+  std::string text;
+  for (auto &record : records) {
+    text += format(record);
+    text += '\n';
+  }
+  return text;
+}
+
+std::string Tracer::format(const trace_record_t &record) {
+  trace_format_t format;
+  {
+    std::lock_guard<std::mutex> lock{formats_mutex};
+    if (record.format_id >= formats.size()) {
+      return "<unknown trace format>";
+    }
+    format = formats[record.format_id];
+  }
+  return Tracer::format(record, format);
+}
+
+std::string Tracer::format(const trace_record_t &record,
+                           const trace_format_t &format) {
+  char stamp[32];
+  time_t seconds = static_cast<time_t>(record.time_ns / 1000000000ull);
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  size_t n = strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+  snprintf(stamp + n, sizeof(stamp) - n, ".%06u %s ",
+           static_cast<unsigned>(record.time_ns % 1000000000ull / 1000),
+           levelName(format.level));
+
+  std::string text = stamp;
+  size_t arg = 0;
+  for (const char *p = format.format; *p; p++) {
+    if (p[0] != '{' || p[1] != '}' || arg >= record.arg_count) {
+      text += *p;
+      continue;
+    }
+    p++;
+    uint64_t value = record.args[arg];
+    switch (record.arg_types[arg]) {
+    case TRACE_ARG_INT:
+      text += std::to_string(static_cast<int64_t>(value));
+      break;
+    case TRACE_ARG_UINT:
+      text += std::to_string(value);
+      break;
+    case TRACE_ARG_DOUBLE: {
+      double d;
+      memcpy(&d, &value, sizeof(d));
+      char number[32];
+      snprintf(number, sizeof(number), "%g", d);
+      text += number;
+      break;
+    }
+    case TRACE_ARG_TEXT:
+      if (value < trace_text_bytes) {
+        text.append(record.text + value,
+                    strnlen(record.text + value, trace_text_bytes - value));
+      }
+      break;
+    }
+    arg++;
+  }
+  return text;
+}
+
+} // namespace vrts
@@ -0,0 +1,216 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "SpscQueue.h"
+
+namespace vrts {
+
+typedef enum : uint8_t {
+  TRACE_LEVEL_DEBUG = 0,
+  TRACE_LEVEL_INFO = 1,
+  TRACE_LEVEL_WARN = 2,
+  TRACE_LEVEL_ERROR = 3,
+} trace_level_t;
+
+// Trace points below this level are compiled out, arguments and all.
+// Set with -DVRTS_TRACE_MIN_LEVEL=n (0 debug .. 3 error).
+#ifndef VRTS_TRACE_MIN_LEVEL
+#define VRTS_TRACE_MIN_LEVEL 0
+#endif
+
+constexpr size_t trace_max_args = 8;
+constexpr size_t trace_text_bytes = 172;
+constexpr size_t trace_ring_depth = 1024;
+constexpr size_t trace_history_depth = 4096;
+
+typedef enum : uint8_t {
+  TRACE_ARG_INT = 0,
+  TRACE_ARG_UINT = 1,
+  TRACE_ARG_DOUBLE = 2,
+  // Offset of a NUL terminated string in the record's text.
+  TRACE_ARG_TEXT = 3,
+} trace_arg_t;
+
+/// @brief One trace point hit: which format, when, and its arguments.
+/// @details Fixed size and trivially copyable, this is also the layout in
+/// trace files. Strings are copied into text, cut off when it runs full.
+typedef struct {
+  uint64_t time_ns;
+  uint64_t args[trace_max_args];
+  uint16_t format_id;
+  uint8_t arg_count;
+  uint8_t text_used;
+  uint8_t arg_types[trace_max_args];
+  char text[trace_text_bytes];
+} trace_record_t;
+static_assert(sizeof(trace_record_t) == 256, "trace file layout changed");
+
+/// @brief A trace point. The format's {} are replaced by the arguments in
+/// order.
+typedef struct {
+  trace_level_t level;
+  uint16_t line;
+  const char *file;
+  const char *format;
+} trace_format_t;
+
+/// @brief Leveled, asynchronous binary logger.
+/// @details A trace point costs a relaxed level check and filling in one
+/// record: every thread has its own lock-free ring, so nothing is formatted
+/// or flushed on the caller's thread. A background thread moves records
+/// from the rings into a bounded history, optionally appending them to a
+/// binary trace file (see vrts-tracedump) or echoing them as text. Readers
+/// drain the history and format on their own time. When a ring is full the
+/// record is counted as dropped rather than waited for.
+class Tracer {
+public:
+  static Tracer &instance(void);
+
+  /// @brief Id of a trace point, registered on first use.
+  uint16_t registerFormat(trace_level_t level, const char *format,
+                          const char *file, int line);
+
+  trace_level_t level(void) const {
+    return level_threshold.load(std::memory_order_relaxed);
+  }
+  /// @brief Skip trace points below level at runtime.
+  void setLevel(trace_level_t level) { level_threshold = level; }
+  /// @brief Also print records to stdout as the background thread sees them.
+  void setEcho(bool echo) { echo_enabled = echo; }
+  /// @brief Append records to a binary trace file, empty path to stop.
+  bool openTraceFile(const std::string &path);
+
+  template <typename... Args> void log(uint16_t format_id, Args &&...args) {
+    static_assert(sizeof...(Args) <= trace_max_args, "too many trace args");
+    // Zeroed, records end up in files as they are.
+    trace_record_t record = {};
+    record.time_ns = nowNs();
+    record.format_id = format_id;
+    (addArg(record, std::forward<Args>(args)), ...);
+    commit(record);
+  }
+
+  /// @brief Move everything the background thread hasn't seen yet into the
+  /// history now.
+  void flush(void);
+  /// @brief Take up to max records from the history, oldest first.
+  size_t drain(std::vector<trace_record_t> &records,
+               size_t max = trace_history_depth);
+  /// @brief Take the history as text, one line per record.
+  std::string drainText(size_t max = trace_history_depth);
+  /// @brief A record as text, without the trailing newline.
+  std::string format(const trace_record_t &record);
+  static std::string format(const trace_record_t &record,
+                            const trace_format_t &format);
+
+  /// @brief Records lost to full rings or a full history.
+  uint64_t dropped(void) const { return dropped_records.load(); }
+  /// @brief Rings held, one per thread that traced and isn't yet forgotten.
+  size_t ringCount(void);
+
+  ~Tracer();
+
+private:
+  typedef SpscQueue<trace_record_t> ring_t;
+
+  Tracer();
+  static uint64_t nowNs(void);
+  ring_t &threadRing(void);
+  void commit(trace_record_t &record);
+  void run(void);
+  /// @details Caller holds move_mutex.
+  void moveRecords(void);
+  void writeRecord(const trace_record_t &record);
+
+  template <typename T> static void addArg(trace_record_t &record, T &&arg) {
+    using U = typename std::decay<T>::type;
+    uint8_t i = record.arg_count++;
+    if constexpr (std::is_same<U, bool>::value) {
+      record.arg_types[i] = TRACE_ARG_UINT;
+      record.args[i] = arg ? 1 : 0;
+    } else if constexpr (std::is_enum<U>::value) {
+      record.arg_types[i] = TRACE_ARG_INT;
+      record.args[i] = static_cast<int64_t>(arg);
+    } else if constexpr (std::is_floating_point<U>::value) {
+      record.arg_types[i] = TRACE_ARG_DOUBLE;
+      double value = arg;
+      memcpy(&record.args[i], &value, sizeof(value));
+    } else if constexpr (std::is_integral<U>::value &&
+                         std::is_signed<U>::value) {
+      record.arg_types[i] = TRACE_ARG_INT;
+      record.args[i] = static_cast<int64_t>(arg);
+    } else if constexpr (std::is_integral<U>::value) {
+      record.arg_types[i] = TRACE_ARG_UINT;
+      record.args[i] = static_cast<uint64_t>(arg);
+    } else if constexpr (std::is_same<U, std::string>::value) {
+      addText(record, i, arg.data(), arg.size());
+    } else {
+      const char *text = arg;
+      addText(record, i, text, strlen(text));
+    }
+  }
+  static void addText(trace_record_t &record, uint8_t i, const char *text,
+                      size_t len);
+
+  std::atomic<trace_level_t> level_threshold;
+  std::atomic<bool> echo_enabled;
+  std::atomic<uint64_t> dropped_records;
+
+  std::mutex formats_mutex;
+  std::vector<trace_format_t> formats;
+
+  // Rings of all threads that ever traced. A ring outlives its thread until
+  // it is empty.
+  std::mutex rings_mutex;
+  std::vector<std::shared_ptr<ring_t>> rings;
+
+  // Held while records move from the rings to the history and file.
+  std::mutex move_mutex;
+  std::vector<trace_record_t> batch;
+  FILE *trace_file;
+  std::vector<bool> formats_written;
+
+  std::mutex history_mutex;
+  std::vector<trace_record_t> history;
+  size_t history_head;
+  size_t history_size;
+
+  std::mutex run_mutex;
+  std::condition_variable run_cv;
+  bool keep_running;
+  std::thread drain_thread;
+};
+
+} // namespace vrts
+
+/// @brief Trace a message at a level (DEBUG, INFO, WARN, ERROR), e.g.
+/// VRTS_TRACE(DEBUG, "[vrts] got ack count: {}", count);
+#define VRTS_TRACE(trace_level, trace_format, ...)                           \
+  do {                                                                       \
+    if constexpr (vrts::TRACE_LEVEL_##trace_level >= VRTS_TRACE_MIN_LEVEL) { \
+      auto &vrts_tracer = vrts::Tracer::instance();                          \
+      if (vrts::TRACE_LEVEL_##trace_level >= vrts_tracer.level()) {          \
+        static const uint16_t vrts_trace_id = vrts_tracer.registerFormat(    \
+            vrts::TRACE_LEVEL_##trace_level, trace_format, __FILE__,         \
+            __LINE__);                                                       \
+        vrts_tracer.log(vrts_trace_id, ##__VA_ARGS__);                       \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+#endif
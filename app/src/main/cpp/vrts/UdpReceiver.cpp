@@ -0,0 +1,255 @@
+#include "UdpReceiver.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Older libc / NDK headers don't carry the GRO socket option.
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace vrts {
+
+static constexpr size_t max_datagram_size = 1472;
+static constexpr size_t max_gro_buffer_size = 65535;
+// Room for a timespec timestamp and a GRO segment size, 8-byte aligned.
+static constexpr size_t cmsg_words =
+    (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(int)) +
+     sizeof(uint64_t) - 1) /
+    sizeof(uint64_t);
+
+UdpReceiver::UdpReceiver(size_t batch_size)
+    : recv_syscalls{0}, recv_datagrams{0}, recv_bytes{0},
+      kernel_timestamps{0}, recv_truncated{0}, fd{-1}, use_gro{false}, timeout_us{1000},
+      rcvbuf_bytes{0}, batch_size{batch_size}, buffer_size{max_datagram_size},
+      bind_port{0}, virtual_link{false} {
+  allocateBuffers();
+}
+
+UdpReceiver::~UdpReceiver() { close(); }
+
+void UdpReceiver::allocateBuffers(void) {
+  buffer_size = use_gro ? max_gro_buffer_size : max_datagram_size;
+  buffers.assign(batch_size * buffer_size, 0);
+  iovecs.resize(batch_size);
+  msgs.resize(batch_size);
+  cmsg_space.assign(batch_size * cmsg_words, 0);
+  received.reserve(use_gro ? batch_size * 64 : batch_size);
+}
+
+bool UdpReceiver::open(const std::string &ip, uint16_t port) {
+  close();
+  bind_ip = ip;
+  bind_port = port;
+  if ((fd = ::socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  applySocketOptions();
+
+  struct sockaddr_in rx_addr;
+  memset(&rx_addr, 0, sizeof(rx_addr));
+  rx_addr.sin_family = AF_INET;
+  rx_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+  rx_addr.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *)&rx_addr, sizeof(rx_addr)) < 0) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void UdpReceiver::openVirtual(void) {
+  close();
+  virtual_link = true;
+}
+
+void UdpReceiver::close(void) {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  virtual_link = false;
+  injected.clear();
+}
+
+void UdpReceiver::inject(const uint8_t *data, size_t len,
+                         std::chrono::system_clock::time_point rx_time) {
+  if (!virtual_link || len > max_datagram_size) {
+    return;
+  }
+  injected.push_back({std::vector<uint8_t>(data, data + len), rx_time});
+}
+
+void UdpReceiver::applySocketOptions(void) {
+  if (fd < 0) {
+    return;
+  }
+  struct timeval tv;
+  tv.tv_sec = timeout_us / 1000000;
+  tv.tv_usec = timeout_us % 1000000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+  if (rcvbuf_bytes > 0) {
+    // SO_RCVBUFFORCE ignores rmem_max but needs CAP_NET_ADMIN.
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf_bytes,
+                   sizeof(rcvbuf_bytes)) < 0) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_bytes,
+                 sizeof(rcvbuf_bytes));
+    }
+  }
+
+  int gro = use_gro ? 1 : 0;
+  if (setsockopt(fd, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) < 0 && use_gro) {
+    use_gro = false;
+    allocateBuffers();
+  }
+}
+
+void UdpReceiver::setTimeout(uint32_t new_timeout_us) {
+  timeout_us = new_timeout_us;
+  applySocketOptions();
+}
+
+int UdpReceiver::setReceiveBufferSize(int bytes) {
+  rcvbuf_bytes = bytes;
+  applySocketOptions();
+  int granted = 0;
+  socklen_t optlen = sizeof(granted);
+  if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &granted, &optlen) < 0) {
+    return 0;
+  }
+  return granted;
+}
+
+void UdpReceiver::setReceiveOffload(bool enable) {
+  if (enable == use_gro) {
+    return;
+  }
+  use_gro = enable;
+  allocateBuffers();
+  applySocketOptions();
+}
+
+size_t UdpReceiver::receive(bool wait) {
+  received.clear();
+  if (virtual_link) {
+    return receiveInjected();
+  }
+  if (fd < 0 && !open(bind_ip, bind_port)) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < batch_size; i++) {
+    iovecs[i].iov_base = &buffers[i * buffer_size];
+    iovecs[i].iov_len = buffer_size;
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = &cmsg_space[i * cmsg_words];
+    msgs[i].msg_hdr.msg_controllen = cmsg_words * sizeof(uint64_t);
+  }
+
+  // Block (up to the socket timeout) for the first datagram only, then take
+  // whatever else is already queued.
+  int flags = wait ? MSG_WAITFORONE : MSG_DONTWAIT;
+  int count = recvmmsg(fd, msgs.data(), batch_size, flags, nullptr);
+  recv_syscalls++;
+  if (count <= 0) {
+    int err = errno;
+    if (count < 0 && err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+      // Reopen on the next call.
+      close();
+    }
+    return 0;
+  }
+
+  auto batch_time = std::chrono::system_clock::now();
+  for (int m = 0; m < count; m++) {
+    if (msgs[m].msg_hdr.msg_flags & MSG_TRUNC) {
+      // Whatever sent it, the header would take the cut as the end of the
+      // payload.
+      recv_truncated++;
+      continue;
+    }
+    auto rx_time = batch_time;
+    int segment_size = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[m].msg_hdr); cm != nullptr;
+         cm = CMSG_NXTHDR(&msgs[m].msg_hdr, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        rx_time = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds(ts.tv_sec) +
+                std::chrono::nanoseconds(ts.tv_nsec)));
+        kernel_timestamps++;
+      } else if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+        memcpy(&segment_size, CMSG_DATA(cm), sizeof(segment_size));
+      }
+    }
+
+    const uint8_t *data = &buffers[m * buffer_size];
+    size_t remaining = msgs[m].msg_len;
+    recv_bytes += remaining;
+    if (segment_size <= 0) {
+      segment_size = static_cast<int>(remaining);
+    }
+    // A GRO buffer holds back-to-back datagrams of segment_size bytes, the
+    // last one possibly shorter.
+    while (remaining > 0) {
+      size_t len = std::min(remaining, static_cast<size_t>(segment_size));
+      udp_datagram_t datagram;
+      datagram.data = data;
+      datagram.len = static_cast<uint16_t>(len);
+      datagram.rx_time = rx_time;
+      received.push_back(datagram);
+      data += len;
+      remaining -= len;
+    }
+  }
+  recv_datagrams += received.size();
+  return received.size();
+}
+
+/// @details Never waits: on a virtual link whoever injects also decides when
+/// to receive.
+size_t UdpReceiver::receiveInjected(void) {
+  injected_batch.clear();
+  while (!injected.empty() && injected_batch.size() < batch_size) {
+    injected_batch.push_back(std::move(injected.front()));
+    injected.pop_front();
+  }
+  if (injected_batch.empty()) {
+    return 0;
+  }
+  recv_syscalls++;
+  for (auto &entry : injected_batch) {
+    udp_datagram_t datagram;
+    datagram.data = entry.data.data();
+    datagram.len = static_cast<uint16_t>(entry.data.size());
+    datagram.rx_time = entry.rx_time;
+    received.push_back(datagram);
+    recv_bytes += entry.data.size();
+  }
+  recv_datagrams += received.size();
+  return received.size();
+}
+
+} // namespace vrts
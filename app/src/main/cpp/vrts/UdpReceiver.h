@@ -0,0 +1,108 @@
+#ifndef UDPRECEIVER_H
+#define UDPRECEIVER_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+namespace vrts {
+
+/// @brief One datagram handed out by UdpReceiver.
+/// @details rx_time is the kernel receive timestamp (SO_TIMESTAMPNS) when the
+/// kernel provided one, otherwise the time the batch was read.
+typedef struct {
+  const uint8_t *data;
+  uint16_t len;
+  std::chrono::system_clock::time_point rx_time;
+} udp_datagram_t;
+
+/// @brief Per-instance UDP receive socket that drains datagrams in batches.
+/// @details receive() pulls up to batch_size datagrams out of the kernel with
+/// a single recvmmsg() call. Optionally accepts UDP_GRO coalesced buffers,
+/// which are split back into their original datagrams. Datagrams point into
+/// internal buffers and are valid until the next receive().
+///
+/// Not thread safe: owned by the thread that services the socket.
+class UdpReceiver {
+public:
+  UdpReceiver(size_t batch_size = 32);
+  ~UdpReceiver();
+
+  /// @brief Open the socket and bind it to ip:port.
+  bool open(const std::string &ip, uint16_t port);
+  /// @brief Take datagrams from inject() rather than from a socket.
+  void openVirtual(void);
+  void close(void);
+  bool isOpen(void) const { return fd >= 0 || virtual_link; }
+  int socket(void) const { return fd; }
+
+  /// @brief How long receive() may block waiting for the first datagram.
+  void setTimeout(uint32_t timeout_us);
+
+  /// @brief Request a kernel receive buffer size.
+  /// @returns the size the kernel actually granted.
+  int setReceiveBufferSize(int bytes);
+
+  /// @brief Accept UDP_GRO coalesced buffers, if the kernel supports it.
+  void setReceiveOffload(bool enable);
+  bool receiveOffload(void) const { return use_gro; }
+
+  /// @brief Read whatever is pending, up to batch_size buffers.
+  /// @param wait block up to the socket timeout for the first datagram.
+  /// @returns number of datagrams available through datagrams().
+  size_t receive(bool wait = true);
+  const std::vector<udp_datagram_t> &datagrams(void) const { return received; }
+
+  /// @brief Queue a datagram for receive() on a virtual link.
+  void inject(const uint8_t *data, size_t len,
+              std::chrono::system_clock::time_point rx_time);
+  bool injectedPending(void) const { return !injected.empty(); }
+
+  // Running totals, safe to read from other threads.
+  std::atomic<uint64_t> recv_syscalls;
+  std::atomic<uint64_t> recv_datagrams;
+  std::atomic<uint64_t> recv_bytes;
+  std::atomic<uint64_t> kernel_timestamps;
+  // Datagrams too large for the buffer, dropped rather than cut short.
+  std::atomic<uint64_t> recv_truncated;
+
+private:
+  int fd;
+  bool use_gro;
+  uint32_t timeout_us;
+  int rcvbuf_bytes;
+  size_t batch_size;
+  size_t buffer_size;
+  std::string bind_ip;
+  uint16_t bind_port;
+
+  std::vector<uint8_t> buffers;
+  std::vector<struct iovec> iovecs;
+  std::vector<struct mmsghdr> msgs;
+  std::vector<uint64_t> cmsg_space;
+  std::vector<udp_datagram_t> received;
+
+  typedef struct {
+    std::vector<uint8_t> data;
+    std::chrono::system_clock::time_point rx_time;
+  } injected_datagram_t;
+  bool virtual_link;
+  std::deque<injected_datagram_t> injected;
+  // The batch handed out by the last receive() on a virtual link.
+  std::vector<injected_datagram_t> injected_batch;
+
+  void allocateBuffers(void);
+  size_t receiveInjected(void);
+  void applySocketOptions(void);
+};
+
+} // namespace vrts
+
+#endif
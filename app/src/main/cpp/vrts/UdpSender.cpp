@@ -0,0 +1,256 @@
+#include "UdpSender.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Older libc / NDK headers don't carry the GSO socket option.
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef IP_PMTUDISC_PROBE
+#define IP_PMTUDISC_PROBE 3
+#endif
+
+namespace vrts {
+
+// Kernel limits for a single UDP_SEGMENT send.
+static constexpr size_t max_gso_segments = 64;
+static constexpr size_t max_gso_bytes = 65000;
+// sendmmsg() vlen and msg_iovlen are both capped by the kernel at UIO_MAXIOV.
+static constexpr size_t max_mmsg_batch = 1024;
+static constexpr size_t max_msg_iovecs = 1024;
+// Enough room for one cmsghdr carrying a uint16_t, kept 8-byte aligned.
+static constexpr size_t cmsg_words =
+    (CMSG_SPACE(sizeof(uint16_t)) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+UdpSender::UdpSender()
+    : sent_datagrams{0}, sent_bytes{0}, send_syscalls{0}, send_errors{0},
+      send_oversize{0}, fd{-1}, gso_supported{false}, use_gso{false},
+      dont_fragment{false} {
+  memset(&destaddr, 0, sizeof(destaddr));
+}
+
+UdpSender::~UdpSender() { close(); }
+
+bool UdpSender::open(const std::string &ip, uint16_t port) {
+  close();
+  if ((fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+  // Probe for GSO support, available since Linux 4.18.
+  int segment_size = 0;
+  socklen_t optlen = sizeof(segment_size);
+  gso_supported =
+      getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, &optlen) == 0;
+  use_gso = gso_supported;
+  dont_fragment = false;
+
+  memset(&destaddr, 0, sizeof(destaddr));
+  destaddr.sin_family = AF_INET;
+  destaddr.sin_addr.s_addr = inet_addr(ip.c_str());
+  destaddr.sin_port = htons(port);
+  return true;
+}
+
+void UdpSender::openVirtual(udp_sink_t new_sink) {
+  close();
+  sink = std::move(new_sink);
+}
+
+void UdpSender::close(void) {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  sink = nullptr;
+  iovecs.clear();
+  datagrams.clear();
+}
+
+void UdpSender::setSegmentationOffload(bool enable) {
+  use_gso = enable && gso_supported;
+}
+
+void UdpSender::setDontFragment(bool enable) {
+  if (enable == dont_fragment) {
+    return;
+  }
+  dont_fragment = enable;
+  if (fd >= 0) {
+    // PROBE sets DF without holding datagrams to the route's cached PMTU,
+    // so a probe larger than that still goes out. WANT is the default.
+    int mode = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+  }
+}
+
+void UdpSender::queue(const uint8_t *data, uint16_t len) {
+  struct iovec iov;
+  iov.iov_base = const_cast<uint8_t *>(data);
+  iov.iov_len = len;
+  queue(&iov, 1);
+}
+
+void UdpSender::queue(const struct iovec *iov, size_t iovcnt) {
+  datagram_t datagram = {iovecs.size(), iovcnt, 0};
+  for (size_t i = 0; i < iovcnt; i++) {
+    datagram.length += iov[i].iov_len;
+  }
+  iovecs.insert(iovecs.end(), iov, iov + iovcnt);
+  datagrams.push_back(datagram);
+}
+
+/// @brief Turn queued datagrams into mmsghdrs, merging equal sized runs into
+/// UDP_SEGMENT messages when GSO is enabled.
+void UdpSender::buildMessages(size_t first_datagram) {
+  msgs.clear();
+  msg_segments.clear();
+  cmsg_space.assign(datagrams.size() * cmsg_words, 0);
+
+  size_t i = first_datagram;
+  while (i < datagrams.size()) {
+    size_t segment_len = datagrams[i].length;
+    size_t run = 1;
+    if (use_gso) {
+      size_t run_bytes = segment_len;
+      size_t run_iovecs = datagrams[i].iov_count;
+      while (i + run < datagrams.size() && run < max_gso_segments) {
+        const datagram_t &next = datagrams[i + run];
+        size_t next_len = next.length;
+        if (next_len > segment_len || run_bytes + next_len > max_gso_bytes ||
+            run_iovecs + next.iov_count > max_msg_iovecs) {
+          break;
+        }
+        run_bytes += next_len;
+        run_iovecs += next.iov_count;
+        run++;
+        // Only the last segment of a GSO train may be short.
+        if (next_len < segment_len) {
+          break;
+        }
+      }
+    }
+
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = &destaddr;
+    msg.msg_hdr.msg_namelen = sizeof(destaddr);
+    // The segments of a run are contiguous in iovecs, the kernel splits the
+    // gathered bytes at gso_size no matter where the iovecs end.
+    const datagram_t &last = datagrams[i + run - 1];
+    msg.msg_hdr.msg_iov = &iovecs[datagrams[i].first_iov];
+    msg.msg_hdr.msg_iovlen =
+        last.first_iov + last.iov_count - datagrams[i].first_iov;
+    if (run > 1) {
+      uint64_t *space = &cmsg_space[msgs.size() * cmsg_words];
+      msg.msg_hdr.msg_control = space;
+      msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      struct cmsghdr *cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t gso_size = static_cast<uint16_t>(segment_len);
+      memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+    }
+    msgs.push_back(msg);
+    msg_segments.push_back(static_cast<uint32_t>(run));
+    i += run;
+  }
+}
+
+int UdpSender::flush(void) {
+  if (datagrams.empty()) {
+    return 0;
+  }
+  if (sink) {
+    return flushToSink();
+  }
+  if (fd < 0) {
+    send_errors += datagrams.size();
+    iovecs.clear();
+    datagrams.clear();
+    return 0;
+  }
+
+  buildMessages(0);
+  int sent_total = 0;
+  size_t datagram_pos = 0;
+  size_t pos = 0;
+  while (pos < msgs.size()) {
+    size_t batch = std::min(msgs.size() - pos, max_mmsg_batch);
+    int sent = sendmmsg(fd, &msgs[pos], batch, 0);
+    send_syscalls++;
+    if (sent > 0) {
+      for (int m = 0; m < sent; m++) {
+        sent_total += msg_segments[pos + m];
+        datagram_pos += msg_segments[pos + m];
+        sent_bytes += msgs[pos + m].msg_len;
+      }
+      pos += sent;
+      continue;
+    }
+
+    int err = (sent < 0) ? errno : 0;
+    if (err == EINTR) {
+      continue;
+    }
+    if (msg_segments[pos] > 1 &&
+        (err == EIO || err == EINVAL || err == EOPNOTSUPP)) {
+      // The kernel or device can't segment for us after all (i.e. no
+      // checksum offload on the egress device). Fall back to plain
+      // sendmmsg for the rest of this flush and from now on.
+      gso_supported = false;
+      use_gso = false;
+      buildMessages(datagram_pos);
+      pos = 0;
+      continue;
+    }
+
+    // Drop the message that failed and keep going with the rest.
+    if (err == EMSGSIZE) {
+      send_oversize += msg_segments[pos];
+    }
+    send_errors += msg_segments[pos];
+    datagram_pos += msg_segments[pos];
+    pos++;
+  }
+
+  sent_datagrams += sent_total;
+  iovecs.clear();
+  datagrams.clear();
+  return sent_total;
+}
+
+/// @brief Every datagram in one piece to the sink, as one "syscall".
+int UdpSender::flushToSink(void) {
+  for (auto &datagram : datagrams) {
+    sink_buffer.clear();
+    for (size_t i = 0; i < datagram.iov_count; i++) {
+      const struct iovec &iov = iovecs[datagram.first_iov + i];
+      const uint8_t *base = static_cast<const uint8_t *>(iov.iov_base);
+      sink_buffer.insert(sink_buffer.end(), base, base + iov.iov_len);
+    }
+    sink(sink_buffer.data(), sink_buffer.size());
+    sent_bytes += sink_buffer.size();
+  }
+  int sent = static_cast<int>(datagrams.size());
+  sent_datagrams += sent;
+  send_syscalls++;
+  iovecs.clear();
+  datagrams.clear();
+  return sent;
+}
+
+} // namespace vrts
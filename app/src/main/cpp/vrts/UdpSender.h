@@ -0,0 +1,99 @@
+#ifndef UDPSENDER_H
+#define UDPSENDER_H
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+namespace vrts {
+
+/// @brief Takes the datagrams of a sender on a virtual link.
+typedef std::function<void(const uint8_t *data, size_t len)> udp_sink_t;
+
+/// @brief Persistent UDP send socket that batches datagrams.
+/// @details Datagrams are queued by pointer during a service pass and pushed
+/// to the kernel by flush() with a single sendmmsg() call. When UDP generic
+/// segmentation offload is available, runs of equally sized datagrams (the
+/// MTU sized fragments of a NAL, optionally followed by one shorter tail
+/// fragment) are handed to the kernel as one UDP_SEGMENT message.
+///
+/// A datagram may be gathered from several buffers, e.g. a header and a
+/// payload that still sits in the encoder's output buffer.
+///
+/// Not thread safe: use one sender per thread. Queued buffers are not copied
+/// and must stay valid until flush() returns.
+class UdpSender {
+public:
+  UdpSender();
+  ~UdpSender();
+
+  /// @brief Open the socket and set the destination.
+  bool open(const std::string &ip, uint16_t port);
+  /// @brief Hand datagrams to sink on flush() rather than to a socket.
+  void openVirtual(udp_sink_t sink);
+  void close(void);
+  bool isOpen(void) const { return fd >= 0 || sink; }
+
+  /// @brief Enable/disable UDP_SEGMENT if the kernel supports it.
+  void setSegmentationOffload(bool enable);
+  bool segmentationOffload(void) const { return use_gso; }
+  /// @brief Set DF on every datagram and never fragment locally, so a
+  /// datagram the path can't carry is lost rather than split up. Datagrams
+  /// larger than the egress device's MTU fail with EMSGSIZE.
+  void setDontFragment(bool enable);
+
+  /// @brief Queue a datagram for the next flush().
+  void queue(const uint8_t *data, uint16_t len);
+  /// @brief Queue a datagram made of iovcnt buffers for the next flush().
+  void queue(const struct iovec *iov, size_t iovcnt);
+
+  /// @brief Send all queued datagrams.
+  /// @returns number of datagrams handed to the kernel.
+  int flush(void);
+
+  size_t pending(void) const { return datagrams.size(); }
+
+  // Running totals, safe to read from other threads.
+  std::atomic<uint64_t> sent_datagrams;
+  std::atomic<uint64_t> sent_bytes;
+  std::atomic<uint64_t> send_syscalls;
+  std::atomic<uint64_t> send_errors;
+  // Of those, datagrams too large to leave this host.
+  std::atomic<uint64_t> send_oversize;
+
+private:
+  int fd;
+  bool gso_supported;
+  bool use_gso;
+  bool dont_fragment;
+  struct sockaddr_in destaddr;
+  typedef struct {
+    size_t first_iov;
+    size_t iov_count;
+    size_t length;
+  } datagram_t;
+  std::vector<struct iovec> iovecs;
+  std::vector<datagram_t> datagrams;
+
+  // Scratch space reused between flushes.
+  std::vector<struct mmsghdr> msgs;
+  std::vector<uint32_t> msg_segments;
+  std::vector<uint64_t> cmsg_space;
+
+  // Virtual link, and where its datagrams are put together.
+  udp_sink_t sink;
+  std::vector<uint8_t> sink_buffer;
+
+  void buildMessages(size_t first_datagram);
+  int flushToSink(void);
+};
+
+} // namespace vrts
+
+#endif
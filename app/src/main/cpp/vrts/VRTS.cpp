@@ -1,4 +1,5 @@
 #include "VRTS.h"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <iostream>
@@ -7,11 +8,14 @@
 #include <netinet/ether.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <pthread.h>
 #include <random>
+#include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace vrts {
@@ -45,14 +49,96 @@ constexpr uint32_t default_max_unacked_items_allowed = 200;
 // How many unacked items are allowed to be in transit before we start to drop
 // TRAIL_N frames.
 constexpr uint32_t default_max_unacked_full_rate = 16;
-constexpr uint32_t default_retransmit_count_limit = 4;
 constexpr uint32_t default_temporal_layer_filter_latency = 300;
 static constexpr uint16_t MaxUDPPayloadSize = 1472;
-
-// Used to reset the threshold, i.e. in the case of connecting to an in-process
-// VRTS downstream where the upstream has been recently restarted from scratch.
+// Pacing. Unless a rate is configured, data leaves at pacing_gain times the
+// congestion controller's target, so IDR bursts still have headroom without
+// being dumped on the radio all at once.
+constexpr uint32_t default_pacing_burst_bytes = 8 * MaxUDPPayloadSize;
+constexpr float pacing_gain = 2.5f;
+// Congestion controller bounds, bytes/s.
+constexpr uint64_t min_target_rate = 400000 / 8;
+constexpr uint64_t initial_target_rate = 4000000 / 8;
+constexpr uint64_t max_target_rate = 50000000 / 8;
+// Once dropping, temporal layers stay dropped until the offered rate is
+// this far under the target.
+constexpr float temporal_filter_release = 0.85f;
+constexpr auto input_rate_interval = std::chrono::seconds(1);
+// Kernel receive buffer sizing. skb overhead roughly doubles the memory a
+// datagram takes up in the socket buffer.
+constexpr int default_min_rcvbuf_bytes = 256 * 1024;
+constexpr int rcvbuf_overhead_factor = 2;
+// Minimum spacing between resends of a NACK'd packet.
+constexpr auto nack_resend_holdoff = std::chrono::milliseconds(10);
+// How often the receiver repeats NACKs for holes that are still open.
+constexpr auto nack_repeat_interval = std::chrono::milliseconds(10);
+// Retry period for a receive socket that failed to bind.
+constexpr auto socket_retry_interval = std::chrono::milliseconds(100);
+// Addresses a virtual link session puts in its captures.
+constexpr uint32_t virtual_local_ip = 0x7f000001;
+constexpr uint32_t virtual_remote_ip = 0x7f000002;
+constexpr uint16_t virtual_port = 5000;
+// Thresholds are compared with '>' on whole milliseconds, so a deadline has
+// to land just past them.
+constexpr auto deadline_slack = std::chrono::milliseconds(1);
+// Wire format we send and the newest one we understand.
+constexpr uint8_t protocol_version = VRTS_VERSION_CANCEL;
+// Parity per 100 fragments, indexed by nal_class_t. Parameter sets and IRAP
+// pictures are what a lost fragment hurts most.
+constexpr uint32_t default_fec_redundancy_percent[NAL_CLASS_COUNT] = {0, 0, 25,
+                                                                     100};
+// Retransmits and sender side age-out per nal_class_t. A lost TRAIL_N only
+// costs one picture, so it gets one try at most and is given up early.
+constexpr uint32_t default_class_retransmit_limit[NAL_CLASS_COUNT] = {1, 4, 8,
+                                                                     8};
+constexpr std::chrono::milliseconds default_class_removal_age[NAL_CLASS_COUNT] =
+    {std::chrono::milliseconds(100), std::chrono::milliseconds(200),
+     std::chrono::milliseconds(200), std::chrono::milliseconds(200)};
+// How long a hole in a protected chain waits for parity after the chain
+// last made progress, before it is NACKed after all.
+constexpr auto fec_nack_holdoff = std::chrono::milliseconds(5);
+// Most missing ids collected for one NACK pass; the rest go next time.
+constexpr size_t max_nack_ids = 4096;
+// How far past the oldest id the rx tree is searched for chains to flush.
+constexpr uint32_t max_flush_lookahead = 1024;
+// Pictures of a GOP the reference graph remembers. Short-term references
+// are limited to the DPB, which holds 16 at most.
+constexpr size_t max_ref_pictures = 64;
+// Extra ack periods an unchanged SACK is repeated for, to ride out ACK loss.
+constexpr uint8_t sack_redundancy = 2;
+// Clock probes go out quickly until the offset estimate has a full window,
+// then once a second to follow drift.
+constexpr auto clock_probe_interval_initial = std::chrono::milliseconds(100);
+constexpr auto clock_probe_interval = std::chrono::seconds(1);
+// A PMTU probe is given up on after this, or a few round trips if that is
+// longer. The search is repeated every so often to follow route changes.
+constexpr auto pmtu_probe_timeout = std::chrono::milliseconds(200);
+constexpr float pmtu_probe_timeout_rtts = 3;
+constexpr auto pmtu_search_interval = std::chrono::seconds(30);
+// Hellos go out quickly at first, then back off while nobody answers.
+constexpr auto hello_interval_initial = std::chrono::milliseconds(50);
+constexpr auto hello_interval_max = std::chrono::seconds(1);
+// Most the jitter buffer delays a block unless configured otherwise.
+constexpr auto default_jitter_buffer_max_delay = std::chrono::milliseconds(100);
+
+// Peers without epochs are taken to have restarted when their ids fall this
+// far behind what was handed out, i.e. in the case of connecting to an
+// in-process VRTS downstream where the upstream has been recently restarted
+// from scratch.
 static constexpr uint32_t reset_rx_id_threshold = 500;
 
+/// @brief A session epoch from seed, spread over all 32 bits and with an
+/// epochTag() that isn't 0.
+static uint32_t makeEpoch(uint64_t seed) {
+  // splitmix64
+  seed += 0x9e3779b97f4a7c15ull;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+  seed ^= seed >> 31;
+  uint32_t epoch = static_cast<uint32_t>(seed);
+  return epochTag(epoch) ? epoch : epoch | 1;
+}
+
 // H.264 video
 #define TYPE_VIDEO_264 0x1b
 #define TYPE_VIDEO_265 0x24
@@ -72,984 +158,2967 @@ void moving_average(float& average, T value) {
     average = value;
   }
 }
+// Same for an average with a single writer that other threads read.
+template <typename T>
+void moving_average(std::atomic<float>& average, T value) {
+  float updated = average.load(std::memory_order_relaxed);
+  moving_average(updated, value);
+  average.store(updated, std::memory_order_relaxed);
+}
 
-// Used for conditional logging flexibility.
-constexpr bool debug_to_cout = true;
-class vrcout {
-public:
-  vrcout &operator()(bool indent = false) {
-    if (indent)
-      std::cout << '\t';
-    return *this;
-  }
+// Annex B start code put in front of each NAL of a tx block.
+static const uint8_t nal_start_code[4] = {0, 0, 0, 1};
 
-  template <class T> vrcout &operator<<(T t) {
-    if (debug_to_cout) {
-      std::cout << t;
-    }
-    return *this;
-  }
+static void appendToBlock(vrts_tx_block_t &block, const uint8_t *data,
+                          size_t len) {
+  block.segments.push_back({const_cast<uint8_t *>(data), len});
+  block.length += len;
+}
 
-  vrcout &operator<<(std::ostream &(*f)(std::ostream &o)) {
-    if (debug_to_cout) {
-      std::cout << f;
+/// @brief Copy len bytes of a block from offset on, for the FEC encoder
+/// which needs its shards in one piece.
+static void copyFromBlock(const vrts_tx_block_t &block, size_t offset,
+                          size_t len, uint8_t *dst) {
+  for (auto &segment : block.segments) {
+    if (len == 0) {
+      break;
     }
-    return *this;
-  };
-};
+    if (offset >= segment.iov_len) {
+      offset -= segment.iov_len;
+      continue;
+    }
+    size_t part = std::min(segment.iov_len - offset, len);
+    memcpy(dst, static_cast<const uint8_t *>(segment.iov_base) + offset, part);
+    dst += part;
+    len -= part;
+    offset = 0;
+  }
+}
 
 VRTS::VRTS(uint16_t downstream_port, uint16_t upstream_port,
            std::string downstream_ip, std::string upstream_ip,
            uint16_t sync_rate_hz)
-    : sync_hz{sync_rate_hz}, mtu{1472 - sizeof(vrts_packetheader_t)},
+    : VRTS(sync_rate_hz, false, chrono_clock::now()) {
+  link_endpoints = {ntohl(inet_addr(upstream_ip.c_str())), upstream_port,
+                    ntohl(inet_addr(downstream_ip.c_str())), downstream_port};
+  reactor.open();
+  // I don't think that if FakeRadioLoop throws an exception that it will be
+  // caught within the scope of the constructor body...
+  reactor_thread = std::make_shared<std::thread>(
+      [this, upstream_ip, upstream_port, downstream_ip, downstream_port] {
+        reactorLoop(upstream_ip, upstream_port, downstream_ip,
+                    downstream_port);
+      });
+}
+
+VRTS::VRTS(udp_sink_t link_send, vrts_clock_time_t start,
+           uint16_t sync_rate_hz)
+    : VRTS(sync_rate_hz, true, start) {
+  link_endpoints = {virtual_local_ip, virtual_port, virtual_remote_ip,
+                    virtual_port};
+  link_sender.openVirtual(std::move(link_send));
+  link_receiver.openVirtual();
+  // Deadlines count from the virtual start, not from when we were built.
+  tx_timers.restart(start);
+  rx_timers.restart(start);
+}
+
+/// @brief What both kinds of session share.
+VRTS::VRTS(uint16_t sync_rate_hz, bool virtual_link, vrts_clock_time_t start)
+    : sync_hz{sync_rate_hz},
+      mtu{MaxUDPPayloadSize - sizeof(vrts_packetheader_t)},
+      mtu_limit{MaxUDPPayloadSize - sizeof(vrts_packetheader_t)},
       current_packet_id{0}, service_tx_tree{false},
-      new_gop_needed{false},
       flush_tx_tree{false}, total_sent{0},
       max_unacked_full_rate{default_max_unacked_full_rate},
       unacked{0},
-      global_status_bit_state{status_bits_t::NEW_GOP_NEEDED},
-      last_input_status_bit_state{0},
-      rx_id_discard_threshold{0},
+      gop_request_mask{(1 << vrts_max_streams) - 1}, rx_streams_seen{1},
+      last_gop_request_mask{0},
       removal_age_threshold{default_removal_age_threshold},
       retransmit_time_threshold{default_retransmit_time_threshold},
       max_unacked_items_allowed{default_max_unacked_items_allowed},
-      retransmit_count_limit{default_retransmit_count_limit},
       temporal_layer_filter_latency_threshold{default_temporal_layer_filter_latency},
-      should_ack{false} {
+      udp_gso_enabled{true}, udp_gro_enabled{false}, pacing_rate_kbps{0},
+      pacing_burst_bytes{default_pacing_burst_bytes},
+      timestamp_sei_enabled{false}, jitter_buffer_enabled{false},
+      jitter_buffer_max_delay{default_jitter_buffer_max_delay},
+      dependency_discard_enabled{true}, should_ack{false},
+      acks_pending{false}, rx_sack_dirty{false}, sack_repeats{0},
+      peer_version{VRTS_VERSION_LEGACY},
+      tx_drr_stream{0}, tx_drr_credited{false}, tx_send_seq{0},
+      tx_acked_seq{0}, tx_sent_end{0},
+      congestion{min_target_rate, initial_target_rate, max_target_rate},
+      target_bitrate_kbps{initial_target_rate * 8 / 1000},
+      pacer_blocked_since{},
+      output_overflow_policy{OUTPUT_OVERFLOW_DROP_OLDEST},
+      virtual_link{virtual_link}, virtual_now{start}, last_ack_check{start},
+      tx_deadline{vrts_clock_time_t::max()}, rcvbuf_window{0},
+      link_endpoints{}, next_clock_probe{start}, clock_reply{},
+      clock_reply_pending{false}, pmtu{MaxUDPPayloadSize},
+      next_pmtu_search{start}, pmtu_probe_id{0}, pmtu_probe_bytes{0},
+      pmtu_probe_sent{}, pmtu_oversize_seen{0}, pmtu_reply{},
+      pmtu_reply_pending{false}, session_epoch{0}, peer_epoch{0},
+      peer_epoch_tag{0}, epoch_confirmed{false}, next_hello{start},
+      hello_interval{hello_interval_initial}, hello_reply_pending{false},
+      stats_wakeups_last{0}, stats_cpu_ns_last{0},
+      stats_idle_ns_last{0}, stats_paced_bytes_last{0} {
   keep_running = true;
+  // A virtual link session gets the same epoch every time it is started at
+  // the same time, so it runs the same way.
+  session_epoch = makeEpoch(
+      virtual_link
+          ? static_cast<uint64_t>(toMicroseconds(start))
+          : static_cast<uint64_t>(std::random_device{}()) << 32 ^
+                std::chrono::steady_clock::now().time_since_epoch().count());
   resetStatistics();
+  for (int c = 0; c < NAL_CLASS_COUNT; c++) {
+    fec_redundancy_percent[c] = default_fec_redundancy_percent[c];
+    class_retransmit_limit[c] = default_class_retransmit_limit[c];
+    class_removal_age[c] = default_class_removal_age[c];
+  }
 
-  // Input h265 state tracking.
-  input_state.running_poc = 0;
-  input_state.last_slice_state = 0xFFFFFFFF;
-  input_state.last_poc_count = 0;
-  input_state.was_last_slice_first = false;
-  input_state.pending_contains_pps = false;
-
-  // Output h265 state tracking.
-  output_state.running_poc = 0;
-  output_state.last_slice_state = 0xFFFFFFFF;
-  output_state.last_poc_count = 0;
-  output_state.was_last_slice_first = false;
-  output_state.pending_contains_pps = false;
-
-  streamPidMap[TYPE_VIDEO_265] = VIDEO_PID;
-  lMuxer = new MpegTsMuxer(streamPidMap, PMT_PID, VIDEO_PID,
-                           MpegTsMuxer::MuxType::segmentType);
+  // We don't want to pass fillers through.
+  filter_list.push_back(h265nal::NalUnitType::FD_NUT);
+  // filter_list.push_back(h265nal::AUD_NUT); // Don't strictly need this
+  filter_list.push_back(h265nal::PREFIX_SEI_NUT);
+  // Experimentation list:
+  // See what happens if we only ever let trailing reference updates
+  // through.
+  // filter_list.push_back(h265nal::NalUnitType::TRAIL_N);
+  // filter_list.push_back(h265nal::NalUnitType::TRAIL_R);
+
+  // Don't currently drop the PREFIX_SEI_NUT as at the moment
+  // it is included in the "first GOP" NAL aggregated chunk
+  // and would drop the whole first big NAL.
+  // filter_list.push_back(h265nal::NalUnitType::PREFIX_SEI_NUT);
+
+  // The types that denote a "threshold" between a group of NALS
+  // that we might want to align our decoder on or skip to reduce
+  // birate.
+  threshold_list.push_back(h265nal::NalUnitType::IDR_N_LP);
+  threshold_list.push_back(h265nal::NalUnitType::IDR_W_RADL);
+  threshold_list.push_back(h265nal::NalUnitType::CRA_NUT);
+
+  for (uint8_t i = 0; i < vrts_max_streams; i++) {
+    auto &stream = streams[i];
+    stream.pending_input_entry = {};
+    // Input h265 state tracking.
+    stream.input_state.running_poc = 0;
+    stream.input_state.last_slice_state = 0xFFFFFFFF;
+    stream.input_state.last_poc_count = 0;
+    stream.input_state.was_last_slice_first = false;
+    stream.input_state.pending_contains_pps = false;
+    stream.input_state.skipped_pictures = 0;
+    stream.input_state.pending_tag = {NAL_CLASS_NON_REFERENCE,
+                                      vrts_nal_type_unknown, 0xff,
+                                      vrts_nal_type_unknown, 0};
+    stream.input_rate_window_start = {};
+    stream.input_rate_window_bytes = 0;
+    stream.input_rate_kbps = 0;
+    stream.input_last_time = vrts_clock_time_t{};
+    stream.temporal_drop_active = false;
+    stream.new_gop_needed = false;
+    stream.next_capture_time = {};
+
+    stream.weight = 1;
+    stream.tx_deficit = 0;
+    stream.tx_gop_last_id = 0;
+    stream.tx_gop_in_flight = false;
+
+    // Output h265 state tracking.
+    stream.output_state.running_poc = 0;
+    stream.output_state.last_slice_state = 0xFFFFFFFF;
+    stream.output_state.last_poc_count = 0;
+    stream.output_state.was_last_slice_first = false;
+    stream.output_state.pending_contains_pps = false;
+    stream.output_state.skipped_pictures = 0;
+    stream.rx_id_discard_threshold = 0;
+    stream.rx_id_discard_valid = false;
+    stream.rx_dropped_chains.clear();
+
+    std::map<uint8_t, int> stream_pid_map;
+    stream_pid_map[TYPE_VIDEO_265] = VIDEO_PID + i;
+    stream.muxer = new MpegTsMuxer(stream_pid_map, PMT_PID + i, VIDEO_PID + i,
+                                   MpegTsMuxer::MuxType::segmentType);
+  }
   // Our PTS for the mpegts stream currently starts when we start to receive
   // frames.
-  mpegtsPtsStart = chrono_clock::now();
-
-  // I don't think that if FakeRadioLoop throws an exception that it will be
-  // caught within the scope of the constructor body...
-  tx_handler = std::make_shared<std::thread>(
-      [this, upstream_ip, upstream_port, downstream_ip, downstream_port] {
-        txHandler(upstream_ip, upstream_port, downstream_ip, downstream_port);
-      });
-  rx_handler = std::make_shared<std::thread>(
-      [this, upstream_ip, upstream_port, downstream_ip, downstream_port] {
-        rxHandler(upstream_ip, upstream_port, downstream_ip, downstream_port);
-      });
+  mpegtsPtsStart = start;
 }
 
 VRTS::~VRTS() {
   keep_running = false;
-  if (tx_handler) {
-    if (tx_handler->joinable()) {
-      tx_handler->join();
+  reactor.notify();
+  if (reactor_thread) {
+    if (reactor_thread->joinable()) {
+      reactor_thread->join();
     }
   }
-  if (rx_handler) {
-    if (rx_handler->joinable()) {
-      rx_handler->join();
-    }
+  for (auto &stream : streams) {
+    delete stream.muxer;
   }
 }
 
 /// @brief Feeds data into the tx tree to be handled by VRTS
-/// @details Will break up large input packets into MTU sized chunks
-/// @param data pointer to data to put into the tree
-/// @param len lenth of data to put into the tree
-void VRTS::feedDataH265(uint8_t *data, uint16_t len) {
-  std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-  int chunks = len / mtu;
-  int leftovers = len - (chunks * mtu);
+/// @details Will break up large input packets into MTU sized chunks. Chains
+/// of a class with FEC redundancy are cut a little shorter so that a parity
+/// shard plus its vrts_fec_header_t still fits one datagram.
+/// Fragments only refer to their slice of the block, the payload is
+/// gathered into the datagram when it is sent.
+/// @param block data to put into the tree
+/// @param tag picks the FEC redundancy, send priority and retransmit limits
+void VRTS::feedDataH265(uint8_t stream_id,
+                        std::shared_ptr<const vrts_tx_block_t> block,
+                        const vrts_nal_tag_t &tag) {
+  size_t len = block->length;
+  nal_class_t nal_class = tag.nal_class;
+  uint32_t fec_percent = fec_redundancy_percent[nal_class];
+  uint16_t payload = mtu;
+  uint16_t chunk_size =
+      fec_percent ? payload - sizeof(vrts_fec_header_t) : payload;
+  int chunks = len / chunk_size;
+  int leftovers = len - (chunks * chunk_size);
   int fragments_total = chunks;
   if (leftovers > 0) {
     fragments_total++;
   }
+  if (fragments_total > UINT8_MAX) {
+    VRTS_TRACE(WARN, "[vrts] NAL block too large to fragment, dropping: {}",
+               len);
+    metrics.send_pkt_dropped += fragments_total;
+    return;
+  }
 
-  // Entry that we'll fill and then put into the tree.
-  vrts_local_txdata_t empty_entry = {};
+  // Parity is computed before taking the tx lock so the reactor isn't held
+  // up by it.
+  int parity_total = 0;
+  if (fec_percent && fragments_total > 0) {
+    parity_total = std::min<int>((fragments_total * fec_percent + 99) / 100,
+                                 FecCodec::max_shards - fragments_total);
+  }
+  std::vector<vrts_tx_fec_t> parity(std::max(parity_total, 0));
+  if (parity_total > 0) {
+    uint16_t largest = chunks > 0 ? chunk_size : leftovers;
+    size_t shard_length = sizeof(uint16_t) + largest;
+    std::vector<uint8_t> shards(fragments_total * shard_length, 0);
+    std::vector<const uint8_t *> data_shards;
+    for (int i = 0; i < fragments_total; i++) {
+      uint16_t length = (i < chunks) ? chunk_size : leftovers;
+      uint8_t *shard = &shards[i * shard_length];
+      memcpy(shard, &length, sizeof(length));
+      copyFromBlock(*block, i * chunk_size, length, shard + sizeof(length));
+      data_shards.push_back(shard);
+    }
+    std::vector<uint8_t *> parity_shards;
+    for (int j = 0; j < parity_total; j++) {
+      auto &packet = parity[j].packet;
+      packet.header = {};
+      packet.header.packet_type = vrts_packet_type_t::VRTS_FEC;
+      packet.header.version = protocol_version;
+      packet.header.fragments = fragments_total;
+      packet.header.length =
+          offsetof(vrts_fec_header_t, fragment_length) + shard_length;
+      auto *fec = reinterpret_cast<vrts_fec_header_t *>(packet.data);
+      fec->parity_count = parity_total;
+      fec->parity_index = j;
+      parity_shards.push_back(reinterpret_cast<uint8_t *>(&fec->fragment_length));
+    }
+    FecCodec::encode(data_shards.data(), fragments_total, parity_shards.data(),
+                     parity_total, shard_length);
+  }
 
-  uint32_t parent_packet_id = current_packet_id;
-  for (int i = 0; i < chunks; i++) {
-    // Make the map item that we'll copy our data into.
-    tx_stream_tree.insert(std::make_pair(current_packet_id, empty_entry));
-    // Get a reference to the allocated
-    auto &this_chunk = tx_stream_tree[current_packet_id];
-    this_chunk.was_sent = false;
-    this_chunk.was_acked = false;
-    this_chunk.was_nacked = false;
-    this_chunk.retx_count = 0;
-    this_chunk.ota_packet.header.fragments = fragments_total;
-    this_chunk.ota_packet.header.length = mtu;
-    this_chunk.ota_packet.header.packet_type = vrts_packet_type_t::VRTS_DATA;
-    this_chunk.ota_packet.header.packet_id = current_packet_id;
-    this_chunk.ota_packet.header.parent_id_offset =
-        static_cast<uint8_t>(current_packet_id - parent_packet_id);
-    memcpy(this_chunk.ota_packet.data, &(data[i * mtu]), mtu);
-    current_packet_id++;
+  std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+  // The whole fragment chain has to fit, otherwise downstream could never
+  // reassemble it.
+  if (fragments_total == 0 ||
+      !tx_stream_tree.canInsert(current_packet_id + fragments_total - 1)) {
+    VRTS_TRACE(WARN, "[vrts] tx tree full, dropping NAL block of size: {}",
+               len);
+    metrics.send_pkt_dropped += fragments_total;
+    return;
   }
 
-  // Handle any packets smaller than the mtu size
-  if (leftovers) {
-    // Make the map item that we'll copy our data into.
-    tx_stream_tree.insert(std::make_pair(current_packet_id, empty_entry));
-    // Get a reference to the allocated
-    auto &this_chunk = tx_stream_tree[current_packet_id];
-    this_chunk.was_sent = false;
-    this_chunk.was_acked = false;
-    this_chunk.was_nacked = false;
-    this_chunk.retx_count = 0;
-    this_chunk.ota_packet.header.fragments = fragments_total;
-    this_chunk.ota_packet.header.length = leftovers;
-    this_chunk.ota_packet.header.packet_type = vrts_packet_type_t::VRTS_DATA;
-    this_chunk.ota_packet.header.packet_id = current_packet_id;
-    this_chunk.ota_packet.header.parent_id_offset =
+  uint32_t parent_packet_id = current_packet_id;
+  auto now = clockNow();
+  for (int i = 0; i < fragments_total; i++) {
+    uint16_t length = (i < chunks) ? chunk_size : leftovers;
+    // Slot metadata comes back value-initialized (unsent, unacked).
+    auto *chunk = tx_stream_tree.insert(current_packet_id);
+    chunk->queued_time_local = now;
+    chunk->stream_id = stream_id;
+    chunk->nal_class = nal_class;
+    chunk->nal_type = tag.nal_type;
+    chunk->temporal_id = tag.temporal_id;
+    streams[stream_id].tx_unsent[nal_class].push_back(current_packet_id);
+    auto &ota_packet = *tx_stream_tree.cold(current_packet_id);
+    ota_packet.header = {};
+    ota_packet.block = block;
+    ota_packet.offset = i * chunk_size;
+    ota_packet.header.fragments = fragments_total;
+    ota_packet.header.length = length;
+    ota_packet.header.packet_type = vrts_packet_type_t::VRTS_DATA;
+    ota_packet.header.version = protocol_version;
+    ota_packet.header.packet_id = current_packet_id;
+    ota_packet.header.stream_id = stream_id;
+    ota_packet.header.parent_id_offset =
         static_cast<uint8_t>(current_packet_id - parent_packet_id);
-    memcpy(this_chunk.ota_packet.data, &(data[chunks * mtu]), leftovers);
+    if (parity_total > 0) {
+      ota_packet.header.status_bits = status_bits_t::FEC_PROTECTED;
+    }
     current_packet_id++;
   }
+  auto &stream = streams[stream_id];
+  // Frames that left the tx tree entirely leave the index.
+  while (!stream.tx_frames.empty()) {
+    auto &oldest = stream.tx_frames.front();
+    bool gone = true;
+    for (uint8_t i = 0; i < oldest.fragments && gone; i++) {
+      gone = !tx_stream_tree.contains(oldest.first_id + i);
+    }
+    if (!gone) {
+      break;
+    }
+    stream.tx_frames.pop_front();
+  }
+  stream.tx_frames.push_back({parent_packet_id,
+                              static_cast<uint8_t>(fragments_total),
+                              tag.picture_type, tag.poc, tag.temporal_id});
+  // A block with parameter sets starts a GOP. Marked under the same lock as
+  // the insert, so an ACK can't get in before it is.
+  if (nal_class == NAL_CLASS_PARAMETER_SETS) {
+    stream.tx_gop_last_id = current_packet_id - 1;
+    stream.tx_gop_in_flight = true;
+  }
+  // Nothing from here on refers to what was fed before an IRAP picture, so
+  // whatever of it is still waiting to be sent or repaired would only be
+  // in the way.
+  if (tag.picture_type != vrts_nal_type_unknown &&
+      nalClassOf(static_cast<h265nal::NalUnitType>(tag.picture_type)) ==
+          NAL_CLASS_IRAP) {
+    dropTxFramesBefore(stream, parent_packet_id);
+  }
+  for (auto &entry : parity) {
+    entry.last_id = current_packet_id - 1;
+    entry.queued = false;
+    entry.packet.header.packet_id = parent_packet_id;
+    entry.packet.header.stream_id = stream_id;
+    tx_fec_queue.emplace_back(entry);
+  }
   service_tx_tree = true;
+  reactor.notify();
 }
 
 /// @brief set new MTU length
 /// @param new_mtu new mtu size in bytes
 bool VRTS::setMtu(uint16_t new_mtu) {
   // VRTS payload must be able to fit into the maximum UDP payload size that can
-  // fit into a single L2 ethernet frame
-  if (mtu - sizeof(vrts_packetheader_t) <= MaxUDPPayloadSize) {
-    mtu = new_mtu;
-    return true;
+  // fit into a single L2 ethernet frame, and leave room for a parity shard.
+  if (new_mtu <= sizeof(vrts_fec_header_t) ||
+      new_mtu + sizeof(vrts_packetheader_t) > MaxUDPPayloadSize) {
+    return false;
   }
-  return false;
+  // The reactor restarts the path MTU search below the new limit.
+  mtu_limit = new_mtu;
+  mtu = new_mtu;
+  return true;
 }
 
-/// @brief rxHandler thread, consider combining with txHandler.
-void VRTS::rxHandler(std::string upstream_ip, uint16_t upstream_port,
-                     std::string downstream_ip, uint16_t downstream_port) {
-  vrts_local_rxdata_t rx_entry = {};
-  while (keep_running) {
-    std::vector<uint32_t> chunks_to_be_removed;
-    while (udpRecv(rx_entry, upstream_ip, upstream_port)) {
-      // ACKs of any type are never put into the tree.
-      // All ACK messages are created on-the-fly based on
-      // the messages in the tree and immediately sent out.
-      vrcout() << "[vrts] rx type = " << (int)rx_entry.ota_packet.header.packet_type << std::endl;
-
-      if (rx_entry.ota_packet.header.packet_type ==
-          vrts_packet_type_t::VRTS_ACKS) {
-        // Check for any piggy-backed status updates:
-        requestNewGOPHandler(rx_entry.ota_packet.header.status_bits);
-
-        uint16_t ack_count = rx_entry.ota_packet.header.length / 4;
-        vrcout() << "[vrts] got ack count: " << ack_count << std::endl;
-
-        for (int i = 0; i < ack_count; i++) {
-          uint32_t acked_packet_id =
-              reinterpret_cast<uint32_t *>(&(rx_entry.ota_packet.data))[i];
-          try {
-            std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-            // Make sure it's actually in the tree before using the overloaded
-            // [] access type.
-            if (tx_stream_tree.find(acked_packet_id) != tx_stream_tree.end()) {
-              tx_stream_tree[acked_packet_id].was_acked = true;
-              tx_stream_tree[acked_packet_id].acked_time_local =
-                  chrono_clock::now();
-              statistics.ack_total++;
-            } else {
-              vrcout() << "[vrts] acked packet id: " << acked_packet_id
-                       << " NOT in tree" << std::endl;
-              statistics.ack_total++;
-              statistics.ack_not_in_tree++;
-            }
-          } catch (...) {
-            vrcout() << "[vrts] caught exception accesing map" << std::endl;
-          }
-        }
-      } else if (rx_entry.ota_packet.header.packet_type ==
-                 vrts_packet_type_t::VRTS_NACKS) {
-        // Check for any piggy-backed status updates:
-        requestNewGOPHandler(rx_entry.ota_packet.header.status_bits);
-
-        auto nack_received_time = chrono_clock::now();
-        uint16_t nack_count = rx_entry.ota_packet.header.length / 4;
-        vrcout() << "[vrts] got nack count: " << nack_count << std::endl;
-        for (int i = 0; i < nack_count; i++) {
-          uint32_t nacked_packet_id =
-              reinterpret_cast<uint32_t *>(&(rx_entry.ota_packet.data))[i];
-          try {
-            std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-            // Make sure it's actually in the tree before using the overloaded
-            // [] access type.
-            if (tx_stream_tree.find(nacked_packet_id) != tx_stream_tree.end()) {
-              if (tx_stream_tree[nacked_packet_id].was_acked) {
-                vrcout()
-                    << "[vrts] == WARNING: Got NACK for a packet marked ACKed."
-                    << std::endl;
-              }
-              vrcout() << "[vrts] == Got NACK for a packet: "
-                       << nacked_packet_id << std::endl;
-              if (!tx_stream_tree[nacked_packet_id].was_nacked) {
-                statistics.nack_total++;
-                statistics.nack_since++;
-
-                auto& chunk = tx_stream_tree[nacked_packet_id];
-                auto chunk_rtt =
-                    std::chrono::duration_cast<std::chrono::milliseconds>(
-                        nack_received_time - chunk.sent_time_local);
-
-                moving_average(statistics.rtt_average, chunk_rtt.count());
-                moving_average(statistics.rtt_nacked, chunk_rtt.count());
-                if (chunk_rtt.count() > statistics.rtt_peak)
-                  statistics.rtt_peak = chunk_rtt.count();
-              }
+template <typename Fn>
+void VRTS::forEachTxInRange(uint32_t first, uint32_t last, Fn &&fn) {
+  if (tx_stream_tree.empty()) {
+    return;
+  }
+  if (tx_stream_tree.before(first, tx_stream_tree.front())) {
+    first = tx_stream_tree.front();
+  }
+  uint32_t stop = tx_stream_tree.back() + 1;
+  if (tx_stream_tree.before(stop, last)) {
+    last = stop;
+  }
+  for (uint32_t id = first; tx_stream_tree.before(id, last); id++) {
+    if (tx_stream_tree.hot(id)) {
+      fn(id);
+    }
+  }
+}
 
-              tx_stream_tree[nacked_packet_id].was_nacked = true;
-              tx_stream_tree[nacked_packet_id].nacked_time_local =
-                  chrono_clock::now();
-            } else {
-              vrcout() << "[vrts] nacked packet id: " << nacked_packet_id
-                       << " NOT in tree" << std::endl;
-            }
-          } catch (...) {
-            vrcout() << "[vrts] caught exception accesing map" << std::endl;
-          }
+/// @brief Handles a single packet pulled off the receive socket.
+void VRTS::handleRxPacket(vrts_packet_t &rx_packet, vrts_clock_time_t rx_time,
+                          size_t wire_bytes, const vrts_header_ext_t &ext) {
+  // ACKs of any type are never put into the tree.
+  // All ACK messages are created on-the-fly based on
+  // the messages in the tree and immediately sent out.
+  VRTS_TRACE(DEBUG, "[vrts] rx type = {}", (int)rx_packet.header.packet_type);
+
+  // Packets of the peer's previous session may still be in flight for a
+  // moment after it restarted. Its hellos tell which session is current.
+  uint8_t epoch_tag = rx_packet.header.epoch_tag;
+  if (rx_packet.header.version >= VRTS_VERSION_EPOCH && epoch_tag &&
+      rx_packet.header.packet_type != vrts_packet_type_t::VRTS_HELLO) {
+    if (peer_epoch_tag == 0) {
+      peer_epoch_tag = epoch_tag;
+    } else if (epoch_tag != peer_epoch_tag) {
+      VRTS_TRACE(DEBUG, "[vrts] dropping packet of epoch tag {}, expected {}",
+                 epoch_tag, peer_epoch_tag);
+      metrics.stale_epoch_drops++;
+      return;
+    }
+  }
+
+  // Answer in the newest format the peer understands.
+  peer_version = rx_packet.header.version;
+  if (peer_version < VRTS_VERSION_EPOCH) {
+    // Nobody to say hello to.
+    epoch_confirmed = true;
+  }
+
+  if (rx_packet.header.packet_type ==
+      vrts_packet_type_t::VRTS_ACKS) {
+    // Check for any piggy-backed status updates:
+    requestNewGOPHandler(rx_packet.header.status_bits,
+                         rx_packet.header.stream_id);
+
+    uint16_t ack_count = rx_packet.header.length / 4;
+    VRTS_TRACE(DEBUG, "[vrts] got ack count: {}", ack_count);
+    // Acked packets can be retired and the window may have opened.
+    service_tx_tree = true;
+
+    for (int i = 0; i < ack_count; i++) {
+      uint32_t acked_packet_id =
+          reinterpret_cast<uint32_t *>(&(rx_packet.data))[i];
+      std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+      if (!ackTxPacket(acked_packet_id, rx_time)) {
+        VRTS_TRACE(WARN, "[vrts] acked packet id: {} NOT in tree",
+                   acked_packet_id);
+        metrics.ack_total++;
+        metrics.ack_not_in_tree++;
+      }
+    }
+    std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+    updateCongestion(rx_time);
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_SACKS) {
+    requestNewGOPHandler(rx_packet.header.status_bits,
+                         rx_packet.header.stream_id);
+
+    vrts_sack_t sack;
+    if (!decodeSack(rx_packet.data, rx_packet.header.length, sack)) {
+      VRTS_TRACE(WARN, "[vrts] malformed sack");
+      return;
+    }
+    VRTS_TRACE(DEBUG, "[vrts] got sack base: {} runs: {}", sack.base,
+               sack.runs.size());
+    service_tx_tree = true;
+    std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+    applySack(sack, rx_time);
+    updateCongestion(rx_time);
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_NACKS) {
+    // Check for any piggy-backed status updates:
+    requestNewGOPHandler(rx_packet.header.status_bits,
+                         rx_packet.header.stream_id);
+
+    uint16_t nack_count = rx_packet.header.length / 4;
+    VRTS_TRACE(DEBUG, "[vrts] got nack count: {}", nack_count);
+    service_tx_tree = true;
+    for (int i = 0; i < nack_count; i++) {
+      uint32_t nacked_packet_id =
+          reinterpret_cast<uint32_t *>(&(rx_packet.data))[i];
+      std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+      nackTxPacket(nacked_packet_id, rx_time);
+    }
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_NACK_RANGES) {
+    requestNewGOPHandler(rx_packet.header.status_bits,
+                         rx_packet.header.stream_id);
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    if (!decodeNackRanges(rx_packet.data, rx_packet.header.length, ranges)) {
+      VRTS_TRACE(WARN, "[vrts] malformed nack ranges");
+      return;
+    }
+    VRTS_TRACE(DEBUG, "[vrts] got nack ranges: {}", ranges.size());
+    service_tx_tree = true;
+    std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+    for (auto &range : ranges) {
+      forEachTxInRange(range.first, range.first + range.second,
+                       [&](uint32_t id) { nackTxPacket(id, rx_time); });
+    }
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_CANCEL) {
+    requestNewGOPHandler(rx_packet.header.status_bits,
+                         rx_packet.header.stream_id);
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    if (!decodeNackRanges(rx_packet.data, rx_packet.header.length, ranges)) {
+      VRTS_TRACE(WARN, "[vrts] malformed cancel");
+      return;
+    }
+    // Nothing downstream can use these any more, repairing them would only
+    // take airtime from what it can.
+    std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+    for (auto &range : ranges) {
+      forEachTxInRange(range.first, range.first + range.second,
+                       [&](uint32_t id) {
+                         retireTxPacket(id);
+                         metrics.cancelled_packets++;
+                       });
+    }
+    if (tx_stream_tree.empty()) {
+      pacer_blocked_since = {};
+    }
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_FEC) {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    handleRxFec(rx_packet, rx_time);
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_CLOCK) {
+    vrts_clock_probe_t probe;
+    if (rx_packet.header.length < sizeof(probe)) {
+      VRTS_TRACE(WARN, "[vrts] malformed clock probe");
+      return;
+    }
+    memcpy(&probe, rx_packet.data, sizeof(probe));
+    if (rx_packet.header.fragments == 0) {
+      // Answered on this rx pass, the transmit time taken when it goes.
+      clock_reply = {probe.origin_us, toMicroseconds(rx_time), 0};
+      clock_reply_pending = true;
+    } else {
+      clock_sync.sample(probe.origin_us, probe.receive_us, probe.transmit_us,
+                        toMicroseconds(rx_time));
+      VRTS_TRACE(DEBUG, "[vrts] clock offset {} us, rtt {} us",
+                 clock_sync.offset(), clock_sync.rtt());
+    }
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_PMTU) {
+    if (rx_packet.header.fragments == 0) {
+      // Answered on this rx pass with the size that made it.
+      pmtu_reply = rx_packet.header;
+      pmtu_reply.length = wire_bytes;
+      pmtu_reply_pending = true;
+      return;
+    }
+    vrts_pmtu_reply_t reply;
+    if (rx_packet.header.length < sizeof(reply)) {
+      VRTS_TRACE(WARN, "[vrts] malformed pmtu reply");
+      return;
+    }
+    memcpy(&reply, rx_packet.data, sizeof(reply));
+    // A late reply to a probe given up on still tells us something.
+    pmtu.acked(reply.probe_bytes);
+    if (rx_packet.header.packet_id == pmtu_probe_id &&
+        reply.probe_bytes == pmtu_probe_bytes) {
+      pmtu_probe_bytes = 0;
+    }
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_HELLO) {
+    vrts_hello_t hello;
+    if (rx_packet.header.length < sizeof(hello)) {
+      VRTS_TRACE(WARN, "[vrts] malformed hello");
+      return;
+    }
+    memcpy(&hello, rx_packet.data, sizeof(hello));
+    handleHello(hello, rx_packet.header.fragments != 0);
+  } else if (rx_packet.header.packet_type ==
+             vrts_packet_type_t::VRTS_DATA) {
+    // Duplicates of packets still in the tree are ignored. Every arrival,
+    // duplicates of flushed packets included, is recorded for the next
+    // SACK, since receiving a packet twice implies the upstream has not
+    // yet gotten an ACK for it.
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    uint32_t packet_id = rx_packet.header.packet_id;
+    bool record = true;
+    uint8_t stream_id = rx_packet.header.stream_id;
+    auto *stream =
+        stream_id < vrts_max_streams ? &streams[stream_id] : nullptr;
+    if (stream == nullptr) {
+      // Recorded anyway, so the upstream stops resending it.
+      VRTS_TRACE(WARN, "[vrts] == unknown stream {}, dropping packet_id: {}",
+                 stream_id, packet_id);
+    } else if (!stream->rx_id_discard_valid ||
+               rx_stream_tree.before(stream->rx_id_discard_threshold,
+                                     packet_id)) {
+      if (droppedChain(*stream,
+                       packet_id - rx_packet.header.parent_id_offset)) {
+        VRTS_TRACE(DEBUG, "[vrts] == packet_id: {} of a dropped chain",
+                   packet_id);
+      } else if (rx_stream_tree.contains(packet_id)) {
+        // If we get a lot of these, then we need to adjust ACK/NACK logic
+        VRTS_TRACE(DEBUG,
+                   "[vrts] == received non-flushed duplicate packet_id: {}",
+                   packet_id);
+      } else if (auto *rx_entry = rx_stream_tree.insert(packet_id)) {
+        rx_entry->received_time_local = rx_time;
+        rx_entry->ack_sent = false;
+        rx_entry->in_consumer_queue = false;
+        rx_entry->parent_id_offset = rx_packet.header.parent_id_offset;
+        rx_entry->fragments = rx_packet.header.fragments;
+        rx_entry->stamped = ext.has_timestamp;
+        rx_entry->sent_us = ext.timestamp_us;
+        rx_streams_seen |= 1 << stream_id;
+        rx_timers.schedule(rx_time + removal_age_threshold.load() +
+                               deadline_slack,
+                           packet_id);
+        rx_unacked_ids.emplace_back(packet_id);
+        // Only the received bytes, not the whole slot.
+        memcpy(rx_stream_tree.cold(packet_id), &rx_packet,
+               sizeof(vrts_packetheader_t) + rx_packet.header.length);
+        if (rx_packet.header.status_bits & status_bits_t::FEC_PROTECTED) {
+          handleRxFec(rx_packet, rx_time);
         }
-      } else if (rx_entry.ota_packet.header.packet_type ==
-                 vrts_packet_type_t::VRTS_DATA) {
-        // The insert() method won't overwrite an entry.
-        // rx_stream_tree.insert(
-        //    std::make_pair(rx_entry.ota_packet.header.packet_id, rx_entry));
-        // Use overloaded [] for insertion and overwriting of an entry such
-        // that if we receive a packet twice that has already been ACK'd, we
-        // will ACK the packet again. Receiving the packet twice implies the
-        // upstream has not yet gotten an ACK for this packet.
-        // TODO: Overwriting an entry and updating its received time could
-        // mess up timing statistics...
-        std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
-        rx_entry.received_time_local = chrono_clock::now();
-        rx_entry.ack_sent = false;
-        // Make sure it's not already in the tree before using the overloaded
-        // [] access type.
-        if (rx_id_discard_threshold == 0 ||
-            (rx_entry.ota_packet.header.packet_id > rx_id_discard_threshold)) {
-          if (rx_stream_tree.find(rx_entry.ota_packet.header.packet_id) ==
-              rx_stream_tree.end()) {
-            rx_stream_tree[rx_entry.ota_packet.header.packet_id] = rx_entry;
-            vrcout() << "[vrts] == got packet_id: "
-                     << std::to_string(rx_entry.ota_packet.header.packet_id)
-                     << " offset: "
-                     << std::to_string(
-                            rx_entry.ota_packet.header.parent_id_offset)
-                     << " fragments: "
-                     << std::to_string(rx_entry.ota_packet.header.fragments)
-                     << std::endl;
-          } else {
-            // If we get a lot of these, then we need to adjust ACK/NACK logic
-            vrcout() << "[vrts] == received non-flushed duplicate packet_id: "
-                     << std::to_string(rx_entry.ota_packet.header.packet_id)
-                     << std::endl;
-          }
+        VRTS_TRACE(DEBUG,
+                   "[vrts] == got packet_id: {} offset: {} fragments: {}",
+                   rx_packet.header.packet_id,
+                   rx_packet.header.parent_id_offset,
+                   rx_packet.header.fragments);
+      } else {
+        VRTS_TRACE(WARN, "[vrts] == rx tree full, dropping packet_id: {}",
+                   packet_id);
+        record = false;
+      }
+    } else {
+      // Peers with epochs say when they restarted, for older ones a big
+      // step back in ids has to do.
+      if (peer_version < VRTS_VERSION_EPOCH &&
+          static_cast<int32_t>(stream->rx_id_discard_threshold - packet_id) >
+              static_cast<int32_t>(reset_rx_id_threshold)) {
+        VRTS_TRACE(DEBUG, "[vrts] == resetting rx_id_discard_threshold");
+        stream->rx_id_discard_valid = false;
+        stream->rx_dropped_chains.clear();
+        rx_sack.reset();
+      } else {
+        VRTS_TRACE(DEBUG, "[vrts] == rx_id_discard_threshold {} >= id: {}",
+                   stream->rx_id_discard_threshold.load(),
+                   rx_packet.header.packet_id);
+      }
+    }
+    if (record) {
+      rx_sack.receive(packet_id, rx_time);
+      rx_sack_dirty = true;
+      acks_pending = true;
+    }
+  } else {
+    VRTS_TRACE(WARN, "[vrts] got unhandled packet type.");
+  }
+}
+
+void VRTS::handleRxFec(const vrts_packet_t &rx_packet,
+                       vrts_clock_time_t rx_time) {
+  bool is_parity = rx_packet.header.packet_type == vrts_packet_type_t::VRTS_FEC;
+  uint32_t first_id = is_parity ? rx_packet.header.packet_id
+                                : rx_packet.header.packet_id -
+                                      rx_packet.header.parent_id_offset;
+  uint8_t fragments = rx_packet.header.fragments;
+  if (fragments == 0 ||
+      rxDelivered(rx_packet.header.stream_id, first_id + fragments - 1)) {
+    // Already handed to the consumer.
+    return;
+  }
+
+  auto &group = rx_fec_groups[first_id];
+  if (group.fragments == 0) {
+    group.first_seen = rx_time;
+    group.stream_id = rx_packet.header.stream_id;
+    group.fragments = fragments;
+    group.parity_count = 0;
+    group.shard_length = 0;
+  }
+  group.last_seen = rx_time;
+  if (!is_parity) {
+    // A late fragment can make the chain decodable.
+    group.dirty = group.parity_count > 0;
+    return;
+  }
+
+  const size_t shard_offset = offsetof(vrts_fec_header_t, fragment_length);
+  auto *fec = reinterpret_cast<const vrts_fec_header_t *>(rx_packet.data);
+  if (rx_packet.header.length <= shard_offset + sizeof(uint16_t) ||
+      fec->parity_count == 0 || fec->parity_index >= fec->parity_count ||
+      (group.parity_count && (group.parity_count != fec->parity_count ||
+                              group.shard_length !=
+                                  rx_packet.header.length - shard_offset))) {
+    VRTS_TRACE(WARN, "[vrts] malformed fec for chain {}", first_id);
+    return;
+  }
+  group.parity_count = fec->parity_count;
+  group.shard_length = rx_packet.header.length - shard_offset;
+  group.parity.resize(group.parity_count);
+  auto *shard = reinterpret_cast<const uint8_t *>(&fec->fragment_length);
+  group.parity[fec->parity_index].assign(shard, shard + group.shard_length);
+  group.dirty = true;
+}
+
+bool VRTS::rxDelivered(uint8_t stream_id, uint32_t id) {
+  if (stream_id >= vrts_max_streams) {
+    return true;
+  }
+  auto &stream = streams[stream_id];
+  return stream.rx_id_discard_valid &&
+         !rx_stream_tree.before(stream.rx_id_discard_threshold, id);
+}
+
+void VRTS::recoverFecGroups(void) {
+  std::vector<vrts_packet_t> rebuilt;
+  auto now = clockNow();
+  {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    for (auto it = rx_fec_groups.begin(); it != rx_fec_groups.end();) {
+      uint32_t first_id = it->first;
+      auto &group = it->second;
+      bool flushed =
+          rxDelivered(group.stream_id, first_id + group.fragments - 1);
+      if (flushed || now - group.first_seen > removal_age_threshold.load()) {
+        it = rx_fec_groups.erase(it);
+        continue;
+      }
+      if (!group.dirty) {
+        ++it;
+        continue;
+      }
+      group.dirty = false;
+
+      int k = group.fragments;
+      size_t shard_length = group.shard_length;
+      std::vector<uint8_t> shards(k * shard_length, 0);
+      std::vector<uint8_t *> data_shards(k);
+      bool present[FecCodec::max_shards];
+      int missing = 0;
+      for (int i = 0; i < k; i++) {
+        data_shards[i] = &shards[i * shard_length];
+        auto *packet = rx_stream_tree.hot(first_id + i)
+                           ? rx_stream_tree.cold(first_id + i)
+                           : nullptr;
+        present[i] = packet != nullptr &&
+                     packet->header.length + sizeof(uint16_t) <= shard_length;
+        if (present[i]) {
+          memcpy(data_shards[i], &packet->header.length, sizeof(uint16_t));
+          memcpy(data_shards[i] + sizeof(uint16_t), packet->data,
+                 packet->header.length);
         } else {
-          // Hacky way to reset the discard threshold if we're reconnecting.
-          // TODO: Deal wth this more gracefully.
-          if ((((int64_t)rx_id_discard_threshold) -
-               ((int64_t)rx_entry.ota_packet.header.packet_id)) >
-              reset_rx_id_threshold) {
-            vrcout() << "[vrts] == resetting rx_id_discard_threshold to 0"
-                     << std::endl;
-            rx_id_discard_threshold = 0;
-          } else {
-            vrcout() << "[vrts] == rx_id_discard_threshold >= id: "
-                     << std::to_string(rx_entry.ota_packet.header.packet_id)
-                     << std::endl;
+          missing++;
+        }
+      }
+      std::vector<const uint8_t *> parity_shards;
+      std::vector<uint8_t> parity_index;
+      for (int j = 0; j < group.parity_count; j++) {
+        if (!group.parity[j].empty()) {
+          parity_shards.push_back(group.parity[j].data());
+          parity_index.push_back(j);
+        }
+      }
+      if (missing > static_cast<int>(parity_shards.size())) {
+        ++it;
+        continue;
+      }
+
+      if (missing && FecCodec::decode(data_shards.data(), present, k,
+                                      parity_shards.data(),
+                                      parity_index.data(),
+                                      parity_shards.size(), shard_length)) {
+        for (int i = 0; i < k; i++) {
+          uint16_t length;
+          memcpy(&length, data_shards[i], sizeof(length));
+          if (present[i] || length + sizeof(uint16_t) > shard_length ||
+              length > sizeof(vrts_packet_t::data)) {
+            continue;
           }
+          vrts_packet_t packet;
+          packet.header = {};
+          packet.header.packet_id = first_id + i;
+          packet.header.parent_id_offset = i;
+          packet.header.packet_type = vrts_packet_type_t::VRTS_DATA;
+          packet.header.fragments = k;
+          packet.header.stream_id = group.stream_id;
+          // handleRxPacket() takes the peer's version from every packet.
+          packet.header.version = peer_version;
+          packet.header.length = length;
+          memcpy(packet.data, data_shards[i] + sizeof(uint16_t), length);
+          rebuilt.emplace_back(packet);
         }
-      } else {
-        vrcout() << "[vrts] got unhandled packet type." << std::endl;
+        VRTS_TRACE(DEBUG, "[vrts] fec rebuilt {} of {} fragments of chain {}",
+                   missing, k, first_id);
       }
+      it = rx_fec_groups.erase(it);
     }
+  }
 
-    // Criteria for periodic removal from the rx_stream_tree:
-    // - Data is ready to be enqueued into output buffer
-    // - Data is too old and should be removed, e.g. from old GOP
-    // - TBD
-
-    // Empty out the buffer.
-    // Rules for this are pretty simple:
-    // - Don't flush any fragmented packets.
-    // - Only flush packets oldest to newest.
-    // - Stop flushing packets once we hit a fragmented packet.
-    //
-    // The map is a sorted tree by key value
-    // First value in the map is smallest, last is largest
-
-    // TODO: keep going until we hit stop condition.
-    // Only check this if the size of the map has changed since the last time
-    // we did this. This scope touches the rx_stream_tree state.
-    {
-      std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
-      std::vector<uint32_t> nack_ids;
-      // Check may not be needed:
-      if (rx_stream_tree.size()) {
-        uint32_t oldest_id = rx_stream_tree.begin()->first;
-        auto &chunk = rx_stream_tree[oldest_id];
-        bool complete_chain = false;
-        if (!chunk.in_consumer_queue) {
-          // Let's see if we have all the data we need
-          // to reconstruct the original un-fragmented data.
-          // Should never receive an ota data packet with fragment count 0.
-          vrcout() << "[vrts] == attempting flush" << std::endl;
-          if (chunk.ota_packet.header.fragments >= 1 &&
-              chunk.ota_packet.header.parent_id_offset == 0) {
-            // If this chunk is part of a fragment chain and the
-            // offset isn't zero, we lost preceeding packets and
-            // must wait for them to arrive.
-            vrcout() << "[vrts]     fragment count "
-                    << std::to_string(chunk.ota_packet.header.fragments)
-                    << std::endl;
-            bool keep_checking = true;
-            for (int i = 0;
-                (i < chunk.ota_packet.header.fragments && keep_checking); i++) {
-              try {
-                // - If we look ahead and the parent id_offset of subsequent
-                // packets doesn't match this iterator value as we access the
-                // map, then the chain is broken and we must wait for
-                // retransmissions or subsequent transmissions to occur.
-                // - First check to see if we even have the keys we would need.
-                if (rx_stream_tree.find(oldest_id + i) == rx_stream_tree.end()) {
-                  vrcout() << "[vrts]     chain links unavailable " << std::endl;
-                  complete_chain = false;
-                  keep_checking = false;
-                } else {
-                  vrcout() << "[vrts]      link available" << std::endl;
-                  auto &link = rx_stream_tree[oldest_id + i];
-                  if (link.ota_packet.header.parent_id_offset == i) {
-                    vrcout() << "[vrts]     chain unbroken count " << i
-                            << std::endl;
-                    complete_chain = true;
-                  } else {
-                    complete_chain = false;
-                    keep_checking = false;
-                    vrcout() << "[vrts]     chain broken" << std::endl;
-                  }
-                }
-              } catch (...) {
-                vrcout() << "[vrts] caught exception looking for complete chain"
-                        << std::endl;
-                complete_chain = false;
-              }
+  // Rebuilt fragments go through the normal path, so they are ACKed like
+  // any other and nobody NACKs them. A rebuilt first fragment has lost its
+  // timestamp, and its chain is handed out unbuffered.
+  for (auto &packet : rebuilt) {
+    handleRxPacket(packet, now,
+                   sizeof(vrts_packetheader_t) + packet.header.length, {});
+  }
+  metrics.fec_recovered += rebuilt.size();
+}
+
+bool VRTS::fecHoldsNack(uint32_t id, vrts_clock_time_t now,
+                        vrts_clock_time_t &release) {
+  auto it = rx_fec_groups.upper_bound(id);
+  if (it == rx_fec_groups.begin()) {
+    return false;
+  }
+  --it;
+  auto &group = it->second;
+  if (id - it->first >= group.fragments) {
+    return false;
+  }
+  // All parity is in and the chain still isn't whole: nothing to wait for.
+  if (group.parity_count > 0 &&
+      std::none_of(group.parity.begin(), group.parity.end(),
+                   [](const std::vector<uint8_t> &p) { return p.empty(); })) {
+    return false;
+  }
+  release = group.last_seen + fec_nack_holdoff;
+  return now < release;
+}
+
+vrts_clock_time_t VRTS::clockNow(void) const {
+  return virtual_link ? virtual_now.load(std::memory_order_relaxed)
+                      : chrono_clock::now();
+}
+
+/// @brief Session event loop. Owns the sockets and services the rx tree, the
+/// tx tree and outgoing ACKs whenever a datagram arrives, feedDataH265()
+/// queues data, or the next retransmit / age-out / ACK deadline passes.
+void VRTS::reactorLoop(std::string upstream_ip, uint16_t upstream_port,
+                       std::string downstream_ip, uint16_t downstream_port) {
+  if (!link_sender.open(downstream_ip, downstream_port)) {
+    VRTS_TRACE(ERROR, "[vrts] failed to get socket reactorLoop");
+  }
+  if (!link_receiver.open(upstream_ip, upstream_port)) {
+    VRTS_TRACE(ERROR, "[vrts] bind failed {} reactorLoop: {}", upstream_ip,
+               errno);
+  }
+  if (!reactor.isOpen()) {
+    VRTS_TRACE(WARN, "[vrts] epoll unavailable, falling back to polling");
+  }
+
+  int watched_fd = -1;
+  last_ack_check = clockNow();
+  while (keep_running) {
+    // The receiver reopens its socket after hard errors. A closed fd drops
+    // out of the epoll set by itself.
+    if (link_receiver.socket() != watched_fd) {
+      watched_fd = link_receiver.socket();
+      reactor.watch(watched_fd);
+    }
+
+    auto next_deadline = servicePass();
+    if (!link_receiver.isOpen()) {
+      next_deadline =
+          std::min(next_deadline, clockNow() + socket_retry_interval);
+    }
+    if (next_deadline == vrts_clock_time_t::max()) {
+      reactor.disarmTimer();
+    } else {
+      reactor.armTimer(next_deadline - clockNow());
+    }
+    reactor.wait();
+  }
+
+  link_receiver.close();
+  link_sender.close();
+  VRTS_TRACE(INFO, "[vrts] reactorLoop exiting");
+}
+
+vrts_clock_time_t VRTS::servicePass(void) {
+  link_sender.setSegmentationOffload(udp_gso_enabled);
+  link_receiver.setReceiveOffload(udp_gro_enabled);
+  // Size the kernel buffer to hold a full in-flight window plus its ACK
+  // traffic, so a burst never overflows between two service passes.
+  if (!virtual_link && rcvbuf_window != max_unacked_items_allowed) {
+    rcvbuf_window = max_unacked_items_allowed;
+    int granted = link_receiver.setReceiveBufferSize(std::max<int>(
+        default_min_rcvbuf_bytes,
+        rcvbuf_window * MaxUDPPayloadSize * rcvbuf_overhead_factor));
+    metrics.recv_buf_bytes = granted;
+    VRTS_TRACE(INFO, "[vrts] receive buffer: {} bytes", granted);
+  }
+
+  // ACKs first, so the rx pass below can already release what they cover.
+  auto ack_period = std::chrono::milliseconds(1000 / sync_hz);
+  auto now = clockNow();
+  metrics.rtt.tick(now);
+  metrics.ack_delay.tick(now);
+  metrics.reassembly.tick(now);
+  metrics.nal_latency.tick(now);
+  metrics.encode_latency.tick(now);
+  metrics.transport_latency.tick(now);
+  metrics.output_latency.tick(now);
+  metrics.glass_latency.tick(now);
+  if (should_ack || (acks_pending && now >= last_ack_check + ack_period)) {
+    last_ack_check = now;
+    should_ack = false;
+    ackService(link_sender);
+  }
+  // Until the peer knows our epoch it may hold state of an earlier session
+  // of ours. Older peers ignore hellos, and only get them until their
+  // first packet shows what they are.
+  if (!epoch_confirmed && now >= next_hello) {
+    sendHello(link_sender, false);
+    next_hello = now + hello_interval;
+    hello_interval = std::min<vrts_clock_time_t::duration>(
+        hello_interval * 2, hello_interval_max);
+  }
+  bool clock_probes = peer_version >= VRTS_VERSION_CLOCK;
+  if (clock_probes && now >= next_clock_probe) {
+    sendClockProbe(link_sender, false);
+    next_clock_probe =
+        now + (clock_sync.count() < ClockSync::window
+                   ? std::chrono::duration_cast<vrts_clock_time_t::duration>(
+                         clock_probe_interval_initial)
+                   : clock_probe_interval);
+  }
+
+  auto rx_deadline = rxService(link_receiver, link_sender);
+
+  if (service_tx_tree || clockNow() >= tx_deadline) {
+    tx_deadline = txService(link_sender);
+  }
+
+  auto next_deadline = std::min(rx_deadline, tx_deadline);
+  if (acks_pending) {
+    next_deadline = std::min(next_deadline, last_ack_check + ack_period);
+  }
+  if (clock_probes) {
+    next_deadline = std::min(next_deadline, next_clock_probe);
+  }
+  if (!epoch_confirmed) {
+    next_deadline = std::min(next_deadline, next_hello);
+  }
+  bool pmtu_probes = peer_version >= VRTS_VERSION_PMTU;
+  // DF only once we size datagrams to the path ourselves, older peers still
+  // get the kernel's fragmentation.
+  link_sender.setDontFragment(pmtu_probes);
+  if (pmtu_probes) {
+    next_deadline = std::min(next_deadline, pmtuService(link_sender, now));
+  }
+  return next_deadline;
+}
+
+vrts_clock_time_t VRTS::step(vrts_clock_time_t now) {
+  if (!virtual_link) {
+    return vrts_clock_time_t::max();
+  }
+  // However it is driven, the session's time never runs backwards.
+  if (now > virtual_now.load(std::memory_order_relaxed)) {
+    virtual_now.store(now, std::memory_order_relaxed);
+  }
+  return servicePass();
+}
+
+void VRTS::receive(const uint8_t *data, size_t len,
+                   vrts_clock_time_t rx_time) {
+  if (virtual_link) {
+    link_receiver.inject(data, len, rx_time);
+  }
+}
+
+bool VRTS::startCapture(const std::string &path) {
+  return capture.open(path, link_endpoints);
+}
+
+void VRTS::stopCapture(void) { capture.close(); }
+
+/// @brief Drains the receive socket, reassembles NALs and sends NACKs.
+/// @returns when the rx tree next needs attention; now if this pass made
+/// progress and the next NAL may already be ready.
+vrts_clock_time_t VRTS::rxService(UdpReceiver &receiver, UdpSender &sender) {
+  vrts_packet_t rx_packet;
+  std::vector<uint32_t> chunks_to_be_removed;
+  auto next_deadline = vrts_clock_time_t::max();
+  bool progressed = false;
+  // Drain everything that is queued; the socket is level-triggered in the
+  // reactor so anything left over wakes us again.
+  while (udpRecv(receiver, false)) {
+    for (auto &datagram : receiver.datagrams()) {
+      size_t header_bytes;
+      vrts_header_ext_t ext;
+      if (!decodeHeader(datagram.data, datagram.len, rx_packet.header,
+                        header_bytes, &ext)) {
+        VRTS_TRACE(WARN, "[vrts] malformed datagram: {}", datagram.len);
+        continue;
+      }
+      // A compact header leaves room for more payload than we hold. Only
+      // PMTU probes use it, and their padding isn't looked at.
+      if (rx_packet.header.length > sizeof(rx_packet.data) &&
+          rx_packet.header.packet_type != vrts_packet_type_t::VRTS_PMTU) {
+        VRTS_TRACE(WARN, "[vrts] oversized packet, length {}",
+                   rx_packet.header.length);
+        continue;
+      }
+      memcpy(rx_packet.data, datagram.data + header_bytes,
+             std::min<size_t>(rx_packet.header.length,
+                              sizeof(rx_packet.data)));
+      handleRxPacket(rx_packet, datagram.rx_time, datagram.len, ext);
+    }
+  }
+  if (clock_reply_pending) {
+    clock_reply_pending = false;
+    sendClockProbe(sender, true);
+  }
+  if (pmtu_reply_pending) {
+    pmtu_reply_pending = false;
+    sendPmtuProbe(sender, true);
+  }
+  if (hello_reply_pending) {
+    hello_reply_pending = false;
+    sendHello(sender, true);
+  }
+
+  // Parity may already cover holes; fill them before anything is NACKed.
+  recoverFecGroups();
+
+  // Criteria for periodic removal from the rx_stream_tree:
+  // - Data is ready to be enqueued into output buffer
+  // - Data is too old and should be removed, e.g. from old GOP
+  // - TBD
+
+  // Empty out the buffer, oldest chains first and each stream on its own:
+  // - A complete chain is flushed unless an older chain of its stream is
+  //   still incomplete, so a loss in one stream doesn't hold up the others.
+  // - An incomplete chain holds up the rest of its stream until it is
+  //   complete or given up on, see skipChain(). With the jitter buffer off
+  //   a picture nothing refers to goes once a later one of its stream is
+  //   complete.
+  // - Fragments of a chain whose start is missing hold up their stream.
+  // - Missing ids not known to be part of a chain may be a whole picture
+  //   later ones refer to, and are waited for, see waitForGap().
+  //
+  // The ring is indexed by packet id, so iteration is ascending by id.
+  // This scope touches the rx_stream_tree state.
+  {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    std::vector<uint32_t> nack_ids;
+    if (rx_stream_tree.size()) {
+      auto now = clockNow();
+      uint32_t front = rx_stream_tree.front();
+      uint32_t end = rx_stream_tree.back() + 1;
+      // The oldest holes may be ahead of everything left in the tree.
+      uint32_t start = front;
+      if (rx_sack.started() && rx_stream_tree.before(rx_sack.base(), front)) {
+        start = rx_sack.base();
+      }
+      // Streams held up by an older chain, and of those the ones held up
+      // by nothing but the incomplete chain starting at blocker[].
+      uint8_t held = 0;
+      uint8_t single = 0;
+      uint32_t blocker[vrts_max_streams] = {};
+      // Streams waiting for a new GOP, until a chain that may start it.
+      uint8_t undecodable = gop_request_mask;
+      // Streams with a lost picture later ones may refer to, until a chain
+      // that may start a GOP. See dropDependent().
+      uint8_t lost_refs = 0;
+      auto has_lost = [&](uint8_t stream_id) {
+        auto &pictures = streams[stream_id].output_state.ref_pictures;
+        return dependency_discard_enabled &&
+               !(gop_request_mask & (1 << stream_id)) &&
+               std::any_of(pictures.begin(), pictures.end(),
+                           [](const vrts_ref_picture_t &picture) {
+                             return !picture.decodable;
+                           });
+      };
+      for (uint8_t i = 0; i < vrts_max_streams; i++) {
+        lost_refs |= has_lost(i) << i;
+      }
+      // Oldest missing id not known to be part of a chain.
+      bool gap = false;
+      uint32_t gap_id = 0;
+      // Missing ids from owned_from on belong to the chain of the fragment
+      // after them.
+      bool owner_known = false;
+      uint32_t owned_from = start;
+      uint32_t id = start;
+      while (rx_stream_tree.before(id, end) &&
+             id - start < max_flush_lookahead) {
+        auto *link = rx_stream_tree.hot(id);
+        if (link == nullptr) {
+          if (!owner_known) {
+            uint32_t next = id + 1;
+            while (next != end && !rx_stream_tree.contains(next)) {
+              next++;
             }
-          } // If the first packet in our tree does not have an offset id of 0,
-            // we're missing preceeding packets.
-          else if (chunk.ota_packet.header.parent_id_offset != 0) {
-            complete_chain = false;
-            uint32_t this_id = chunk.ota_packet.header.packet_id;
-            uint32_t chain_parent_id =
-                this_id - chunk.ota_packet.header.parent_id_offset;
-            vrcout() << "[vrts] == this_id: " << std::to_string(this_id)
-                    << " parent-id: " << std::to_string(chain_parent_id)
-                    << std::endl;
-            vrcout() << "[vrts] == missing leading packets: ";
+            auto *after = rx_stream_tree.hot(next);
+            owned_from = after ? next - after->parent_id_offset : next;
+            owner_known = true;
+          }
+          if (!gap && rx_sack.hole(id) &&
+              rx_stream_tree.before(id, owned_from)) {
+            gap = true;
+            gap_id = id;
+          }
+          id++;
+          continue;
+        }
+        owner_known = false;
+        // Handed out already, waiting for its ACK to go out.
+        if (link->in_consumer_queue) {
+          id++;
+          continue;
+        }
+        uint8_t stream_id = rx_stream_tree.cold(id)->header.stream_id;
+        uint8_t stream_bit = 1 << stream_id;
+        if (link->parent_id_offset != 0) {
+          // We lost preceeding packets of this chain and must wait for them
+          // to arrive.
+          held |= stream_bit;
+          single &= ~stream_bit;
+          undecodable &= ~stream_bit;
+          lost_refs &= ~stream_bit;
+          if (id == front) {
+            uint32_t chain_parent_id = id - link->parent_id_offset;
+            VRTS_TRACE(DEBUG, "[vrts] == missing leading packets: {} - {}",
+                       chain_parent_id, id - 1);
             // Enqueue nacks for the missing preceeding items.
-            for (uint32_t nack_id = chain_parent_id; nack_id < this_id;
-                nack_id++) {
-              vrcout() << std::to_string(nack_id) << " ";
+            for (uint32_t nack_id = chain_parent_id; nack_id != id;
+                 nack_id++) {
               nack_ids.emplace_back(nack_id);
             }
-            vrcout() << std::endl;
           }
+          id += link->fragments > link->parent_id_offset
+                    ? link->fragments - link->parent_id_offset
+                    : 1;
+          continue;
         }
-
-        // TODO: Add rejection criteria:
-        // - Don't enqueue a NAL that we've already enqueued within the GOP
-        // - Don't enqueue a NAL if we're waiting on a NACKd chunk that should
-        // be coming before this full NAL. I.e. if NACKd packet ID is at all
-        // before any packet IDs in this chunk, we gotta wait!
-        // (duplicate)
-        if (complete_chain) {
-          std::vector<uint8_t> nal;
-          for (int i = 0; i < chunk.ota_packet.header.fragments; i++) {
-            try {
-              auto &link = rx_stream_tree[oldest_id + i];
-              nal.insert(nal.end(), link.ota_packet.data,
-                         link.ota_packet.data + link.ota_packet.header.length);
-              link.in_consumer_queue = true;
-              // Defer tree removal until packet acked AND in consumer queue
-
-              // Update our up-front filter for dropping ids that come in that
-              // are too old:
-              rx_id_discard_threshold = oldest_id + i;
-            } catch (...) {
-              vrcout() << "[vrts] output: caught exception at rx nal enqueue"
-                       << std::endl;
-            }
+        // Should never receive an ota data packet with fragment count 0.
+        if (link->fragments == 0) {
+          id++;
+          continue;
+        }
+        if (undecodable & stream_bit) {
+          // Nothing before the new GOP can be decoded, so it isn't waited
+          // for or repaired either.
+          nal_class_t chain_class;
+          if (sniffChain(*rx_stream_tree.cold(id), chain_class) &&
+              chain_class < NAL_CLASS_IRAP) {
+            discardChain(id, chunks_to_be_removed);
+            metrics.undecodable_pictures++;
+            progressed = true;
+            id += link->fragments;
+            continue;
           }
-
-          if (trackOutputStream(nal.data(), nal.size())) {
-            // parse output stream, check for errors.
-            output_queue.emplace_back(nal);
+          undecodable &= ~stream_bit;
+        }
+        if (lost_refs & stream_bit) {
+          // Pictures referring to a lost one can't be decoded either, so
+          // what is missing of them isn't waited for or repaired.
+          nal_class_t chain_class;
+          if (!sniffChain(*rx_stream_tree.cold(id), chain_class) ||
+              chain_class >= NAL_CLASS_IRAP) {
+            lost_refs &= ~stream_bit;
+          } else if (dropDependent(id, chunks_to_be_removed)) {
+            metrics.undecodable_pictures++;
+            progressed = true;
+            id += link->fragments;
+            continue;
           }
-          vrcout() << "[vrts] nal emplaced" << std::endl;
         }
-
-        // Schedule packets for removal once ACK sent and in consumer queue
-        for (auto &entry : rx_stream_tree) {
-          auto &chunk = entry.second;
-          if (chunk.ack_sent && chunk.in_consumer_queue) {
-            uint32_t this_id = chunk.ota_packet.header.packet_id;
-            vrcout() << "[vrts] output: erasing id: " << this_id
-                      << std::endl;
-              chunks_to_be_removed.emplace_back(this_id);
+        // If the parent id_offset of subsequent packets doesn't match, the
+        // chain is broken and we must wait for retransmissions.
+        bool complete_chain = true;
+        for (uint8_t i = 1; i < link->fragments && complete_chain; i++) {
+          auto *next_link = rx_stream_tree.hot(id + i);
+          complete_chain = next_link && next_link->parent_id_offset == i;
+        }
+        uint32_t next_chain = id + link->fragments;
+
+        // Nothing from an IRAP picture on refers to what came before it, so
+        // it doesn't wait for any of that.
+        nal_class_t chain_class;
+        bool gop_start = complete_chain && ((held & stream_bit) || gap) &&
+                         sniffChain(*rx_stream_tree.cold(id), chain_class) &&
+                         chain_class >= NAL_CLASS_IRAP;
+        bool overtaking = false;
+        if (gop_start && (held & stream_bit)) {
+          dropChainsBefore(stream_id, start, id, chunks_to_be_removed);
+          held &= ~stream_bit;
+          single &= ~stream_bit;
+          overtaking = true;
+        } else if (held & stream_bit) {
+          // A complete chain may overtake a single picture nothing refers
+          // to; otherwise it waits along with the rest of its stream.
+          if (!complete_chain || !(single & stream_bit) ||
+              !skipChain(blocker[stream_id], now, true, next_deadline,
+                         chunks_to_be_removed)) {
+            single &= ~stream_bit;
+            id = next_chain;
+            continue;
           }
+          held &= ~stream_bit;
+          single &= ~stream_bit;
+          overtaking = true;
+          progressed = true;
         }
-      }
-
-      // Now look for any discontinuities in the keys we've received
-      // These are missing packets that we need to NACK.
-      uint32_t last_id = 0;
-      for (auto &entry : rx_stream_tree) {
-        uint32_t id = entry.second.ota_packet.header.packet_id;
-        if (last_id == 0) {
-          last_id = id;
-        } else {
-          uint8_t difference = labs((long int)id - (long int)last_id);
-          if (difference > 1) {
-            vrcout() << "[vrts] detected missing id id/last" << id << "/"
-                     << last_id << std::endl;
-            for (uint32_t missing_id = last_id + 1; missing_id < id;
-                 missing_id++) {
-              vrcout() << "[vrts] " << missing_id << std::endl;
-              nack_ids.emplace_back(missing_id);
-            }
+        if (gap && !gop_start && waitForGap(id, gap_id, now, next_deadline)) {
+          held |= stream_bit;
+          id = next_chain;
+          continue;
+        }
+        if (complete_chain) {
+          if (overtaking || held) {
+            metrics.hol_bypassed++;
           }
-          last_id = id;
+          flushChain(id, chunks_to_be_removed);
+          VRTS_TRACE(DEBUG, "[vrts] nal emplaced");
+          progressed = true;
+          // It may have been found to refer to a lost picture on its way.
+          lost_refs |= has_lost(stream_id) << stream_id;
+        } else if (skipChain(id, now, false, next_deadline,
+                             chunks_to_be_removed)) {
+          progressed = true;
+          lost_refs |= has_lost(stream_id) << stream_id;
+        } else {
+          held |= stream_bit;
+          single |= stream_bit;
+          blocker[stream_id] = id;
         }
+        id = next_chain;
       }
+    }
+    next_deadline = std::min(next_deadline, playoutService(clockNow()));
+
+    // Now add any discontinuities in the ids we've received. These are
+    // missing packets that we need to NACK. The tracker knows how many there
+    // are, so a clean stream doesn't walk anything.
+    rx_sack.expire(clockNow() - removal_age_threshold.load());
+    rx_sack.holes(nack_ids, max_nack_ids);
+
+    if (nack_ids.size()) {
+      std::sort(nack_ids.begin(), nack_ids.end(),
+                [](uint32_t a, uint32_t b) {
+                  return PacketRing<vrts_local_rxdata_t,
+                                    vrts_packet_t>::before(a, b);
+                });
+      nack_ids.erase(std::unique(nack_ids.begin(), nack_ids.end()),
+                     nack_ids.end());
+
+      // Holes in protected chains wait a moment for their parity.
+      if (!rx_fec_groups.empty()) {
+        auto now = clockNow();
+        nack_ids.erase(
+            std::remove_if(nack_ids.begin(), nack_ids.end(),
+                           [&](uint32_t id) {
+                             vrts_clock_time_t release;
+                             if (!fecHoldsNack(id, now, release)) {
+                               return false;
+                             }
+                             next_deadline = std::min(next_deadline, release);
+                             return true;
+                           }),
+            nack_ids.end());
+      }
+    }
 
-      if (nack_ids.size()) {
-        vrts_local_txdata_t nack = {};
-        // Put the chunk's packet ID into the ack packet's payload.
-        // TODO: Handle this case...
-        if (nack_ids.size() > (1472 - sizeof(vrts_packetheader_t)) / 4) {
-          vrcout() << "[vrts] hit nack payload size limit - nacks backing up "
-                      "/ dropped"
-                   << std::endl;
-        } else {
-          uint32_t *indexes =
-              reinterpret_cast<uint32_t *>(&(nack.ota_packet.data[0]));
-          for (int i = 0; i < nack_ids.size(); i++) {
-            indexes[i] = nack_ids.at(i);
-          }
+    if (nack_ids.size()) {
+      vrts_packet_t nack = {};
+      // Kept to what the path carries, like the data.
+      size_t nack_bytes_max = std::min<size_t>(mtu, sizeof(nack.data));
+      size_t nacked = 0;
+      if (peer_version >= VRTS_VERSION_SACK) {
+        nack.header.packet_type = vrts_packet_type_t::VRTS_NACK_RANGES;
+        nack.header.length =
+            encodeNackRanges(nack_ids, nack.data, nack_bytes_max, nacked);
+      } else {
+        // Put the missing ids into the nack packet's payload.
+        nacked = std::min(nack_ids.size(), nack_bytes_max / sizeof(uint32_t));
+        memcpy(nack.data, nack_ids.data(), nacked * sizeof(uint32_t));
+        nack.header.packet_type = vrts_packet_type_t::VRTS_NACKS;
+        nack.header.length = nacked * sizeof(uint32_t);
+      }
+      if (nacked < nack_ids.size()) {
+        VRTS_TRACE(WARN,
+                   "[vrts] hit nack payload size limit - {} nacks deferred",
+                   nack_ids.size() - nacked);
+      }
+
+      // Set flags
+      setGOPRequest(nack.header);
+
+      nack.header.fragments = 0;
+      nack.header.packet_id = 0;
+      nack.header.parent_id_offset = 0;
+      nack.header.version = protocol_version;
+
+      // Don't put the nack packet into the tx tree, NACKs are never
+      // retransmitted.
+      uint16_t nack_bytes = udpSend(sender, nack);
+      udpFlush(sender);
+      metrics.ack_byte_total += nack_bytes;
+      VRTS_TRACE(DEBUG, "[vrts] == sending nack chunk of size: {}",
+                 nack.header.length);
+      // Keep asking while the holes are still there.
+      next_deadline = std::min(next_deadline, clockNow() +
+                                                  nack_repeat_interval);
+    }
+
+    // Best effort: if it is lost, the repairs it would have saved are
+    // discarded on arrival.
+    if (!rx_cancel_ids.empty() && peer_version >= VRTS_VERSION_CANCEL) {
+      std::sort(rx_cancel_ids.begin(), rx_cancel_ids.end(),
+                [](uint32_t a, uint32_t b) {
+                  return PacketRing<vrts_local_rxdata_t,
+                                    vrts_packet_t>::before(a, b);
+                });
+      rx_cancel_ids.erase(
+          std::unique(rx_cancel_ids.begin(), rx_cancel_ids.end()),
+          rx_cancel_ids.end());
+      vrts_packet_t cancel = {};
+      size_t cancelled = 0;
+      cancel.header.packet_type = vrts_packet_type_t::VRTS_CANCEL;
+      cancel.header.length = encodeNackRanges(
+          rx_cancel_ids, cancel.data,
+          std::min<size_t>(mtu, sizeof(cancel.data)), cancelled);
+      setGOPRequest(cancel.header);
+      cancel.header.version = protocol_version;
+      if (cancel.header.length) {
+        metrics.ack_byte_total += udpSend(sender, cancel);
+        udpFlush(sender);
+        VRTS_TRACE(DEBUG, "[vrts] == cancelled {} ids", cancelled);
+      }
+    }
+    rx_cancel_ids.clear();
+  }
+
+  // Scope touches rx_stream_tree state
+  // In this scope we remove entries from the tree and queue entries against
+  // age criteria for removal
+  {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    auto now = clockNow();
+    // Only packets whose age-out deadline passed. A stale entry (the id was
+    // flushed and later received again) finds a younger packet and is
+    // ignored; the new packet has its own entry.
+    rx_timers.advance(now, [&](uint32_t id, uint8_t) {
+      auto *chunk = rx_stream_tree.hot(id);
+      if (chunk == nullptr || chunk->in_consumer_queue) {
+        return;
+      }
+      auto chunk_age = std::chrono::duration_cast<std::chrono::milliseconds>(
+          now - chunk->received_time_local);
+      if (chunk_age > removal_age_threshold.load()) {
+        VRTS_TRACE(DEBUG, "[vrts] == OLD {} [ms] | erasing id: {}",
+                   chunk_age.count(), id);
+        chunks_to_be_removed.emplace_back(id);
+      }
+    });
+    next_deadline = std::min(next_deadline, rx_timers.nextDeadline());
+
+    // Remove chunks that have been slated for removal from our receive
+    // tree.
+    for (auto id : chunks_to_be_removed) {
+      auto *chunk = rx_stream_tree.hot(id);
+      if (chunk && !chunk->ack_sent) {
+        VRTS_TRACE(DEBUG, "[vrts] removing unacked packet {}", id);
+      }
+      rx_stream_tree.erase(id);
+    }
+    progressed = progressed || !chunks_to_be_removed.empty();
+  }
+
+  // Flushing or erasing can unblock the next NAL at the front of the tree.
+  return progressed ? clockNow() : next_deadline;
+}
 
-          nack.was_sent = true;
-          nack.was_acked = true;
-          nack.was_nacked = true;
-
-          // Set flags
-          nack.ota_packet.header.status_bits =
-              static_cast<status_bits_t>(global_status_bit_state.load());
-
-          nack.sent_time_local = chrono_clock::now();
-          nack.ota_packet.header.fragments = 0;
-          nack.ota_packet.header.packet_id = 0;
-          nack.ota_packet.header.parent_id_offset = 0;
-          nack.ota_packet.header.packet_type = vrts_packet_type_t::VRTS_NACKS;
-          // Specify how much ack data there is in this ota_packet.
-          nack.ota_packet.header.length = nack_ids.size() * sizeof(uint32_t);
-
-          // Don't put the ack packet into the tx tree. But do update the
-          // packet id.
-          // tx_stream_tree.insert(std::make_pair(current_packet_id, ack));
-          udpSend(reinterpret_cast<uint8_t *>(&(nack.ota_packet)),
-                  sizeof(vrts_packetheader_t) + nack.ota_packet.header.length,
-                  downstream_ip, downstream_port);
-          vrcout() << "[vrts] == sending nack chunk of size: "
-                   << nack.ota_packet.header.length << std::endl;
+/// @brief Sends new and retransmitted data and retires old/acked packets.
+/// @returns when the tx tree next needs attention without new input.
+vrts_clock_time_t VRTS::txService(UdpSender &sender) {
+  // Every time we service / access the tree, we should take a look at the
+  // conditons that might require a chunk to be removed from memory.
+  // Conditions:
+  // - Packet is too old (based on wall time threshold)
+  // - Packet is from a GOP that we wont be decoding
+  // - Packet has been acked successfully (handled as the ACK arrives)
+  // - TBD
+  std::vector<uint32_t> chunks_to_be_removed;
+  std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+
+  // Only packets whose NACK hold-off, retransmit or age-out deadline has
+  // passed are looked at. Entries left over from an earlier send of the same
+  // packet find nothing due and are dropped.
+  auto now = clockNow();
+  pacer.setRate(pacingRate());
+  pacer.setBurst(pacing_burst_bytes);
+  tx_timers.advance(now, [&](uint32_t id, uint8_t) {
+    auto *chunk = tx_stream_tree.hot(id);
+    if (chunk == nullptr || !chunk->was_sent || chunk->was_acked) {
+      return;
+    }
+    auto &ota_packet = *tx_stream_tree.cold(id);
+    auto last_send_period =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - chunk->sent_time_local);
+    uint32_t retx_limit = class_retransmit_limit[chunk->nal_class];
+    auto removal_age = class_removal_age[chunk->nal_class].load();
+    bool nack_resend_due = chunk->was_nacked == true &&
+                           last_send_period > nack_resend_holdoff &&
+                           chunk->retx_count < retx_limit;
+    // Non-reference pictures are only repaired out of spare pacing budget.
+    if (chunk->nal_class == NAL_CLASS_NON_REFERENCE && !pacer.ready(now) &&
+        (nack_resend_due || (last_send_period <= removal_age &&
+                             last_send_period >
+                                 retransmit_time_threshold.load()))) {
+      tx_timers.schedule(pacer.nextReady(now) + deadline_slack, id);
+      return;
+    }
+    if (nack_resend_due) {
+      chunk->sent_time_local = now;
+      chunk->retx_count++;
+      // Repairs jump the pacing queue but still count against the rate.
+      pacer.consume(udpSendTx(sender, ota_packet, *chunk));
+      VRTS_TRACE(DEBUG, "[vrts] sent nacked packet id: {}", id);
+
+      metrics.retx_total++;
+      scheduleTxTimer(id, *chunk);
+    } else if (last_send_period > removal_age) {
+      // Queue to remove because too old.
+      VRTS_TRACE(DEBUG, "[vrts] == id : {} queued for removal due to age", id);
+      chunks_to_be_removed.emplace_back(id);
+      if (metrics.ack_total.value() > 0) {
+        metrics.send_pkt_loss++;
+        if (!chunk->was_nacked) {
+          congestion.onLoss();
+        }
+      }
+      else {
+        // no losses until after first ack, backout send
+        metrics.send_pkt_total.sub(1);
+        metrics.send_byte_total.sub(ota_packet.header.length);
+        VRTS_TRACE(WARN, "[vrts] NO CONNECTION:  send total {} {}",
+                   metrics.send_pkt_total.value(),
+                   metrics.send_byte_total.value());
+      }
+    } else if (last_send_period > retransmit_time_threshold.load()) {
+      //   TODO: This timing theshold needs to be a setting.
+      //   Since we have 1-way ACK currently do we want to limit
+      //   how many retransmits we allow per packet?
+      pacer.consume(udpSendTx(sender, ota_packet, *chunk));
+      chunk->sent_time_local = now;
+      VRTS_TRACE(DEBUG,
+                 "[vrts] re-tx unack period: {} [ms], chunk of size : {}",
+                 last_send_period.count(), ota_packet.header.length);
+      chunk->retx_count++;
+      metrics.retx_total++;
+      if (chunk->retx_count > retx_limit) {
+        VRTS_TRACE(WARN,
+                   "[vrts] == id : {} queued for removal due to retx limit",
+                   id);
+        chunks_to_be_removed.emplace_back(id);
+      } else {
+        scheduleTxTimer(id, *chunk);
+      }
+    }
+  });
+
+  // If we have too many packets in transit, don't transmit more data.
+  // A backlog from before a new GOP is already gone, see feedDataH265().
+  // TODO: If the unack count is starting to grow, trim the data that's
+  // supposed to be sent before it's sent, e.g. drop a temporal layer.
+  auto pacing_deadline = vrts_clock_time_t::max();
+  pruneUnsent(now);
+  if (unacked < max_unacked_items_allowed) {
+    // New data is shared out between streams by weight, and goes out most
+    // important class first within a stream, in feed order within a class.
+    if (!tx_stream_tree.empty()) {
+      bool paced_out = false;
+      uint32_t id;
+      while (nextUnsent(id)) {
+        if (!pacer.ready(now)) {
+          paced_out = true;
+          pacing_deadline = pacer.nextReady(now);
+          break;
+        }
+        auto *chunk = tx_stream_tree.hot(id);
+        auto &stream = streams[chunk->stream_id];
+        stream.tx_unsent[chunk->nal_class].pop_front();
+        auto &ota_packet = *tx_stream_tree.cold(id);
+        uint16_t bytes = udpSendTx(sender, ota_packet, *chunk);
+        pacer.consume(bytes);
+        stream.tx_deficit -= bytes;
+        // Only the time spent waiting on the pacer, not on the window.
+        auto held_since = std::max(chunk->queued_time_local,
+                                   pacer_blocked_since);
+        moving_average(metrics.pacing_delay_ms,
+                       pacer_blocked_since == vrts_clock_time_t{}
+                           ? 0.0f
+                           : std::chrono::duration<float, std::milli>(
+                                 now - held_since)
+                                 .count());
+        chunk->was_sent = true;
+        chunk->sent_time_local = now;
+        chunk->send_seq = ++tx_send_seq;
+        chunk->sent_behind = tx_stream_tree.before(id + 1, tx_sent_end);
+        if (!chunk->sent_behind) {
+          tx_sent_end = id + 1;
         }
+        VRTS_TRACE(DEBUG, "[vrts] sending chunk of size: {}",
+                   ota_packet.header.length);
+        total_sent++;
+        unacked++;
+        scheduleTxTimer(id, *chunk);
+      }
+      sendFec(sender);
+      if (paced_out) {
+        if (pacer_blocked_since == vrts_clock_time_t{}) {
+          pacer_blocked_since = now;
+        }
+      } else {
+        pacer_blocked_since = {};
       }
     }
+  } else {
+    metrics.send_pkt_dropped++;
+  }
+
+  // Everything queued during this pass goes out in one batch while the
+  // tree (and therefore the queued payloads) is still locked.
+  udpFlush(sender);
+  while (!tx_fec_queue.empty() && tx_fec_queue.front().queued) {
+    tx_fec_queue.pop_front();
+  }
+
+  // Remove chunks slated for removal.
+  for (auto id : chunks_to_be_removed) {
+    VRTS_TRACE(DEBUG, "[vrts] == removing packet from tx: {}", id);
+    retireTxPacket(id);
+  }
+
+  metrics.pending_acks = unacked;
+  moving_average(metrics.tx_in_transit, unacked.load());
+  if (unacked) {
+    VRTS_TRACE(DEBUG, "[vrts] unacked in tree: {}", unacked.load());
+    VRTS_TRACE(DEBUG, "[vrts] total_sent: {}", total_sent.load());
+  }
+  service_tx_tree = false;
+  return std::min(tx_timers.nextDeadline(), pacing_deadline);
+}
+
+void VRTS::updateCongestion(vrts_clock_time_t rx_time) {
+  congestion.onFeedback(rx_time);
+  target_bitrate_kbps = congestion.targetRate() * 8 / 1000;
+}
+
+uint64_t VRTS::pacingRate(void) {
+  if (pacing_rate_kbps) {
+    return pacing_rate_kbps * 1000ull / 8;
+  }
+  return pacing_gain * congestion.targetRate();
+}
+
+/// @brief Arm the next retransmit / age-out check for a sent packet. While a
+/// NACK'd packet has resends left it is rechecked after the NACK hold-off.
+/// @details Caller holds tx_tree_mutex.
+void VRTS::scheduleTxTimer(uint32_t id, const vrts_local_txdata_t &chunk) {
+  auto due = chunk.sent_time_local +
+             std::min(retransmit_time_threshold.load(),
+                      class_removal_age[chunk.nal_class].load());
+  if (chunk.was_nacked &&
+      chunk.retx_count < class_retransmit_limit[chunk.nal_class]) {
+    due = std::min(due, chunk.sent_time_local + nack_resend_holdoff);
+  }
+  tx_timers.schedule(due + deadline_slack, id);
+}
+
+/// @brief Drop a packet from the tx tree, keeping the in-flight count.
+/// @details Caller holds tx_tree_mutex. Any timers still pending for the id
+/// find it gone and are ignored.
+void VRTS::retireTxPacket(uint32_t id) {
+  auto *chunk = tx_stream_tree.hot(id);
+  if (chunk == nullptr) {
+    return;
+  }
+  if (chunk->was_sent && !chunk->was_acked && unacked > 0) {
+    unacked--;
+  }
+  // Slots aren't destroyed on erase, let go of the block here so its
+  // buffers are released now rather than when the slot is reused.
+  tx_stream_tree.cold(id)->block.reset();
+  tx_stream_tree.erase(id);
+}
 
-    // Scope touches rx_stream_tree state
-    // In this scope we remove entries from the tree and queue entries against
-    // age criteria for removal
-    {
-      std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
-      auto now = chrono_clock::now();
-      for (auto &entry : rx_stream_tree) {
-        auto &chunk = entry.second;
-        auto chunk_age = std::chrono::duration_cast<std::chrono::milliseconds>(
-            now - chunk.received_time_local);
-        if ((chunk_age > removal_age_threshold.load()) &&
-            !chunk.in_consumer_queue) {
-          vrcout() << "[vrts] == OLD " << chunk_age.count()
-                   << " [ms] | erasing id: "
-                   << chunk.ota_packet.header.packet_id << std::endl;
-          chunks_to_be_removed.emplace_back(chunk.ota_packet.header.packet_id);
+void VRTS::pruneUnsent(vrts_clock_time_t now) {
+  for (auto &stream : streams) {
+    for (int c = 0; c < NAL_CLASS_COUNT; c++) {
+      auto &unsent = stream.tx_unsent[c];
+      auto removal_age = class_removal_age[c].load();
+      while (!unsent.empty()) {
+        auto *chunk = tx_stream_tree.hot(unsent.front());
+        if (chunk != nullptr && !chunk->was_sent) {
+          if (now - chunk->queued_time_local <= removal_age) {
+            break;
+          }
+          VRTS_TRACE(WARN, "[vrts] == id : {} dropped unsent, class {}",
+                     unsent.front(), c);
+          metrics.send_pkt_dropped++;
+          retireTxPacket(unsent.front());
         }
+        unsent.pop_front();
+      }
+    }
+  }
+}
+
+bool VRTS::frontUnsent(vrts_stream_t &stream, uint32_t &id) {
+  for (int c = NAL_CLASS_COUNT - 1; c >= 0; c--) {
+    auto &unsent = stream.tx_unsent[c];
+    while (!unsent.empty()) {
+      auto *chunk = tx_stream_tree.hot(unsent.front());
+      if (chunk != nullptr && !chunk->was_sent) {
+        id = unsent.front();
+        return true;
+      }
+      unsent.pop_front();
+    }
+  }
+  return false;
+}
+
+/// @details A stream is credited weight * MaxUDPPayloadSize bytes once per
+/// turn and keeps the turn while that covers its next packet. An idle
+/// stream's deficit is reset so it can't save up for later. The turn
+/// survives the pacer running dry, so a heavy stream can't restart its
+/// round every pass.
+bool VRTS::nextUnsent(uint32_t &id) {
+  // Each stream is visited at most twice: once to use up what it has left,
+  // once more after being credited.
+  for (int turns = 0; turns < 2 * vrts_max_streams + 1; turns++) {
+    auto &stream = streams[tx_drr_stream];
+    if (!frontUnsent(stream, id)) {
+      stream.tx_deficit = 0;
+    } else if (stream.tx_deficit >=
+               static_cast<int64_t>(sizeof(vrts_packetheader_t) +
+                                    tx_stream_tree.cold(id)->header.length)) {
+      return true;
+    } else if (!tx_drr_credited) {
+      stream.tx_deficit +=
+          std::max<uint32_t>(stream.weight, 1) * MaxUDPPayloadSize;
+      tx_drr_credited = true;
+      continue;
+    }
+    tx_drr_stream = (tx_drr_stream + 1) % vrts_max_streams;
+    tx_drr_credited = false;
+  }
+  return false;
+}
+
+/// @details Classes go out of feed order, so parity waits for the last
+/// fragment of its own chain. A chain that was dropped or already
+/// acknowledged doesn't need it any more.
+void VRTS::sendFec(UdpSender &sender) {
+  for (auto &entry : tx_fec_queue) {
+    if (entry.queued) {
+      continue;
+    }
+    auto *last = tx_stream_tree.hot(entry.last_id);
+    if (last != nullptr && !last->was_sent) {
+      continue;
+    }
+    entry.queued = true;
+    if (last == nullptr) {
+      continue;
+    }
+    pacer.consume(udpSend(sender, entry.packet));
+    metrics.fec_sent++;
+  }
+}
+
+bool VRTS::ackTxPacket(uint32_t id, vrts_clock_time_t rx_time) {
+  auto *chunk = tx_stream_tree.hot(id);
+  if (chunk == nullptr) {
+    return false;
+  }
+  if (chunk->was_sent && !chunk->was_acked) {
+    // Measured to the ACK's kernel arrival time, so it doesn't
+    // include however long this thread took to get here.
+    auto chunk_rtt = std::chrono::duration_cast<std::chrono::milliseconds>(
+        rx_time - chunk->sent_time_local);
+    moving_average(metrics.rtt_average, chunk_rtt.count());
+    moving_average(metrics.rtt_acked, chunk_rtt.count());
+    if (chunk_rtt.count() > metrics.rtt_peak)
+      metrics.rtt_peak = chunk_rtt.count();
+    if (chunk->retx_count == 0) {
+      metrics.rtt.record(std::chrono::duration_cast<std::chrono::microseconds>(
+          rx_time - chunk->sent_time_local));
+    }
+    VRTS_TRACE(DEBUG, "[vrts] rtt : {} avg {}", chunk_rtt.count(),
+               metrics.rtt_average.load());
+    congestion.onAck(sizeof(vrts_packetheader_t) +
+                         tx_stream_tree.cold(id)->header.length,
+                     chunk->sent_time_local, rx_time, chunk->retx_count > 0);
+    // The ACK of a resent packet may be for any of its copies.
+    if (chunk->retx_count == 0 &&
+        static_cast<int32_t>(chunk->send_seq - tx_acked_seq) > 0) {
+      tx_acked_seq = chunk->send_seq;
+    }
+  }
+  metrics.ack_total++;
+  // The last fragment of a NAL to leave the tree completes it.
+  const auto &header = tx_stream_tree.cold(id)->header;
+  uint32_t first = id - header.parent_id_offset;
+  bool nal_complete = true;
+  for (uint8_t i = 0; i < header.fragments; i++) {
+    if (first + i != id && tx_stream_tree.hot(first + i) != nullptr) {
+      nal_complete = false;
+      break;
+    }
+  }
+  if (nal_complete) {
+    metrics.nal_latency.record(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            rx_time - chunk->queued_time_local));
+  }
+  // If the chunk has been sent and acked, we don't need it any longer.
+  retireTxPacket(id);
+  return true;
+}
+
+void VRTS::nackTxPacket(uint32_t id, vrts_clock_time_t rx_time) {
+  auto *chunk = tx_stream_tree.hot(id);
+  if (chunk == nullptr) {
+    VRTS_TRACE(WARN, "[vrts] nacked packet id: {} NOT in tree", id);
+    return;
+  }
+  if (!chunk->was_sent) {
+    // Streams and classes go out of id order, so the peer sees holes for
+    // packets that are simply still queued.
+    return;
+  }
+  if (chunk->sent_behind && chunk->retx_count == 0 &&
+      static_cast<int32_t>(tx_acked_seq - chunk->send_seq) <= 0) {
+    // Nor is a packet that went out after a higher id lost, even on a path
+    // that keeps order, until something sent after it got through. The
+    // peer keeps asking while it is missing.
+    return;
+  }
+  if (chunk->was_acked) {
+    VRTS_TRACE(WARN, "[vrts] == WARNING: Got NACK for a packet marked ACKed.");
+  }
+  VRTS_TRACE(DEBUG, "[vrts] == Got NACK for a packet: {}", id);
+  if (!chunk->was_nacked) {
+    metrics.nack_total++;
+    congestion.onLoss();
+
+    auto chunk_rtt = std::chrono::duration_cast<std::chrono::milliseconds>(
+        rx_time - chunk->sent_time_local);
+
+    moving_average(metrics.rtt_average, chunk_rtt.count());
+    moving_average(metrics.rtt_nacked, chunk_rtt.count());
+    if (chunk_rtt.count() > metrics.rtt_peak)
+      metrics.rtt_peak = chunk_rtt.count();
+  }
+
+  bool first_nack = !chunk->was_nacked;
+  chunk->was_nacked = true;
+  chunk->nacked_time_local = rx_time;
+  // Pull the next check in to the NACK hold-off. Later resends
+  // reschedule themselves.
+  if (first_nack && chunk->was_sent) {
+    scheduleTxTimer(id, *chunk);
+  }
+}
+
+/// @details Everything before the SACK base is done with on the far side.
+/// The holes the receiver lists as given up on are retired without counting
+/// them as delivered, the rest of it and the received runs are ACKs (all of
+/// it, from a peer that doesn't list them). Missing runs are left to the
+/// receiver's NACKs, which know when a hole is worth asking for (e.g. not
+/// while FEC parity is still on its way). Every SACK repeats the whole
+/// window, so ids that are already gone are skipped without counting them
+/// again.
+void VRTS::applySack(const vrts_sack_t &sack, vrts_clock_time_t rx_time) {
+  for (auto &range : sack.given_up) {
+    if (!tx_stream_tree.before(range.first, sack.base)) {
+      continue;
+    }
+    uint32_t last = range.first + range.second;
+    if (tx_stream_tree.before(sack.base, last)) {
+      last = sack.base;
+    }
+    forEachTxInRange(range.first, last,
+                     [&](uint32_t id) { retireTxPacket(id); });
+  }
+  while (!tx_stream_tree.empty() &&
+         tx_stream_tree.before(tx_stream_tree.front(), sack.base)) {
+    ackTxPacket(tx_stream_tree.front(), rx_time);
+  }
+
+  uint32_t id = sack.base;
+  for (auto &run : sack.runs) {
+    uint32_t received_start = id + run.first;
+    uint32_t received_end = received_start + run.second;
+    forEachTxInRange(received_start, received_end,
+                     [&](uint32_t acked) { ackTxPacket(acked, rx_time); });
+    id = received_end;
+  }
+}
+
+/// @brief Sends one ACK covering everything received since the last one.
+/// @details Peers that understand SACKs get the whole receive window, and
+/// the same SACK is repeated a few ack periods after the last change so a
+/// lost ACK gets repaired without the upstream resending data. Older peers
+/// get the plain id list, each id once.
+void VRTS::ackService(UdpSender &sender) {
+  // ACK scope:
+  // Here we handle sending out acks based on the data we've received.
+  {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    vrts_packet_t ack = {};
+    bool use_sack = peer_version >= VRTS_VERSION_SACK;
+    // Kept to what the path carries, like the data.
+    size_t ack_bytes_max = std::min<size_t>(mtu, sizeof(ack.data));
+
+    // Only packets received since the last ACK need to be looked at.
+    // A SACK covers all of them, the id list only as many as fit.
+    const size_t max_ack_ids =
+        use_sack ? rx_unacked_ids.size() : ack_bytes_max / sizeof(uint32_t);
+    size_t ack_count = 0;
+    size_t consumed = 0;
+    std::vector<uint32_t> acked_and_flushed;
+    for (; consumed < rx_unacked_ids.size(); consumed++) {
+      uint32_t id = rx_unacked_ids[consumed];
+      auto *chunk = rx_stream_tree.hot(id);
+      // Gone (aged out / flushed) or already covered by an earlier ACK.
+      if (chunk == nullptr || chunk->ack_sent) {
+        continue;
+      }
+      // Put the chunk's packet ID into the ack packet's payload.
+      if (ack_count >= max_ack_ids) {
+        VRTS_TRACE(WARN, "[vrts] hit ack payload size limit - acks backing up");
+        break;
+      }
+      chunk->ack_sent = true;
+      if (!use_sack) {
+        uint32_t *indexes = reinterpret_cast<uint32_t *>(&(ack.data[0]));
+        indexes[ack_count] = id;
+      }
+      auto ack_delay =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              clockNow() - chunk->received_time_local);
+      metrics.ack_delay.record(ack_delay);
+      VRTS_TRACE(DEBUG, "[vrts] packet {} ack delay: {} [ms]", id,
+                 ack_delay.count() / 1000);
+      ack_count++;
+      // Already handed to the consumer, nothing left to wait for.
+      if (chunk->in_consumer_queue) {
+        acked_and_flushed.emplace_back(id);
+      }
+    }
+    // Whatever didn't fit goes into the next ACK.
+    rx_unacked_ids.erase(rx_unacked_ids.begin(),
+                         rx_unacked_ids.begin() + consumed);
+    acks_pending = !rx_unacked_ids.empty();
+    for (auto id : acked_and_flushed) {
+      VRTS_TRACE(DEBUG, "[vrts] output: erasing id: {}", id);
+      rx_stream_tree.erase(id);
+    }
+
+    if (use_sack) {
+      if (rx_sack_dirty) {
+        rx_sack_dirty = false;
+        sack_repeats = sack_redundancy;
+      } else if (sack_repeats > 0) {
+        sack_repeats--;
+      } else {
+        return;
+      }
+      acks_pending = acks_pending || sack_repeats > 0;
+      // Holes the upstream has given up on by now aren't worth reporting.
+      rx_sack.expire(clockNow() - removal_age_threshold.load());
+      ack.header.length = rx_sack.encode(ack.data, ack_bytes_max);
+      ack.header.packet_type = vrts_packet_type_t::VRTS_SACKS;
+    } else if (ack_count) {
+      ack.header.length = ack_count * sizeof(uint32_t);
+      ack.header.packet_type = vrts_packet_type_t::VRTS_ACKS;
+    } else {
+      return;
+    }
+
+    // ACKs and NACK packets are special in the sense that we
+    // don't try to resend them. As such we just say upfront that
+    // they need no further acking/retransmission.
+    // Set flags
+    setGOPRequest(ack.header);
+
+    ack.header.fragments = 0;
+    ack.header.packet_id = 0;
+    ack.header.parent_id_offset = 0;
+    ack.header.version = protocol_version;
+
+    // Don't put the ack packet into the tx tree.
+    uint16_t ack_bytes = udpSend(sender, ack);
+    udpFlush(sender);
+    metrics.ack_byte_total += ack_bytes;
+    VRTS_TRACE(DEBUG, "[vrts] sending ack chunk of size: {}",
+               ack.header.length);
+  }
+}
+
+void VRTS::sendClockProbe(UdpSender &sender, bool reply) {
+  vrts_packet_t packet = {};
+  vrts_clock_probe_t probe = {};
+  if (reply) {
+    probe = clock_reply;
+  } else {
+    probe.origin_us = toMicroseconds(clockNow());
+  }
+  probe.transmit_us = toMicroseconds(clockNow());
+  memcpy(packet.data, &probe, sizeof(probe));
+  packet.header.packet_type = vrts_packet_type_t::VRTS_CLOCK;
+  packet.header.fragments = reply ? 1 : 0;
+  packet.header.version = protocol_version;
+  packet.header.length = sizeof(probe);
+  udpSend(sender, packet);
+  udpFlush(sender);
+}
+
+/// @details One probe is out at a time. Whatever the search settles on is
+/// what feedDataH265() cuts the next blocks to, fragments already in the tx
+/// tree keep their size.
+vrts_clock_time_t VRTS::pmtuService(UdpSender &sender, vrts_clock_time_t now) {
+  uint16_t limit = mtu_limit + sizeof(vrts_packetheader_t);
+  if (limit != pmtu.limit()) {
+    pmtu.restart(limit);
+    pmtu_probe_bytes = 0;
+    next_pmtu_search = now + pmtu_search_interval;
+  }
+  // Data too large for this host means the path got smaller here.
+  uint64_t oversize = sender.send_oversize;
+  if (oversize != pmtu_oversize_seen) {
+    pmtu_oversize_seen = oversize;
+    if (!pmtu.searching()) {
+      VRTS_TRACE(WARN, "[vrts] datagrams too large to send, searching pmtu");
+      next_pmtu_search = now;
+    }
+  }
+  auto timeout = std::max<vrts_clock_time_t::duration>(
+      pmtu_probe_timeout,
+      std::chrono::duration_cast<vrts_clock_time_t::duration>(
+          std::chrono::duration<float, std::milli>(
+              pmtu_probe_timeout_rtts * metrics.rtt_average.load())));
+  if (pmtu_probe_bytes && now >= pmtu_probe_sent + timeout) {
+    VRTS_TRACE(DEBUG, "[vrts] pmtu probe of {} bytes lost", pmtu_probe_bytes);
+    pmtu.lost(pmtu_probe_bytes);
+    pmtu_probe_bytes = 0;
+  }
+  if (!pmtu.searching() && now >= next_pmtu_search) {
+    pmtu.restart(limit);
+    next_pmtu_search = now + pmtu_search_interval;
+  }
+  if (pmtu.searching() && pmtu_probe_bytes == 0) {
+    pmtu_probe_id++;
+    pmtu_probe_bytes = pmtu.candidate();
+    pmtu_probe_sent = now;
+    sendPmtuProbe(sender, false);
+    if (sender.send_oversize != pmtu_oversize_seen) {
+      pmtu_oversize_seen = sender.send_oversize;
+      pmtu.tooBig(pmtu_probe_bytes);
+      pmtu_probe_bytes = 0;
+    }
+  }
+
+  uint16_t payload = pmtu.current() - sizeof(vrts_packetheader_t);
+  if (payload != mtu) {
+    VRTS_TRACE(INFO, "[vrts] fragments of {} bytes, path mtu {}", payload,
+               pmtu.current());
+    mtu = payload;
+  }
+  metrics.path_mtu_bytes = pmtu.confirmed();
+  if (pmtu_probe_bytes) {
+    return pmtu_probe_sent + timeout;
+  }
+  return pmtu.searching() ? now : next_pmtu_search;
+}
+
+void VRTS::sendPmtuProbe(UdpSender &sender, bool reply) {
+  static const uint8_t padding[MaxUDPPayloadSize] = {};
+  vrts_packet_t packet = {};
+  packet.header.packet_type = vrts_packet_type_t::VRTS_PMTU;
+  packet.header.version = protocol_version;
+  if (reply) {
+    vrts_pmtu_reply_t answer = {pmtu_reply.length};
+    memcpy(packet.data, &answer, sizeof(answer));
+    packet.header.packet_id = pmtu_reply.packet_id;
+    packet.header.fragments = 1;
+    packet.header.length = sizeof(answer);
+    udpSend(sender, packet);
+  } else {
+    // Padded so the whole datagram is the size probed for, which with a
+    // compact header is more than a packet holds. The header is gathered
+    // again once its length is known; that doesn't change its size.
+    packet.header.packet_id = pmtu_probe_id;
+    tx_gather.clear();
+    gatherHeader(packet.header);
+    packet.header.length = pmtu_probe_bytes - tx_gather[0].iov_len;
+    tx_gather.clear();
+    gatherHeader(packet.header);
+    tx_gather.push_back({const_cast<uint8_t *>(padding), packet.header.length});
+    queueGathered(sender);
+  }
+  udpFlush(sender);
+}
+
+void VRTS::sendHello(UdpSender &sender, bool reply) {
+  vrts_packet_t packet = {};
+  vrts_hello_t hello = {session_epoch, peer_epoch};
+  memcpy(packet.data, &hello, sizeof(hello));
+  packet.header.packet_type = vrts_packet_type_t::VRTS_HELLO;
+  packet.header.fragments = reply ? 1 : 0;
+  packet.header.version = protocol_version;
+  packet.header.length = sizeof(hello);
+  udpSend(sender, packet);
+  udpFlush(sender);
+}
+
+/// @details A peer we knew nothing about yet is simply taken in, data of
+/// it may have told us its tag before its hello came. Hellos are answered
+/// whatever they say, so a peer keeps asking until an answer got through;
+/// answers aren't.
+void VRTS::handleHello(const vrts_hello_t &hello, bool reply) {
+  bool known = peer_epoch != 0 || peer_epoch_tag != 0;
+  bool same = peer_epoch != 0 ? hello.epoch == peer_epoch
+                              : epochTag(hello.epoch) == peer_epoch_tag;
+  if (known && !same) {
+    VRTS_TRACE(INFO, "[vrts] peer restarted, epoch {} -> {}",
+               peer_epoch, hello.epoch);
+    resetPeerState();
+  }
+  peer_epoch = hello.epoch;
+  peer_epoch_tag = epochTag(hello.epoch);
+  if (hello.peer_epoch == session_epoch) {
+    epoch_confirmed = true;
+  }
+  if (!reply) {
+    hello_reply_pending = true;
+  }
+}
+
+/// @details Like a new session with the peer: both trees, the SACK state
+/// and whatever was reassembled up to are dropped, the receiver waits for
+/// a GOP to start over from and every stream is asked for one. What is
+/// already in the output queues stays there. Reactor thread only.
+void VRTS::resetPeerState(void) {
+  metrics.peer_restarts++;
+  flushTXTree();
+  flushRXTree();
+  {
+    std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
+    rx_sack.reset();
+    rx_sack_dirty = false;
+    rx_cancel_ids.clear();
+    for (auto &stream : streams) {
+      stream.rx_id_discard_valid = false;
+      stream.rx_dropped_chains.clear();
+      stream.output_state.running_poc = 0;
+      stream.output_state.last_slice_state = 0xFFFFFFFF;
+      stream.output_state.last_poc_count = 0;
+      stream.output_state.was_last_slice_first = false;
+      stream.output_state.pending_contains_pps = false;
+      stream.output_state.skipped_pictures = 0;
+      stream.output_state.ref_pictures.clear();
+      // Its stamps start over as well.
+      stream.playout_queue.clear();
+      stream.playout_jitter.reset();
+    }
+  }
+  acks_pending = false;
+  sack_repeats = 0;
+  gop_request_mask = (1 << vrts_max_streams) - 1;
+  rx_streams_seen = 1;
+  last_gop_request_mask = 0;
+  for (auto &stream : streams) {
+    stream.new_gop_needed = true;
+  }
+  // Its clock may have moved on too.
+  clock_sync.reset();
+  next_clock_probe = clockNow();
+}
+
+size_t VRTS::udpRecv(UdpReceiver &receiver, bool wait) {
+  uint64_t bytes_before = receiver.recv_bytes;
+  uint64_t syscalls_before = receiver.recv_syscalls;
+  uint64_t truncated_before = receiver.recv_truncated;
+  size_t received = receiver.receive(wait);
+  metrics.recv_syscalls += receiver.recv_syscalls - syscalls_before;
+  if (receiver.recv_truncated != truncated_before) {
+    VRTS_TRACE(WARN, "[vrts] dropped {} truncated datagrams",
+               receiver.recv_truncated - truncated_before);
+    metrics.recv_truncated += receiver.recv_truncated - truncated_before;
+  }
+  if (received > 0 && capture.isOpen()) {
+    for (auto &datagram : receiver.datagrams()) {
+      struct iovec iov = {const_cast<uint8_t *>(datagram.data), datagram.len};
+      capture.datagram(CAPTURE_RX, &iov, 1, datagram.rx_time);
+    }
+  }
+  if (received > 0) {
+    uint32_t bytes = static_cast<uint32_t>(receiver.recv_bytes - bytes_before);
+    VRTS_TRACE(DEBUG, "[vrts] received: {} / {}", received, bytes);
+    metrics.recv_pkt_total += received;
+    metrics.recv_byte_total += bytes;
+  } else if (!receiver.isOpen()) {
+    VRTS_TRACE(ERROR, "[vrts] recvmmsg failed udpRecv: {}", errno);
+  }
+  return received;
+}
+
+/// @details The header goes into tx_headers, tagged with our epoch, where
+/// it stays until the next udpFlush(). A legacy header is copied as is.
+/// Fragments are sized for a legacy header, so a compact one that would be
+/// longer leaves its timestamp out.
+void VRTS::gatherHeader(const vrts_packetheader_t &header,
+                        const vrts_header_ext_t *ext) {
+  tx_headers.emplace_back();
+  auto &encoded = tx_headers.back();
+  vrts_packetheader_t tagged = header;
+  tagged.epoch_tag = epochTag(session_epoch);
+  if (peer_version < VRTS_VERSION_COMPACT) {
+    // Older peers never look at the tag.
+    memcpy(encoded.data(), &tagged, sizeof(tagged));
+    tx_gather.push_back({encoded.data(), sizeof(tagged)});
+    return;
+  }
+  if (peer_version < VRTS_VERSION_EPOCH) {
+    // Nor would they know the extension.
+    tagged.epoch_tag = 0;
+  }
+  size_t header_bytes = encodeCompactHeader(tagged, ext, encoded.data());
+  if (header_bytes > sizeof(vrts_packetheader_t)) {
+    header_bytes = encodeCompactHeader(tagged, nullptr, encoded.data());
+  }
+  tx_gather.push_back({encoded.data(), header_bytes});
+}
+
+uint16_t VRTS::queueGathered(UdpSender &sender) {
+  if (capture.isOpen()) {
+    capture.datagram(CAPTURE_TX, tx_gather.data(), tx_gather.size(),
+                     clockNow());
+  }
+  sender.queue(tx_gather.data(), tx_gather.size());
+  size_t bytes = 0;
+  for (auto &iov : tx_gather) {
+    bytes += iov.iov_len;
+  }
+  return static_cast<uint16_t>(bytes);
+}
+
+uint16_t VRTS::udpSend(UdpSender &sender, vrts_packet_t &packet) {
+  tx_gather.clear();
+  gatherHeader(packet.header);
+  tx_gather.push_back({packet.data, packet.header.length});
+  return queueGathered(sender);
+}
+
+/// @details Caller holds tx_tree_mutex until the sender was flushed, the
+/// datagram points into the slab and the block.
+uint16_t VRTS::udpSendTx(UdpSender &sender, const vrts_tx_packet_t &packet,
+                         const vrts_local_txdata_t &chunk) {
+  tx_gather.clear();
+  // Feed time, for the receiver's jitter buffer. Resends carry the same.
+  vrts_header_ext_t ext = {};
+  if (packet.header.parent_id_offset == 0) {
+    ext.has_timestamp = true;
+    ext.timestamp_us =
+        static_cast<uint32_t>(toMicroseconds(chunk.queued_time_local));
+  }
+  gatherHeader(packet.header, &ext);
+  size_t offset = packet.offset;
+  size_t len = packet.header.length;
+  for (auto &segment : packet.block->segments) {
+    if (len == 0) {
+      break;
+    }
+    if (offset >= segment.iov_len) {
+      offset -= segment.iov_len;
+      continue;
+    }
+    size_t part = std::min(segment.iov_len - offset, len);
+    tx_gather.push_back(
+        {static_cast<uint8_t *>(segment.iov_base) + offset, part});
+    len -= part;
+    offset = 0;
+  }
+  return queueGathered(sender);
+}
+
+void VRTS::udpFlush(UdpSender &sender) {
+  size_t queued = sender.pending();
+  if (queued == 0) {
+    return;
+  }
+  uint64_t bytes_before = sender.sent_bytes;
+  uint64_t syscalls_before = sender.send_syscalls;
+  int sent = sender.flush();
+  tx_headers.clear();
+  if (sent < static_cast<int>(queued)) {
+    VRTS_TRACE(ERROR, "[vrts] send failed");
+  }
+  uint32_t bytes = static_cast<uint32_t>(sender.sent_bytes - bytes_before);
+  metrics.send_pkt_total += sent;
+  metrics.send_byte_total += bytes;
+  metrics.send_syscalls += sender.send_syscalls - syscalls_before;
+}
+
+void VRTS::flushUpToNalType(uint8_t stream_id,
+                             h265nal::NalUnitType nal_type) {
+  std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+  auto &stream = streams[stream_id];
+  bool irap = nalClassOf(nal_type) == NAL_CLASS_IRAP;
+  for (auto frame = stream.tx_frames.rbegin();
+       frame != stream.tx_frames.rend(); ++frame) {
+    if (frame->picture_type == vrts_nal_type_unknown) {
+      continue;
+    }
+    auto type = static_cast<h265nal::NalUnitType>(frame->picture_type);
+    if (type == nal_type || (irap && nalClassOf(type) == NAL_CLASS_IRAP)) {
+      dropTxFramesBefore(stream, frame->first_id);
+      return;
+    }
+  }
+}
+
+void VRTS::dropTxFramesBefore(vrts_stream_t &stream, uint32_t first_id) {
+  size_t dropped = 0;
+  while (!stream.tx_frames.empty() &&
+         tx_stream_tree.before(stream.tx_frames.front().first_id, first_id)) {
+    auto &frame = stream.tx_frames.front();
+    size_t dropped_before = dropped;
+    // Timers, parity and unsent entries left for these ids find them gone.
+    for (uint8_t i = 0; i < frame.fragments; i++) {
+      if (tx_stream_tree.contains(frame.first_id + i)) {
+        retireTxPacket(frame.first_id + i);
+        dropped++;
+      }
+    }
+    if (dropped > dropped_before) {
+      metrics.obsolete_frames++;
+    }
+    stream.tx_frames.pop_front();
+  }
+  if (dropped) {
+    VRTS_TRACE(INFO, "[vrts] dropped {} packets from before id {}", dropped,
+               first_id);
+  }
+  if (tx_stream_tree.empty()) {
+    pacer_blocked_since = {};
+  }
+}
+
+void VRTS::queueOutput(uint8_t stream_id, vrts_output_block_t &&block) {
+  auto &output = streams[stream_id];
+  block.queued = clockNow();
+  uint8_t stream_bit = 1 << stream_id;
+  while (!output.output_queue.push(std::move(block))) {
+    if (output_overflow_policy == OUTPUT_OVERFLOW_NEW_GOP) {
+      VRTS_TRACE(WARN,
+                 "[vrts] output queue of stream {} full, requesting new GOP",
+                 stream_id);
+      gop_request_mask |= stream_bit;
+      metrics.output_queue_drops++;
+      return;
+    }
+    // A GOP start is only given up for a newer one, and a reference for a
+    // new block that is one too. If the consumer emptied the queue meanwhile
+    // there is nothing to drop and the push goes through.
+    bool keep_oldest = false;
+    vrts_output_block_t dropped;
+    if (output.output_queue.popIf(
+            dropped, [&](const vrts_output_block_t &oldest) {
+              keep_oldest =
+                  !block.gop_start &&
+                  (oldest.gop_start ||
+                   (oldest.nal_class > NAL_CLASS_NON_REFERENCE &&
+                    block.nal_class == NAL_CLASS_NON_REFERENCE));
+              return !keep_oldest;
+            })) {
+      VRTS_TRACE(WARN,
+                 "[vrts] output queue of stream {} full, dropped oldest block",
+                 stream_id);
+      metrics.output_queue_drops++;
+      // A new GOP start is as good as the one asked for.
+      if (dropped.nal_class > NAL_CLASS_NON_REFERENCE && !block.gop_start) {
+        dropOutputReference(stream_id);
       }
-
-      // Remove chunks that have been slated for removal from our receive
-      // tree.
-      for (auto id : chunks_to_be_removed) {
-        try {
-          auto& chunk = rx_stream_tree[id];
-          if (!chunk.ack_sent) {
-            vrcout() << "[vrts] removing unacked packet " << chunk.ota_packet.header.packet_id << std::endl;
-          }
-          rx_stream_tree.erase(id);
-        } catch (...) {
-          vrcout()
-              << "[vrts] caught exception releasing items in the rx_stream_tree"
-              << std::endl;
-        }
+    } else if (keep_oldest) {
+      VRTS_TRACE(WARN,
+                 "[vrts] output queue of stream {} full, dropped new block",
+                 stream_id);
+      metrics.output_queue_drops++;
+      if (block.nal_class > NAL_CLASS_NON_REFERENCE) {
+        dropOutputReference(stream_id);
       }
+      return;
     }
-
-    // In the rxHandler thread we should have decision thresholds for
-    // allowing data to go to the output queue. E.g. are we skipping the next
-    // P-frame chunk to catch up on missed packets?
-    // Delay should be a setting.
-    std::this_thread::sleep_for(std::chrono::microseconds(250));
   }
+  std::lock_guard<std::mutex> callback_lock{data_ready_mutex};
+  if (data_ready_callback) {
+    data_ready_callback(stream_id);
+  }
+}
 
-  vrcout() << "[vrts] rxHandler exiting" << std::endl;
+void VRTS::dropOutputReference(uint8_t stream_id) {
+  VRTS_TRACE(WARN,
+             "[vrts] stream {} lost a reference to its output queue, "
+             "requesting new GOP",
+             stream_id);
+  gop_request_mask |= 1 << stream_id;
+  metrics.output_reference_drops++;
 }
 
-void VRTS::txHandler(std::string upstream_ip, uint16_t upstream_port,
-                     std::string downstream_ip, uint16_t downstream_port) {
-  auto last_ack_check = chrono_clock::now();
-  // TODO: Limit how many items can be outstanding
-  while (keep_running) {
-    // Every time we service / access the tree, we should take a look at the
-    // conditons that might require a chunk to be removed from memory.
-    // Conditions:
-    // - Packet is too old (based on wall time threshold)
-    // - Packet is from a GOP that we wont be decoding
-    // - Packet has been acked successfully
-    // - TBD
-    std::vector<uint32_t> chunks_to_be_removed;
-    if (service_tx_tree) {
-      std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-      unacked = 0;
-      int nacked = 0;
+void VRTS::schedulePlayout(uint8_t stream_id, vrts_output_block_t &&block,
+                           nal_class_t block_class,
+                           const vrts_local_rxdata_t &first) {
+  if (!jitter_buffer_enabled) {
+    queueOutput(stream_id, std::move(block));
+    return;
+  }
+  auto &stream = streams[stream_id];
+  auto &jitter = stream.playout_jitter;
+  jitter.setLimits(std::chrono::microseconds(0),
+                   jitter_buffer_max_delay.load());
+  // Blocks without a stamp, and all of them until there are enough
+  // samples, are due right away, but still behind those already held.
+  auto now = block.reassembled;
+  auto deadline = now;
+  if (first.stamped) {
+    if (jitter.valid()) {
+      deadline = jitter.deadline(first.sent_us);
+    }
+    jitter.sample(first.sent_us, now);
+  }
+  if (deadline < now) {
+    // Pictures after it may refer to it, so only one nothing refers to is
+    // given up.
+    if (block_class == NAL_CLASS_NON_REFERENCE && !block.gop_start) {
+      VRTS_TRACE(DEBUG, "[vrts] stream {} block late by {} [us], dropped",
+                 stream_id,
+                 std::chrono::duration_cast<std::chrono::microseconds>(
+                     now - deadline)
+                     .count());
+      metrics.playout_skipped++;
+      return;
+    }
+    metrics.playout_late++;
+    deadline = now;
+  }
+  if (!stream.playout_queue.empty()) {
+    deadline = std::max(deadline, stream.playout_queue.back().deadline);
+  }
+  stream.playout_queue.push_back({std::move(block), deadline});
+}
 
-      // Handle NACK'd packets first.
-      for (auto &entry : tx_stream_tree) {
-        auto &chunk = entry.second;
-        auto now = chrono_clock::now();
-        auto last_send_period =
-            std::chrono::duration_cast<std::chrono::milliseconds>(
-                now - chunk.sent_time_local);
-        // TODO: Make nack transmission rate limit a param / constexpr.
-        if (chunk.was_nacked == true &&
-            last_send_period > std::chrono::milliseconds(10) &&
-            chunk.retx_count < retransmit_count_limit) {
-          chunk.sent_time_local = now;
-          chunk.retx_count++;
-          udpSend(reinterpret_cast<uint8_t *>(&(chunk.ota_packet)),
-                  sizeof(vrts_packetheader_t) + chunk.ota_packet.header.length,
-                  downstream_ip, downstream_port);
-          vrcout() << "[vrts] sent nacked packet id: "
-                   << chunk.ota_packet.header.packet_id << std::endl;
-
-          statistics.retx_total++;
-          statistics.retx_since++;
-        }
+vrts_clock_time_t VRTS::playoutService(vrts_clock_time_t now) {
+  auto next_deadline = vrts_clock_time_t::max();
+  for (uint8_t stream_id = 0; stream_id < vrts_max_streams; stream_id++) {
+    auto &queue = streams[stream_id].playout_queue;
+    while (!queue.empty() && queue.front().deadline <= now) {
+      auto &entry = queue.front();
+      metrics.playout_delay.record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              now - entry.block.reassembled));
+      queueOutput(stream_id, std::move(entry.block));
+      queue.pop_front();
+    }
+    if (!queue.empty()) {
+      next_deadline = std::min(next_deadline, queue.front().deadline);
+    }
+  }
+  return next_deadline;
+}
 
-        if (chunk.was_nacked) {
-          nacked++;
-         }
+void VRTS::flushChain(uint32_t first_id, std::vector<uint32_t> &removed) {
+  auto &chunk = *rx_stream_tree.hot(first_id);
+  // Only packets of known streams make it into the tree.
+  uint8_t stream_id = rx_stream_tree.cold(first_id)->header.stream_id;
+  auto &output = streams[stream_id];
+  std::vector<uint8_t> nal;
+  vrts_clock_time_t first_received = chunk.received_time_local;
+  for (int i = 0; i < chunk.fragments; i++) {
+    auto &link = *rx_stream_tree.hot(first_id + i);
+    auto &link_packet = *rx_stream_tree.cold(first_id + i);
+    nal.insert(nal.end(), link_packet.data,
+               link_packet.data + link_packet.header.length);
+    link.in_consumer_queue = true;
+    first_received = std::min(first_received, link.received_time_local);
+    // Defer tree removal until packet acked AND in consumer queue
+    if (link.ack_sent) {
+      removed.emplace_back(first_id + i);
+    }
 
-        // While we're iterating, keep track of how many items have been
-        // unacked.
-        if (!chunk.was_acked && chunk.was_sent) {
-          unacked++;
-          statistics.pending_acks = unacked;
-          moving_average(statistics.tx_in_transit, unacked.load());
-        }
-      }
+    // Update our up-front filter for dropping ids that come in that are too
+    // old. Per stream, since streams are interleaved on the link and a late
+    // chain of one doesn't hurt the other.
+    output.rx_id_discard_threshold = first_id + i;
+    output.rx_id_discard_valid = true;
+  }
 
-      if (nacked > 0) {
-        vrcout() << "[vrts] nacked in tree: " << nacked << std::endl;
-      }
+  metrics.reassembly.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          clockNow() - first_received));
+
+  bool gop_start = false;
+  nal_class_t block_class;
+  if (trackOutputStream(stream_id, nal.data(), nal.size(), gop_start,
+                        block_class)) {
+    // parse output stream, check for errors.
+    vrts_output_block_t block{};
+    block.data = std::move(nal);
+    block.gop_start = gop_start;
+    block.nal_class = block_class;
+    block.reassembled = clockNow();
+    readTimestamp(block);
+    schedulePlayout(stream_id, std::move(block), block_class, chunk);
+  }
+}
 
-      // If we have too many packets in transit, don't transmit more data.
-      // TODO: If the backlog of data grows long enough that a new GOP has
-      // entered the TX tree, clear all the data up to that point? Perhaps that
-      // should happen before the data enters the tree at all?
-      // TODO: If the unack count is starting to grow, trim the data that's
-      // supposed to be sent before it's sent, e.g. drop a temporal layer.
-      if (unacked < max_unacked_items_allowed) {
-        for (auto &entry : tx_stream_tree) {
-          auto &chunk = entry.second;
-          if (chunk.was_sent == false) {
-            udpSend(reinterpret_cast<uint8_t *>(&(chunk.ota_packet)),
-                    sizeof(vrts_packetheader_t) +
-                        chunk.ota_packet.header.length,
-                    downstream_ip, downstream_port);
-            chunk.was_sent = true;
-            chunk.sent_time_local = chrono_clock::now();
-            vrcout() << "[vrts] sending chunk of size: "
-                     << chunk.ota_packet.header.length << std::endl;
-            total_sent++;
-          } else if (chunk.was_acked == false) {
-            //   TODO: This timing theshold needs to be a setting.
-            //   Since we have 1-way ACK currently do we want to limit
-            //   how many retransmits we allow per packet?
-            auto unack_period =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    chrono_clock::now() - chunk.sent_time_local);
-            if (unack_period > removal_age_threshold.load()) {
-              // Queue to remove because too old.
-              vrcout() << "[vrts] == id : " << chunk.ota_packet.header.packet_id
-                       << " queued for removal due to age" << std::endl;
-              chunks_to_be_removed.emplace_back(
-                  chunk.ota_packet.header.packet_id);
-              if (statistics.ack_total > 0) {
-                statistics.send_pkt_loss++;
-              }
-              else {
-                // no losses until after first ack, backout send
-                --statistics.send_pkt_total;
-                --statistics.send_pkt_since;
-                statistics.send_byte_total -= chunk.ota_packet.header.length;
-                statistics.send_byte_since -= chunk.ota_packet.header.length;
-                vrcout() << "[vrts] NO CONNECTION:  send total " << statistics.send_pkt_total << " " << statistics.send_byte_total << std::endl;
-              }
-            } else if (unack_period > retransmit_time_threshold.load()) {
-              udpSend(reinterpret_cast<uint8_t *>(&(chunk.ota_packet)),
-                      sizeof(vrts_packetheader_t) +
-                          chunk.ota_packet.header.length,
-                      downstream_ip, downstream_port);
-              chunk.sent_time_local = chrono_clock::now();
-              vrcout() << "[vrts] re-tx unack period: " << unack_period.count()
-                       << " [ms], chunk of size : "
-                       << chunk.ota_packet.header.length << std::endl;
-              chunk.retx_count++;
-              statistics.retx_total++;
-              statistics.retx_since++;
-              if (chunk.retx_count > retransmit_count_limit) {
-                vrcout() << "[vrts] == id : "
-                         << chunk.ota_packet.header.packet_id
-                         << " queued for removal due to retx limit"
-                         << std::endl;
-                chunks_to_be_removed.emplace_back(
-                    chunk.ota_packet.header.packet_id);
-              }
-            }
-          } else if (chunk.was_acked && chunk.was_sent) {
-            auto chunk_rtt =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    chrono_clock::now() - chunk.sent_time_local);
-            moving_average(statistics.rtt_average, chunk_rtt.count());
-            moving_average(statistics.rtt_acked, chunk_rtt.count());
-            if (chunk_rtt.count() > statistics.rtt_peak)
-              statistics.rtt_peak = chunk_rtt.count();
-            vrcout() << "[vrts] rtt : " << chunk_rtt.count() << " avg "
-                                        << statistics.rtt_average << std::endl;
-
-            // If the chunk has been sent and acked, we don't need it any
-            // longer.
-            vrcout() << "[vrts] == id : " << chunk.ota_packet.header.packet_id
-                     << " acked/sent will remove" << std::endl;
-            chunks_to_be_removed.emplace_back(
-                chunk.ota_packet.header.packet_id);
-          }
-        }
-      } else {
-        statistics.send_pkt_dropped++;
-      }
+bool VRTS::waitForGap(uint32_t first_id, uint32_t gap_id,
+                      vrts_clock_time_t now, vrts_clock_time_t &due) {
+  auto &first = *rx_stream_tree.hot(first_id);
+  auto &stream = streams[rx_stream_tree.cold(first_id)->header.stream_id];
+  // Already too late for this stream.
+  if (stream.rx_id_discard_valid &&
+      !rx_stream_tree.before(stream.rx_id_discard_threshold, gap_id)) {
+    return false;
+  }
+  // Without a deadline, until the hole is given up on; the NACKs for it
+  // bring us back here.
+  if (!jitter_buffer_enabled || !first.stamped ||
+      !stream.playout_jitter.sampled()) {
+    return true;
+  }
+  auto limit = stream.playout_jitter.limit(first.sent_us);
+  if (now >= limit) {
+    return false;
+  }
+  due = std::min(due, limit);
+  return true;
+}
 
-      if (unacked) {
-        vrcout() << "[vrts] unacked in tree: " << unacked.load() << std::endl;
-        vrcout() << "[vrts] total_sent: " << total_sent.load() << std::endl;
-      }
+bool VRTS::sniffChain(const vrts_packet_t &first, nal_class_t &chain_class) {
+  bool picture = false;
+  chain_class = NAL_CLASS_NON_REFERENCE;
+  const uint8_t *data = first.data;
+  size_t len = first.header.length;
+  for (size_t i = 0; i + 3 < len; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+    auto nal_type =
+        static_cast<h265nal::NalUnitType>((data[i + 3] >> 1) & 0x3f);
+    chain_class = std::max(chain_class, nalClassOf(nal_type));
+    picture = picture || nal_type < h265nal::NalUnitType::VPS_NUT;
+    i += 2;
+  }
+  return picture;
+}
 
-      // Remove chunks slated for removal.
-      for (auto id : chunks_to_be_removed) {
-        vrcout() << "[vrts] == removing packet from tx: " << id << std::endl;
-        tx_stream_tree.erase(id);
+void VRTS::dropChainsBefore(uint8_t stream_id, uint32_t from, uint32_t gop_id,
+                            std::vector<uint32_t> &removed) {
+  size_t dropped = 0;
+  for (uint32_t id = from; rx_stream_tree.before(id, gop_id); id++) {
+    auto *link = rx_stream_tree.hot(id);
+    if (link == nullptr || link->in_consumer_queue ||
+        rx_stream_tree.cold(id)->header.stream_id != stream_id) {
+      continue;
+    }
+    link->in_consumer_queue = true;
+    if (link->ack_sent) {
+      removed.emplace_back(id);
+    }
+    uint32_t chain_id = id - link->parent_id_offset;
+    for (uint8_t i = 0; i < link->fragments; i++) {
+      if (rx_sack.hole(chain_id + i)) {
+        rx_cancel_ids.emplace_back(chain_id + i);
       }
-      chunks_to_be_removed.clear();
-      service_tx_tree = false;
     }
+    rx_sack.abandon(chain_id, link->fragments);
+    dropped++;
+  }
+  auto &stream = streams[stream_id];
+  if (!stream.rx_id_discard_valid ||
+      rx_stream_tree.before(stream.rx_id_discard_threshold, gop_id - 1)) {
+    stream.rx_id_discard_threshold = gop_id - 1;
+    stream.rx_id_discard_valid = true;
+  }
+  VRTS_TRACE(INFO, "[vrts] IRAP at {} overtook {} fragments of stream {}",
+             gop_id, dropped, stream_id);
+}
 
-    auto ack_check_wait = std::chrono::duration_cast<std::chrono::milliseconds>(
-        chrono_clock::now() - last_ack_check);
-
-    // ACK Handling.
-    if ((ack_check_wait >= std::chrono::milliseconds(1000 / sync_hz)) ||
-        should_ack) {
-      std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-      last_ack_check = chrono_clock::now();
-      should_ack = false;
-
-      // ACK scope:
-      // Here we handle sending out acks based on the data we've received.
-      {
-        std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
-        vrts_local_txdata_t ack = {};
-
-        // Find out if we need to ack anything new.
-        int ack_count = 0;
-        for (auto &entry : rx_stream_tree) {
-          auto &chunk = entry.second;
-          // If we haven't sent out an ack for this packet we received, or we
-          // haven't gotten confirmation that our ack was received, send
-          // another ack out in the next ACK packet for a given chunk id.
-          if (chunk.ack_sent == false) {
-            chunk.ack_sent = true;
-            // Put the chunk's packet ID into the ack packet's payload.
-            if (ack_count > (1472 - sizeof(vrts_packetheader_t)) / 4) {
-              vrcout() << "[vrts] hit ack payload size limit - acks backing up "
-                          "/ dropped"
-                       << std::endl;
-              continue;
-            }
-            uint32_t *indexes =
-                reinterpret_cast<uint32_t *>(&(ack.ota_packet.data[0]));
-            indexes[ack_count] = chunk.ota_packet.header.packet_id;
-            auto ack_delay =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    chrono_clock::now() - chunk.received_time_local);
-            vrcout() << "[vrts] packet " << chunk.ota_packet.header.packet_id
-                     << " ack delay: " << ack_delay.count()
-                     << " [ms]" << std::endl;
-            ack_count++;
-          }
-        }
+void VRTS::discardChain(uint32_t first_id, std::vector<uint32_t> &removed,
+                        bool in_order) {
+  auto &first = *rx_stream_tree.hot(first_id);
+  auto &stream = streams[rx_stream_tree.cold(first_id)->header.stream_id];
+  // What did arrive goes as if handed out, and is ACKed as usual.
+  for (uint8_t i = 0; i < first.fragments; i++) {
+    auto *link = rx_stream_tree.hot(first_id + i);
+    if (link == nullptr) {
+      // Ones still on their way too, the sender needn't repair those.
+      rx_cancel_ids.emplace_back(first_id + i);
+      continue;
+    }
+    if (link->parent_id_offset != i) {
+      continue;
+    }
+    link->in_consumer_queue = true;
+    if (link->ack_sent) {
+      removed.emplace_back(first_id + i);
+    }
+  }
+  uint32_t last_id = first_id + first.fragments - 1;
+  if (in_order && (!stream.rx_id_discard_valid ||
+                   rx_stream_tree.before(stream.rx_id_discard_threshold,
+                                         last_id))) {
+    stream.rx_id_discard_threshold = last_id;
+    stream.rx_id_discard_valid = true;
+  }
+  rx_sack.abandon(first_id, first.fragments);
+}
 
-        // ACKs and NACK packets are special in the sense that we
-        // don't try to resend them. As such we just say upfront that
-        // they need no further acking/retransmission.
-        if (ack_count) {
-          ack.was_sent = true;
-          ack.was_acked = true;
-          ack.was_nacked = false;
-
-          // Set flags
-          ack.ota_packet.header.status_bits =
-              static_cast<status_bits_t>(global_status_bit_state.load());
-
-          ack.sent_time_local = chrono_clock::now();
-          ack.ota_packet.header.fragments = 0;
-          ack.ota_packet.header.packet_id = 0;
-          ack.ota_packet.header.parent_id_offset = 0;
-          ack.ota_packet.header.packet_type = vrts_packet_type_t::VRTS_ACKS;
-          // Specify how much ack data there is in this ota_packet.
-          ack.ota_packet.header.length = ack_count * sizeof(uint32_t);
-
-          // Don't put the ack packet into the tx tree. But do update the
-          // packet id.
-          // tx_stream_tree.insert(std::make_pair(current_packet_id, ack));
-          udpSend(reinterpret_cast<uint8_t *>(&(ack.ota_packet)),
-                  sizeof(vrts_packetheader_t) + ack.ota_packet.header.length,
-                  downstream_ip, downstream_port);
-          vrcout() << "[vrts] sending ack chunk of size: "
-                   << ack.ota_packet.header.length << std::endl;
-        }
-      }
+/// @brief Newest picture of a POC lsb among the last few of a reference
+/// graph, if any.
+static const vrts_ref_picture_t *
+newestPicture(const std::deque<vrts_ref_picture_t> &pictures, uint32_t poc,
+              size_t within) {
+  size_t looked = 0;
+  for (auto it = pictures.rbegin(); it != pictures.rend() && looked < within;
+       ++it, looked++) {
+    if (it->poc == poc) {
+      return &*it;
+    }
+  }
+  return nullptr;
+}
 
-      // Remove chunks that have been slated for removal from our transmit
-      // tree.
-      for (auto id : chunks_to_be_removed) {
-        tx_stream_tree.erase(id);
-      }
+/// @brief Whether a picture of a temporal layer can use one as reference.
+/// @details A sub-layer non-reference picture is only of use to higher
+/// temporal layers, whether it was lost doesn't matter to its own or below.
+static bool usableReference(const vrts_ref_picture_t &reference,
+                            uint8_t temporal_id) {
+  return reference.decodable ||
+         (!reference.reference && reference.temporal_id >= temporal_id);
+}
 
-      // On the next loop service transmit/retransmit scope
-      service_tx_tree = true;
+bool VRTS::trackLostPicture(uint8_t stream_id, const vrts_packet_t &first) {
+  auto &output_state = streams[stream_id].output_state;
+  const uint8_t *data = first.data;
+  size_t len = first.header.length;
+  for (size_t i = 0; i + 5 < len; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
     }
-
-    // Delay should be a setting.
-    std::this_thread::sleep_for(std::chrono::microseconds(500));
+    auto nal_type =
+        static_cast<h265nal::NalUnitType>((data[i + 3] >> 1) & 0x3f);
+    if (nal_type >= h265nal::NalUnitType::VPS_NUT) {
+      i += 2;
+      continue;
+    }
+    // The slice header is short, and all there is to go by.
+    auto ssh = h265nal::H265SliceSegmentHeaderParser::ParseSliceSegmentHeader(
+        data + i + 5, len - i - 5, nal_type,
+        &output_state.bitstream_parser_state);
+    if (ssh == nullptr || !ssh->first_slice_segment_in_pic_flag) {
+      return false;
+    }
+    uint8_t temporal_id = (data[i + 4] & 0x07) - 1;
+    bool reference = nalClassOf(nal_type) != NAL_CLASS_NON_REFERENCE;
+    auto &pictures = output_state.ref_pictures;
+    pictures.push_back(
+        {ssh->slice_pic_order_cnt_lsb, temporal_id, reference, false});
+    if (pictures.size() > max_ref_pictures) {
+      pictures.pop_front();
+    }
+    return reference && temporal_id == 0;
   }
+  return false;
 }
 
-// TODO: Speed up udp recv
-bool VRTS::udpRecv(vrts_local_rxdata_t &entry, std::string ip, uint16_t port) {
-  // TODO: ADD SYNC TYPE THAT ALLOWS US TO WIPE THE TRANSMISSION TREE LIKE IN
-  // THE CASE OF STARTING A NEW SESSION ONLY ON ONE END
-  static int fd = -1;
-  if (fd < 0) {
-    if ((fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-      vrcout() << "[vrts] failed to get socket udpRecv" << std::endl;
+bool VRTS::dropDependent(uint32_t first_id, std::vector<uint32_t> &removed) {
+  auto &first = *rx_stream_tree.cold(first_id);
+  auto &stream = streams[first.header.stream_id];
+  auto &output_state = stream.output_state;
+  const uint8_t *data = first.data;
+  size_t len = first.header.length;
+  for (size_t i = 0; i + 5 < len; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+    auto nal_type =
+        static_cast<h265nal::NalUnitType>((data[i + 3] >> 1) & 0x3f);
+    if (nal_type >= h265nal::NalUnitType::VPS_NUT) {
+      i += 2;
+      continue;
+    }
+    nal_class_t nal_class = nalClassOf(nal_type);
+    if (nal_class == NAL_CLASS_IRAP) {
       return false;
     }
-
-    int one = 1;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 1000;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
-    // //fcntl(fd, F_SETFL, O_NONBLOCK);
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
-
-    struct sockaddr_in rx_addr;
-    memset(&rx_addr, 0, sizeof(rx_addr));
-    rx_addr.sin_family = AF_INET;
-    rx_addr.sin_addr.s_addr = inet_addr(ip.c_str());
-    rx_addr.sin_port = htons(port);
-
-    /* Bind to the broadcast port */
-    if (bind(fd, (struct sockaddr *)&rx_addr, sizeof(rx_addr)) < 0) {
-      vrcout() << "[vrts] bind failed " << ip << " udpRecv: " << errno << std::endl;
+    auto ssh = h265nal::H265SliceSegmentHeaderParser::ParseSliceSegmentHeader(
+        data + i + 5, len - i - 5, nal_type,
+        &output_state.bitstream_parser_state);
+    std::vector<uint32_t> pocs;
+    uint32_t poc_range;
+    if (ssh == nullptr || !ssh->first_slice_segment_in_pic_flag ||
+        !referencePocs(output_state, *ssh, pocs, poc_range)) {
       return false;
     }
-  }
-
-  //struct sockaddr_in from;
-  int received = read(fd, reinterpret_cast<uint8_t *>(&(entry.ota_packet)),
-                      sizeof(vrts_packet_t));
-  // socklen_t addrlen = sizeof(struct sockaddr_in);
-  //    recvfrom(fd, reinterpret_cast<uint8_t *>(&(entry.ota_packet)),
-  //             sizeof(vrts_packet_t), 0, (struct sockaddr *)&from,
-  //             &addrlen);
-
-  if (received > 0) {
-    entry.ack_sent = false;
-    vrcout() << "[vrts] received: " << received << std::endl;
-    statistics.recv_pkt_total++;
-    statistics.recv_pkt_since++;
-    statistics.recv_byte_total += received;
-    statistics.recv_byte_since += received;
-    return true;
-  }
-  if (received < 0) {
-    int err = errno;
-    if (err != EAGAIN) {
-      close(fd);
-      fd = -1;
-      vrcout() << "[vrts] recvfrom failed udpRecv: " << err << std::endl;
+    uint8_t temporal_id = (data[i + 4] & 0x07) - 1;
+    auto &pictures = output_state.ref_pictures;
+    // Only a picture the graph has is gone by: one it hasn't may be on its
+    // way ahead of this one. Pictures further back than half the POC lsb
+    // range may share a POC lsb with one still on its way, too.
+    bool lost = std::any_of(pocs.begin(), pocs.end(), [&](uint32_t poc) {
+      auto *reference = newestPicture(pictures, poc, poc_range / 2);
+      return reference != nullptr && !usableReference(*reference, temporal_id);
+    });
+    if (!lost) {
+      return false;
     }
+    pictures.push_back({ssh->slice_pic_order_cnt_lsb, temporal_id,
+                        nal_class != NAL_CLASS_NON_REFERENCE, false});
+    if (pictures.size() > max_ref_pictures) {
+      pictures.pop_front();
+    }
+    VRTS_TRACE(DEBUG, "[vrts] dropping chain {}, its picture refers to a "
+                      "lost one",
+               first_id);
+    discardChain(first_id, removed, false);
+    stream.rx_dropped_chains.push_back(first_id);
+    if (stream.rx_dropped_chains.size() > max_ref_pictures) {
+      stream.rx_dropped_chains.pop_front();
+    }
+    return true;
   }
   return false;
 }
 
-void VRTS::udpSend(uint8_t *data, uint16_t len, std::string ip, uint16_t port) {
-  int tx_sock = -1;
-  struct sockaddr_in destaddr;
-  if (tx_sock < 0) {
-    if ((tx_sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-    }
+bool VRTS::droppedChain(vrts_stream_t &stream, uint32_t first_id) {
+  auto &dropped = stream.rx_dropped_chains;
+  // Once the output is past them, the discard threshold covers them.
+  while (!dropped.empty() && stream.rx_id_discard_valid &&
+         !rx_stream_tree.before(stream.rx_id_discard_threshold,
+                                dropped.front())) {
+    dropped.pop_front();
+  }
+  return std::find(dropped.begin(), dropped.end(), first_id) != dropped.end();
+}
 
-    int one = 1;
-    if (setsockopt(tx_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+bool VRTS::skipChain(uint32_t first_id, vrts_clock_time_t now,
+                     bool overtaken, vrts_clock_time_t &due,
+                     std::vector<uint32_t> &removed) {
+  auto &first = *rx_stream_tree.hot(first_id);
+  auto &first_packet = *rx_stream_tree.cold(first_id);
+  auto &stream = streams[first_packet.header.stream_id];
+  // If no picture starts in the first fragment, what the chain is can't be
+  // told, and it is waited for.
+  nal_class_t chain_class;
+  if (!sniffChain(first_packet, chain_class)) {
+    return false;
+  }
+  bool reference = chain_class != NAL_CLASS_NON_REFERENCE;
+  if (!jitter_buffer_enabled) {
+    // Handed out as soon as complete: nothing waits for a picture that
+    // nothing refers to once the next one is there.
+    if (reference || !overtaken) {
+      return false;
     }
-
-    if (setsockopt(tx_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+  } else {
+    if (!first.stamped || !stream.playout_jitter.valid()) {
+      return false;
+    }
+    auto deadline = reference ? stream.playout_jitter.limit(first.sent_us)
+                              : stream.playout_jitter.deadline(first.sent_us);
+    if (now < deadline) {
+      due = std::min(due, deadline);
+      return false;
     }
-
-    // Broadcast details
-    memset(&destaddr, 0, sizeof(destaddr));
-    destaddr.sin_family = AF_INET;
-    destaddr.sin_addr.s_addr = inet_addr(ip.c_str());
-    destaddr.sin_port = htons(port);
   }
 
-  if (sendto(tx_sock, data, len, 0, (sockaddr *)&destaddr, sizeof(destaddr)) <=
-      0) {
-    vrcout() << "[vrts] send failed" << std::endl;
+  uint8_t stream_id = first_packet.header.stream_id;
+  uint32_t last_id = first_id + first.fragments - 1;
+  bool base_layer = trackLostPicture(stream_id, first_packet);
+  discardChain(first_id, removed);
+  if (reference) {
+    // What refers to it is dropped as it comes, see trackReferences(). In
+    // the base layer that is everything up to the next GOP, so ask for one
+    // now rather than once the next picture shows.
+    VRTS_TRACE(WARN, "[vrts] gave up on late reference chain {} - {}",
+               first_id, last_id);
+    if (base_layer) {
+      gop_request_mask |= 1 << stream_id;
+    }
   } else {
-    statistics.send_pkt_total++;
-    statistics.send_pkt_since++;
-    statistics.send_byte_total += len;
-    statistics.send_byte_since += len;
+    stream.output_state.skipped_pictures++;
+    metrics.playout_skipped++;
+    VRTS_TRACE(DEBUG, "[vrts] skipped non-reference chain {} - {}", first_id,
+               last_id);
   }
+  return true;
+}
 
+void VRTS::readTimestamp(vrts_output_block_t &block) {
+  block.stamped = false;
+  vrts_sei_timestamp_t stamp;
+  if (!findTimestampSei(block.data.data(), block.data.size(), stamp)) {
+    return;
+  }
+  metrics.encode_latency.record(
+      std::chrono::microseconds(stamp.ingest_us - stamp.capture_us));
+  if (!clock_sync.valid()) {
+    return;
+  }
+  metrics.transport_latency.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          block.reassembled - clock_sync.toLocal(stamp.ingest_us)));
+  block.capture_time = clock_sync.toLocal(stamp.capture_us);
+  block.stamped = true;
+}
 
-  close(tx_sock);
+void VRTS::handOut(const vrts_output_block_t &block) {
+  auto now = clockNow();
+  metrics.output_latency.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                            block.queued));
+  if (block.stamped) {
+    metrics.glass_latency.record(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            now - block.capture_time));
+  }
 }
 
-// This function will go through the tree
-void VRTS::flushUpToNalType(h265nal::NalUnitType) {
-  std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-  // Iterate through the tx_tree and flush all packets from oldest up to the
-  // first packet with the nal type passed into this function Could be used to
-  // flush our internal streaming buffer after we've received a new IDR /
-  // CRA_NUT / etc...
-  // - This is currently very dumb and will just drop all items in the tree.
-  if (tx_stream_tree.size()) {
-    // vrcout() << "[vrts] new gop - clearing tree of item count: "
-    //          << tx_stream_tree.size() << std::endl;
-    // tx_stream_tree.clear();
+bool VRTS::dataReady(uint8_t stream_id) {
+  return stream_id < vrts_max_streams &&
+         !streams[stream_id].output_queue.empty();
+}
+
+bool VRTS::popData(std::vector<uint8_t> &nal, uint8_t stream_id) {
+  if (stream_id >= vrts_max_streams) {
+    return false;
+  }
+  vrts_output_block_t block;
+  if (!streams[stream_id].output_queue.tryPop(block)) {
+    return false;
   }
+  handOut(block);
+  nal = std::move(block.data);
+  return true;
 }
 
-bool VRTS::dataReady(void) { return (output_queue.size() > 0); }
+bool VRTS::popData(std::vector<uint8_t> &nal, uint8_t stream_id,
+                   std::chrono::milliseconds timeout) {
+  if (stream_id >= vrts_max_streams) {
+    return false;
+  }
+  vrts_output_block_t block;
+  if (!streams[stream_id].output_queue.pop(block, timeout)) {
+    return false;
+  }
+  handOut(block);
+  nal = std::move(block.data);
+  return true;
+}
 
-const std::vector<uint8_t> VRTS::getData(void) {
-  const auto vec = output_queue.front();
-  output_queue.pop_front();
+const std::vector<uint8_t> VRTS::getData(uint8_t stream_id) {
+  std::vector<uint8_t> vec;
+  popData(vec, stream_id);
   return vec;
 }
 
-const std::vector<uint8_t> VRTS::getDataAsMPEGTS(void) {
-  vrcout() << "Getting mpegts" << std::endl;
+const std::vector<uint8_t> VRTS::getDataAsMPEGTS(uint8_t stream_id) {
+  VRTS_TRACE(DEBUG, "Getting mpegts");
   // Get our NAL blocks out.
-  const auto vec = output_queue.front();
-  output_queue.pop_front();
+  if (stream_id >= vrts_max_streams) {
+    return {};
+  }
+  vrts_output_block_t block;
+  if (!streams[stream_id].output_queue.tryPop(block)) {
+    return {};
+  }
+  handOut(block);
 
   // Build a frame of data (ES)
   EsFrame esFrame;
   esFrame.mData = std::make_shared<SimpleBuffer>();
   // Append your ES-Data
-  esFrame.mData->append(vec.data(), vec.size());
+  esFrame.mData->append(block.data.data(), block.data.size());
 
-  // We set both the pts and dts to the current local time.
+  // We set both the pts and dts to when the picture was captured if the
+  // sender stamped it, the current local time otherwise.
+  auto presentation = block.stamped
+                          ? std::max(block.capture_time, mpegtsPtsStart)
+                          : clockNow();
   uint64_t pts = static_cast<uint64_t>(
-      std::chrono::duration_cast<std::chrono::microseconds>(chrono_clock::now() - mpegtsPtsStart)
+      std::chrono::duration_cast<std::chrono::microseconds>(presentation -
+                                                            mpegtsPtsStart)
           .count());
 
-  vrcout() << "PTS/DTS: " << pts << std::endl;
+  VRTS_TRACE(DEBUG, "PTS/DTS: {}", pts);
 
   esFrame.mPts = pts;
   esFrame.mDts = pts;
   esFrame.mPcr = pts; // This isn't correct, but tsparse should handle it.
   esFrame.mStreamType = TYPE_VIDEO_265;
   esFrame.mStreamId = 224;
-  esFrame.mPid = VIDEO_PID;
+  esFrame.mPid = VIDEO_PID + stream_id;
   esFrame.mExpectedPesPacketLength = 0;
   esFrame.mCompleted = true;
 
   // TODO: Rework mpegts lib to hand out vector directly.
-  auto ts_out = lMuxer->encode(esFrame);
+  auto ts_out = streams[stream_id].muxer->encode(esFrame);
   std::vector<uint8_t> vec_out;
   vec_out.assign(ts_out.data(), ts_out.data() + ts_out.size());
   return vec_out;
 }
 
-void VRTS::getStatistics(vrts_stat_t& stats) {
-  static vrts_clock_time_t time_start = chrono_clock::now();
-  static vrts_clock_time_t time_local = time_start;
+/// @brief Percentiles of a latency histogram over the last 1, 10 and 60 s.
+static vrts_latency_stat_t latencyStat(LatencyHistogram &histogram,
+                                       vrts_clock_time_t now) {
+  auto window = [&](size_t seconds) {
+    HistogramCounts counts = histogram.window(now, seconds);
+    vrts_latency_window_t result;
+    result.p50 = counts.percentile(0.5) / 1000.0f;
+    result.p99 = counts.percentile(0.99) / 1000.0f;
+    result.p999 = counts.percentile(0.999) / 1000.0f;
+    result.samples = static_cast<uint32_t>(counts.count());
+    return result;
+  };
+  vrts_latency_stat_t stat;
+  stat.last_1s = window(1);
+  stat.last_10s = window(10);
+  stat.last_60s = window(60);
+  return stat;
+}
 
+std::string latencyReport(const vrts_stat_t &stats) {
+  std::string report;
+  char line[128];
+  snprintf(line, sizeof(line), "%-16s %8s %9s %9s %9s\n", "last 10 s",
+           "frames", "p50 ms", "p99 ms", "p99.9 ms");
+  report += line;
+  const std::pair<const char *, const vrts_latency_stat_t *> stages[] = {
+      {"encode", &stats.encode_latency},
+      {"transport", &stats.transport_latency},
+      {"jitter buffer", &stats.playout_delay},
+      {"output queue", &stats.output_latency},
+      {"glass to glass", &stats.glass_latency}};
+  for (auto &stage : stages) {
+    auto &window = stage.second->last_10s;
+    snprintf(line, sizeof(line), "%-16s %8u %9.2f %9.2f %9.2f\n", stage.first,
+             window.samples, window.p50, window.p99, window.p999);
+    report += line;
+  }
+  if (stats.clock_rtt_ms >= 0) {
+    snprintf(line, sizeof(line), "peer clock %+.3f ms, probe rtt %.3f ms\n",
+             stats.clock_offset_ms, stats.clock_rtt_ms);
+  } else {
+    snprintf(line, sizeof(line), "peer clock not synced yet\n");
+  }
+  report += line;
+  return report;
+}
+
+void VRTS::getStatistics(vrts_stat_t& stats) {
   std::lock_guard<std::mutex> stats_lock(statistics_mutex);
-  if (statistics.send_pkt_total < 5) return;
+  if (metrics.send_pkt_total.value() < 5) return;
 
-  vrts_clock_time_t statistics_now = chrono_clock::now();
+  vrts_clock_time_t statistics_now = clockNow();
   statistics.timestamp_ms =
     std::chrono::duration_cast<std::chrono::milliseconds>(
-      statistics_now - time_start).count();
+      statistics_now - stats_time_start).count();
+
+  // totals and gauges
+  statistics.send_byte_total = metrics.send_byte_total.value();
+  statistics.recv_byte_total = metrics.recv_byte_total.value();
+  statistics.send_pkt_total = metrics.send_pkt_total.value();
+  statistics.send_pkt_dropped = metrics.send_pkt_dropped.value();
+  statistics.send_pkt_loss = metrics.send_pkt_loss.value();
+  statistics.recv_pkt_total = metrics.recv_pkt_total.value();
+  statistics.ack_total = metrics.ack_total.value();
+  statistics.ack_not_in_tree = metrics.ack_not_in_tree.value();
+  statistics.nack_total = metrics.nack_total.value();
+  statistics.ack_byte_total = metrics.ack_byte_total.value();
+  statistics.fec_sent = metrics.fec_sent.value();
+  statistics.fec_recovered = metrics.fec_recovered.value();
+  statistics.retx_total = metrics.retx_total.value();
+  statistics.gop_requests = metrics.gop_requests.value();
+  statistics.peer_restarts = metrics.peer_restarts.value();
+  statistics.stale_epoch_drops = metrics.stale_epoch_drops.value();
+  statistics.playout_late = metrics.playout_late.value();
+  statistics.playout_skipped = metrics.playout_skipped.value();
+  statistics.hol_bypassed = metrics.hol_bypassed.value();
+  statistics.obsolete_frames = metrics.obsolete_frames.value();
+  statistics.undecodable_pictures = metrics.undecodable_pictures.value();
+  statistics.cancelled_packets = metrics.cancelled_packets.value();
+  statistics.send_syscalls = metrics.send_syscalls.value();
+  statistics.recv_syscalls = metrics.recv_syscalls.value();
+  statistics.recv_truncated = metrics.recv_truncated.value();
+  statistics.output_queue_drops = metrics.output_queue_drops.value();
+  statistics.output_reference_drops = metrics.output_reference_drops.value();
+  statistics.recv_buf_bytes = metrics.recv_buf_bytes;
+  statistics.fragment_bytes = mtu;
+  statistics.path_mtu_bytes = metrics.path_mtu_bytes;
+  statistics.pending_acks = metrics.pending_acks;
+  statistics.temporal_filter = metrics.temporal_filter;
+  statistics.rtt_peak = metrics.rtt_peak;
+  statistics.rtt_average = metrics.rtt_average;
+  statistics.rtt_acked = metrics.rtt_acked;
+  statistics.rtt_nacked = metrics.rtt_nacked;
+  statistics.tx_in_transit = metrics.tx_in_transit;
+  statistics.pacing_delay_ms = metrics.pacing_delay_ms;
+  statistics.clock_offset_ms =
+      clock_sync.valid() ? clock_sync.offset() / 1000.0f : 0.0f;
+  statistics.clock_rtt_ms =
+      clock_sync.valid() ? clock_sync.rtt() / 1000.0f : -1.0f;
+  statistics.jitter_ms = 0.0f;
+  statistics.playout_target_ms = 0.0f;
+  if (jitter_buffer_enabled) {
+    for (auto &stream : streams) {
+      statistics.jitter_ms = std::max(
+          statistics.jitter_ms, stream.playout_jitter.jitter().count() / 1000.0f);
+      if (stream.playout_jitter.valid()) {
+        statistics.playout_target_ms =
+            std::max(statistics.playout_target_ms,
+                     stream.playout_jitter.target().count() / 1000.0f);
+      }
+    }
+  }
+
+  // Counts since the start of the sample window.
+  statistics.send_byte_since =
+      statistics.send_byte_total - stats_window_start.send_byte_total;
+  statistics.recv_byte_since =
+      statistics.recv_byte_total - stats_window_start.recv_byte_total;
+  statistics.send_pkt_since =
+      statistics.send_pkt_total - stats_window_start.send_pkt_total;
+  statistics.recv_pkt_since =
+      statistics.recv_pkt_total - stats_window_start.recv_pkt_total;
+  statistics.retx_since = statistics.retx_total - stats_window_start.retx_total;
+  statistics.nack_since = statistics.nack_total - stats_window_start.nack_total;
 
   // queue sizes
   statistics.tx_queued = tx_stream_tree.size();
   statistics.rx_queued = rx_stream_tree.size();
+  statistics.output_queue_depth = 0;
+  for (auto &stream : streams) {
+    statistics.output_queue_depth += stream.output_queue.size();
+  }
+
+  // latency percentiles
+  statistics.rtt_latency = latencyStat(metrics.rtt, statistics_now);
+  statistics.ack_delay = latencyStat(metrics.ack_delay, statistics_now);
+  statistics.reassembly_latency =
+      latencyStat(metrics.reassembly, statistics_now);
+  statistics.nal_latency = latencyStat(metrics.nal_latency, statistics_now);
+  statistics.encode_latency =
+      latencyStat(metrics.encode_latency, statistics_now);
+  statistics.transport_latency =
+      latencyStat(metrics.transport_latency, statistics_now);
+  statistics.playout_delay =
+      latencyStat(metrics.playout_delay, statistics_now);
+  statistics.output_latency =
+      latencyStat(metrics.output_latency, statistics_now);
+  statistics.glass_latency = latencyStat(metrics.glass_latency, statistics_now);
 
   auto age_since_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    statistics_now - time_local).count();
+                    statistics_now - stats_time_last).count();
   float delta =  age_since_ms / 1000.0f;
   if (delta > 1.0f) delta = 1.0f;
 
@@ -1058,7 +3127,14 @@ void VRTS::getStatistics(vrts_stat_t& stats) {
     statistics.retx_percent = static_cast<float>(statistics.retx_since) /
                               static_cast<float>(send_pkt_unique);
   }
+  if (statistics.recv_syscalls) {
+    statistics.recv_pkts_per_syscall =
+        static_cast<float>(statistics.recv_pkt_total) /
+        static_cast<float>(statistics.recv_syscalls);
+  }
   if (statistics.send_pkt_total) {
+    statistics.syscalls_per_pkt = static_cast<float>(statistics.send_syscalls) /
+                                  static_cast<float>(statistics.send_pkt_total);
     uint32_t send_pkt_unique = statistics.send_pkt_total - statistics.retx_total;
     statistics.drop_percent = 100.0f * static_cast<float>(statistics.send_pkt_dropped) /
                               static_cast<float>(send_pkt_unique);
@@ -1066,14 +3142,21 @@ void VRTS::getStatistics(vrts_stat_t& stats) {
                               static_cast<float>(send_pkt_unique);
   }
   uint32_t total_bytes = statistics.send_byte_since + statistics.recv_byte_since;
+  // ACK/NACK bytes we sent per byte we received.
+  if (statistics.recv_byte_total > 0) {
+    statistics.ack_overhead_percent =
+        100.0f * static_cast<float>(statistics.ack_byte_total) /
+        static_cast<float>(statistics.recv_byte_total);
+  }
 
   // Determine oldest unacked tx packet in transit
+  uint64_t paced_bytes;
   {
     statistics.send_buf_ms = 0;
     std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
-    auto now = chrono_clock::now();
-    for (auto &entry : tx_stream_tree) {
-      auto &chunk = entry.second;
+    auto now = clockNow();
+    tx_stream_tree.forEach([&](uint32_t, vrts_local_txdata_t &chunk,
+                               vrts_tx_packet_t &) {
       if (chunk.was_sent && !chunk.was_acked) {
         auto last_send_period =
             std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -1082,7 +3165,37 @@ void VRTS::getStatistics(vrts_stat_t& stats) {
           statistics.send_buf_ms = last_send_period;
         }
       }
-    }
+    });
+    metrics.send_buf_ms = statistics.send_buf_ms;
+    statistics.pacing_rate_kbps = pacer.rate() * 8.0f / 1000.0f;
+    paced_bytes = pacer.released();
+    statistics.congestion_state = congestion.state();
+    statistics.queue_delay_ms = congestion.queueDelay();
+    statistics.delay_trend = congestion.trend();
+  }
+  statistics.target_bitrate_kbps = target_bitrate_kbps;
+  uint32_t input_kbps = 0;
+  for (auto &stream : streams) {
+    input_kbps += stream.input_rate_kbps;
+  }
+  statistics.input_rate_kbps = input_kbps;
+
+  // Reactor wakeups and thread CPU over the sample window.
+  statistics.wakeups_total = reactor.wakeups;
+  statistics.wakeups_socket = reactor.socket_wakeups;
+  statistics.wakeups_feed = reactor.notify_wakeups;
+  statistics.wakeups_timer = reactor.timer_wakeups;
+  uint64_t reactor_cpu_ns = reactorCpuTimeNs();
+  uint64_t reactor_idle_ns = reactor.idle_ns;
+  if (age_since_ms > 0) {
+    float window_ns = age_since_ms * 1000000.0f;
+    moving_average(statistics.wakeup_rate,
+                   (statistics.wakeups_total - stats_wakeups_last) * 1000.0f /
+                       age_since_ms);
+    moving_average(statistics.reactor_cpu_percent,
+                   100.0f * (reactor_cpu_ns - stats_cpu_ns_last) / window_ns);
+    moving_average(statistics.reactor_idle_percent,
+                   100.0f * (reactor_idle_ns - stats_idle_ns_last) / window_ns);
   }
 
   // update moving averages for rates
@@ -1101,25 +3214,77 @@ void VRTS::getStatistics(vrts_stat_t& stats) {
     moving_average(statistics.retx_rate, retx_rate);
     moving_average(statistics.nack_rate, nack_rate);
     moving_average(statistics.average_mbps, total_mbps);
+    moving_average(statistics.pacing_sent_kbps,
+                   (paced_bytes - stats_paced_bytes_last) / delta *
+                       (8.0f / 1000.0f));
   }
 
   stats = statistics;
 
-  // Reset rate counters every 1/10th of a second
+  // Start a new sample window every 1/10th of a second
   if (delta >= 0.1f) {
-    statistics.send_byte_since = 0;
-    statistics.recv_byte_since = 0;
-    statistics.send_pkt_since = 0;
-    statistics.recv_pkt_since = 0;
-    statistics.retx_since = 0;
-    statistics.nack_since = 0;
-    time_local = statistics_now;
+    stats_window_start = statistics;
+    stats_wakeups_last = statistics.wakeups_total;
+    stats_cpu_ns_last = reactor_cpu_ns;
+    stats_idle_ns_last = reactor_idle_ns;
+    stats_paced_bytes_last = paced_bytes;
+    stats_time_last = statistics_now;
+  }
+}
+
+/// @brief CPU time consumed by the reactor thread so far.
+uint64_t VRTS::reactorCpuTimeNs(void) {
+  clockid_t cid;
+  struct timespec ts;
+  if (!reactor_thread ||
+      pthread_getcpuclockid(reactor_thread->native_handle(), &cid) != 0 ||
+      clock_gettime(cid, &ts) != 0) {
+    return 0;
   }
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
 }
 
 void VRTS::resetStatistics(void) {
   std::lock_guard<std::mutex> stats_lock(statistics_mutex);
+  for (Counter *counter :
+       {&metrics.send_byte_total, &metrics.recv_byte_total,
+        &metrics.send_pkt_total, &metrics.send_pkt_dropped,
+        &metrics.send_pkt_loss, &metrics.recv_pkt_total, &metrics.ack_total,
+        &metrics.ack_not_in_tree, &metrics.nack_total, &metrics.ack_byte_total,
+        &metrics.fec_sent, &metrics.fec_recovered, &metrics.retx_total,
+        &metrics.gop_requests, &metrics.peer_restarts,
+        &metrics.stale_epoch_drops, &metrics.playout_late,
+        &metrics.playout_skipped, &metrics.hol_bypassed,
+        &metrics.obsolete_frames, &metrics.undecodable_pictures,
+        &metrics.cancelled_packets, &metrics.send_syscalls, &metrics.recv_syscalls,
+        &metrics.recv_truncated, &metrics.output_queue_drops,
+        &metrics.output_reference_drops}) {
+    counter->reset();
+  }
+  metrics.recv_buf_bytes = 0;
+  metrics.path_mtu_bytes = 0;
+  metrics.pending_acks = 0;
+  metrics.send_buf_ms = 0;
+  metrics.temporal_filter = 0;
+  metrics.rtt_peak = 0;
+  metrics.rtt_average = 0.0f;
+  metrics.rtt_acked = 0.0f;
+  metrics.rtt_nacked = 0.0f;
+  metrics.tx_in_transit = 0.0f;
+  metrics.pacing_delay_ms = 0.0f;
+  metrics.rtt.reset();
+  metrics.ack_delay.reset();
+  metrics.reassembly.reset();
+  metrics.nal_latency.reset();
+  metrics.encode_latency.reset();
+  metrics.transport_latency.reset();
+  metrics.playout_delay.reset();
+  metrics.output_latency.reset();
+  metrics.glass_latency.reset();
   memset(&statistics, 0, sizeof(statistics));
+  memset(&stats_window_start, 0, sizeof(stats_window_start));
+  stats_time_start = clockNow();
+  stats_time_last = stats_time_start;
 }
 
 // For details on the NAL unit types, see the H265 spec
@@ -1215,6 +3380,24 @@ std::string VRTS::nalTypeToString(h265nal::NalUnitType nalType) {
   return type;
 }
 
+nal_class_t VRTS::nalClassOf(h265nal::NalUnitType nal_type) {
+  if (nal_type == h265nal::NalUnitType::VPS_NUT ||
+      nal_type == h265nal::NalUnitType::SPS_NUT ||
+      nal_type == h265nal::NalUnitType::PPS_NUT) {
+    return NAL_CLASS_PARAMETER_SETS;
+  }
+  if (nal_type >= h265nal::NalUnitType::BLA_W_LP &&
+      nal_type <= h265nal::NalUnitType::RSV_IRAP_VCL23) {
+    return NAL_CLASS_IRAP;
+  }
+  // Below the IRAP range, even types are the sub-layer non-reference ones
+  // (TRAIL_N, TSA_N, ...).
+  if (nal_type < h265nal::NalUnitType::BLA_W_LP) {
+    return (nal_type & 1) ? NAL_CLASS_REFERENCE : NAL_CLASS_NON_REFERENCE;
+  }
+  return NAL_CLASS_NON_REFERENCE;
+}
+
 // Currently our logic for handling errors in the stream is extremely simplistic
 // where our only actions are to...
 // - Ask upstream for new GOP AND
@@ -1224,13 +3407,17 @@ std::string VRTS::nalTypeToString(h265nal::NalUnitType nalType) {
 // - POC jump is detected with missing slices
 // - POC jump detected without temporal layers / short term references enabled
 // - We haven't ever received a PPS (connecting mid-GOP)
-bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
+bool VRTS::trackOutputStream(uint8_t stream_id, uint8_t *data, uint16_t len,
+                             bool &gop_start, nal_class_t &block_class) {
+  auto &output_state = streams[stream_id].output_state;
+  block_class = NAL_CLASS_NON_REFERENCE;
+  uint8_t stream_bit = 1 << stream_id;
   // What do we do with this?
   if (data[0] != 0x00 || data[1] != 0x00 || data[2] != 0x00 ||
       data[3] != 0x01) {
-    vrcout()
-        << "[vrts] parse-out: buffer doesn't start with start code 0x00000001"
-        << std::endl;
+    VRTS_TRACE(WARN,
+               "[vrts] parse-out: buffer doesn't start with start code "
+               "0x00000001");
     return false;
   }
 
@@ -1240,12 +3427,13 @@ bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
       data, len, &output_state.bitstream_parser_state, parsing_options);
   if (stream == nullptr) {
     // did not work
-    vrcout() << " [vrcout] parse-out: Couldn't determine NAL indices..."
-             << std::endl;
+    VRTS_TRACE(WARN, "[vrts] parse-out: Couldn't determine NAL indices...");
     return false;
   }
 
   uint32_t highest_tid = 0;
+  bool has_picture = false;
+  bool undecodable = false;
   for (auto &nalu : stream->nal_units) {
     uint8_t *offset = &(data[nalu->offset]);
     if (nalu->nal_unit_payload->slice_segment_layer != nullptr) {
@@ -1255,10 +3443,37 @@ bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
       highest_tid = std::max(highest_tid,
                             nalu->nal_unit_header->nuh_temporal_id_plus1);
 
-      // Look for input discontinuties in POC count:
+      // A picture can be decoded if the ones it refers to could. If one
+      // of them was lost, so is what refers to it, up to the next GOP if it
+      // was in the base layer; a lost picture nothing refers to costs
+      // nothing more.
+      auto slice_type = static_cast<h265nal::NalUnitType>(
+          nalu->nal_unit_header->nal_unit_type);
+      uint8_t temporal_id = nalu->nal_unit_header->nuh_temporal_id_plus1 - 1;
+      bool decodable = true;
+      bool graphed = trackReferences(output_state, *ssh, slice_type,
+                                     temporal_id, decodable);
+      has_picture = true;
+      if (graphed && !decodable) {
+        if (!undecodable && temporal_id == 0 &&
+            nalClassOf(slice_type) != NAL_CLASS_NON_REFERENCE) {
+          VRTS_TRACE(WARN,
+                     "[vrts] parse-out: POC {} refers to a lost picture, "
+                     "requesting new GOP",
+                     ssh->slice_pic_order_cnt_lsb);
+          gop_request_mask |= stream_bit;
+        }
+        undecodable = true;
+      }
+
+      // Without a graph to go by, look for input discontinuties in POC
+      // count. Pictures the jitter buffer skipped are no surprise, nor is
+      // anything at an IRAP picture, which may have overtaken what was left
+      // of the GOP before it.
       long poc_jump = labs((long int)output_state.running_poc -
                 (long int)ssh->slice_pic_order_cnt_lsb);
-      if (poc_jump > 1 &&
+      if (!graphed && poc_jump > 1 + output_state.skipped_pictures &&
+          nalClassOf(slice_type) != NAL_CLASS_IRAP &&
           (ssh->slice_pic_order_cnt_lsb != 255) &&
           ssh->slice_pic_order_cnt_lsb != 0) {
         // Carve out exception for 50% temporal filtering
@@ -1271,10 +3486,9 @@ bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
           // Skip odd POC ok when temporal filter active
           // TODO: pass bitmask to indicate percent of filtering
         } else {
-          vrcout() << "[vrts] parse-out: POC jump detected: "
-                  << output_state.running_poc << " / "
-                  << ssh->slice_pic_order_cnt_lsb << std::endl;
-          global_status_bit_state |= ((uint8_t)status_bits_t::NEW_GOP_NEEDED);
+          VRTS_TRACE(WARN, "[vrts] parse-out: POC jump detected: {} / {}",
+                     output_state.running_poc, ssh->slice_pic_order_cnt_lsb);
+          gop_request_mask |= stream_bit;
         }
 
         // TODO: We may want to force sending out a packet here with the
@@ -1289,10 +3503,10 @@ bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
       // slice isn't the fist in the POC, that's bad!
       if (output_state.last_poc_count != ssh->slice_pic_order_cnt_lsb &&
           !ssh->first_slice_segment_in_pic_flag) {
-        vrcout() << "[vrts] parse-out: Unexpected POC jump across slices. "
-                    "Requesting New GOP."
-                 << std::endl;
-        global_status_bit_state |= ((uint8_t)status_bits_t::NEW_GOP_NEEDED);
+        VRTS_TRACE(WARN,
+                   "[vrts] parse-out: Unexpected POC jump across slices. "
+                   "Requesting New GOP.");
+        gop_request_mask |= stream_bit;
 
         // TODO: We may want to force sending out a packet here with the
         // NEW_GOP_NEEDED bit set.
@@ -1302,64 +3516,192 @@ bool VRTS::trackOutputStream(uint8_t *data, uint16_t len) {
         // flushRXTree();
       }
 
-      vrcout() << "[vrts] parse-out: - POC: " << ssh->slice_pic_order_cnt_lsb
-               << " first slice: " << ssh->first_slice_segment_in_pic_flag
-               << std::endl;
+      VRTS_TRACE(DEBUG, "[vrts] parse-out: - POC: {} first slice: {}",
+                 ssh->slice_pic_order_cnt_lsb,
+                 ssh->first_slice_segment_in_pic_flag);
 
       // Update last state tracking vars.
       // TODO: Replace with copy of last slice_segment_header?
       output_state.was_last_slice_first = ssh->first_slice_segment_in_pic_flag;
       output_state.last_poc_count = ssh->slice_pic_order_cnt_lsb;
       output_state.running_poc = ssh->slice_pic_order_cnt_lsb;
+      output_state.skipped_pictures = 0;
+    }
+
+    auto nal_type =
+        static_cast<h265nal::NalUnitType>(nalu->nal_unit_header->nal_unit_type);
+    block_class = std::max(block_class, nalClassOf(nal_type));
+    if (block_class >= NAL_CLASS_IRAP) {
+      gop_start = true;
     }
 
     // If we've gotten a PPS_NUT, an IDR frame is surely to follow.
     // TODO: This is an assumption based on our encoder configuration.
-    if (nalu->nal_unit_header->nal_unit_type == h265nal::PPS_NUT) {
-      global_status_bit_state &= ~((uint8_t)status_bits_t::NEW_GOP_NEEDED);
+    if (nal_type == h265nal::PPS_NUT) {
+      gop_request_mask &= ~stream_bit;
     }
   }
 
-  if (global_status_bit_state & status_bits_t::NEW_GOP_NEEDED) {
-    vrcout() << "[vrts] parse-out: Dropping input data, waiting for new GOP."
-             << std::endl;
+  if (gop_request_mask & stream_bit) {
+    VRTS_TRACE(WARN,
+               "[vrts] parse-out: Dropping input data, waiting for new GOP.");
+    if (has_picture) {
+      metrics.undecodable_pictures++;
+    }
+    return false;
+  }
+  if (undecodable) {
+    VRTS_TRACE(DEBUG, "[vrts] parse-out: dropping undecodable picture");
+    metrics.undecodable_pictures++;
     return false;
   }
 
   return true;
 }
 
-bool VRTS::parse(uint8_t *data, size_t len) {
-  static bool inited = false;
-  if (!inited) {
-    inited = true;
-    // We don't want to pass fillers through.
-    filter_list.push_back(h265nal::NalUnitType::FD_NUT);
-    // filter_list.push_back(h265nal::AUD_NUT); // Don't strictly need this
-    filter_list.push_back(h265nal::PREFIX_SEI_NUT);
-    // Experimentation list:
-    // See what happens if we only ever let trailing reference updates
-    // through.
-    // filter_list.push_back(h265nal::NalUnitType::TRAIL_N);
-    // filter_list.push_back(h265nal::NalUnitType::TRAIL_R);
-
-    // Don't currently drop the PREFIX_SEI_NUT as at the moment
-    // it is included in the "first GOP" NAL aggregated chunk
-    // and would drop the whole first big NAL.
-    // filter_list.push_back(h265nal::NalUnitType::PREFIX_SEI_NUT);
-
-    // The types that denote a "threshold" between a group of NALS
-    // that we might want to align our decoder on or skip to reduce
-    // birate.
-    threshold_list.push_back(h265nal::NalUnitType::IDR_N_LP);
-    threshold_list.push_back(h265nal::NalUnitType::IDR_W_RADL);
-    threshold_list.push_back(h265nal::NalUnitType::CRA_NUT);
+bool VRTS::referencePocs(
+    const parse_tracking_data_t &state,
+    const h265nal::H265SliceSegmentHeaderParser::SliceSegmentHeaderState &ssh,
+    std::vector<uint32_t> &pocs, uint32_t &poc_range) {
+  auto pps =
+      state.bitstream_parser_state.GetPps(ssh.slice_pic_parameter_set_id);
+  auto sps = pps ? state.bitstream_parser_state.GetSps(
+                       pps->pps_seq_parameter_set_id)
+                 : nullptr;
+  const h265nal::H265StRefPicSetParser::StRefPicSetState *rps =
+      ssh.st_ref_pic_set.get();
+  if (sps && ssh.short_term_ref_pic_set_sps_flag) {
+    rps = ssh.short_term_ref_pic_set_idx < sps->st_ref_pic_set.size()
+              ? sps->st_ref_pic_set[ssh.short_term_ref_pic_set_idx].get()
+              : nullptr;
+  }
+  // Long-term references aren't tracked.
+  if (!sps || !rps || ssh.num_long_term_sps != 0 ||
+      ssh.num_long_term_pics != 0) {
+    return false;
+  }
+  poc_range = 1u << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+  int32_t delta = 0;
+  for (uint32_t i = 0; i < rps->num_negative_pics; i++) {
+    delta -= rps->delta_poc_s0_minus1[i] + 1;
+    if (rps->used_by_curr_pic_s0_flag[i]) {
+      pocs.push_back((ssh.slice_pic_order_cnt_lsb + delta) & (poc_range - 1));
+    }
+  }
+  delta = 0;
+  for (uint32_t i = 0; i < rps->num_positive_pics; i++) {
+    delta += rps->delta_poc_s1_minus1[i] + 1;
+    if (rps->used_by_curr_pic_s1_flag[i]) {
+      pocs.push_back((ssh.slice_pic_order_cnt_lsb + delta) & (poc_range - 1));
+    }
+  }
+  return true;
+}
+
+bool VRTS::trackReferences(
+    parse_tracking_data_t &state,
+    const h265nal::H265SliceSegmentHeaderParser::SliceSegmentHeaderState &ssh,
+    h265nal::NalUnitType nal_type, uint8_t temporal_id, bool &decodable) {
+  auto &pictures = state.ref_pictures;
+  if (!ssh.first_slice_segment_in_pic_flag) {
+    // Its picture was looked at with the first slice.
+    if (pictures.empty() || pictures.back().poc != ssh.slice_pic_order_cnt_lsb) {
+      return false;
+    }
+    decodable = pictures.back().decodable;
+    return true;
+  }
+
+  nal_class_t nal_class = nalClassOf(nal_type);
+  vrts_ref_picture_t picture = {ssh.slice_pic_order_cnt_lsb, temporal_id,
+                                nal_class != NAL_CLASS_NON_REFERENCE, true};
+  bool known = true;
+  if (nal_type >= h265nal::NalUnitType::BLA_W_LP &&
+      nal_type <= h265nal::NalUnitType::IDR_N_LP) {
+    // Nothing after an IDR or BLA picture refers to anything before it.
+    pictures.clear();
+  } else if (nal_class != NAL_CLASS_IRAP) {
+    std::vector<uint32_t> pocs;
+    uint32_t poc_range;
+    known = referencePocs(state, ssh, pocs, poc_range);
+    for (auto poc : pocs) {
+      auto *reference = newestPicture(pictures, poc, pictures.size());
+      if (reference == nullptr) {
+        // Everything before this picture in decode order came through
+        // here, so that one was lost without a trace. Pictures still on
+        // their way that refer to it can be told by it now.
+        pictures.push_back({poc, 0, true, false});
+        picture.decodable = false;
+      } else if (!usableReference(*reference, temporal_id)) {
+        picture.decodable = false;
+      }
+    }
+  }
+  pictures.push_back(picture);
+  while (pictures.size() > max_ref_pictures) {
+    pictures.pop_front();
+  }
+  decodable = picture.decodable;
+  return known;
+}
+
+bool VRTS::parse(uint8_t *data, size_t len, uint8_t stream_id) {
+  // The one copy on the way in, so the caller gets its buffer back.
+  auto copy = std::make_shared<const std::vector<uint8_t>>(data, data + len);
+  return parseBuffer(copy->data(), len, copy, stream_id);
+}
+
+bool VRTS::parse(const uint8_t *data, size_t len,
+                 std::function<void(void)> release, uint8_t stream_id) {
+  std::shared_ptr<const void> owner(data,
+                                    [release](const void *) {
+                                      if (release) {
+                                        release();
+                                      }
+                                    });
+  return parseBuffer(data, len, owner, stream_id);
+}
+
+bool VRTS::parseBuffer(const uint8_t *data, size_t len,
+                       const std::shared_ptr<const void> &owner,
+                       uint8_t stream_id) {
+  if (stream_id >= vrts_max_streams) {
+    VRTS_TRACE(WARN, "[vrts] no such stream: {}", stream_id);
+    return false;
   }
+  auto &input = streams[stream_id];
+  auto &input_state = input.input_state;
+  auto &pending_input_entry = input.pending_input_entry;
 
   if (data[0] != 0x00 || data[1] != 0x00 || data[2] != 0x00 ||
       data[3] != 0x01) {
-    vrcout() << "[vrts] buffer doesn't start with start code 0x00000001"
-             << std::endl;
+    VRTS_TRACE(WARN, "[vrts] buffer doesn't start with start code 0x00000001");
+  }
+
+  // Measure what the encoder offers, before anything is dropped, against
+  // the stream's share of the congestion controller's target.
+  auto input_now = clockNow();
+  if (capture.isOpen()) {
+    capture.input(stream_id, data, len, input_now);
+  }
+  if (input.input_rate_window_start == vrts_clock_time_t{}) {
+    input.input_rate_window_start = input_now;
+  }
+  input.input_rate_window_bytes += len;
+  input.input_last_time = input_now;
+  if (input_now - input.input_rate_window_start >= input_rate_interval) {
+    auto window_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         input_now - input.input_rate_window_start)
+                         .count();
+    input.input_rate_kbps = input.input_rate_window_bytes * 8ull / window_ms;
+    input.input_rate_window_start = input_now;
+    input.input_rate_window_bytes = 0;
+    uint32_t target_kbps = getTargetBitrate(stream_id);
+    if (input.input_rate_kbps > target_kbps) {
+      input.temporal_drop_active = true;
+    } else if (input.input_rate_kbps < target_kbps * temporal_filter_release) {
+      input.temporal_drop_active = false;
+    }
   }
 
   h265nal::ParsingOptions parsing_options;
@@ -1368,13 +3710,13 @@ bool VRTS::parse(uint8_t *data, size_t len) {
       data, len, &input_state.bitstream_parser_state, parsing_options);
   if (stream == nullptr) {
     // did not work
-    vrcout() << " [vrcout] Couldn't determine NAL indices..." << std::endl;
+    VRTS_TRACE(WARN, "[vrts] Couldn't determine NAL indices...");
     return false;
   }
   stream->parsing_options = parsing_options;
 
   if (stream->nal_units.size() == 0) {
-    vrcout() << " [vrcout] Couldn't determine NAL indices..." << std::endl;
+    VRTS_TRACE(WARN, "[vrts] Couldn't determine NAL indices...");
     return false;
   }
 
@@ -1385,7 +3727,7 @@ bool VRTS::parse(uint8_t *data, size_t len) {
       bool drop_nal = false;
       // Use UNSPEC63 as the default value denoting that no NAL was present
       h265nal::NalUnitType nal_type = h265nal::NalUnitType::UNSPEC63;
-      uint8_t *offset = &(data[nalu->offset]);
+      const uint8_t *offset = &(data[nalu->offset]);
       // if (h265nal::H265NalUnitHeaderParser::GetNalUnitType(
       //         offset, nalu->length, nal_type)) {
       nal_type = static_cast<h265nal::NalUnitType>(
@@ -1397,13 +3739,12 @@ bool VRTS::parse(uint8_t *data, size_t len) {
               nalu->nal_unit_payload->slice_segment_layer->slice_segment_header;
           if (ssh) current_poc = ssh->slice_pic_order_cnt_lsb;
         }
-        vrcout() << "   [vrts] GOT NAL: " << nalTypeToString(nal_type)
-                //  << " size: " << nalu->length << std::endl;
-                 << " size: " << nalu->length
-                 << " LID: " << nalu->nal_unit_header->nuh_layer_id
-                 << " TID: " << nalu->nal_unit_header->nuh_temporal_id_plus1 - 1
-                 << " POC: " << current_poc
-                 << std::endl;
+        VRTS_TRACE(DEBUG,
+                   "   [vrts] GOT NAL: {} size: {} LID: {} TID: {} POC: {}",
+                   nalTypeToString(nal_type), nalu->length,
+                   nalu->nal_unit_header->nuh_layer_id,
+                   nalu->nal_unit_header->nuh_temporal_id_plus1 - 1,
+                   current_poc);
         // TODO: Use std::any_of()?
         for (auto type : filter_list) {
           if (type == nal_type) {
@@ -1420,28 +3761,33 @@ bool VRTS::parse(uint8_t *data, size_t len) {
 
         // Our encoder currently is set up to output AUD_NUTs, so use them to
         // flush pending data chunks.
-        if (pending_input_entry.size() &&
+        if (pending_input_entry.length &&
             nal_type == h265nal::NalUnitType::AUD_NUT) {
-          vrcout() << "[vrts] Feeding h265 ES block of size: "
-                   << pending_input_entry.size() << std::endl;
-          if (new_gop_needed && !input_state.pending_contains_pps) {
+          VRTS_TRACE(DEBUG, "[vrts] Feeding h265 ES block of size: {}",
+                     pending_input_entry.length);
+          auto block = std::make_shared<const vrts_tx_block_t>(
+              std::move(pending_input_entry));
+          if (input.new_gop_needed && !input_state.pending_contains_pps) {
             // Don't put this into the tree, just clear it.
-            vrcout() << "[vrts] Dropping input until PPS arives." << std::endl;
-          } else if (new_gop_needed && input_state.pending_contains_pps) {
-            this->feedDataH265(pending_input_entry.data(),
-                               pending_input_entry.size());
+            VRTS_TRACE(INFO, "[vrts] Dropping input until PPS arives.");
+          } else if (input.new_gop_needed && input_state.pending_contains_pps) {
+            this->feedDataH265(stream_id, std::move(block),
+                               input_state.pending_tag);
             // Assumes that we're fed blocks of NALS that contain both
             // PPS and gop transition NALS like IDR NAL(s) between AUD_NUTs
-            vrcout() << "[vrts] new GOP request cleared." << std::endl;
-            new_gop_needed = false;
+            VRTS_TRACE(INFO, "[vrts] new GOP request cleared.");
+            input.new_gop_needed = false;
             input_state.pending_contains_pps = false;
           } else {
-            this->feedDataH265(pending_input_entry.data(),
-                               pending_input_entry.size());
+            this->feedDataH265(stream_id, std::move(block),
+                               input_state.pending_tag);
             input_state.pending_contains_pps = false;
           }
 
-          pending_input_entry.clear();
+          pending_input_entry = {};
+          input_state.pending_tag = {NAL_CLASS_NON_REFERENCE,
+                                     vrts_nal_type_unknown, 0xff,
+                                     vrts_nal_type_unknown, 0};
         }
 
         // If we care about this NAL type, parse it further.
@@ -1454,20 +3800,19 @@ bool VRTS::parse(uint8_t *data, size_t len) {
             if ((labs((long int)input_state.running_poc -
                       (long int)ssh->slice_pic_order_cnt_lsb) > 1) &&
                 (ssh->slice_pic_order_cnt_lsb != 255)) {
-              vrcout() << "[vrts] parse: POC jump detected: "
-                       << input_state.running_poc << " / "
-                       << ssh->slice_pic_order_cnt_lsb << std::endl;
+              VRTS_TRACE(WARN, "[vrts] parse: POC jump detected: {} / {}",
+                         input_state.running_poc, ssh->slice_pic_order_cnt_lsb);
             }
 
             if (input_state.last_poc_count != ssh->slice_pic_order_cnt_lsb &&
                 !ssh->first_slice_segment_in_pic_flag) {
-              vrcout() << "[vrts] parse: Unexpected POC jump across slices."
-                       << std::endl;
+              VRTS_TRACE(WARN,
+                         "[vrts] parse: Unexpected POC jump across slices.");
             }
 
-            vrcout() << "[vrts] parse - POC: " << ssh->slice_pic_order_cnt_lsb
-                     << " first slice: " << ssh->first_slice_segment_in_pic_flag
-                     << std::endl;
+            VRTS_TRACE(DEBUG, "[vrts] parse - POC: {} first slice: {}",
+                       ssh->slice_pic_order_cnt_lsb,
+                       ssh->first_slice_segment_in_pic_flag);
 
             // Update last state tracking vars.
             // TODO: Replace with copy of last slice_segment_header?
@@ -1504,23 +3849,24 @@ bool VRTS::parse(uint8_t *data, size_t len) {
               // if (ssh->short_term_ref_pic_set_idx == 3) {
               //   drop_nal = true;
               // }
-              vrcout() << " [vrts] temporal layer: "
-                       << ssh->short_term_ref_pic_set_idx << std::endl;
+              VRTS_TRACE(DEBUG, " [vrts] temporal layer: {}",
+                         ssh->short_term_ref_pic_set_idx);
             }
           } else {
             // Couldn't parse header, either not an image slice or PPS hasn't
             // arrived yet.
             if (nal_type != h265nal::NalUnitType::AUD_NUT) {
-              vrcout()
-                  << " [vrts] couldn't parse header, not image, or no PPS yet. "
-                  << std::endl;
+              VRTS_TRACE(DEBUG,
+                         " [vrts] couldn't parse header, not image, or no PPS "
+                         "yet. ");
             }
           }
         }
 
-        // If link is starting to get congested, drop our non-reference P-frames
-        // to reduce bitrate. As of now there are two temporal layers, so this
-        // is a binary 50% drop in configured bitrate.
+        // If the encoder offers more than the congestion controller's target,
+        // or the link is backing up regardless, drop our non-reference
+        // P-frames to reduce bitrate. As of now there are two temporal layers,
+        // so this is a binary 50% drop in configured bitrate.
         {
           // Lock the mutex briefly such that we don't get an in-process update
           // of the unacked count.
@@ -1530,16 +3876,23 @@ bool VRTS::parse(uint8_t *data, size_t len) {
             // OMX encoder will output either TID 3 (one layer) or 4 (4 layer hibrid)
             // Anything above 2 will achive 50% drop of temporal backs
             if (temporal_id > 2) {
-              if (statistics.send_buf_ms > temporal_layer_filter_latency_threshold) {
-                  vrcout() << "[vrts] dropping temporal layer due to congestion"
-                           << " in transit " << unacked.load() << ", " << statistics.tx_in_transit << " (" << statistics.send_buf_ms << " ms)"
-                           << std::endl;
+              if (input.temporal_drop_active ||
+                  metrics.send_buf_ms > temporal_layer_filter_latency_threshold) {
+                  VRTS_TRACE(INFO,
+                             "[vrts] dropping temporal layer due to congestion "
+                             "offered {} / target {} kbps in transit {}, {} "
+                             "({} ms)", input.input_rate_kbps.load(),
+                             getTargetBitrate(stream_id), unacked.load(),
+                             metrics.tx_in_transit.load(),
+                             metrics.send_buf_ms.load());
                   temporal_filter |= 1 << (temporal_id - 3); // TODO: test with hybrid 4 layer encoding
                   drop_nal = true;
               } else {
-                vrcout() << "[vrts] not dropping temporal layer"
-                         << " in transit " << unacked.load() << ", " << statistics.tx_in_transit << " (" << statistics.send_buf_ms << " ms)"
-                         << std::endl;
+                VRTS_TRACE(DEBUG,
+                           "[vrts] not dropping temporal layer in transit {}, "
+                           "{} ({} ms)", unacked.load(),
+                           metrics.tx_in_transit.load(),
+                           metrics.send_buf_ms.load());
                 drop_nal = false;
 
               }
@@ -1550,27 +3903,64 @@ bool VRTS::parse(uint8_t *data, size_t len) {
         // We can decide to drop this nal in this scope as well.
         if (!drop_nal) {
           // Add the NAL delimiter back to the stream.
-          pending_input_entry.emplace_back(0);
-          pending_input_entry.emplace_back(0);
-          pending_input_entry.emplace_back(0);
-          pending_input_entry.emplace_back(1);
-          pending_input_entry.insert(pending_input_entry.end(), offset,
-                                     &offset[nalu->length]);
+          appendToBlock(pending_input_entry, nal_start_code,
+                        sizeof(nal_start_code));
+          appendToBlock(pending_input_entry, offset, nalu->length);
+          auto &owners = pending_input_entry.owners;
+          if (owners.empty() || owners.back() != owner) {
+            owners.push_back(owner);
+          }
+          // The stamp goes right after the AUD that opens the block.
+          if (nal_type == h265nal::NalUnitType::AUD_NUT &&
+              timestamp_sei_enabled) {
+            vrts_sei_timestamp_t stamp;
+            stamp.ingest_us = toMicroseconds(input_now);
+            stamp.capture_us = input.next_capture_time == vrts_clock_time_t{}
+                                   ? stamp.ingest_us
+                                   : toMicroseconds(input.next_capture_time);
+            input.next_capture_time = {};
+            auto sei = std::make_shared<std::vector<uint8_t>>(
+                vrts_sei_max_bytes);
+            sei->resize(buildTimestampSei(stamp, sei->data()));
+            appendToBlock(pending_input_entry, sei->data(), sei->size());
+            owners.push_back(sei);
+          }
 
           if (nal_type == h265nal::PPS_NUT) {
             input_state.pending_contains_pps = true;
           }
+          // The AUD that opens the block says nothing about its content.
+          if (nal_type != h265nal::NalUnitType::AUD_NUT) {
+            auto &tag = input_state.pending_tag;
+            nal_class_t nal_class = nalClassOf(nal_type);
+            if (nal_class > tag.nal_class ||
+                tag.nal_type == vrts_nal_type_unknown) {
+              tag.nal_class = std::max(tag.nal_class, nal_class);
+              tag.nal_type = nal_type;
+            }
+            tag.temporal_id = std::min<uint8_t>(
+                tag.temporal_id,
+                nalu->nal_unit_header->nuh_temporal_id_plus1 - 1);
+            if (nal_type < h265nal::NalUnitType::VPS_NUT &&
+                tag.picture_type == vrts_nal_type_unknown) {
+              tag.picture_type = nal_type;
+              tag.poc = std::max(current_poc, 0);
+            }
+          }
         }
 
         if (drop_nal) {
-          vrcout() << "    [vrts] Dropping NAL" << std::endl;
+          VRTS_TRACE(DEBUG, "    [vrts] Dropping NAL");
         }
       }
     }
-    statistics.temporal_filter = temporal_filter;
+    metrics.temporal_filter = temporal_filter;
   } else {
-    vrcout() << "[vrts] directly feeding block size: " << len << std::endl;
-    this->feedDataH265(data, len);
+    VRTS_TRACE(DEBUG, "[vrts] directly feeding block size: {}", len);
+    auto block = std::make_shared<vrts_tx_block_t>();
+    appendToBlock(*block, data, len);
+    block->owners.push_back(owner);
+    this->feedDataH265(stream_id, std::move(block));
   }
 
   return true;
@@ -1605,26 +3995,75 @@ bool VRTS::parse(uint8_t *data, size_t len) {
 /// We can't just look at the request for a new GOP and then issue a new GOP
 /// as there is pipeline delay. Here we track state changes and make changes
 /// accordingly.
-void VRTS::requestNewGOPHandler(uint8_t downstream_state) {
-  // If we transitioned from a state of not needing a new GOP, to needing a new
-  // GOP set the global atomic flag.
-  if ((downstream_state & status_bits_t::NEW_GOP_NEEDED) &&
-      !(last_input_status_bit_state & status_bits_t::NEW_GOP_NEEDED)) {
+void VRTS::requestNewGOPHandler(uint8_t downstream_state,
+                                uint8_t stream_mask) {
+  uint8_t requested = 0;
+  if (downstream_state & status_bits_t::NEW_GOP_NEEDED) {
+    requested = stream_mask ? stream_mask : 1;
+  }
+  // If a stream transitioned from a state of not needing a new GOP, to
+  // needing a new GOP set its atomic flag.
+  for (uint8_t i = 0; i < vrts_max_streams; i++) {
+    uint8_t stream_bit = 1 << i;
+    if (!(requested & stream_bit) || (last_gop_request_mask & stream_bit)) {
+      continue;
+    }
+    auto &stream = streams[i];
+    std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+    // A paced GOP start reaches the receiver over several service passes,
+    // and its ACKs carry the request until the PPS is parsed. Hold off while
+    // the GOP we already sent is in flight; the next ACK re-evaluates. What
+    // was fed before it is of no use downstream any more.
+    if (stream.tx_gop_in_flight) {
+      auto *chunk = tx_stream_tree.hot(stream.tx_gop_last_id);
+      if (chunk != nullptr && !chunk->was_acked) {
+        auto &last = *tx_stream_tree.cold(stream.tx_gop_last_id);
+        dropTxFramesBefore(stream, stream.tx_gop_last_id -
+                                       last.header.parent_id_offset);
+        requested &= ~stream_bit;
+        continue;
+      }
+      stream.tx_gop_in_flight = false;
+    }
     // This will be cleared by the input parser.
-    vrcout() << "[vrts] downstream requested new GOP" << std::endl;
-    new_gop_needed = true;
-    statistics.gop_requests++;
+    VRTS_TRACE(INFO, "[vrts] downstream requested new GOP for stream {}", i);
+    stream.new_gop_needed = true;
+    metrics.gop_requests++;
 
-    // Flush tx tree here.
-    flushTXTree();
+    // Flush the stream's part of the tx tree here.
+    flushTXStream(i);
   }
 
-  last_input_status_bit_state = downstream_state;
+  last_gop_request_mask = requested;
+}
+
+void VRTS::setGOPRequest(vrts_packetheader_t &header) {
+  // Streams the peer never sent aren't asked for anything.
+  uint8_t requested = gop_request_mask & rx_streams_seen;
+  header.status_bits =
+      requested ? status_bits_t::NEW_GOP_NEEDED : static_cast<status_bits_t>(0);
+  header.stream_id = requested;
 }
 
 void VRTS::flushTXTree(void) {
   std::lock_guard<std::mutex> tx_tree_lock{tx_tree_mutex};
+  tx_stream_tree.forEach(
+      [](uint32_t, vrts_local_txdata_t &, vrts_tx_packet_t &packet) {
+        packet.block.reset();
+      });
   tx_stream_tree.clear();
+  tx_timers.clear();
+  tx_fec_queue.clear();
+  for (auto &stream : streams) {
+    for (auto &unsent : stream.tx_unsent) {
+      unsent.clear();
+    }
+    stream.tx_frames.clear();
+    stream.tx_deficit = 0;
+    stream.tx_gop_in_flight = false;
+  }
+  pacer_blocked_since = {};
+  unacked = 0;
   // We don't handle any outstanding IDs.
   // The downstream side that requested the
   // new GOP will purge its RX tree.
@@ -1635,9 +4074,31 @@ void VRTS::flushTXTree(void) {
   //}
 }
 
+void VRTS::flushTXStream(uint8_t stream_id) {
+  auto &stream = streams[stream_id];
+  // Timers and parity left for these ids find them gone.
+  for (auto &frame : stream.tx_frames) {
+    for (uint8_t i = 0; i < frame.fragments; i++) {
+      retireTxPacket(frame.first_id + i);
+    }
+  }
+  stream.tx_frames.clear();
+  for (auto &unsent : stream.tx_unsent) {
+    unsent.clear();
+  }
+  stream.tx_deficit = 0;
+  stream.tx_gop_in_flight = false;
+  if (tx_stream_tree.empty()) {
+    pacer_blocked_since = {};
+  }
+}
+
 void VRTS::flushRXTree(void) {
   std::lock_guard<std::mutex> rx_tree_lock{rx_tree_mutex};
   rx_stream_tree.clear();
+  rx_timers.clear();
+  rx_unacked_ids.clear();
+  rx_fec_groups.clear();
   // If we wanted to be smart about what exactly we clear,
   // we could iterate through the items like so:
   // for (auto &entry : rx_stream_tree) {
@@ -1645,10 +4106,68 @@ void VRTS::flushRXTree(void) {
   //}
 }
 
-bool VRTS::newGOPRequested(void) { return new_gop_needed; }
+void VRTS::updateTimestampSei(bool enable) { timestamp_sei_enabled = enable; }
+
+void VRTS::updateJitterBuffer(bool enable) { jitter_buffer_enabled = enable; }
+
+void VRTS::updateJitterBufferMaxDelay(uint32_t max_delay_ms) {
+  jitter_buffer_max_delay = std::chrono::milliseconds(max_delay_ms);
+}
+
+void VRTS::updateDependencyDiscard(bool enable) {
+  dependency_discard_enabled = enable;
+}
+
+void VRTS::setCaptureTime(vrts_clock_time_t capture_time, uint8_t stream_id) {
+  if (stream_id < vrts_max_streams) {
+    streams[stream_id].next_capture_time = capture_time;
+  }
+}
+
+bool VRTS::newGOPRequested(uint8_t stream_id) {
+  return stream_id < vrts_max_streams && streams[stream_id].new_gop_needed;
+}
+
+uint32_t VRTS::getTargetBitrate(uint8_t stream_id) {
+  if (stream_id >= vrts_max_streams) {
+    return 0;
+  }
+  // Streams nobody feeds, or nobody has fed for a while, don't take a
+  // share.
+  auto now = clockNow();
+  uint64_t total_weight = 0;
+  for (uint8_t i = 0; i < vrts_max_streams; i++) {
+    if (i == stream_id ||
+        (streams[i].input_rate_kbps > 0 &&
+         now - streams[i].input_last_time.load() < input_rate_interval)) {
+      total_weight += std::max<uint32_t>(streams[i].weight, 1);
+    }
+  }
+  return uint64_t{target_bitrate_kbps} *
+         std::max<uint32_t>(streams[stream_id].weight, 1) / total_weight;
+}
+
+void VRTS::updateStreamWeight(uint8_t stream_id, uint32_t weight) {
+  if (stream_id < vrts_max_streams) {
+    streams[stream_id].weight = weight;
+  }
+}
+
+void VRTS::setDataReadyCallback(
+    std::function<void(uint8_t stream_id)> callback) {
+  std::lock_guard<std::mutex> callback_lock{data_ready_mutex};
+  data_ready_callback = std::move(callback);
+}
+
+void VRTS::updateOutputOverflowPolicy(output_overflow_t policy) {
+  output_overflow_policy = policy;
+}
 
 void VRTS::updateAgeRemovalThreshold(uint32_t age_threshold_ms) {
   removal_age_threshold = std::chrono::milliseconds(age_threshold_ms);
+  for (int c = 0; c < NAL_CLASS_COUNT; c++) {
+    class_removal_age[c] = std::chrono::milliseconds(age_threshold_ms);
+  }
 }
 void VRTS::updateUnACKedRetransmitTimeThreshold(uint32_t retx_threshold_ms) {
   retransmit_time_threshold = std::chrono::milliseconds(retx_threshold_ms);
@@ -1657,11 +4176,49 @@ void VRTS::updateMaxUnACKedPacketsInTransit(uint32_t max_unack_count) {
   max_unacked_items_allowed = max_unack_count;
 }
 void VRTS::updateReTXLimitPerPacket(uint32_t retx_count_max) {
-  retransmit_count_limit = retx_count_max;
+  for (int c = 0; c < NAL_CLASS_COUNT; c++) {
+    class_retransmit_limit[c] = retx_count_max;
+  }
 }
 
 void VRTS::updateTemporalFilterLatencyThreshold(uint32_t in_transit_latency_ms) {
   temporal_layer_filter_latency_threshold = in_transit_latency_ms;
 }
 
+void VRTS::updateSegmentationOffload(bool enable) {
+  udp_gso_enabled = enable;
+}
+
+void VRTS::updateReceiveOffload(bool enable) {
+  udp_gro_enabled = enable;
+}
+
+void VRTS::updatePacingRate(uint32_t rate_kbps) {
+  pacing_rate_kbps = rate_kbps;
+}
+
+void VRTS::updatePacingBurst(uint32_t burst_bytes) {
+  pacing_burst_bytes = burst_bytes;
+}
+
+void VRTS::updateFecRedundancy(nal_class_t nal_class, uint32_t percent) {
+  if (nal_class < NAL_CLASS_COUNT) {
+    fec_redundancy_percent[nal_class] = percent;
+  }
+}
+
+void VRTS::updateClassReTXLimit(nal_class_t nal_class,
+                                uint32_t retx_count_max) {
+  if (nal_class < NAL_CLASS_COUNT) {
+    class_retransmit_limit[nal_class] = retx_count_max;
+  }
+}
+
+void VRTS::updateClassAgeRemovalThreshold(nal_class_t nal_class,
+                                          uint32_t age_threshold_ms) {
+  if (nal_class < NAL_CLASS_COUNT) {
+    class_removal_age[nal_class] = std::chrono::milliseconds(age_threshold_ms);
+  }
+}
+
 } // namespace vrts
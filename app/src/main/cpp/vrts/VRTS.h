@@ -3,30 +3,95 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <deque>
+#include <functional>
 #include <h265_bitstream_parser.h>
 #include <h265_common.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <stdint.h>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "Capture.h"
+#include "CongestionController.h"
+#include "Fec.h"
+#include "JitterBuffer.h"
+#include "Metrics.h"
+#include "PacketRing.h"
+#include "Pacer.h"
+#include "Pmtu.h"
+#include "Reactor.h"
+#include "Sack.h"
+#include "SpscQueue.h"
+#include "TimerWheel.h"
+#include "Timestamp.h"
+#include "Trace.h"
+#include "UdpReceiver.h"
+#include "UdpSender.h"
+#include "WireHeader.h"
 #include "mpegts/mpegts/mpegts_muxer.h"
 //#include <mpegts_muxer.h>
 
 /// @brief Namespace for the vr transport stream layer.
 namespace vrts {
 
-typedef enum { VRTS_DATA = 0, VRTS_ACKS, VRTS_NACKS } vrts_packet_type_t;
+/// @brief How much a block of NALs matters to the decoder, least first.
+/// @details A block takes the class of its most important NAL.
+typedef enum {
+  NAL_CLASS_NON_REFERENCE = 0,
+  NAL_CLASS_REFERENCE,
+  NAL_CLASS_IRAP,
+  NAL_CLASS_PARAMETER_SETS,
+  NAL_CLASS_COUNT
+} nal_class_t;
 
-// Bits to pack into headers of ACKS/NACKS
-// to let upstream know that some action
-// needs to be taken. Piggyback on top of
-// existing comms.
-typedef enum { NEW_GOP_NEEDED = 1 } status_bits_t;
+/// @brief What to give up when a stream's output queue is full.
+typedef enum {
+  // Drop the oldest queued blocks to make room. Blocks a decoder can start
+  // over from are kept, the new block goes instead unless it is one too. So
+  // does a new block nothing refers to when the oldest is a reference. If a
+  // reference goes, a new GOP is asked for.
+  OUTPUT_OVERFLOW_DROP_OLDEST = 0,
+  // Drop the new block and ask the sender for a new GOP. Nothing more is
+  // queued until it arrives.
+  OUTPUT_OVERFLOW_NEW_GOP,
+} output_overflow_t;
+
+/// @brief A reassembled NAL block waiting for the consumer.
+typedef struct {
+  std::vector<uint8_t> data;
+  // Has parameter sets or an IRAP picture.
+  bool gop_start;
+  nal_class_t nal_class;
+  // When the chain was complete, and when the picture was captured on our
+  // clock if the sender stamped it and the clocks are synced.
+  std::chrono::system_clock::time_point reassembled;
+  std::chrono::system_clock::time_point capture_time;
+  bool stamped;
+  // When it went on the output queue.
+  std::chrono::system_clock::time_point queued;
+} vrts_output_block_t;
+
+/// @brief What parse() knows about a block of NALs when it feeds it.
+typedef struct {
+  nal_class_t nal_class;
+  // Type of the first NAL of that class, vrts_nal_type_unknown if none.
+  uint8_t nal_type;
+  // Lowest temporal id in the block.
+  uint8_t temporal_id;
+  // Type of the block's first picture NAL and its POC lsb,
+  // vrts_nal_type_unknown if it has none.
+  uint8_t picture_type;
+  uint32_t poc;
+} vrts_nal_tag_t;
+
+constexpr uint8_t vrts_nal_type_unknown = 0xff;
 
 // Define clock time point type
 #ifdef __ANDROID__
@@ -35,19 +100,11 @@ using vrts_clock_time_t = std::chrono::system_clock::time_point;
 using vrts_clock_time_t = std::chrono::_V2::system_clock::time_point;
 #endif
 
-// TODO: Simplify this, drop bytes.
-/// @brief Simple packet header structure
-/// @param parent_id_offset Subtract from current packet id to get
-///                         the parent packet_id in the fragment chain.
-///                         We use an offset to save 3 bytes in the header.
-typedef struct {
-  uint32_t packet_id;
-  uint8_t parent_id_offset;
-  uint8_t packet_type;
-  uint8_t fragments;
-  status_bits_t status_bits;
-  uint16_t length;
-} vrts_packetheader_t;
+/// @brief Streams one session can carry, see parse().
+constexpr uint8_t vrts_max_streams = 4;
+static_assert(vrts_max_streams <= 8, "streams are passed around as a mask");
+/// @brief NAL blocks a stream holds for its consumer.
+constexpr size_t vrts_output_queue_depth = 128;
 
 /// @brief Structure for local packet trees.
 /// @details currently fixed size for initial
@@ -56,18 +113,99 @@ typedef struct {
   uint8_t data[1472 - sizeof(vrts_packetheader_t)];
 } vrts_packet_t;
 
+/// @brief Payload of one fed NAL block, as views into the buffers it was
+/// parsed from.
+/// @details Start codes point at a shared constant, everything else at the
+/// encoder's buffers, which owners keeps alive. The block is dropped, and
+/// the buffers released, with the last fragment referring to it.
+typedef struct {
+  std::vector<struct iovec> segments;
+  size_t length;
+  std::vector<std::shared_ptr<const void>> owners;
+} vrts_tx_block_t;
+
+/// @brief Transmit side payload slab entry.
+/// @details Fragments aren't copied out of their block, the header and the
+/// block's bytes from offset on are gathered into the datagram at send time.
+typedef struct {
+  vrts_packetheader_t header;
+  std::shared_ptr<const vrts_tx_block_t> block;
+  uint32_t offset;
+} vrts_tx_packet_t;
+
+/// @brief Start of a VRTS_FEC payload.
+/// @details The packet header carries the chain's first id in packet_id and
+/// its fragment count in fragments. Each data fragment is coded as a shard
+/// of its 16-bit length followed by its payload, zero padded to the longest
+/// fragment; fragment_length and the bytes after it are this parity shard.
+typedef struct {
+  uint8_t parity_count;
+  uint8_t parity_index;
+  uint16_t fragment_length;
+} vrts_fec_header_t;
+
+/// @brief Parity waiting for the last fragment of its chain to be sent.
 typedef struct {
-  vrts_packet_t ota_packet;
+  uint32_t last_id;
+  bool queued;
+  vrts_packet_t packet;
+} vrts_tx_fec_t;
+
+/// @brief Receive side state of one FEC protected fragment chain.
+typedef struct {
+  vrts_clock_time_t first_seen;
+  vrts_clock_time_t last_seen;
+  uint8_t stream_id;
+  uint8_t fragments;
+  uint8_t parity_count;
+  uint16_t shard_length;
+  bool dirty;
+  // Indexed by parity_index, empty until that shard arrived.
+  std::vector<std::vector<uint8_t>> parity;
+} vrts_rx_fec_t;
+
+/// @brief Hot per-packet transmit state, kept parallel to the payload slab.
+typedef struct {
+  vrts_clock_time_t queued_time_local;
+  vrts_clock_time_t sent_time_local;
+  vrts_clock_time_t acked_time_local;
+  vrts_clock_time_t nacked_time_local;
   bool was_sent;
   bool was_acked;
   bool was_nacked;
   uint8_t retx_count;
-  vrts_clock_time_t sent_time_local;
-  vrts_clock_time_t acked_time_local;
-  vrts_clock_time_t nacked_time_local;
-
+  uint8_t stream_id;
+  uint8_t nal_class;
+  uint8_t nal_type;
+  uint8_t temporal_id;
+  // Place of its first transmission among everything sent, and whether a
+  // higher id went out before it, see nackTxPacket().
+  uint32_t send_seq;
+  bool sent_behind;
 } vrts_local_txdata_t;
 
+/// @brief Index entry of a block fed to the tx tree, usually an access
+/// unit. Its fragments are the ids from first_id on.
+typedef struct {
+  uint32_t first_id;
+  uint8_t fragments;
+  // Picture type, POC lsb and lowest temporal id, see vrts_nal_tag_t.
+  uint8_t picture_type;
+  uint32_t poc;
+  uint8_t temporal_id;
+} vrts_tx_frame_t;
+
+/// @brief A picture of the current GOP as far as decoding the ones after
+/// it is concerned.
+/// @details reference is false for sub-layer non-reference pictures, which
+/// nothing of their own temporal layer or below may refer to.
+typedef struct {
+  uint32_t poc;
+  uint8_t temporal_id;
+  bool reference;
+  bool decodable;
+} vrts_ref_picture_t;
+
 // TODO: Replace with copy of last slice_segment_header and parser state?
 typedef struct {
   h265nal::H265BitstreamParserState bitstream_parser_state;
@@ -76,16 +214,102 @@ typedef struct {
   uint32_t running_poc;
   uint32_t last_slice_state;
   bool pending_contains_pps;
+  vrts_nal_tag_t pending_tag;
   uint16_t max_poc;
+  // Non-reference pictures the jitter buffer skipped since the last one
+  // parsed, which the POC check makes allowance for.
+  uint16_t skipped_pictures;
+  // Reference graph of the GOP being output, pictures in decode order. Only
+  // the newest are kept, short-term references don't reach further back.
+  std::deque<vrts_ref_picture_t> ref_pictures;
 } parse_tracking_data_t;
 
+/// @brief A reassembled block held by the jitter buffer until it is due.
+typedef struct {
+  vrts_output_block_t block;
+  vrts_clock_time_t deadline;
+} vrts_playout_entry_t;
+
+/// @brief State of one multiplexed stream.
+/// @details All streams share the packet id space, the congestion controller
+/// and the pacer; this is what each has of its own. The input fields belong
+/// to the thread calling parse() for the stream, the tx fields are guarded
+/// by tx_tree_mutex and the output fields by rx_tree_mutex.
+typedef struct {
+  // Input
+  vrts_tx_block_t pending_input_entry;
+  parse_tracking_data_t input_state;
+  // Rate offered to parse(), and whether temporal layers are being dropped
+  // because it is over the stream's share of the target.
+  vrts_clock_time_t input_rate_window_start;
+  uint32_t input_rate_window_bytes;
+  std::atomic<uint32_t> input_rate_kbps;
+  // Last time parse() was called for the stream. One left unfed for an
+  // input rate interval gives up its share, see getTargetBitrate().
+  std::atomic<vrts_clock_time_t> input_last_time;
+  bool temporal_drop_active;
+  std::atomic<bool> new_gop_needed;
+  // Capture time of the next access unit, see setCaptureTime().
+  vrts_clock_time_t next_capture_time;
+  // Transmit
+  std::atomic<uint32_t> weight;
+  // Ids never sent yet, in feed order per NAL class.
+  std::deque<uint32_t> tx_unsent[NAL_CLASS_COUNT];
+  // Blocks fed that may still have fragments in the tx tree, oldest first.
+  std::deque<vrts_tx_frame_t> tx_frames;
+  // Bytes the stream may still send in its current round.
+  int64_t tx_deficit;
+  // Last packet of the newest fed block that started a GOP.
+  uint32_t tx_gop_last_id;
+  bool tx_gop_in_flight;
+  // Output
+  // Last id handed to the consumer, once one was. Later ones only are
+  // accepted.
+  std::atomic<uint32_t> rx_id_discard_threshold;
+  bool rx_id_discard_valid;
+  // First ids of chains dropped ahead of the output, see dropDependent().
+  // Their late fragments are ignored like those of chains handed out.
+  std::deque<uint32_t> rx_dropped_chains;
+  parse_tracking_data_t output_state;
+  // Transit times of the blocks the sender stamped, and the blocks waiting
+  // for their playout deadline, in order. See updateJitterBuffer().
+  JitterEstimator playout_jitter;
+  std::deque<vrts_playout_entry_t> playout_queue;
+  // Filled by the reactor thread, drained by the one consumer.
+  SpscQueue<vrts_output_block_t> output_queue{vrts_output_queue_depth};
+  MpegTsMuxer *muxer;
+} vrts_stream_t;
+
+/// @brief Hot per-packet receive state, kept parallel to the payload slab.
+/// @details Copies the header fields the reassembly scan needs so that the
+/// scan never has to touch the payload.
 typedef struct {
-  vrts_packet_t ota_packet;
   vrts_clock_time_t received_time_local;
   bool ack_sent;
   bool in_consumer_queue;
+  uint8_t parent_id_offset;
+  uint8_t fragments;
+  // The sender's timestamp extension, which it puts on the first fragment
+  // of a chain: when it was fed, in us on its clock modulo 2^32.
+  bool stamped;
+  uint32_t sent_us;
 } vrts_local_rxdata_t;
 
+/// @brief Latency percentiles over one window, in ms.
+typedef struct {
+  float p50;
+  float p99;
+  float p999;
+  uint32_t samples;
+} vrts_latency_window_t;
+
+/// @brief Latency percentiles over the last 1, 10 and 60 seconds.
+typedef struct {
+  vrts_latency_window_t last_1s;
+  vrts_latency_window_t last_10s;
+  vrts_latency_window_t last_60s;
+} vrts_latency_stat_t;
+
 /// @brief Structure for collecting statistics.
 typedef struct {
   int64_t timestamp_ms;
@@ -103,15 +327,54 @@ typedef struct {
   uint32_t ack_not_in_tree;
   uint32_t nack_total;
   uint32_t nack_since;
+  uint32_t ack_byte_total;
+  uint32_t fec_sent;
+  uint32_t fec_recovered;
   uint32_t retx_total;
   uint32_t retx_since;
   uint32_t tx_queued;
   uint32_t rx_queued;
+  uint32_t output_queue_depth;
+  uint32_t output_queue_drops;
+  // Of those, blocks later pictures refer to, each costing a new GOP.
+  uint32_t output_reference_drops;
   uint32_t gop_requests;
+  // Restarts of the peer noticed by its epoch, and packets dropped for
+  // belonging to an earlier session of it.
+  uint32_t peer_restarts;
+  uint32_t stale_epoch_drops;
+  // Blocks the jitter buffer released after their deadline because they
+  // are needed for decoding, and late ones it dropped, complete or not.
+  uint32_t playout_late;
+  uint32_t playout_skipped;
+  // Chains handed out while an older one was still incomplete, because it
+  // was of another stream or skipped for them.
+  uint32_t hol_bypassed;
+  // Frames dropped from the tx store unsent or unrepaired because a newer
+  // IRAP picture makes them useless to the receiver.
+  uint32_t obsolete_frames;
+  // Pictures not handed out because one they refer to was lost, and sent
+  // packets the receiver cancelled because nothing could decode them.
+  uint32_t undecodable_pictures;
+  uint32_t cancelled_packets;
   uint32_t send_buf_ms;
+  uint32_t send_syscalls;
+  uint32_t recv_syscalls;
+  // Datagrams dropped for not fitting the receive buffer.
+  uint32_t recv_truncated;
+  uint32_t recv_buf_bytes;
+  // Payload of a full data fragment, and the largest datagram the path was
+  // last found to carry, 0 until a PMTU probe got through.
+  uint32_t fragment_bytes;
+  uint32_t path_mtu_bytes;
+  uint32_t wakeups_total;
+  uint32_t wakeups_socket;
+  uint32_t wakeups_feed;
+  uint32_t wakeups_timer;
   uint16_t pending_acks;
   uint16_t rtt_peak;
   uint16_t temporal_filter;
+  uint16_t congestion_state;
   float rtt_average;
   float rtt_acked;
   float rtt_nacked;
@@ -126,114 +389,654 @@ typedef struct {
   float drop_percent;
   float loss_percent;
   float nack_rate;
+  float ack_overhead_percent;
+  float pacing_rate_kbps;
+  float pacing_sent_kbps;
+  float pacing_delay_ms;
+  float target_bitrate_kbps;
+  float input_rate_kbps;
+  float queue_delay_ms;
+  float delay_trend;
+  float syscalls_per_pkt;
+  float recv_pkts_per_syscall;
+  float wakeup_rate;
+  float reactor_cpu_percent;
+  float reactor_idle_percent;
+  // The peer's clock minus ours, and the round trip that was measured
+  // over. The offset is 0 and the round trip -1 until a clock probe was
+  // answered.
+  float clock_offset_ms;
+  float clock_rtt_ms;
+  // Interarrival jitter of complete blocks, and the delay the jitter buffer
+  // aims to add for it, of the stream where both are largest. 0 while the
+  // jitter buffer is off or still measuring.
+  float jitter_ms;
+  float playout_target_ms;
+  // Data sent to first ACK, retransmits left out.
+  vrts_latency_stat_t rtt_latency;
+  // Data received to the ACK covering it going out.
+  vrts_latency_stat_t ack_delay;
+  // First fragment of a chain received to the chain complete.
+  vrts_latency_stat_t reassembly_latency;
+  // NAL block fed to its last fragment ACKed, so end to end plus the way
+  // back of one ACK.
+  vrts_latency_stat_t nal_latency;
+  // Stages of the access units the sender stamped, see
+  // updateTimestampSei(): capture to parse() on the sender, parse() to
+  // reassembled here, reassembled to handed to the consumer, and capture to
+  // handed out. Those crossing the link need the clocks synced first.
+  // Output is the time on the output queue only, time held by the jitter
+  // buffer is playout_delay, which counts every block.
+  vrts_latency_stat_t encode_latency;
+  vrts_latency_stat_t transport_latency;
+  vrts_latency_stat_t playout_delay;
+  vrts_latency_stat_t output_latency;
+  vrts_latency_stat_t glass_latency;
 } vrts_stat_t;
 
+/// @brief Live counters and histograms behind vrts_stat_t.
+/// @details Updated from the reactor and the parse threads without locks;
+/// getStatistics() turns them into a vrts_stat_t. The averages and gauges
+/// each have a single writer.
+typedef struct {
+  Counter send_byte_total;
+  Counter recv_byte_total;
+  Counter send_pkt_total;
+  Counter send_pkt_dropped;
+  Counter send_pkt_loss;
+  Counter recv_pkt_total;
+  Counter ack_total;
+  Counter ack_not_in_tree;
+  Counter nack_total;
+  Counter ack_byte_total;
+  Counter fec_sent;
+  Counter fec_recovered;
+  Counter retx_total;
+  Counter gop_requests;
+  Counter peer_restarts;
+  Counter stale_epoch_drops;
+  Counter playout_late;
+  Counter playout_skipped;
+  Counter hol_bypassed;
+  Counter obsolete_frames;
+  Counter undecodable_pictures;
+  Counter cancelled_packets;
+  Counter send_syscalls;
+  Counter recv_syscalls;
+  Counter recv_truncated;
+  Counter output_queue_drops;
+  Counter output_reference_drops;
+  std::atomic<uint32_t> recv_buf_bytes;
+  std::atomic<uint32_t> path_mtu_bytes;
+  std::atomic<uint32_t> pending_acks;
+  std::atomic<uint32_t> send_buf_ms;
+  std::atomic<uint16_t> temporal_filter;
+  std::atomic<uint16_t> rtt_peak;
+  std::atomic<float> rtt_average;
+  std::atomic<float> rtt_acked;
+  std::atomic<float> rtt_nacked;
+  std::atomic<float> tx_in_transit;
+  std::atomic<float> pacing_delay_ms;
+  LatencyHistogram rtt;
+  LatencyHistogram ack_delay;
+  LatencyHistogram reassembly;
+  LatencyHistogram nal_latency;
+  LatencyHistogram encode_latency;
+  LatencyHistogram transport_latency;
+  LatencyHistogram playout_delay;
+  LatencyHistogram output_latency;
+  LatencyHistogram glass_latency;
+} vrts_metrics_t;
+
 class VRTS {
 public:
   VRTS(uint16_t downstream_port, uint16_t upstream_port,
        std::string downstream_ip, std::string upstream_ip,
        uint16_t sync_rate_hz);
+  /// @brief A session on a virtual link: no sockets and no reactor thread.
+  /// @details Datagrams are handed to link_send as they are sent and come in
+  /// through receive(). The session's clock is whatever step() was given
+  /// last, starting at start, so it runs as fast as it is driven and the
+  /// same way every time. step(), receive() and the stream consumers must
+  /// all be on one thread; parse() too, unless it is told apart by time.
+  VRTS(udp_sink_t link_send, vrts_clock_time_t start,
+       uint16_t sync_rate_hz = 100);
   ~VRTS();
 
-  bool parse(uint8_t *data, size_t len);
-  bool dataReady(void);
+  /// @brief Feed encoder output of one stream.
+  /// @details Each stream has its own parser state and GOP handling. Streams
+  /// may be fed from different threads, but each from only one.
+  /// The data is copied once, so the buffer may be reused on return.
+  /// @param stream_id below vrts_max_streams, 0 is what older peers see.
+  bool parse(uint8_t *data, size_t len, uint8_t stream_id = 0);
+  /// @brief Feed an encoder owned buffer of one stream without copying it.
+  /// @details Fragments are sent straight out of data, which must stay valid
+  /// and unchanged until release is called. That happens once nothing
+  /// refers to it any more, i.e. its NALs were dropped or every fragment was
+  /// acknowledged or given up on, on whichever thread that was. The input
+  /// is only cut into NAL blocks when the next access unit starts, so a
+  /// buffer is held at least until the following one was parsed. release
+  /// must not call into VRTS.
+  bool parse(const uint8_t *data, size_t len, std::function<void(void)> release,
+             uint8_t stream_id = 0);
+  bool dataReady(uint8_t stream_id = 0);
 
+  /// @brief Largest fragment payload to send, VRTS header not included.
+  /// @details With a peer that answers PMTU probes this is only the upper
+  /// bound, fragments are cut to what the path was found to carry.
+  /// @returns false if a fragment that size can't be sent.
   bool setMtu(uint16_t new_mtu);
-  const std::vector<uint8_t> getData(void);
-  const std::vector<uint8_t> getDataAsMPEGTS(void);
+  /// @brief Next NAL block of a stream, empty if there is none.
+  /// @details Each stream's output may be drained by one thread at a time.
+  const std::vector<uint8_t> getData(uint8_t stream_id = 0);
+  /// @brief Take the next NAL block of a stream if there is one.
+  bool popData(std::vector<uint8_t> &nal, uint8_t stream_id = 0);
+  /// @brief Take the next NAL block of a stream, waiting up to timeout.
+  bool popData(std::vector<uint8_t> &nal, uint8_t stream_id,
+               std::chrono::milliseconds timeout);
+  /// @brief Called on the reactor thread whenever a block was queued for a
+  /// stream, so a consumer of several streams can sleep until then. Must be
+  /// quick and must not call into VRTS.
+  void setDataReadyCallback(std::function<void(uint8_t stream_id)> callback);
+  /// @brief What a full output queue gives up, see output_overflow_t.
+  void updateOutputOverflowPolicy(output_overflow_t policy);
+  /// @brief Next NAL block of a stream as MPEG-TS, empty if there is none.
+  /// Each stream has its own muxer, with PMT and video PIDs offset by the
+  /// stream id.
+  const std::vector<uint8_t> getDataAsMPEGTS(uint8_t stream_id = 0);
   void getStatistics(vrts_stat_t& stats);
   void resetStatistics(void);
+  /// @brief How long either side keeps an unacknowledged packet. Also sets
+  /// the age-out of every NAL class.
   void updateAgeRemovalThreshold(uint32_t age_threshold_ms);
   void updateUnACKedRetransmitTimeThreshold(uint32_t retx_threshold_ms);
   void updateMaxUnACKedPacketsInTransit(uint32_t max_unack_count);
+  /// @brief Set the retransmit limit of every NAL class.
   void updateReTXLimitPerPacket(uint32_t retx_count_max);
   void updateTemporalFilterLatencyThreshold(uint32_t in_transit_latency_ms);
-  bool newGOPRequested(void);
+  /// @brief Allow UDP generic segmentation offload for fragment trains.
+  void updateSegmentationOffload(bool enable);
+  /// @brief Accept UDP generic receive offload (coalesced) buffers.
+  void updateReceiveOffload(bool enable);
+  /// @brief Parity packets per 100 data fragments for a NAL class, rounded
+  /// up. 0 turns FEC off for the class.
+  void updateFecRedundancy(nal_class_t nal_class, uint32_t percent);
+  /// @brief Retransmits allowed for packets of a NAL class. The
+  /// non-reference class is only ever resent when the pacer has room.
+  void updateClassReTXLimit(nal_class_t nal_class, uint32_t retx_count_max);
+  /// @brief Age after which the sender gives up on a packet of a NAL class,
+  /// sent or not. Ages above the removal threshold gain nothing, as the
+  /// receiver stops waiting for a hole by then.
+  void updateClassAgeRemovalThreshold(nal_class_t nal_class,
+                                      uint32_t age_threshold_ms);
+  /// @brief Pace data onto the link at this rate. 0 follows the congestion
+  /// controller.
+  void updatePacingRate(uint32_t rate_kbps);
+  /// @brief Bytes that may leave back to back after an idle period.
+  void updatePacingBurst(uint32_t burst_bytes);
+  bool newGOPRequested(uint8_t stream_id = 0);
+  /// @brief Stamp every access unit with when it was captured and fed, in
+  /// a user data SEI after its AUD, so the receiver can tell encoder, link
+  /// and consumer latency apart. Decoders skip the SEI. Off by default.
+  void updateTimestampSei(bool enable);
+  /// @brief Hold reassembled blocks until a playout deadline instead of
+  /// handing them out the moment they are complete.
+  /// @details Deadlines follow the sender's feed times, delayed by as much
+  /// as recent blocks took beyond the fastest, so the consumer gets blocks
+  /// as evenly as they were fed. A block that misses its deadline is still
+  /// handed out if pictures after it refer to it, and dropped if not; a
+  /// non-reference picture still missing fragments by then is skipped
+  /// rather than waited for. Needs a peer sending compact headers, blocks
+  /// of older peers are handed out as before. Off by default.
+  void updateJitterBuffer(bool enable);
+  /// @brief Most the jitter buffer may delay a block, 100 ms by default.
+  void updateJitterBufferMaxDelay(uint32_t max_delay_ms);
+  /// @brief Drop a chain that refers to a picture known to be lost as soon
+  /// as its first fragment is in, rather than once it is complete, and have
+  /// the sender cancel what of it is still missing. On by default.
+  void updateDependencyDiscard(bool enable);
+  /// @brief When the access unit fed next on a stream was captured, on
+  /// this session's clock. Call from the thread feeding the stream, before
+  /// parse(). Without it the time parse() got it stands in.
+  void setCaptureTime(vrts_clock_time_t capture_time, uint8_t stream_id = 0);
+  /// @brief Bitrate a stream's encoder should aim for, in kbit/s: its
+  /// weighted share, among the streams being fed, of what the congestion
+  /// controller estimates. Temporal layers are dropped above it.
+  uint32_t getTargetBitrate(uint8_t stream_id = 0);
+  /// @brief Relative share of the link for a stream, 1 by default.
+  /// @details New data is sent by deficit round robin, each stream getting
+  /// weight datagrams' worth per round while it has data waiting.
+  void updateStreamWeight(uint8_t stream_id, uint32_t weight);
+
+  /// @brief Move a virtual link session's clock to now and service it.
+  /// @returns when it next needs a step() by itself, max() if nothing is
+  /// due before the next receive() or parse().
+  vrts_clock_time_t step(vrts_clock_time_t now);
+  /// @brief Deliver a datagram to a virtual link session, handled on the
+  /// next step().
+  void receive(const uint8_t *data, size_t len, vrts_clock_time_t rx_time);
+
+  /// @brief Record every datagram sent and received, and all encoder
+  /// input, to a pcapng file. See CaptureWriter and vrts-replay.
+  bool startCapture(const std::string &path);
+  void stopCapture(void);
 
 private:
-  std::shared_ptr<std::thread> tx_handler;
-  std::shared_ptr<std::thread> rx_handler;
+  std::shared_ptr<std::thread> reactor_thread;
+  Reactor reactor;
   uint16_t sync_hz;
-  uint16_t mtu;
-  std::map<uint32_t, vrts_local_txdata_t> tx_stream_tree;
-  std::map<uint32_t, vrts_local_rxdata_t> rx_stream_tree;
+  // Fragment payload in use, and the one setMtu() allows.
+  std::atomic<uint16_t> mtu;
+  std::atomic<uint16_t> mtu_limit;
+  PacketRing<vrts_local_txdata_t, vrts_tx_packet_t> tx_stream_tree;
+  PacketRing<vrts_local_rxdata_t, vrts_packet_t> rx_stream_tree;
   std::mutex tx_tree_mutex;
   std::mutex rx_tree_mutex;
+  // Per-packet deadlines, guarded by the matching tree mutex.
+  TimerWheel tx_timers;
+  TimerWheel rx_timers;
   uint32_t current_packet_id;
   std::atomic<bool> keep_running;
   std::atomic<bool> service_tx_tree;
-  std::atomic<bool> new_gop_needed;
   std::atomic<bool> flush_tx_tree;
   std::atomic<uint32_t> total_sent;
   std::atomic<uint16_t> max_unacked_full_rate;
   std::atomic<uint16_t> unacked;
 
   // Input/output parsing
-  std::vector<uint8_t> pending_input_entry;
+  vrts_stream_t streams[vrts_max_streams];
   // Experimental option to drop NALs by type.
   std::vector<h265nal::NalUnitType> filter_list;
   std::vector<h265nal::NalUnitType> threshold_list;
-  parse_tracking_data_t input_state;
-  parse_tracking_data_t output_state;
-  // What should be going out in nacks / acks
-  std::atomic<uint8_t> global_status_bit_state;
-  // Tracking input status bit state over time
-  std::atomic<uint8_t> last_input_status_bit_state;
+  // Streams whose output waits for a new GOP, sent out in acks / nacks.
+  std::atomic<uint8_t> gop_request_mask;
+  // Streams data was received for. Stream 0 always counts.
+  std::atomic<uint8_t> rx_streams_seen;
+  // Tracking the peer's GOP requests over time
+  std::atomic<uint8_t> last_gop_request_mask;
 
   // Tunables
-  std::atomic<uint32_t> rx_id_discard_threshold;
   std::atomic<std::chrono::milliseconds> removal_age_threshold;
   std::atomic<std::chrono::milliseconds> retransmit_time_threshold;
   std::atomic<uint32_t> max_unacked_items_allowed;
-  std::atomic<uint32_t> retransmit_count_limit;
+  std::atomic<uint32_t> class_retransmit_limit[NAL_CLASS_COUNT];
+  std::atomic<std::chrono::milliseconds> class_removal_age[NAL_CLASS_COUNT];
   std::atomic<uint32_t> temporal_layer_filter_latency_threshold;
+  std::atomic<bool> udp_gso_enabled;
+  std::atomic<bool> udp_gro_enabled;
+  std::atomic<uint32_t> fec_redundancy_percent[NAL_CLASS_COUNT];
+  std::atomic<uint32_t> pacing_rate_kbps;
+  std::atomic<uint32_t> pacing_burst_bytes;
+  std::atomic<bool> timestamp_sei_enabled;
+  std::atomic<bool> jitter_buffer_enabled;
+  std::atomic<std::chrono::milliseconds> jitter_buffer_max_delay;
+  std::atomic<bool> dependency_discard_enabled;
 
   std::atomic<bool> should_ack;
-  std::deque<std::vector<uint8_t>> output_queue;
+  // Data received since the last ACK went out. Reactor thread only.
+  bool acks_pending;
+  // Received ids not ACKed yet, guarded by rx_tree_mutex.
+  std::vector<uint32_t> rx_unacked_ids;
+  // Everything received recently, for SACKs and NACKs. rx_tree_mutex.
+  SackTracker rx_sack;
+  // rx_sack changed since the last SACK. rx_tree_mutex.
+  bool rx_sack_dirty;
+  // Missing ids given up on since the last VRTS_CANCEL. rx_tree_mutex.
+  std::vector<uint32_t> rx_cancel_ids;
+  // Unchanged SACKs still to repeat. Reactor thread only.
+  uint8_t sack_repeats;
+  // Wire format the peer advertised on its last packet.
+  std::atomic<uint8_t> peer_version;
+  // Deficit round robin position, and whether that stream was already
+  // credited for its turn. tx_tree_mutex.
+  uint8_t tx_drr_stream;
+  bool tx_drr_credited;
+  // First transmissions so far, the send_seq of the latest one ACKed that
+  // was never resent, and one past the highest id sent. tx_tree_mutex.
+  uint32_t tx_send_seq;
+  uint32_t tx_acked_seq;
+  uint32_t tx_sent_end;
+  // Parity in chain order, guarded by tx_tree_mutex.
+  std::deque<vrts_tx_fec_t> tx_fec_queue;
+  // Scratch for gathering a fragment, and the compact headers queued since
+  // the last flush. Reactor thread only.
+  std::vector<struct iovec> tx_gather;
+  std::deque<std::array<uint8_t, vrts_compact_header_max>> tx_headers;
+  // Both guarded by tx_tree_mutex.
+  Pacer pacer;
+  CongestionController congestion;
+  // congestion's target, for the parse thread and the app.
+  std::atomic<uint32_t> target_bitrate_kbps;
+  // Set while new data is held back by the pacer. tx_tree_mutex.
+  vrts_clock_time_t pacer_blocked_since;
+  // Chains that announced FEC, by first id. rx_tree_mutex.
+  std::map<uint32_t, vrts_rx_fec_t, PacketIdOrder> rx_fec_groups;
+  std::atomic<output_overflow_t> output_overflow_policy;
+  std::mutex data_ready_mutex;
+  std::function<void(uint8_t)> data_ready_callback;
+
+  // Sockets, or the virtual link. Reactor thread (step() caller) only, as is
+  // the service loop state after them.
+  bool virtual_link;
+  std::atomic<vrts_clock_time_t> virtual_now;
+  UdpSender link_sender;
+  UdpReceiver link_receiver;
+  vrts_clock_time_t last_ack_check;
+  vrts_clock_time_t tx_deadline;
+  uint32_t rcvbuf_window;
+  capture_endpoints_t link_endpoints;
+  CaptureWriter capture;
+  // Offset of the peer's clock, and when to probe it next.
+  ClockSync clock_sync;
+  vrts_clock_time_t next_clock_probe;
+  // Probe to answer on the next rx pass, if pending.
+  vrts_clock_probe_t clock_reply;
+  bool clock_reply_pending;
+  // Path MTU search and the probe of it waiting for a reply, if any.
+  PmtuSearch pmtu;
+  vrts_clock_time_t next_pmtu_search;
+  uint32_t pmtu_probe_id;
+  uint16_t pmtu_probe_bytes;
+  vrts_clock_time_t pmtu_probe_sent;
+  uint64_t pmtu_oversize_seen;
+  // Probe to answer on the next rx pass, if pending.
+  vrts_packetheader_t pmtu_reply;
+  bool pmtu_reply_pending;
+  // Our epoch, the peer's once its hello came in and the peer's tag, which
+  // its data may tell first. 0 while unknown.
+  uint32_t session_epoch;
+  uint32_t peer_epoch;
+  uint8_t peer_epoch_tag;
+  // The peer answered our hello or predates epochs, so no more are sent.
+  bool epoch_confirmed;
+  vrts_clock_time_t next_hello;
+  vrts_clock_time_t::duration hello_interval;
+  // Hello to answer on the next rx pass.
+  bool hello_reply_pending;
 
   // mpegts related
-  std::map<uint8_t, int> streamPidMap;
   vrts_clock_time_t mpegtsPtsStart;
-  // Leave as void pointer so we don't have to add includes in this header.
-  MpegTsMuxer* lMuxer;
 
   // Statistics collection
+  vrts_metrics_t metrics;
+  // Last result of getStatistics(), which keeps the rates and averages of
+  // the sample window in it. statistics_mutex.
   vrts_stat_t statistics;
   std::mutex statistics_mutex;
+  vrts_clock_time_t stats_time_start;
+  vrts_clock_time_t stats_time_last;
+  // Totals at the start of the sample window.
+  vrts_stat_t stats_window_start;
+  uint32_t stats_wakeups_last;
+  uint64_t stats_cpu_ns_last;
+  uint64_t stats_idle_ns_last;
+  uint64_t stats_paced_bytes_last;
+  /// @brief CPU time used by the reactor thread, in ns.
+  uint64_t reactorCpuTimeNs(void);
 
-  void rxHandler(std::string upstream_ip, uint16_t upstream_port,
-                 std::string downstream_ip, uint16_t downstream_port);
-  void txHandler(std::string upstream_ip, uint16_t upstream_port,
-                 std::string downstream_ip, uint16_t downstream_port);
+  VRTS(uint16_t sync_rate_hz, bool virtual_link, vrts_clock_time_t start);
+  /// @brief The session's time: the wall clock, or the virtual link's.
+  vrts_clock_time_t clockNow(void) const;
+  void reactorLoop(std::string upstream_ip, uint16_t upstream_port,
+                   std::string downstream_ip, uint16_t downstream_port);
+  /// @brief One round of ACK, rx and tx service.
+  /// @returns when the next round is due.
+  vrts_clock_time_t servicePass(void);
+  vrts_clock_time_t rxService(UdpReceiver &receiver, UdpSender &sender);
+  vrts_clock_time_t txService(UdpSender &sender);
+  void ackService(UdpSender &sender);
+  /// @brief Send a clock probe, or the reply to the peer's.
+  void sendClockProbe(UdpSender &sender, bool reply);
+  /// @brief Probe the path MTU and follow the results.
+  /// @returns when it next needs a pass.
+  vrts_clock_time_t pmtuService(UdpSender &sender, vrts_clock_time_t now);
+  /// @brief Send a PMTU probe of pmtu_probe_bytes, or the reply to the
+  /// peer's.
+  void sendPmtuProbe(UdpSender &sender, bool reply);
+  /// @brief Announce our epoch, or answer the peer's hello.
+  void sendHello(UdpSender &sender, bool reply);
+  /// @brief Learn the peer's epoch from its hello or its answer to ours.
+  void handleHello(const vrts_hello_t &hello, bool reply);
+  /// @brief The peer restarted: drop everything in flight either way and
+  /// start over as with a new peer.
+  void resetPeerState(void);
+  void scheduleTxTimer(uint32_t id, const vrts_local_txdata_t &chunk);
+  void retireTxPacket(uint32_t id);
+  /// @brief Account for and retire an ACKed packet. Caller holds
+  /// tx_tree_mutex. @returns false if the id isn't in the tx tree.
+  bool ackTxPacket(uint32_t id, vrts_clock_time_t rx_time);
+  /// @brief Mark a packet NACKed. Caller holds tx_tree_mutex.
+  void nackTxPacket(uint32_t id, vrts_clock_time_t rx_time);
+  /// @brief Close out one ACK datagram in the congestion controller and
+  /// publish the new target. Caller holds tx_tree_mutex.
+  void updateCongestion(vrts_clock_time_t rx_time);
+  /// @brief Pacing rate in bytes/s. Caller holds tx_tree_mutex.
+  uint64_t pacingRate(void);
+  /// @brief Call fn with each id of [first, last) that is in the tx tree.
+  /// @details Only the part of the range the tree still covers is walked,
+  /// so a stale or malformed range costs no more than the tree is long.
+  /// Caller holds tx_tree_mutex.
+  template <typename Fn>
+  void forEachTxInRange(uint32_t first, uint32_t last, Fn &&fn);
+  /// @brief Apply a decoded SACK to the tx tree. Caller holds tx_tree_mutex.
+  void applySack(const vrts_sack_t &sack, vrts_clock_time_t rx_time);
+  /// @brief Queue the parity of every chain whose data has all been sent.
+  /// Entries are popped once the sender has been flushed.
+  /// @details Caller holds tx_tree_mutex.
+  void sendFec(UdpSender &sender);
+  /// @brief Drop never-sent packets that waited past their class age.
+  /// @details Caller holds tx_tree_mutex.
+  void pruneUnsent(vrts_clock_time_t now);
+  /// @brief Next id to send for the first time: streams by deficit round
+  /// robin, then most important class first.
+  /// @details The caller takes the packet's size off its stream's deficit
+  /// once sent. Caller holds tx_tree_mutex.
+  /// @returns false if nothing is waiting.
+  bool nextUnsent(uint32_t &id);
+  /// @brief Front of a stream's unsent queues, stale entries popped.
+  /// @details Caller holds tx_tree_mutex.
+  bool frontUnsent(vrts_stream_t &stream, uint32_t &id);
+  /// @brief Track a protected chain or store its parity. Caller holds
+  /// rx_tree_mutex.
+  void handleRxFec(const vrts_packet_t &rx_packet, vrts_clock_time_t rx_time);
+  /// @brief Whether id of a stream can't be handed to the consumer any more.
+  /// @details Caller holds rx_tree_mutex.
+  bool rxDelivered(uint8_t stream_id, uint32_t id);
+  /// @brief Rebuild missing fragments of protected chains from parity and
+  /// feed them back in as if received.
+  void recoverFecGroups(void);
+  /// @brief Whether a NACK for id should wait for parity still in flight.
+  /// @details Caller holds rx_tree_mutex.
+  bool fecHoldsNack(uint32_t id, vrts_clock_time_t now,
+                    vrts_clock_time_t &release);
 
   std::string nalTypeToString(h265nal::NalUnitType nalType);
-  void flushUpToNalType(h265nal::NalUnitType nal_type);
+  static nal_class_t nalClassOf(h265nal::NalUnitType nal_type);
+  /// @brief What the NAL headers in the first fragment of a chain tell of
+  /// it: chain_class is the highest class among them.
+  /// @returns whether a picture starts in there.
+  static bool sniffChain(const vrts_packet_t &first, nal_class_t &chain_class);
+  /// @brief Drop a stream's frames fed before its newest one whose picture
+  /// is of nal_type, or of any IRAP type if nal_type is one.
+  /// @details Looks back from the newest frame, so for one just fed the
+  /// first frame looked at is it.
+  void flushUpToNalType(uint8_t stream_id, h265nal::NalUnitType nal_type);
+  /// @brief Drop a stream's frames fed before the one starting at first_id
+  /// from the tx tree, sent or not. Caller holds tx_tree_mutex.
+  void dropTxFramesBefore(vrts_stream_t &stream, uint32_t first_id);
 
-  void udpSend(uint8_t *data, uint16_t len, std::string ip, uint16_t port);
-  bool udpRecv(vrts_local_rxdata_t &entry, std::string ip, uint16_t port);
+  /// @brief Queue a packet on a thread's sender, its header in the form
+  /// the peer understands. Goes out on udpFlush().
+  /// @returns the datagram's size.
+  uint16_t udpSend(UdpSender &sender, vrts_packet_t &packet);
+  /// @brief Queue a data fragment, gathered from its header and its block.
+  /// @returns the datagram's size.
+  /// @details The first fragment of a chain carries when it was fed.
+  uint16_t udpSendTx(UdpSender &sender, const vrts_tx_packet_t &packet,
+                     const vrts_local_txdata_t &chunk);
+  /// @brief Start tx_gather with the header in the form the peer
+  /// understands.
+  /// @param ext optional fields, left out where they don't fit.
+  void gatherHeader(const vrts_packetheader_t &header,
+                    const vrts_header_ext_t *ext = nullptr);
+  /// @brief Queue tx_gather as one datagram. @returns its size.
+  uint16_t queueGathered(UdpSender &sender);
+  /// @brief Send everything queued on the sender and account for it.
+  void udpFlush(UdpSender &sender);
+  /// @brief Drain one batch from the receiver and account for it.
+  /// @param wait block up to the socket timeout for the first datagram.
+  size_t udpRecv(UdpReceiver &receiver, bool wait);
+  /// @brief Handle one received ACK/NACK/DATA packet.
+  /// @param rx_time kernel receive timestamp of the datagram.
+  /// @param wire_bytes size of the datagram, header included.
+  /// @param ext the header's optional fields.
+  void handleRxPacket(vrts_packet_t &rx_packet, vrts_clock_time_t rx_time,
+                      size_t wire_bytes, const vrts_header_ext_t &ext);
 
   /// @brief parse output stream and return if stream is ok
   /// @todo At some point this shold specify what upstream needs to happen
   /// @returns true if stream OK, false if stream not OK and upstream shoul
   /// issue new iframe/drop pending frames.
-  bool trackOutputStream(uint8_t *data, uint16_t len);
+  /// @param gop_start set if the block has parameter sets or an IRAP slice.
+  /// @param block_class set to the class of the block's most important NAL.
+  bool trackOutputStream(uint8_t stream_id, uint8_t *data, uint16_t len,
+                         bool &gop_start, nal_class_t &block_class);
+  /// @brief POC lsbs of the short-term references a slice's picture uses.
+  /// @param poc_range set to the number of POC lsb values.
+  /// @returns false if they can't be told, e.g. for long-term references.
+  static bool referencePocs(
+      const parse_tracking_data_t &state,
+      const h265nal::H265SliceSegmentHeaderParser::SliceSegmentHeaderState
+          &ssh,
+      std::vector<uint32_t> &pocs, uint32_t &poc_range);
+  /// @brief Check a slice's short-term references against the stream's
+  /// reference graph, adding its picture there if it is the first slice.
+  /// A picture it refers to that the graph hasn't got was lost, and is
+  /// added as such.
+  /// @param decodable cleared if a picture it refers to is missing or
+  /// can't be decoded itself.
+  /// @returns false if the graph can't tell, e.g. for long-term references.
+  bool trackReferences(
+      parse_tracking_data_t &state,
+      const h265nal::H265SliceSegmentHeaderParser::SliceSegmentHeaderState
+          &ssh,
+      h265nal::NalUnitType nal_type, uint8_t temporal_id, bool &decodable);
+  /// @brief Add the picture starting in the first fragment of a chain given
+  /// up on to the stream's reference graph as not decodable.
+  /// @returns whether it is in the base temporal layer and referred to, so
+  /// nothing is decodable until the next GOP.
+  bool trackLostPicture(uint8_t stream_id, const vrts_packet_t &first);
+  /// @brief Hand a block to the stream's consumer, applying the overflow
+  /// policy if it is behind.
+  /// @details Reactor thread only.
+  void queueOutput(uint8_t stream_id, vrts_output_block_t &&block);
+  /// @brief Count a reference block the output queue gave up and ask for a
+  /// new GOP, the pictures after it can't be decoded.
+  void dropOutputReference(uint8_t stream_id);
+  /// @brief Give a complete block its playout deadline, or queue it right
+  /// away if the jitter buffer is off.
+  /// @param first hot state of the chain's first fragment.
+  /// @details Caller holds rx_tree_mutex.
+  void schedulePlayout(uint8_t stream_id, vrts_output_block_t &&block,
+                       nal_class_t block_class,
+                       const vrts_local_rxdata_t &first);
+  /// @brief Queue the blocks that are due. Caller holds rx_tree_mutex.
+  /// @returns the next deadline, max() if nothing is held.
+  vrts_clock_time_t playoutService(vrts_clock_time_t now);
+  /// @brief Reassemble the complete chain starting at first_id and hand
+  /// it on. Caller holds rx_tree_mutex.
+  /// @param removed gets the fragments that can go from the tree now.
+  void flushChain(uint32_t first_id, std::vector<uint32_t> &removed);
+  /// @brief Whether the chain starting at first_id should wait for gap_id,
+  /// a missing id ahead of it not known to be part of another chain, which
+  /// may be a picture it refers to, before it is handed out or skipped.
+  /// @details Until the chain would be delayed by the most the jitter
+  /// buffer allows, or without deadlines until the hole is given up on.
+  /// Caller holds rx_tree_mutex.
+  /// @param due lowered to when it stops waiting.
+  bool waitForGap(uint32_t first_id, uint32_t gap_id, vrts_clock_time_t now,
+                  vrts_clock_time_t &due);
+  /// @brief Give up on the incomplete chain starting at first_id so the
+  /// rest of its stream can go on.
+  /// @details A picture nothing refers to is given up once a later chain
+  /// of its stream is complete, or with the jitter buffer on once it is
+  /// past its deadline. A reference picture only with the jitter buffer on
+  /// and once it would be delayed by more than allowed; the pictures that
+  /// refer to it are dropped, and if it is in the base layer the stream
+  /// needs a new GOP. See discardChain(). Caller holds rx_tree_mutex.
+  /// @param overtaken whether a later chain of the stream is complete.
+  /// @param due lowered to when it would be given up if it isn't yet.
+  /// @param removed gets the fragments that can go from the tree now.
+  /// @returns whether it was given up.
+  bool skipChain(uint32_t first_id, vrts_clock_time_t now, bool overtaken,
+                 vrts_clock_time_t &due, std::vector<uint32_t> &removed);
+  /// @brief Give up on the chain starting at first_id: the fragments that
+  /// did arrive go as if flushed, the missing ones are no longer waited for
+  /// and are cancelled with the sender, those still on their way too.
+  /// Caller holds rx_tree_mutex.
+  /// @param removed gets the fragments that can go from the tree now.
+  /// @param in_order whether everything of its stream before it is done
+  /// with, so later fragments of it can be told by id alone.
+  void discardChain(uint32_t first_id, std::vector<uint32_t> &removed,
+                    bool in_order = true);
+  /// @brief Drop the chain starting at first_id, ahead of the chains of its
+  /// stream before it, if its picture refers to one the reference graph
+  /// knows to be lost. Its picture is added there as lost too, so what
+  /// refers to it goes the same way. Caller holds rx_tree_mutex.
+  /// @param removed gets the fragments that can go from the tree now.
+  /// @returns whether it was dropped.
+  bool dropDependent(uint32_t first_id, std::vector<uint32_t> &removed);
+  /// @brief Whether the chain starting at first_id was dropped by
+  /// dropDependent(). Caller holds rx_tree_mutex.
+  bool droppedChain(vrts_stream_t &stream, uint32_t first_id);
+  /// @brief Give up on what is left of a stream's chains from from up to
+  /// the IRAP picture at gop_id, which nothing after it refers past.
+  /// Caller holds rx_tree_mutex.
+  /// @param removed gets the fragments that can go from the tree now.
+  void dropChainsBefore(uint8_t stream_id, uint32_t from, uint32_t gop_id,
+                        std::vector<uint32_t> &removed);
+  /// @brief Take the sender's stamp out of a reassembled block and account
+  /// for the stages up to here.
+  void readTimestamp(vrts_output_block_t &block);
+  /// @brief Account for a block the consumer just took.
+  void handOut(const vrts_output_block_t &block);
+
+  /// @brief Split encoder output into NALs and queue them on the stream.
+  /// @param owner keeps data alive for as long as a NAL block refers to it.
+  bool parseBuffer(const uint8_t *data, size_t len,
+                   const std::shared_ptr<const void> &owner, uint8_t stream_id);
 
   /// @brief Consumes an elementary h265 stream.
   /// @details Assumes each chunk contains unfragmented NAL(s)
-  /// @param data pointer to data chunk
-  /// @param len length of data chunk
-  void feedDataH265(uint8_t *data, uint16_t len);
+  /// @param block the chunk, fragmented as views into it
+  /// @param stream_id stream the chunk belongs to
+  /// @param tag class, type and temporal id of the chunk
+  void feedDataH265(uint8_t stream_id,
+                    std::shared_ptr<const vrts_tx_block_t> block,
+                    const vrts_nal_tag_t &tag = {NAL_CLASS_REFERENCE,
+                                                 vrts_nal_type_unknown, 0,
+                                                 vrts_nal_type_unknown, 0});
 
   /// @brief Handle the request for a new GOP from downstream.
-  void requestNewGOPHandler(uint8_t downstream_state);
+  /// @param stream_mask streams the request is for, 0 from older peers.
+  void requestNewGOPHandler(uint8_t downstream_state, uint8_t stream_mask);
+  /// @brief Status bits and stream mask to put on an ACK or NACK.
+  void setGOPRequest(vrts_packetheader_t &header);
 
   /// @brief Deletes all entries in the tx-tree.
   void flushTXTree(void);
+  /// @brief Deletes the entries of one stream from the tx-tree.
+  /// @details Caller holds tx_tree_mutex.
+  void flushTXStream(uint8_t stream_id);
 
   /// @brief Deletes all entries in the rx-tree.
   void flushRXTree(void);
 };
 
+/// @brief The glass to glass stages and clock sync of a session's
+/// statistics as a table over the last 10 s, for printing.
+std::string latencyReport(const vrts_stat_t &stats);
+
 } // namespace vrts
 
 #endif
@@ -0,0 +1,179 @@
+#include "WireHeader.h"
+#include "Sack.h"
+#include <string.h>
+
+namespace vrts {
+
+// Legacy versions are small, leave room for ones to come.
+static constexpr uint8_t legacy_version_limit = 0x40;
+static constexpr size_t legacy_header_bytes = sizeof(vrts_packetheader_t);
+
+static constexpr uint8_t form_extensions = 0x01;
+static constexpr uint8_t form_fec_protected = 0x02;
+static constexpr uint8_t form_new_gop_needed = 0x04;
+static constexpr int form_type_shift = 3;
+static constexpr uint8_t form_type_mask = 0x0f;
+static_assert(VRTS_PACKET_TYPE_COUNT <= form_type_mask + 1,
+              "packet types have to fit the form byte");
+
+/// @brief Whether a packet type carries fragments in the compact form.
+static bool hasFragments(uint8_t packet_type) {
+  return packet_type != VRTS_ACKS && packet_type != VRTS_NACKS &&
+         packet_type != VRTS_SACKS && packet_type != VRTS_NACK_RANGES &&
+         packet_type != VRTS_CANCEL;
+}
+
+bool isLegacyHeader(const uint8_t *data, size_t len) {
+  if (len < legacy_header_bytes) {
+    return false;
+  }
+  vrts_packetheader_t header;
+  memcpy(&header, data, sizeof(header));
+  const uint8_t *status = data + offsetof(vrts_packetheader_t, status_bits);
+  return header.packet_type < VRTS_PACKET_TYPE_COUNT &&
+         header.version < legacy_version_limit &&
+         status[0] <= (NEW_GOP_NEEDED | FEC_PROTECTED) && status[1] == 0 &&
+         status[2] == 0 && status[3] == 0 && header.length > 0 &&
+         legacy_header_bytes + header.length == len;
+}
+
+size_t encodeCompactHeader(const vrts_packetheader_t &header,
+                           const vrts_header_ext_t *ext, uint8_t *out) {
+  uint8_t extensions = 0;
+  if (header.stream_id) {
+    extensions |= vrts_ext_stream_id;
+  }
+  if (ext && ext->has_timestamp) {
+    extensions |= vrts_ext_timestamp;
+  }
+  if (header.epoch_tag) {
+    extensions |= vrts_ext_epoch;
+  }
+  uint8_t form = vrts_compact_form |
+                 (header.packet_type & form_type_mask) << form_type_shift;
+  if (header.status_bits & NEW_GOP_NEEDED) {
+    form |= form_new_gop_needed;
+  }
+  if (header.status_bits & FEC_PROTECTED) {
+    form |= form_fec_protected;
+  }
+  if (extensions) {
+    form |= form_extensions;
+  }
+  const size_t cap = vrts_compact_header_max;
+  size_t n = 0;
+  out[n++] = form;
+  out[n++] = header.version;
+  n += putVarint(out + n, cap - n, header.packet_id);
+  if (hasFragments(header.packet_type)) {
+    out[n++] = header.fragments;
+  }
+  if (header.packet_type == VRTS_DATA) {
+    out[n++] = header.parent_id_offset;
+  }
+  if (extensions) {
+    out[n++] = extensions;
+    if (extensions & vrts_ext_stream_id) {
+      out[n++] = header.stream_id;
+    }
+    if (extensions & vrts_ext_timestamp) {
+      n += putVarint(out + n, cap - n, ext->timestamp_us);
+    }
+    if (extensions & vrts_ext_epoch) {
+      out[n++] = header.epoch_tag;
+    }
+  }
+  return n;
+}
+
+static bool decodeCompactHeader(const uint8_t *data, size_t len,
+                                vrts_packetheader_t &header,
+                                size_t &header_bytes, vrts_header_ext_t *ext) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  if (len < 2 || !(p[0] & vrts_compact_form)) {
+    return false;
+  }
+  uint8_t form = *p++;
+  header = {};
+  header.packet_type = (form >> form_type_shift) & form_type_mask;
+  header.version = *p++;
+  int status = 0;
+  if (form & form_new_gop_needed) {
+    status |= NEW_GOP_NEEDED;
+  }
+  if (form & form_fec_protected) {
+    status |= FEC_PROTECTED;
+  }
+  header.status_bits = static_cast<status_bits_t>(status);
+  if (!getVarint(p, end, header.packet_id)) {
+    return false;
+  }
+  if (hasFragments(header.packet_type)) {
+    if (p >= end) {
+      return false;
+    }
+    header.fragments = *p++;
+  }
+  if (header.packet_type == VRTS_DATA) {
+    if (p >= end) {
+      return false;
+    }
+    header.parent_id_offset = *p++;
+  }
+  if (ext) {
+    *ext = {};
+  }
+  if (form & form_extensions) {
+    if (p >= end) {
+      return false;
+    }
+    uint8_t extensions = *p++;
+    if (extensions & vrts_ext_stream_id) {
+      if (p >= end) {
+        return false;
+      }
+      header.stream_id = *p++;
+    }
+    if (extensions & vrts_ext_timestamp) {
+      uint32_t timestamp_us;
+      if (!getVarint(p, end, timestamp_us)) {
+        return false;
+      }
+      if (ext) {
+        ext->has_timestamp = true;
+        ext->timestamp_us = timestamp_us;
+      }
+    }
+    if (extensions & vrts_ext_epoch) {
+      if (p >= end) {
+        return false;
+      }
+      header.epoch_tag = *p++;
+    }
+    // Extensions we don't know come after these and can't be skipped.
+    if (extensions &
+        ~(vrts_ext_stream_id | vrts_ext_timestamp | vrts_ext_epoch)) {
+      return false;
+    }
+  }
+  header_bytes = p - data;
+  header.length = static_cast<uint16_t>(len - header_bytes);
+  return true;
+}
+
+bool decodeHeader(const uint8_t *data, size_t len,
+                  vrts_packetheader_t &header, size_t &header_bytes,
+                  vrts_header_ext_t *ext) {
+  if (isLegacyHeader(data, len)) {
+    memcpy(&header, data, sizeof(header));
+    header_bytes = legacy_header_bytes;
+    if (ext) {
+      *ext = {};
+    }
+    return true;
+  }
+  return decodeCompactHeader(data, len, header, header_bytes, ext);
+}
+
+} // namespace vrts
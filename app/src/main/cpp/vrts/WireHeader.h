@@ -0,0 +1,164 @@
+#ifndef WIREHEADER_H
+#define WIREHEADER_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vrts {
+
+typedef enum {
+  VRTS_DATA = 0,
+  VRTS_ACKS,
+  VRTS_NACKS,
+  // Only sent to peers advertising VRTS_VERSION_SACK, see Sack.h.
+  VRTS_SACKS,
+  VRTS_NACK_RANGES,
+  // Parity for one fragment chain. Older peers ignore it.
+  VRTS_FEC,
+  // Clock offset probe and its reply, see Timestamp.h. Only sent to peers
+  // advertising VRTS_VERSION_CLOCK.
+  VRTS_CLOCK,
+  // Path MTU probe and its reply, see Pmtu.h. Only sent to peers
+  // advertising VRTS_VERSION_PMTU.
+  VRTS_PMTU,
+  // Session epoch handshake, see vrts_hello_t. Sent before the peer's
+  // version is known; older peers ignore it.
+  VRTS_HELLO,
+  // Data ids the receiver gave up on, as NACK ranges (see Sack.h), so they
+  // are no longer repaired. Only sent to peers advertising
+  // VRTS_VERSION_CANCEL.
+  VRTS_CANCEL,
+  VRTS_PACKET_TYPE_COUNT
+} vrts_packet_type_t;
+
+/// @brief Wire format revision, carried in every header.
+/// @details Older peers leave the byte zero. Each side answers in the
+/// newest format the other advertised on its last packet.
+typedef enum {
+  VRTS_VERSION_LEGACY = 0,
+  VRTS_VERSION_SACK = 1,
+  VRTS_VERSION_CLOCK = 2,
+  VRTS_VERSION_PMTU = 3,
+  // Compact headers, see below.
+  VRTS_VERSION_COMPACT = 4,
+  // Session epochs: epoch_tag on every packet and the VRTS_HELLO handshake.
+  VRTS_VERSION_EPOCH = 5,
+  VRTS_VERSION_CANCEL = 6
+} vrts_version_t;
+
+// Bits to pack into headers of ACKS/NACKS
+// to let upstream know that some action
+// needs to be taken. Piggyback on top of
+// existing comms.
+// FEC_PROTECTED goes on DATA packets whose chain is followed by VRTS_FEC
+// parity, so the receiver holds off NACKing its holes for a moment.
+typedef enum { NEW_GOP_NEEDED = 1, FEC_PROTECTED = 2 } status_bits_t;
+
+/// @brief Simple packet header structure
+/// @details The legacy wire header, sent as is, and how every header is
+/// held in memory.
+/// @param parent_id_offset Subtract from current packet id to get
+///                         the parent packet_id in the fragment chain.
+///                         We use an offset to save 3 bytes in the header.
+/// @param version vrts_version_t of the sender. Used to be padding.
+/// @param length Payload bytes following the header.
+/// @param stream_id Stream of a DATA or FEC packet. On ACK and NACK types,
+///                  the mask of streams asking for a new GOP. Used to be
+///                  padding, so older peers only ever talk about stream 0.
+/// @param epoch_tag epochTag() of the sender's session, 0 if it has none.
+///                  Used to be reserved, and is only looked at on packets
+///                  from VRTS_VERSION_EPOCH on.
+typedef struct {
+  uint32_t packet_id;
+  uint8_t parent_id_offset;
+  uint8_t packet_type;
+  uint8_t fragments;
+  uint8_t version;
+  status_bits_t status_bits;
+  uint16_t length;
+  uint8_t stream_id;
+  uint8_t epoch_tag;
+} vrts_packetheader_t;
+
+static_assert(sizeof(vrts_packetheader_t) == 16,
+              "header layout is part of the wire format");
+
+// Compact header, sent to peers advertising VRTS_VERSION_COMPACT. Every
+// field is explicitly serialized, so unlike the legacy struct it doesn't
+// depend on the compiler or the host's byte order:
+//   uint8_t  form         1tttt gfx: packet type t, NEW_GOP_NEEDED g,
+//                         FEC_PROTECTED f, extensions follow x
+//   uint8_t  version
+//   varint   packet_id
+//   uint8_t  fragments         all but the ACK, NACK and cancel types
+//   uint8_t  parent_id_offset  VRTS_DATA only
+//   uint8_t  extensions        if x, which of the following are present:
+//   uint8_t  stream_id           vrts_ext_stream_id
+//   varint   timestamp_us        vrts_ext_timestamp
+//   uint8_t  epoch_tag           vrts_ext_epoch, VRTS_VERSION_EPOCH on
+// The payload is the rest of the datagram. Varints are LEB128 as in Sack.h.
+//
+// Which form a datagram is in is told by the legacy header's invariants:
+// at least 16 bytes, a known type, a small version, status bits in the low
+// byte and a length that matches and isn't 0. Our own legacy headers always
+// meet them, as every packet type has a payload. A compact datagram meeting
+// them all by chance is not going to happen; without the last one, any of
+// exactly 16 bytes ending in zeros would.
+
+constexpr uint8_t vrts_compact_form = 0x80;
+constexpr uint8_t vrts_ext_stream_id = 0x01;
+constexpr uint8_t vrts_ext_timestamp = 0x02;
+constexpr uint8_t vrts_ext_epoch = 0x04;
+/// @brief Longest compact header, extensions included.
+constexpr size_t vrts_compact_header_max = 20;
+static_assert(vrts_compact_header_max >= sizeof(vrts_packetheader_t),
+              "a legacy header has to fit where a compact one does");
+
+// Session epochs. Every session picks a random 32 bit epoch when it starts
+// and tags each packet with its low byte. A VRTS_HELLO with fragments 0
+// announces the epoch, one with fragments 1 answers a hello, and both
+// carry a vrts_hello_t. Each side sends hellos until the peer answers with
+// its epoch, or turns out to predate epochs. A hello with an epoch other
+// than the one known for the peer means the peer restarted, and whatever
+// was in flight between the two sessions is dropped on the spot. Packets
+// tagged for another epoch are stale and are dropped too.
+
+typedef struct {
+  uint32_t epoch;
+  // Epoch the sender knows for us, 0 if none yet.
+  uint32_t peer_epoch;
+} vrts_hello_t;
+
+/// @brief What goes into epoch_tag. Epochs are picked so it isn't 0.
+inline uint8_t epochTag(uint32_t epoch) { return epoch & 0xff; }
+
+/// @brief Optional header fields.
+typedef struct {
+  bool has_timestamp;
+  // Sender's clock in us, modulo 2^32.
+  uint32_t timestamp_us;
+} vrts_header_ext_t;
+
+/// @brief Whether a datagram carries a legacy header.
+bool isLegacyHeader(const uint8_t *data, size_t len);
+
+/// @brief Write header in the compact form.
+/// @param ext optional fields, nullptr for none.
+/// @returns bytes written, at most vrts_compact_header_max.
+size_t encodeCompactHeader(const vrts_packetheader_t &header,
+                           const vrts_header_ext_t *ext, uint8_t *out);
+
+/// @brief Read the header of a datagram in either form.
+/// @details header.length is set to the payload that follows.
+/// @param header_bytes set to where the payload starts.
+/// @param ext set to the optional fields, may be nullptr.
+/// @returns false if the datagram is neither.
+bool decodeHeader(const uint8_t *data, size_t len,
+                  vrts_packetheader_t &header, size_t &header_bytes,
+                  vrts_header_ext_t *ext = nullptr);
+
+} // namespace vrts
+
+#endif
@@ -0,0 +1,3344 @@
+#include "argparse.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "CongestionController.h"
+#include "Fec.h"
+#include "Metrics.h"
+#include "Pacer.h"
+#include "PacketRing.h"
+#include "Replay.h"
+#include "Sack.h"
+#include "SimLink.h"
+#include "SpscQueue.h"
+#include "Trace.h"
+#include "UdpSender.h"
+#include "VRTS.h"
+
+// Microbenchmarks for the VRTS internals. Each benchmark prints one line per
+// configuration so results can be diffed between builds / boards.
+//
+// Run everything: ./vrts-bench
+// Run one:        ./vrts-bench --store
+//                 ./vrts-bench --sack
+//                 ./vrts-bench --header
+//                 ./vrts-bench --fec
+//                 ./vrts-bench --ingest
+//                 ./vrts-bench --queue
+//                 ./vrts-bench --metrics
+//                 ./vrts-bench --trace
+//                 ./vrts-bench --replay
+//                 ./vrts-bench --sim
+//                 ./vrts-bench --glass
+//                 ./vrts-bench --jitter
+//                 ./vrts-bench --hol
+//                 ./vrts-bench --weights
+//                 ./vrts-bench --gop
+//                 ./vrts-bench --deps
+//                 ./vrts-bench --classes
+//                 ./vrts-bench --pmtu
+//                 ./vrts-bench --reconnect
+//                 ./vrts-bench --cc
+
+using bench_clock = std::chrono::steady_clock;
+
+// Keeps the optimizer from discarding benchmark loops.
+static volatile uint64_t bench_sink = 0;
+
+template <typename F> double nsPerOp(uint64_t ops, F &&f) {
+  auto start = bench_clock::now();
+  f();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     bench_clock::now() - start)
+                     .count();
+  return static_cast<double>(elapsed) / static_cast<double>(ops);
+}
+
+// ---------------------------------------------------------------------------
+// Packet store: std::map (previous tx_stream_tree layout) vs PacketRing.
+// ---------------------------------------------------------------------------
+
+// Node layout used by the tx tree before the ring replaced it: payload and
+// metadata in one ~1.5KB map node.
+typedef struct {
+  vrts::vrts_packet_t ota_packet;
+  bool was_sent;
+  bool was_acked;
+  bool was_nacked;
+  uint8_t retx_count;
+  vrts::vrts_clock_time_t sent_time_local;
+  vrts::vrts_clock_time_t acked_time_local;
+  vrts::vrts_clock_time_t nacked_time_local;
+} legacy_txdata_t;
+
+static void benchPacketStore(void) {
+  const uint32_t in_flight_counts[] = {200, 2000, 20000};
+  const uint32_t base_id = 1000000;
+  std::mt19937 gen(1234);
+
+  std::cout << "== packet store: std::map vs PacketRing (ns/op)" << std::endl;
+  std::cout << std::setw(10) << "in-flight" << std::setw(12) << "store"
+            << std::setw(10) << "ack" << std::setw(10) << "nack"
+            << std::setw(10) << "scan/pkt" << std::endl;
+
+  for (auto in_flight : in_flight_counts) {
+    // ACKs usually come back in order, NACKs in holes. Use a shuffled order
+    // for both so neither store benefits from a lucky access pattern.
+    std::vector<uint32_t> ack_order(in_flight);
+    for (uint32_t i = 0; i < in_flight; i++) {
+      ack_order[i] = base_id + i;
+    }
+    std::shuffle(ack_order.begin(), ack_order.end(), gen);
+    uint64_t rounds = std::max<uint64_t>(1, 2000000 / in_flight);
+    auto now = std::chrono::system_clock::now();
+
+    // std::map, with the access pattern rxHandler used (find + 2x []).
+    {
+      std::map<uint32_t, legacy_txdata_t> tree;
+      legacy_txdata_t empty_entry = {};
+      for (uint32_t i = 0; i < in_flight; i++) {
+        tree.insert(std::make_pair(base_id + i, empty_entry));
+        tree[base_id + i].was_sent = true;
+        tree[base_id + i].sent_time_local = now;
+      }
+      double ack_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (auto id : ack_order) {
+            if (tree.find(id) != tree.end()) {
+              tree[id].was_acked = !tree[id].was_acked;
+              tree[id].acked_time_local = now;
+            }
+          }
+        }
+      });
+      double nack_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (auto id : ack_order) {
+            if (tree.find(id) != tree.end()) {
+              if (!tree[id].was_nacked) {
+                bench_sink += tree[id].retx_count;
+              }
+              tree[id].was_nacked = !tree[id].was_nacked;
+              tree[id].nacked_time_local = now;
+            }
+          }
+        }
+      });
+      double scan_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          uint32_t unacked = 0;
+          for (auto &entry : tree) {
+            auto &chunk = entry.second;
+            if (chunk.was_sent && !chunk.was_acked) {
+              unacked++;
+            }
+          }
+          bench_sink += unacked;
+        }
+      });
+      std::cout << std::setw(10) << in_flight << std::setw(12) << "std::map"
+                << std::fixed << std::setprecision(1) << std::setw(10)
+                << ack_ns << std::setw(10) << nack_ns << std::setw(10)
+                << scan_ns << std::endl;
+    }
+
+    // PacketRing with separate hot metadata and payload slab.
+    {
+      vrts::PacketRing<vrts::vrts_local_txdata_t, vrts::vrts_packet_t> ring;
+      for (uint32_t i = 0; i < in_flight; i++) {
+        auto *meta = ring.insert(base_id + i);
+        meta->was_sent = true;
+        meta->sent_time_local = now;
+      }
+      double ack_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (auto id : ack_order) {
+            if (auto *chunk = ring.hot(id)) {
+              chunk->was_acked = !chunk->was_acked;
+              chunk->acked_time_local = now;
+            }
+          }
+        }
+      });
+      double nack_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (auto id : ack_order) {
+            if (auto *chunk = ring.hot(id)) {
+              if (!chunk->was_nacked) {
+                bench_sink += chunk->retx_count;
+              }
+              chunk->was_nacked = !chunk->was_nacked;
+              chunk->nacked_time_local = now;
+            }
+          }
+        }
+      });
+      double scan_ns = nsPerOp(rounds * in_flight, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          uint32_t unacked = 0;
+          ring.forEach([&](uint32_t, vrts::vrts_local_txdata_t &chunk,
+                           vrts::vrts_packet_t &) {
+            if (chunk.was_sent && !chunk.was_acked) {
+              unacked++;
+            }
+          });
+          bench_sink += unacked;
+        }
+      });
+      std::cout << std::setw(10) << in_flight << std::setw(12) << "PacketRing"
+                << std::fixed << std::setprecision(1) << std::setw(10)
+                << ack_ns << std::setw(10) << nack_ns << std::setw(10)
+                << scan_ns << std::endl;
+    }
+  }
+}
+
+/// Prints a mode's checks under its table. @returns whether all passed.
+static bool
+printChecks(std::initializer_list<std::pair<const char *, bool>> checks) {
+  std::cout << std::setw(24) << "check" << std::setw(6) << "ok" << std::endl;
+  bool pass = true;
+  for (auto &check : checks) {
+    pass &= check.second;
+    std::cout << std::setw(24) << check.first << std::setw(6)
+              << (check.second ? "yes" : "NO") << std::endl;
+  }
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// ACK wire format: 4-byte id lists vs SACK / NACK ranges.
+// ---------------------------------------------------------------------------
+
+// Per-datagram cost that isn't VRTS payload: VRTS header plus IPv4 + UDP.
+static constexpr size_t feedback_overhead_bytes =
+    sizeof(vrts::vrts_packetheader_t) + 28;
+
+typedef struct {
+  uint64_t ack_bytes;
+  uint64_t nack_bytes;
+  uint64_t feedback_datagrams;
+  uint64_t delivered_packets;
+  uint64_t retransmits;
+  uint64_t unacked_delivered;
+} ack_sim_result_t;
+
+/// Simulates one session at a fixed loss rate, applied independently to data
+/// and feedback. One period is one ack period (10ms). The sender resends on
+/// NACK (up to 4 times, within the 200ms age limit), the receiver NACKs its
+/// holes every period and ACKs what arrived.
+static ack_sim_result_t simulateAcks(double loss, bool sack, uint32_t seed) {
+  const uint32_t periods = 3000;
+  const uint32_t packets_per_period = 20;
+  const uint32_t age_limit_periods = 20;
+  const uint32_t retx_limit = 4;
+  const uint8_t sack_redundancy = 2;
+  const size_t max_ids = sizeof(vrts::vrts_packet_t::data) / sizeof(uint32_t);
+  const auto period = std::chrono::milliseconds(10);
+  const uint32_t total = periods * packets_per_period;
+
+  std::mt19937 gen(seed);
+  std::bernoulli_distribution lost(loss);
+  ack_sim_result_t result = {};
+
+  std::vector<uint8_t> received(total, 0);
+  std::vector<uint8_t> acked(total, 0);
+  std::vector<uint8_t> nacked(total, 0);
+  std::vector<uint8_t> retx(total, 0);
+  vrts::SackTracker tracker;
+  bool dirty = false;
+  uint8_t repeats = 0;
+  std::vector<uint32_t> fresh;
+  vrts::vrts_packet_t packet;
+  vrts::vrts_sack_t decoded;
+  auto start = std::chrono::system_clock::time_point();
+
+  for (uint32_t t = 0; t < periods; t++) {
+    auto now = start + period * t;
+    // Sender: resends first, then new data.
+    std::vector<uint32_t> outgoing;
+    uint32_t oldest = t > age_limit_periods
+                          ? (t - age_limit_periods) * packets_per_period
+                          : 0;
+    for (uint32_t id = oldest; id < t * packets_per_period; id++) {
+      if (nacked[id] && !acked[id] && retx[id] < retx_limit) {
+        nacked[id] = 0;
+        retx[id]++;
+        result.retransmits++;
+        outgoing.push_back(id);
+      }
+    }
+    for (uint32_t i = 0; i < packets_per_period; i++) {
+      outgoing.push_back(t * packets_per_period + i);
+    }
+    for (auto id : outgoing) {
+      if (lost(gen)) {
+        continue;
+      }
+      if (!received[id]) {
+        received[id] = 1;
+        result.delivered_packets++;
+      }
+      tracker.receive(id, now);
+      fresh.push_back(id);
+      dirty = true;
+    }
+
+    // Receiver: NACK the holes.
+    tracker.expire(now - period * age_limit_periods);
+    std::vector<uint32_t> holes;
+    tracker.holes(holes, 4096);
+    for (size_t first = 0; first < holes.size();) {
+      size_t count;
+      if (sack) {
+        std::vector<uint32_t> rest(holes.begin() + first, holes.end());
+        packet.header.length =
+            vrts::encodeNackRanges(rest, packet.data, sizeof(packet.data), count);
+      } else {
+        count = std::min(holes.size() - first, max_ids);
+        packet.header.length = count * sizeof(uint32_t);
+      }
+      result.nack_bytes += feedback_overhead_bytes + packet.header.length;
+      result.feedback_datagrams++;
+      if (!lost(gen)) {
+        if (sack) {
+          std::vector<std::pair<uint32_t, uint32_t>> ranges;
+          vrts::decodeNackRanges(packet.data, packet.header.length, ranges);
+          for (auto &range : ranges) {
+            for (uint32_t i = 0; i < range.second; i++) {
+              nacked[range.first + i] = 1;
+            }
+          }
+        } else {
+          for (size_t i = first; i < first + count; i++) {
+            nacked[holes[i]] = 1;
+          }
+        }
+      }
+      first += count;
+    }
+
+    // Receiver: ACK.
+    if (sack) {
+      if (dirty) {
+        dirty = false;
+        repeats = sack_redundancy;
+      } else if (repeats > 0) {
+        repeats--;
+      } else {
+        continue;
+      }
+      packet.header.length = tracker.encode(packet.data, sizeof(packet.data));
+      result.ack_bytes += feedback_overhead_bytes + packet.header.length;
+      result.feedback_datagrams++;
+      if (!lost(gen) &&
+          vrts::decodeSack(packet.data, packet.header.length, decoded)) {
+        for (uint32_t id = oldest; id < decoded.base && id < total; id++) {
+          acked[id] = 1;
+        }
+        uint32_t id = decoded.base;
+        for (auto &run : decoded.runs) {
+          id += run.first;
+          for (uint32_t i = 0; i < run.second; i++, id++) {
+            acked[id] = 1;
+          }
+        }
+      }
+    } else {
+      for (size_t first = 0; first < fresh.size(); first += max_ids) {
+        size_t count = std::min(fresh.size() - first, max_ids);
+        result.ack_bytes += feedback_overhead_bytes + count * sizeof(uint32_t);
+        result.feedback_datagrams++;
+        if (!lost(gen)) {
+          for (size_t i = first; i < first + count; i++) {
+            acked[fresh[i]] = 1;
+          }
+        }
+      }
+    }
+    fresh.clear();
+  }
+
+  for (uint32_t id = 0; id < total; id++) {
+    if (received[id] && !acked[id]) {
+      result.unacked_delivered++;
+    }
+  }
+  return result;
+}
+
+static bool benchAckFormat(void) {
+  const double loss_rates[] = {0.05, 0.20, 0.40};
+  const size_t payload = sizeof(vrts::vrts_packet_t::data);
+
+  std::cout << "== ack format: id lists vs SACK (per delivered video byte)"
+            << std::endl;
+  std::cout << std::setw(6) << "loss" << std::setw(8) << "format"
+            << std::setw(10) << "ack %" << std::setw(10) << "nack %"
+            << std::setw(12) << "fb pkt/pkt" << std::setw(10) << "retx/pkt"
+            << std::setw(12) << "unacked %" << std::endl;
+  for (auto loss : loss_rates) {
+    for (bool sack : {false, true}) {
+      auto r = simulateAcks(loss, sack, 1234);
+      double video_bytes = static_cast<double>(r.delivered_packets * payload);
+      double delivered = static_cast<double>(r.delivered_packets);
+      std::cout << std::setw(5) << std::fixed << std::setprecision(0)
+                << loss * 100.0 << "%" << std::setw(8)
+                << (sack ? "sack" : "list") << std::setprecision(3)
+                << std::setw(10) << 100.0 * r.ack_bytes / video_bytes
+                << std::setw(10) << 100.0 * r.nack_bytes / video_bytes
+                << std::setw(12) << r.feedback_datagrams / delivered
+                << std::setw(10) << r.retransmits / delivered
+                << std::setw(12) << 100.0 * r.unacked_delivered / delivered
+                << std::endl;
+    }
+  }
+
+  // Every 7th id lost and the first 500 given up on, as a dropped chain
+  // would. Before base, the sender has to take exactly the received ones
+  // for ACKs.
+  vrts::SackTracker tracker;
+  auto now = std::chrono::system_clock::time_point();
+  std::vector<uint8_t> received(1000, 0);
+  for (uint32_t id = 0; id < received.size(); id++) {
+    if (id % 7 != 3) {
+      received[id] = 1;
+      tracker.receive(id, now);
+    }
+  }
+  tracker.abandon(0, 500);
+  vrts::vrts_packet_t packet;
+  vrts::vrts_sack_t sack;
+  size_t len = tracker.encode(packet.data, sizeof(packet.data));
+  // 500 itself is the next hole.
+  bool given_up_kept =
+      vrts::decodeSack(packet.data, len, sack) && sack.base == 500;
+  std::vector<uint8_t> acked(500, 1);
+  for (auto &range : sack.given_up) {
+    for (uint32_t id = range.first; id - range.first < range.second; id++) {
+      given_up_kept &= id < acked.size();
+      if (id < acked.size()) {
+        acked[id] = 0;
+      }
+    }
+  }
+  for (uint32_t id = 0; id < acked.size(); id++) {
+    given_up_kept &= acked[id] == received[id];
+  }
+  return printChecks({{"given up not acked", given_up_kept}});
+}
+
+// ---------------------------------------------------------------------------
+// Wire header: legacy struct vs compact encoding.
+// ---------------------------------------------------------------------------
+
+static bool sameHeader(const vrts::vrts_packetheader_t &a,
+                       const vrts::vrts_packetheader_t &b) {
+  return a.packet_id == b.packet_id &&
+         a.parent_id_offset == b.parent_id_offset &&
+         a.packet_type == b.packet_type && a.fragments == b.fragments &&
+         a.version == b.version && a.status_bits == b.status_bits &&
+         a.length == b.length && a.stream_id == b.stream_id &&
+         a.epoch_tag == b.epoch_tag;
+}
+
+/// Header fields as the compact form carries them: fragments and offsets
+/// only where they mean something.
+static vrts::vrts_packetheader_t randomHeader(std::mt19937 &gen) {
+  vrts::vrts_packetheader_t header = {};
+  header.packet_type = gen() % vrts::VRTS_PACKET_TYPE_COUNT;
+  header.version = gen() % (vrts::VRTS_VERSION_COMPACT + 1);
+  header.packet_id = gen() >> (gen() % 32);
+  header.status_bits = static_cast<vrts::status_bits_t>(gen() % 4);
+  header.stream_id = gen() % 3 ? 0 : gen() % 256;
+  header.epoch_tag = gen() % 2 ? 0 : gen() % 256;
+  bool acks = header.packet_type == vrts::VRTS_ACKS ||
+              header.packet_type == vrts::VRTS_NACKS ||
+              header.packet_type == vrts::VRTS_SACKS ||
+              header.packet_type == vrts::VRTS_NACK_RANGES ||
+              header.packet_type == vrts::VRTS_CANCEL;
+  if (!acks) {
+    header.fragments = gen() % 256;
+  }
+  if (header.packet_type == vrts::VRTS_DATA) {
+    header.parent_id_offset = gen() % 256;
+  }
+  header.length = 1 + gen() % 1400;
+  return header;
+}
+
+/// Two virtual link sessions stepped in 1 ms, without loss. With
+/// downgrade, B's datagrams are rewritten into legacy headers claiming
+/// VRTS_VERSION_PMTU, as a peer from before compact headers would send.
+typedef struct {
+  uint64_t blocks;
+  uint64_t a_datagrams;
+  uint64_t a_compact;
+  uint64_t a_bytes;
+  uint64_t b_legacy_decoded;
+} header_session_t;
+
+static header_session_t
+headerSession(const std::vector<std::vector<uint8_t>> &units, bool downgrade) {
+  header_session_t result = {};
+  vrts::vrts_clock_time_t now{std::chrono::seconds(1700000000)};
+  std::vector<std::vector<uint8_t>> to_a, to_b;
+  vrts::VRTS a(
+      [&](const uint8_t *data, size_t len) {
+        result.a_datagrams++;
+        result.a_bytes += len;
+        result.a_compact += !vrts::isLegacyHeader(data, len);
+        to_b.emplace_back(data, data + len);
+      },
+      now);
+  vrts::VRTS b(
+      [&](const uint8_t *data, size_t len) {
+        vrts::vrts_packetheader_t header;
+        size_t header_bytes;
+        if (!downgrade ||
+            !vrts::decodeHeader(data, len, header, header_bytes)) {
+          to_a.emplace_back(data, data + len);
+          return;
+        }
+        header.version = vrts::VRTS_VERSION_PMTU;
+        std::vector<uint8_t> legacy(sizeof(header) + header.length);
+        memcpy(legacy.data(), &header, sizeof(header));
+        memcpy(legacy.data() + sizeof(header), data + header_bytes,
+               header.length);
+        to_a.push_back(std::move(legacy));
+      },
+      now);
+  std::vector<uint8_t> unit, nal;
+  for (size_t i = 0; i < units.size(); i++) {
+    unit = units[i];
+    a.parse(unit.data(), unit.size());
+    for (int ms = 0; ms < 10; ms++) {
+      now += std::chrono::milliseconds(1);
+      for (auto &datagram : to_b) {
+        vrts::vrts_packetheader_t header;
+        size_t header_bytes;
+        if (vrts::isLegacyHeader(datagram.data(), datagram.size()) &&
+            vrts::decodeHeader(datagram.data(), datagram.size(), header,
+                               header_bytes)) {
+          result.b_legacy_decoded++;
+        }
+        b.receive(datagram.data(), datagram.size(), now);
+      }
+      for (auto &datagram : to_a) {
+        a.receive(datagram.data(), datagram.size(), now);
+      }
+      to_a.clear();
+      to_b.clear();
+      a.step(now);
+      b.step(now);
+      while (b.popData(nal)) {
+        result.blocks++;
+      }
+    }
+  }
+  return result;
+}
+
+static bool benchHeader(void) {
+  std::mt19937 gen(1234);
+  std::cout << "== header: legacy struct vs compact encoding" << std::endl;
+
+  // Sizes of what a session mostly sends.
+  struct {
+    const char *name;
+    vrts::vrts_packetheader_t header;
+    bool timestamp;
+  } shapes[] = {
+      {"sack", {0, 0, vrts::VRTS_SACKS, 0, 4, {}, 20, 0, 0}, false},
+      {"data id 1000", {1000, 2, vrts::VRTS_DATA, 5, 4, {}, 1456, 0, 0}, false},
+      {"data id 2^24", {1u << 24, 2, vrts::VRTS_DATA, 5, 4, {}, 1456, 0, 0},
+       false},
+      {"data stream 2", {1000, 2, vrts::VRTS_DATA, 5, 4, {}, 1456, 2, 0},
+       false},
+      {"data + time", {1000, 2, vrts::VRTS_DATA, 5, 4, {}, 1456, 0, 0}, true},
+      {"data + epoch", {1000, 2, vrts::VRTS_DATA, 5, 5, {}, 1456, 0, 0x5a},
+       false},
+  };
+  std::cout << std::setw(16) << "packet" << std::setw(10) << "legacy"
+            << std::setw(10) << "compact" << std::endl;
+  uint8_t wire[vrts::vrts_compact_header_max];
+  for (auto &shape : shapes) {
+    vrts::vrts_header_ext_t ext = {shape.timestamp, 123456789};
+    std::cout << std::setw(16) << shape.name << std::setw(10)
+              << sizeof(vrts::vrts_packetheader_t) << std::setw(10)
+              << vrts::encodeCompactHeader(shape.header, &ext, wire)
+              << std::endl;
+  }
+
+  // Codec cost over a spread of headers, with their payload behind them.
+  const size_t count = 4096;
+  const uint64_t rounds = 200;
+  std::vector<vrts::vrts_packetheader_t> headers;
+  std::vector<std::vector<uint8_t>> legacy, compact;
+  for (size_t i = 0; i < count; i++) {
+    auto header = randomHeader(gen);
+    headers.push_back(header);
+    std::vector<uint8_t> datagram(sizeof(header) + header.length);
+    memcpy(datagram.data(), &header, sizeof(header));
+    legacy.push_back(datagram);
+    size_t n = vrts::encodeCompactHeader(header, nullptr, wire);
+    datagram.assign(wire, wire + n);
+    datagram.resize(n + header.length);
+    compact.push_back(datagram);
+  }
+  vrts::vrts_packetheader_t decoded;
+  size_t header_bytes;
+  double legacy_encode = nsPerOp(rounds * count, [&] {
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (auto &header : headers) {
+        memcpy(wire, &header, sizeof(header));
+        bench_sink += wire[0];
+      }
+    }
+  });
+  double compact_encode = nsPerOp(rounds * count, [&] {
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (auto &header : headers) {
+        bench_sink += vrts::encodeCompactHeader(header, nullptr, wire);
+      }
+    }
+  });
+  double legacy_decode = nsPerOp(rounds * count, [&] {
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (auto &datagram : legacy) {
+        vrts::decodeHeader(datagram.data(), datagram.size(), decoded,
+                           header_bytes);
+        bench_sink += decoded.packet_id;
+      }
+    }
+  });
+  double compact_decode = nsPerOp(rounds * count, [&] {
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (auto &datagram : compact) {
+        vrts::decodeHeader(datagram.data(), datagram.size(), decoded,
+                           header_bytes);
+        bench_sink += decoded.packet_id;
+      }
+    }
+  });
+  std::cout << std::setw(16) << "ns/header" << std::setw(10) << "encode"
+            << std::setw(10) << "decode" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(16) << "legacy"
+            << std::setw(10) << legacy_encode << std::setw(10) << legacy_decode
+            << std::endl;
+  std::cout << std::setw(16) << "compact" << std::setw(10) << compact_encode
+            << std::setw(10) << compact_decode << std::endl;
+
+  // Both forms come back as they went in, and are told apart.
+  bool round_trip = true;
+  bool told_apart = true;
+  for (size_t i = 0; i < count; i++) {
+    vrts::vrts_header_ext_t ext = {gen() % 2 == 0, static_cast<uint32_t>(gen())};
+    vrts::vrts_header_ext_t ext_out;
+    size_t n = vrts::encodeCompactHeader(headers[i], &ext, wire);
+    compact[i].assign(wire, wire + n);
+    compact[i].resize(n + headers[i].length);
+    round_trip &= vrts::decodeHeader(compact[i].data(), compact[i].size(),
+                                     decoded, header_bytes, &ext_out) &&
+                  header_bytes == n && sameHeader(decoded, headers[i]) &&
+                  ext_out.has_timestamp == ext.has_timestamp &&
+                  (!ext.has_timestamp ||
+                   ext_out.timestamp_us == ext.timestamp_us);
+    round_trip &= vrts::decodeHeader(legacy[i].data(), legacy[i].size(),
+                                     decoded, header_bytes) &&
+                  header_bytes == sizeof(decoded) &&
+                  sameHeader(decoded, headers[i]);
+    told_apart &= vrts::isLegacyHeader(legacy[i].data(), legacy[i].size()) &&
+                  !vrts::isLegacyHeader(compact[i].data(), compact[i].size());
+  }
+  // Compact headers in front of random payload.
+  for (size_t i = 0; i < 100000; i++) {
+    auto header = randomHeader(gen);
+    std::vector<uint8_t> datagram(vrts::encodeCompactHeader(header, nullptr,
+                                                            wire));
+    memcpy(datagram.data(), wire, datagram.size());
+    for (int b = 0; b < header.length; b++) {
+      datagram.push_back(gen());
+    }
+    told_apart &= !vrts::isLegacyHeader(datagram.data(), datagram.size());
+  }
+  // Cut short anywhere, a compact header is rejected rather than misread.
+  bool truncation = true;
+  for (auto &shape : shapes) {
+    vrts::vrts_header_ext_t ext = {shape.timestamp, 123456789};
+    size_t n = vrts::encodeCompactHeader(shape.header, &ext, wire);
+    for (size_t cut = 0; cut < n; cut++) {
+      truncation &= !vrts::decodeHeader(wire, cut, decoded, header_bytes);
+    }
+  }
+
+  // Whole sessions: compact between current peers, legacy with an older one.
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  bool sessions_ok = true;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", sessions skipped"
+              << std::endl;
+  } else {
+    auto &tracer = vrts::Tracer::instance();
+    auto level = tracer.level();
+    tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+    auto current = headerSession(units, false);
+    auto older = headerSession(units, true);
+    tracer.setLevel(level);
+    std::cout << std::setw(16) << "session" << std::setw(10) << "blocks"
+              << std::setw(10) << "compact" << std::setw(12) << "bytes/dgram"
+              << std::endl;
+    for (auto *r : {&current, &older}) {
+      std::cout << std::setw(16) << (r == &current ? "current" : "v3 peer")
+                << std::setw(10) << r->blocks << std::setw(9)
+                << std::setprecision(1)
+                << 100.0 * r->a_compact / std::max<uint64_t>(r->a_datagrams, 1)
+                << "%" << std::setw(12)
+                << double(r->a_bytes) / std::max<uint64_t>(r->a_datagrams, 1)
+                << std::endl;
+    }
+    // Everything but the AUD that flushes the clip arrives. Until the first
+    // ACK, A can only send legacy headers.
+    size_t expected = units.size() - 1;
+    sessions_ok = current.blocks == expected && older.blocks == expected &&
+                  current.a_compact + current.b_legacy_decoded ==
+                      current.a_datagrams &&
+                  current.a_compact * 10 >= current.a_datagrams * 9 &&
+                  older.a_compact == 0;
+  }
+
+  return printChecks({
+      {"round trip", round_trip},
+      {"forms told apart", told_apart},
+      {"truncation rejected", truncation},
+      {"sessions across versions", sessions_ok}});
+}
+
+// ---------------------------------------------------------------------------
+// FEC: Reed-Solomon encode / rebuild throughput.
+// ---------------------------------------------------------------------------
+
+static void benchFec(void) {
+  // (fragments, parity): small P slice chain, parameter sets at 100%, a
+  // large IDR at 25%.
+  const int shapes[][2] = {{4, 1}, {1, 1}, {16, 4}, {64, 16}, {140, 35}};
+  const size_t shard_length = sizeof(uint16_t) + 1452;
+  std::mt19937 gen(1234);
+
+  std::cout << "== fec: Reed-Solomon over GF(256), MB/s of video data"
+            << std::endl;
+  std::cout << std::setw(8) << "path" << std::setw(6) << "k" << std::setw(6)
+            << "m" << std::setw(12) << "encode" << std::setw(12) << "rebuild"
+            << std::endl;
+  for (bool simd : {false, true}) {
+    vrts::gf256::useSimd(simd);
+    if (simd && strcmp(vrts::gf256::simdPath(), "scalar") == 0) {
+      continue;
+    }
+    for (auto &shape : shapes) {
+      int k = shape[0], m = shape[1];
+      std::vector<std::vector<uint8_t>> data(k,
+                                             std::vector<uint8_t>(shard_length));
+      std::vector<std::vector<uint8_t>> parity(
+          m, std::vector<uint8_t>(shard_length));
+      for (auto &shard : data) {
+        for (auto &byte : shard) {
+          byte = gen();
+        }
+      }
+      std::vector<const uint8_t *> data_in;
+      std::vector<uint8_t *> data_out, parity_out;
+      for (auto &shard : data) {
+        data_in.push_back(shard.data());
+        data_out.push_back(shard.data());
+      }
+      for (auto &shard : parity) {
+        parity_out.push_back(shard.data());
+      }
+      uint64_t rounds = std::max<uint64_t>(1, 20000000 / (k * m * shard_length));
+      double video_mb = rounds * k * shard_length / 1e6;
+
+      double encode_ns = nsPerOp(1, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          vrts::FecCodec::encode(data_in.data(), k, parity_out.data(), m,
+                                 shard_length);
+        }
+      });
+
+      // Worst case: as many fragments lost as there is parity.
+      bool present[vrts::FecCodec::max_shards];
+      std::vector<const uint8_t *> parity_in(parity_out.begin(),
+                                             parity_out.end());
+      std::vector<uint8_t> parity_index(m);
+      for (int j = 0; j < m; j++) {
+        parity_index[j] = j;
+      }
+      double rebuild_ns = nsPerOp(1, [&] {
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (int i = 0; i < k; i++) {
+            present[i] = i >= m;
+          }
+          vrts::FecCodec::decode(data_out.data(), present, k, parity_in.data(),
+                                 parity_index.data(), m, shard_length);
+        }
+      });
+      bench_sink += data[0][0];
+      std::cout << std::setw(8) << vrts::gf256::simdPath() << std::setw(6) << k
+                << std::setw(6) << m << std::fixed << std::setprecision(1)
+                << std::setw(12) << video_mb / (encode_ns / 1e9)
+                << std::setw(12) << video_mb / (rebuild_ns / 1e9) << std::endl;
+    }
+  }
+  vrts::gf256::useSimd(true);
+}
+
+// ---------------------------------------------------------------------------
+// Ingest: encoder buffer to queued datagrams, copying vs gathering views.
+// ---------------------------------------------------------------------------
+
+static void benchIngest(void) {
+  // Access units as (NAL count, NAL bytes): a small P frame, a large one
+  // and an IDR with its parameter sets.
+  const size_t shapes[][2] = {{2, 1500}, {2, 12000}, {4, 60000}};
+  const uint16_t mtu = 1456;
+  std::mt19937 gen(99);
+  // Never opened, flush() just drops what was queued.
+  vrts::UdpSender sender;
+
+  std::cout << "== ingest: encoder output to queued datagrams, ns per access "
+               "unit"
+            << std::endl;
+  std::cout << std::setw(6) << "nals" << std::setw(10) << "bytes"
+            << std::setw(12) << "copy" << std::setw(12) << "gather"
+            << std::endl;
+  for (auto &shape : shapes) {
+    size_t nals = shape[0], nal_bytes = shape[1];
+    std::vector<uint8_t> encoder_buffer(nals * (4 + nal_bytes));
+    for (auto &byte : encoder_buffer) {
+      byte = gen();
+    }
+    const uint64_t rounds = 2000;
+
+    // Previous path: NALs and start codes appended to a pending vector, then
+    // every fragment copied into its slab entry and queued from there.
+    std::vector<vrts::vrts_packet_t> slab(256);
+    double copy_ns = nsPerOp(rounds, [&] {
+      for (uint64_t r = 0; r < rounds; r++) {
+        std::vector<uint8_t> pending;
+        for (size_t n = 0; n < nals; n++) {
+          const uint8_t *nal = &encoder_buffer[n * (4 + nal_bytes) + 4];
+          pending.emplace_back(0);
+          pending.emplace_back(0);
+          pending.emplace_back(0);
+          pending.emplace_back(1);
+          pending.insert(pending.end(), nal, nal + nal_bytes);
+        }
+        size_t fragments = (pending.size() + mtu - 1) / mtu;
+        for (size_t i = 0; i < fragments; i++) {
+          uint16_t length =
+              std::min<size_t>(mtu, pending.size() - i * mtu);
+          auto &packet = slab[i];
+          packet.header = {};
+          packet.header.length = length;
+          memcpy(packet.data, &pending[i * mtu], length);
+          sender.queue(reinterpret_cast<uint8_t *>(&packet),
+                       sizeof(vrts::vrts_packetheader_t) + length);
+        }
+        bench_sink += slab[0].data[0];
+        sender.flush();
+      }
+    });
+
+    // Views into the encoder buffer, gathered per fragment at send time.
+    static const uint8_t start_code[4] = {0, 0, 0, 1};
+    std::vector<vrts::vrts_tx_packet_t> tx_slab(256);
+    std::vector<struct iovec> gather;
+    double gather_ns = nsPerOp(rounds, [&] {
+      for (uint64_t r = 0; r < rounds; r++) {
+        auto block = std::make_shared<vrts::vrts_tx_block_t>();
+        for (size_t n = 0; n < nals; n++) {
+          uint8_t *nal = &encoder_buffer[n * (4 + nal_bytes) + 4];
+          block->segments.push_back({const_cast<uint8_t *>(start_code), 4});
+          block->segments.push_back({nal, nal_bytes});
+          block->length += 4 + nal_bytes;
+        }
+        size_t fragments = (block->length + mtu - 1) / mtu;
+        for (size_t i = 0; i < fragments; i++) {
+          auto &packet = tx_slab[i];
+          packet.header = {};
+          packet.header.length =
+              std::min<size_t>(mtu, block->length - i * mtu);
+          packet.block = block;
+          packet.offset = i * mtu;
+          gather.clear();
+          gather.push_back({&packet.header, sizeof(packet.header)});
+          size_t offset = packet.offset, len = packet.header.length;
+          for (auto &segment : block->segments) {
+            if (len == 0) {
+              break;
+            }
+            if (offset >= segment.iov_len) {
+              offset -= segment.iov_len;
+              continue;
+            }
+            size_t part = std::min(segment.iov_len - offset, len);
+            gather.push_back(
+                {static_cast<uint8_t *>(segment.iov_base) + offset, part});
+            len -= part;
+            offset = 0;
+          }
+          sender.queue(gather.data(), gather.size());
+        }
+        sender.flush();
+        for (size_t i = 0; i < fragments; i++) {
+          tx_slab[i].block.reset();
+        }
+      }
+    });
+
+    std::cout << std::setw(6) << nals << std::setw(10)
+              << nals * (4 + nal_bytes) << std::fixed << std::setprecision(0)
+              << std::setw(12) << copy_ns << std::setw(12) << gather_ns
+              << std::endl;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Output queue: reactor thread to consumer hand-off.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t seq;
+  bool keep;
+} queue_item_t;
+
+/// Producer and consumer on their own threads, ns per item. With shedding
+/// the producer drops the oldest entry (unless marked keep) whenever the
+/// queue is full, racing the consumer for it; every item has to end up
+/// either consumed or dropped exactly once, in order.
+static bool benchOutputQueue(void) {
+  const uint64_t items = 2000000;
+  bool pass = true;
+
+  std::cout << "== queue: reactor to consumer hand-off, ns per item"
+            << std::endl;
+  std::cout << std::setw(14) << "queue" << std::setw(10) << "ns"
+            << std::setw(10) << "dropped" << std::setw(8) << "ok"
+            << std::endl;
+
+  // What the output queue replaced, plus a lock so it is actually safe.
+  {
+    std::deque<queue_item_t> deque;
+    std::mutex mutex;
+    uint64_t next = 0;
+    double ns = nsPerOp(items, [&] {
+      std::thread consumer([&] {
+        while (next < items) {
+          std::lock_guard<std::mutex> lock{mutex};
+          while (!deque.empty()) {
+            bench_sink += deque.front().seq;
+            deque.pop_front();
+            next++;
+          }
+        }
+      });
+      for (uint64_t i = 0; i < items; i++) {
+        std::lock_guard<std::mutex> lock{mutex};
+        deque.push_back({i, false});
+      }
+      consumer.join();
+    });
+    std::cout << std::setw(14) << "deque+mutex" << std::fixed
+              << std::setprecision(1) << std::setw(10) << ns << std::setw(10)
+              << 0 << std::setw(8) << "yes" << std::endl;
+  }
+
+  for (bool shed : {false, true}) {
+    vrts::SpscQueue<queue_item_t> queue{vrts::vrts_output_queue_depth};
+    std::vector<uint8_t> seen(items, 0);
+    uint64_t dropped = 0;
+    bool in_order = true;
+    double ns = nsPerOp(items, [&] {
+      std::thread consumer([&] {
+        queue_item_t item;
+        uint64_t last = 0;
+        bool first = true;
+        for (;;) {
+          if (!queue.pop(item, std::chrono::milliseconds(100))) {
+            break;
+          }
+          if (item.seq == items) {
+            break;
+          }
+          in_order &= first || item.seq > last;
+          first = false;
+          last = item.seq;
+          seen[item.seq]++;
+          // A consumer that stalls now and then, so the queue fills up.
+          if (shed && item.seq % 4096 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+          }
+        }
+      });
+      for (uint64_t i = 0; i <= items; i++) {
+        queue_item_t item{i, i % 64 == 0};
+        while (!queue.push(std::move(item))) {
+          if (!shed || i == items) {
+            std::this_thread::yield();
+            continue;
+          }
+          queue_item_t oldest;
+          if (queue.popIf(oldest,
+                          [](const queue_item_t &o) { return !o.keep; })) {
+            seen[oldest.seq]++;
+            dropped++;
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      }
+      consumer.join();
+    });
+    bool ok = in_order && std::all_of(seen.begin(), seen.end(),
+                                      [](uint8_t n) { return n == 1; });
+    pass &= ok;
+    std::cout << std::setw(14) << (shed ? "spsc+shedding" : "spsc")
+              << std::fixed << std::setprecision(1) << std::setw(10) << ns
+              << std::setw(10) << dropped << std::setw(8)
+              << (ok ? "yes" : "NO") << std::endl;
+  }
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// Metrics: sharded counters and latency histograms.
+// ---------------------------------------------------------------------------
+
+/// Counter bumps from several threads at once, one shared atomic vs the
+/// sharded Counter, ns per bump overall; both have to add up exactly. Then
+/// percentiles and windows of a LatencyHistogram fed with known values at
+/// made-up times.
+static bool benchMetrics(void) {
+  const uint64_t bumps = 2000000;
+  bool pass = true;
+
+  std::cout << "== metrics: counter bumps across threads, ns per bump"
+            << std::endl;
+  std::cout << std::setw(14) << "counter" << std::setw(9) << "threads"
+            << std::setw(10) << "ns" << std::setw(8) << "ok" << std::endl;
+  for (int threads : {1, 4}) {
+    std::atomic<uint64_t> shared{0};
+    vrts::Counter sharded;
+    auto run = [&](auto &&bump) {
+      return nsPerOp(bumps, [&] {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+          workers.emplace_back([&] {
+            for (uint64_t i = 0; i < bumps / threads; i++) {
+              bump();
+            }
+          });
+        }
+        for (auto &worker : workers) {
+          worker.join();
+        }
+      });
+    };
+    uint64_t expected = bumps / threads * threads;
+    double shared_ns =
+        run([&] { shared.fetch_add(1, std::memory_order_relaxed); });
+    double sharded_ns = run([&] { sharded++; });
+    bool shared_ok = shared.load() == expected;
+    bool sharded_ok = sharded.value() == expected;
+    pass &= shared_ok && sharded_ok;
+    std::cout << std::setw(14) << "atomic" << std::setw(9) << threads
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << shared_ns << std::setw(8) << (shared_ok ? "yes" : "NO")
+              << std::endl;
+    std::cout << std::setw(14) << "sharded" << std::setw(9) << threads
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << sharded_ns << std::setw(8) << (sharded_ok ? "yes" : "NO")
+              << std::endl;
+  }
+
+  std::cout << "== metrics: latency histogram percentiles and windows"
+            << std::endl;
+  std::cout << std::setw(14) << "check" << std::setw(12) << "got"
+            << std::setw(12) << "want" << std::setw(8) << "ok" << std::endl;
+  auto check = [&](const char *name, uint64_t got, uint64_t low,
+                   uint64_t high) {
+    bool ok = got >= low && got <= high;
+    pass &= ok;
+    std::cout << std::setw(14) << name << std::setw(12) << got
+              << std::setw(12) << (low + high) / 2 << std::setw(8)
+              << (ok ? "yes" : "NO") << std::endl;
+  };
+
+  // 1..100000us once each; buckets are at most 1/16 wide.
+  vrts::LatencyHistogram histogram;
+  vrts::vrts_clock_time_t t0{std::chrono::seconds(1000)};
+  histogram.tick(t0);
+  for (uint64_t us = 1; us <= 100000; us++) {
+    histogram.record(std::chrono::microseconds(us));
+  }
+  auto all = histogram.window(t0, 60);
+  check("p50", all.percentile(0.5), 50000, 50000 + 50000 / 16);
+  check("p99", all.percentile(0.99), 99000, 99000 + 99000 / 16);
+  check("p999", all.percentile(0.999), 99900, 99900 + 99900 / 16);
+
+  // Another 1000 samples five seconds later: only those are in the last
+  // second, both batches in the last ten, and after a minute neither.
+  auto t5 = t0 + std::chrono::seconds(5);
+  histogram.tick(t5);
+  for (int i = 0; i < 1000; i++) {
+    histogram.record(std::chrono::milliseconds(200));
+  }
+  check("last 1s", histogram.window(t5, 1).count(), 1000, 1000);
+  check("last 10s", histogram.window(t5, 10).count(), 101000, 101000);
+  check("1s p50", histogram.window(t5, 1).percentile(0.5), 200000,
+        200000 + 200000 / 16);
+  auto t70 = t0 + std::chrono::seconds(70);
+  check("after 60s", histogram.window(t70, 60).count(), 0, 0);
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// Trace: per packet logging on the caller's thread.
+// ---------------------------------------------------------------------------
+
+/// ns per log line of the rx path: formatted and flushed on the spot as
+/// vrcout did, as a trace record, and as a trace point below the runtime
+/// level. Then the text of a few records as drained back.
+static bool benchTrace(void) {
+  const uint64_t lines = 200000;
+  auto &tracer = vrts::Tracer::instance();
+  bool pass = true;
+
+  std::cout << "== trace: one rx log line, ns per line" << std::endl;
+  std::cout << std::setw(14) << "logger" << std::setw(10) << "ns"
+            << std::setw(10) << "dropped" << std::endl;
+  {
+    std::ofstream out{"/dev/null"};
+    double ns = nsPerOp(lines, [&] {
+      for (uint64_t i = 0; i < lines; i++) {
+        out << "[vrts] == got packet_id: " << std::to_string(i)
+            << " offset: " << std::to_string(i % 7) << std::endl;
+      }
+    });
+    std::cout << std::setw(14) << "ostream+endl" << std::fixed
+              << std::setprecision(1) << std::setw(10) << ns << std::setw(10)
+              << 0 << std::endl;
+  }
+  for (bool enabled : {true, false}) {
+    tracer.setLevel(enabled ? vrts::TRACE_LEVEL_DEBUG : vrts::TRACE_LEVEL_INFO);
+    uint64_t dropped = tracer.dropped();
+    // In bursts that fit the ring, emptied outside the timing as the
+    // background thread would.
+    const uint64_t burst = vrts::trace_ring_depth / 2;
+    double ns = 0;
+    for (uint64_t first = 0; first < lines; first += burst) {
+      ns += nsPerOp(lines, [&] {
+        for (uint64_t i = first; i < first + burst; i++) {
+          VRTS_TRACE(DEBUG, "[vrts] == got packet_id: {} offset: {}", i,
+                     i % 7);
+        }
+      });
+      tracer.flush();
+      tracer.drainText();
+    }
+    std::cout << std::setw(14) << (enabled ? "trace" : "trace (off)")
+              << std::fixed << std::setprecision(1) << std::setw(10) << ns
+              << std::setw(10) << tracer.dropped() - dropped << std::endl;
+  }
+  tracer.setLevel(vrts::TRACE_LEVEL_DEBUG);
+  tracer.flush();
+  tracer.drainText();
+
+  std::cout << "== trace: records drained back as text" << std::endl;
+  std::string name = "pacer";
+  VRTS_TRACE(INFO, "[vrts] {} rate {} kbps, {} in transit", name, 1.5,
+             int32_t{-3});
+  VRTS_TRACE(WARN, "[vrts] stream {} flag {} {}", uint8_t{2}, true, "done");
+  tracer.flush();
+  std::string text = tracer.drainText();
+  std::string want[] = {" I [vrts] pacer rate 1.5 kbps, -3 in transit",
+                        " W [vrts] stream 2 flag 1 done"};
+  size_t at = 0;
+  for (auto &line : want) {
+    size_t end = text.find('\n', at);
+    bool ok = end != std::string::npos &&
+              text.compare(at + 15, end - at - 15, line) == 0;
+    pass &= ok;
+    std::cout << (end == std::string::npos ? "<missing>"
+                                           : text.substr(at, end - at))
+              << (ok ? "" : "  <- NO") << std::endl;
+    at = end == std::string::npos ? text.size() : end + 1;
+  }
+
+  // A thread that traced and exited leaves its ring behind until drained,
+  // unless the background thread got to it first.
+  size_t rings = tracer.ringCount();
+  std::thread worker([] { VRTS_TRACE(INFO, "[vrts] worker {}", 1); });
+  worker.join();
+  size_t held = tracer.ringCount();
+  tracer.flush();
+  tracer.drainText();
+  bool freed = held <= rings + 1 && tracer.ringCount() == rings;
+  std::cout << "rings: " << rings << " before, " << held
+            << " after a thread traced, " << tracer.ringCount()
+            << " once drained" << (freed ? "" : "  <- NO") << std::endl;
+  pass &= freed;
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// Replay: a lossy session captured, then replayed under virtual time.
+// ---------------------------------------------------------------------------
+
+#ifndef VRTS_MEDIA_DIR
+#define VRTS_MEDIA_DIR "h265nal/media"
+#endif
+
+typedef struct {
+  vrts::vrts_clock_time_t deliver_at;
+  std::vector<uint8_t> data;
+} bench_datagram_t;
+
+/// Two virtual link sessions stream a clip at 100 fps over 5 ms each way,
+/// losing every 20th data-side datagram, with the receiver captured. The
+/// capture is replayed twice: both replays, and the live run, have to hand
+/// out the same NAL blocks.
+static bool benchReplay(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== replay: lossy session captured and replayed under "
+               "virtual time"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  const auto frame_interval = std::chrono::milliseconds(10);
+  const auto one_way_delay = std::chrono::milliseconds(5);
+  const auto tick = std::chrono::microseconds(250);
+  const uint64_t loss_period = 20;
+  const std::string capture_path = "vrts-bench-replay.pcapng";
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+
+  vrts::vrts_clock_time_t now{std::chrono::seconds(1700000000)};
+  std::deque<bench_datagram_t> to_receiver, to_sender;
+  uint64_t forwarded = 0;
+  std::vector<std::vector<uint8_t>> live;
+  vrts::vrts_stat_t live_stats = {};
+  auto wall_start = bench_clock::now();
+  {
+    vrts::VRTS sender(
+        [&](const uint8_t *data, size_t len) {
+          if (++forwarded % loss_period == 3) {
+            return;
+          }
+          to_receiver.push_back(
+              {now + one_way_delay, std::vector<uint8_t>(data, data + len)});
+        },
+        now);
+    vrts::VRTS receiver(
+        [&](const uint8_t *data, size_t len) {
+          to_sender.push_back(
+              {now + one_way_delay, std::vector<uint8_t>(data, data + len)});
+        },
+        now);
+    receiver.startCapture(capture_path);
+
+    auto end = now + frame_interval * units.size() + std::chrono::seconds(1);
+    auto next_feed = now;
+    size_t next_unit = 0;
+    std::vector<uint8_t> nal;
+    for (; now < end; now += tick) {
+      while (!to_receiver.empty() && to_receiver.front().deliver_at <= now) {
+        auto &datagram = to_receiver.front();
+        receiver.receive(datagram.data.data(), datagram.data.size(),
+                         datagram.deliver_at);
+        to_receiver.pop_front();
+      }
+      while (!to_sender.empty() && to_sender.front().deliver_at <= now) {
+        auto &datagram = to_sender.front();
+        sender.receive(datagram.data.data(), datagram.data.size(),
+                       datagram.deliver_at);
+        to_sender.pop_front();
+      }
+      if (next_unit < units.size() && now >= next_feed) {
+        sender.parse(units[next_unit].data(), units[next_unit].size());
+        next_unit++;
+        next_feed += frame_interval;
+      }
+      sender.step(now);
+      receiver.step(now);
+      while (receiver.popData(nal)) {
+        live.push_back(std::move(nal));
+      }
+    }
+    receiver.stopCapture();
+    receiver.getStatistics(live_stats);
+  }
+  double live_ms = std::chrono::duration<double, std::milli>(
+                       bench_clock::now() - wall_start)
+                       .count();
+
+  std::cout << std::setw(10) << "run" << std::setw(8) << "nals"
+            << std::setw(10) << "bytes" << std::setw(9) << "rx pkts"
+            << std::setw(10) << "wall ms" << std::setw(8) << "ok"
+            << std::endl;
+  auto row = [](const char *name, const std::vector<std::vector<uint8_t>> &out,
+                uint32_t packets, double ms, bool ok) {
+    size_t bytes = 0;
+    for (auto &nal : out) {
+      bytes += nal.size();
+    }
+    std::cout << std::setw(10) << name << std::setw(8) << out.size()
+              << std::setw(10) << bytes << std::setw(9) << packets
+              << std::fixed << std::setprecision(1) << std::setw(10) << ms
+              << std::setw(8) << (ok ? "yes" : "NO") << std::endl;
+  };
+  row("live", live, live_stats.recv_pkt_total, live_ms, !live.empty());
+
+  bool pass = !live.empty();
+  vrts::CaptureReplay replay;
+  uint64_t first_hash = 0;
+  for (int run = 0; run < 2; run++) {
+    std::vector<std::vector<uint8_t>> replayed;
+    replay.setOutput([&](uint8_t, const std::vector<uint8_t> &nal) {
+      replayed.push_back(nal);
+    });
+    vrts::replay_result_t result;
+    auto start = bench_clock::now();
+    bool ok = replay.run(capture_path, result);
+    double ms = std::chrono::duration<double, std::milli>(
+                    bench_clock::now() - start)
+                    .count();
+    if (run == 0) {
+      first_hash = result.output_hash;
+    }
+    ok &= replayed == live && result.output_hash == first_hash &&
+          result.stats.recv_pkt_total == live_stats.recv_pkt_total;
+    pass &= ok;
+    row(run == 0 ? "replay 1" : "replay 2", replayed,
+        result.stats.recv_pkt_total, ms, ok);
+  }
+  remove(capture_path.c_str());
+  tracer.setLevel(level);
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// Link simulator: path models checked against theory, sessions repeatable.
+// ---------------------------------------------------------------------------
+
+/// Offers count datagrams of len bytes, interval apart, each carrying its
+/// index, and drains the path. Returns how many arrived before a lower index.
+static uint64_t simOffer(vrts::SimPath &path, uint64_t count, size_t len,
+                         std::chrono::nanoseconds interval,
+                         std::chrono::system_clock::time_point &last_arrival) {
+  std::chrono::system_clock::time_point now{std::chrono::seconds(1)};
+  std::vector<uint8_t> data(len);
+  vrts::SimPath::datagram_t datagram;
+  uint64_t highest = 0;
+  uint64_t overtaken = 0;
+  auto drain = [&](std::chrono::system_clock::time_point until) {
+    while (path.receive(until, datagram)) {
+      uint64_t index;
+      memcpy(&index, datagram.data.data(), sizeof(index));
+      overtaken += index < highest;
+      highest = std::max(highest, index);
+      last_arrival = datagram.arrival;
+    }
+  };
+  for (uint64_t i = 1; i <= count; i++) {
+    memcpy(data.data(), &i, sizeof(i));
+    path.send(data.data(), data.size(), now);
+    now += interval;
+    drain(now);
+  }
+  drain(std::chrono::system_clock::time_point::max());
+  return overtaken;
+}
+
+/// Streams a clip for 2 s over a lossy, jittery, rate capped SimLink and
+/// returns a hash of what came out and of the link's counts, with the
+/// simulated over wall time.
+static uint64_t simSession(const std::vector<std::vector<uint8_t>> &units,
+                           uint32_t seed, uint64_t &blocks, double &speedup) {
+  vrts::vrts_clock_time_t start{std::chrono::seconds(1700000000)};
+  vrts::SimLink link(start, seed);
+  vrts::sim_path_t lossy = {0.01f, 0.3f, 0.005f, 0.5f, 8000, 64 * 1024,
+                            15000, 5000, 0.01f, 3000, 0.005f, 0};
+  link.setProfile(vrts::SIM_SIDE_A, lossy);
+  link.setProfile(vrts::SIM_SIDE_B, lossy);
+  uint64_t hash = 14695981039346656037ull;
+  blocks = 0;
+  link.setOutput([&](vrts::sim_side_t side, uint8_t,
+                     std::vector<uint8_t> &nal) {
+    if (side != vrts::SIM_SIDE_B) {
+      return;
+    }
+    blocks++;
+    for (auto byte : nal) {
+      hash = (hash ^ byte) * 1099511628211ull;
+    }
+  });
+  auto wall_start = bench_clock::now();
+  size_t count = std::min<size_t>(units.size(), 200);
+  std::vector<uint8_t> unit;
+  for (size_t i = 0; i < count; i++) {
+    unit = units[i];
+    link.endpoint(vrts::SIM_SIDE_A).parse(unit.data(), unit.size());
+    link.runFor(std::chrono::milliseconds(10));
+  }
+  double wall_s =
+      std::chrono::duration<double>(bench_clock::now() - wall_start).count();
+  speedup = 0.01 * count / std::max(wall_s, 1e-9);
+  // Over a link that lets enough through, the output is the whole clip
+  // whatever the seed, so what the link did goes in too.
+  for (auto side : {vrts::SIM_SIDE_A, vrts::SIM_SIDE_B}) {
+    auto &stats = link.path(side).stats();
+    for (uint64_t count : {stats.delivered, stats.lost, stats.reordered,
+                           stats.duplicated}) {
+      hash = (hash ^ count) * 1099511628211ull;
+    }
+  }
+  return hash;
+}
+
+static bool benchSim(void) {
+  bool pass = true;
+  std::cout << "== sim: link models against theory" << std::endl;
+  std::cout << std::setw(28) << "model" << std::setw(12) << "measured"
+            << std::setw(12) << "expected" << std::setw(6) << "ok"
+            << std::endl;
+  auto row = [&](const char *name, double measured, double expected,
+                 double tolerance) {
+    bool ok = std::abs(measured - expected) <= tolerance * expected;
+    pass &= ok;
+    std::cout << std::setw(28) << name << std::fixed << std::setprecision(3)
+              << std::setw(12) << measured << std::setw(12) << expected
+              << std::setw(6) << (ok ? "yes" : "NO") << std::endl;
+  };
+  std::chrono::system_clock::time_point last_arrival;
+
+  // Gilbert-Elliott with a lossless good and a lossy bad state: the chain
+  // spends to_bad / (to_bad + to_good) of the time bad, and stays there
+  // 1 / to_good datagrams on average.
+  {
+    vrts::SimPath path(7);
+    vrts::sim_path_t profile = vrts::sim_path_ideal;
+    profile.loss_bad = 1.0f;
+    profile.to_bad = 0.02f;
+    profile.to_good = 0.25f;
+    path.setProfile(profile);
+    const uint64_t count = 400000;
+    simOffer(path, count, 16, std::chrono::microseconds(1), last_arrival);
+    auto &stats = path.stats();
+    row("gilbert-elliott loss %", 100.0 * stats.lost / count,
+        100.0 * 0.02 / 0.27, 0.05);
+    row("mean loss burst", double(stats.lost) / stats.loss_bursts, 4.0, 0.05);
+  }
+  // Offered at twice the bottleneck rate, the queue fills and the rest is
+  // dropped, but what gets through leaves at the bottleneck rate.
+  {
+    vrts::SimPath path(7);
+    vrts::sim_path_t profile = vrts::sim_path_ideal;
+    profile.rate_kbps = 10000;
+    profile.queue_bytes = 32 * 1024;
+    path.setProfile(profile);
+    const uint64_t count = 20000;
+    // 1200 bytes every 480 us is 20 Mbit/s.
+    simOffer(path, count, 1200, std::chrono::microseconds(480), last_arrival);
+    auto &stats = path.stats();
+    double seconds =
+        std::chrono::duration<double>(last_arrival.time_since_epoch())
+            .count() -
+        1.0;
+    row("bottleneck kbit/s", stats.delivered_bytes * 8 / seconds / 1000,
+        10000, 0.02);
+    row("queue drops %", 100.0 * stats.queue_drops / count, 50, 0.05);
+  }
+  // Reordering and duplication happen at their rates, and nothing else
+  // overtakes: jitter alone keeps the order.
+  {
+    vrts::SimPath path(7);
+    vrts::sim_path_t profile = vrts::sim_path_ideal;
+    profile.delay_us = 5000;
+    profile.jitter_us = 2000;
+    profile.reorder = 0.01f;
+    profile.reorder_us = 3000;
+    profile.duplicate = 0.01f;
+    path.setProfile(profile);
+    const uint64_t count = 200000;
+    uint64_t overtaken = simOffer(path, count, 16,
+                                  std::chrono::microseconds(100), last_arrival);
+    auto &stats = path.stats();
+    row("reordered %", 100.0 * stats.reordered / count, 1.0, 0.05);
+    row("duplicated %", 100.0 * stats.duplicated / count, 1.0, 0.05);
+    // A held datagram comes in after the next 30 or so, and so does its
+    // copy if it has one.
+    bool ok = overtaken > 0 &&
+              overtaken <= stats.reordered + stats.duplicated &&
+              stats.delivered == count + stats.duplicated;
+    pass &= ok;
+    std::cout << std::setw(28) << "late arrivals" << std::setw(12) << overtaken
+              << std::setw(12) << "<= held" << std::setw(6)
+              << (ok ? "yes" : "NO") << std::endl;
+  }
+
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== sim: two sessions over a lossy link, same seed twice"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return pass;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  std::cout << std::setw(8) << "seed" << std::setw(8) << "nals"
+            << std::setw(20) << "hash" << std::setw(14) << "x real time"
+            << std::setw(6) << "ok" << std::endl;
+  uint64_t first_hash = 0;
+  for (int run = 0; run < 3; run++) {
+    // The third run takes another seed and should come out different.
+    uint32_t seed = run < 2 ? 11 : 12;
+    uint64_t blocks;
+    double speedup;
+    uint64_t hash = simSession(units, seed, blocks, speedup);
+    if (run == 0) {
+      first_hash = hash;
+    }
+    bool ok = blocks > 0 && (run < 2 ? hash == first_hash : hash != first_hash);
+    pass &= ok;
+    std::cout << std::setw(8) << seed << std::setw(8) << blocks
+              << std::setw(20) << std::hex << hash << std::dec << std::fixed
+              << std::setprecision(1) << std::setw(14) << speedup
+              << std::setw(6) << (ok ? "yes" : "NO") << std::endl;
+  }
+  tracer.setLevel(level);
+  return pass;
+}
+
+// ---------------------------------------------------------------------------
+// Glass to glass: stamped frames over a link between skewed clocks.
+// ---------------------------------------------------------------------------
+
+/// The receiver's clock runs 2.5 s ahead of the sender's, the link takes
+/// 10 ms each way plus serialization at 20 Mbit/s, and every frame was
+/// captured 30 ms before it is fed, 100 per second. The receiver has to find the offset
+/// from its clock probes and split the latency into its stages.
+static bool benchGlass(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== glass: stage latencies between clocks 2.5 s apart"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  const auto clock_offset = std::chrono::microseconds(2500000);
+  const auto encode_delay = std::chrono::milliseconds(30);
+  const float one_way_ms = 10;
+  const float frame_ms = 10;
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+
+  vrts::vrts_clock_time_t start{std::chrono::seconds(1700000000)};
+  vrts::SimLink link(start);
+  link.setClockOffset(vrts::SIM_SIDE_B, clock_offset);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = one_way_ms * 1000;
+  path.rate_kbps = 20000;
+  path.queue_bytes = 1 << 20;
+  link.setProfile(vrts::SIM_SIDE_A, path);
+  link.setProfile(vrts::SIM_SIDE_B, path);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  auto &receiver = link.endpoint(vrts::SIM_SIDE_B);
+  sender.updateTimestampSei(true);
+  uint64_t blocks = 0;
+  uint64_t stamped = 0;
+  link.setOutput([&](vrts::sim_side_t side, uint8_t,
+                     std::vector<uint8_t> &nal) {
+    vrts::vrts_sei_timestamp_t stamp;
+    if (side == vrts::SIM_SIDE_B) {
+      blocks++;
+      stamped += vrts::findTimestampSei(nal.data(), nal.size(), stamp);
+    }
+  });
+  std::vector<uint8_t> unit;
+  size_t count = std::min<size_t>(units.size(), 400);
+  for (size_t i = 0; i < count; i++) {
+    unit = units[i];
+    sender.setCaptureTime(link.now() - encode_delay);
+    sender.parse(unit.data(), unit.size());
+    link.runFor(std::chrono::milliseconds(int(frame_ms)));
+  }
+  link.runFor(std::chrono::milliseconds(500));
+  vrts::vrts_stat_t stats, sent;
+  receiver.getStatistics(stats);
+  sender.getStatistics(sent);
+  tracer.setLevel(level);
+
+  std::cout << vrts::latencyReport(stats);
+  auto &encode = stats.encode_latency.last_10s;
+  auto &transport = stats.transport_latency.last_10s;
+  auto &glass = stats.glass_latency.last_10s;
+  // Histogram buckets are within a few percent.
+  auto near = [](float measured, float expected, float tolerance) {
+    return std::abs(measured - expected) <= tolerance * expected;
+  };
+  bool offset_ok =
+      std::abs(stats.clock_offset_ms + clock_offset.count() / 1000.0f) < 0.1f;
+  bool encode_ok = near(encode.p50, encode_delay.count(), 0.05f);
+  // A block only goes out once the next access unit's AUD came in, a frame
+  // after its own. From there it takes no longer than to the sender seeing
+  // it ACKed.
+  bool transport_ok = transport.p50 >= one_way_ms + frame_ms &&
+                      transport.p50 <= sent.nal_latency.last_10s.p50;
+  bool glass_ok = near(glass.p50, encode.p50 + transport.p50, 0.1f);
+  bool all_ok = blocks > 0 && stamped == blocks && glass.samples > 0;
+  return printChecks({
+      {"offset from probes", offset_ok},
+      {"encode stage", encode_ok},
+      {"transport stage", transport_ok},
+      {"sum of stages", glass_ok},
+      {"every block stamped", all_ok}});
+}
+
+// ---------------------------------------------------------------------------
+// Jitter buffer: playout deadlines against a jittery, lossy link.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t fed;
+  uint64_t pictures;
+  // Feed to handed out of the pictures that made it, and the 90th
+  // percentile of how much that changes from one to the next, i.e. of how
+  // far the intervals they come out at are off those they were fed at. ms.
+  double latency_p50_ms;
+  double latency_max_ms;
+  double interval_p90_ms;
+  vrts::vrts_stat_t received;
+  vrts::vrts_stat_t sent;
+} jitter_result_t;
+
+static bool hasPicture(const std::vector<uint8_t> &data) {
+  for (size_t i = 0; i + 3 < data.size(); i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      if (((data[i + 3] >> 1) & 0x3f) < 32) {
+        return true;
+      }
+      i += 2;
+    }
+  }
+  return false;
+}
+
+static const vrts::vrts_clock_time_t clip_start{
+    std::chrono::seconds(1700000000)};
+
+/// Feeds up to count units of a clip at 30 fps from side A of link to side
+/// B, over path both ways, then lets it run for tail. The sender stamps
+/// what it is fed, and out gets when each picture handed out on side B was
+/// fed, us, and how long ago that was, ms. Before each unit, feed may
+/// change the link, the endpoints or the unit, and says how many streams
+/// it goes into. @returns how many pictures were fed.
+static uint64_t
+clipSession(vrts::SimLink &link, const std::vector<std::vector<uint8_t>> &units,
+            size_t count, const vrts::sim_path_t &path,
+            std::chrono::microseconds tail,
+            const std::function<uint8_t(size_t, std::vector<uint8_t> &)> &feed,
+            const std::function<void(int64_t, double)> &out) {
+  link.setProfile(vrts::SIM_SIDE_A, path);
+  link.setProfile(vrts::SIM_SIDE_B, path);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  sender.updateTimestampSei(true);
+  link.setOutput([&](vrts::sim_side_t side, uint8_t,
+                     std::vector<uint8_t> &nal) {
+    vrts::vrts_sei_timestamp_t stamp;
+    if (side == vrts::SIM_SIDE_B && hasPicture(nal) &&
+        vrts::findTimestampSei(nal.data(), nal.size(), stamp)) {
+      out(stamp.ingest_us,
+          (vrts::toMicroseconds(link.now()) - stamp.ingest_us) / 1000.0);
+    }
+  });
+  uint64_t fed = 0;
+  uint8_t stream_count = 0;
+  std::vector<uint8_t> unit;
+  count = std::min(count, units.size());
+  for (size_t i = 0; i < count; i++) {
+    unit = units[i];
+    stream_count = feed(i, unit);
+    for (uint8_t stream_id = 0; stream_id < stream_count; stream_id++) {
+      sender.parse(unit.data(), unit.size(), stream_id);
+      fed += hasPicture(unit);
+    }
+    link.runFor(std::chrono::microseconds(33333));
+  }
+  // The sender holds on to an access unit until the next one starts.
+  uint8_t aud[] = {0, 0, 0, 1, 0x46, 0x01, 0x50};
+  for (uint8_t stream_id = 0; stream_id < stream_count; stream_id++) {
+    sender.parse(aud, sizeof(aud), stream_id);
+  }
+  link.runFor(tail);
+  return fed;
+}
+
+/// Relabels the TRAIL_R slices of an access unit TRAIL_N. VRTS only looks
+/// at the NAL headers, so this passes for an encoder with a non-reference
+/// layer.
+static void dropReference(std::vector<uint8_t> &unit) {
+  for (size_t k = 0; k + 3 < unit.size(); k++) {
+    if (unit[k] == 0 && unit[k + 1] == 0 && unit[k + 2] == 1 &&
+        ((unit[k + 3] >> 1) & 0x3f) == h265nal::NalUnitType::TRAIL_R) {
+      unit[k + 3] &= 0x81;
+    }
+  }
+}
+
+/// 10 s of the clip, every other picture relabelled TRAIL_N, as if from an
+/// encoder with a non-reference layer; the clip has none of its own.
+static jitter_result_t
+jitterSession(const std::vector<std::vector<uint8_t>> &units,
+              const vrts::sim_path_t &path, bool buffered) {
+  vrts::SimLink link(clip_start, 7);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  auto &receiver = link.endpoint(vrts::SIM_SIDE_B);
+  receiver.updateJitterBuffer(buffered);
+  std::vector<double> latencies;
+  jitter_result_t result = {};
+  result.fed = clipSession(
+      link, units, 300, path, std::chrono::milliseconds(500),
+      [&](size_t i, std::vector<uint8_t> &unit) {
+        if (i % 2) {
+          dropReference(unit);
+        }
+        return 1;
+      },
+      [&](int64_t, double latency_ms) { latencies.push_back(latency_ms); });
+  receiver.getStatistics(result.received);
+  sender.getStatistics(result.sent);
+
+  result.pictures = latencies.size();
+  if (latencies.size() > 1) {
+    std::vector<double> changes;
+    for (size_t i = 1; i < latencies.size(); i++) {
+      changes.push_back(std::abs(latencies[i] - latencies[i - 1]));
+    }
+    std::sort(changes.begin(), changes.end());
+    result.interval_p90_ms = changes[changes.size() * 9 / 10];
+    std::sort(latencies.begin(), latencies.end());
+    result.latency_p50_ms = latencies[latencies.size() / 2];
+    result.latency_max_ms = latencies.back();
+  }
+  return result;
+}
+
+/// The same clip over the same link, handed out as soon as complete and
+/// through the jitter buffer. The buffer should even out when pictures come
+/// out for no more delay than it is allowed, and what it skips must not
+/// cost a new GOP.
+static bool benchJitter(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== jitter: playout deadlines on a jittery, lossy link"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = 20000;
+  path.jitter_us = 15000;
+  path.loss_good = 0.02f;
+  path.rate_kbps = 20000;
+  path.queue_bytes = 1 << 20;
+  const float max_delay_ms = 100;
+  auto off = jitterSession(units, path, false);
+  auto on = jitterSession(units, path, true);
+  tracer.setLevel(level);
+
+  std::cout << std::setw(8) << "buffer" << std::setw(10) << "pictures"
+            << std::setw(8) << "p50 ms" << std::setw(8) << "max ms"
+            << std::setw(13) << "interval ms" << std::setw(10) << "held p99"
+            << std::setw(8) << "late" << std::setw(9) << "skipped"
+            << std::setw(6) << "gops" << std::endl;
+  for (auto *r : {&off, &on}) {
+    std::cout << std::setw(8) << (r == &on ? "on" : "off") << std::setw(10)
+              << r->pictures << std::fixed << std::setprecision(1)
+              << std::setw(8) << r->latency_p50_ms << std::setw(8)
+              << r->latency_max_ms << std::setw(13) << r->interval_p90_ms
+              << std::setw(10) << r->received.playout_delay.last_10s.p99
+              << std::setw(8) << r->received.playout_late << std::setw(9)
+              << r->received.playout_skipped << std::setw(6)
+              << r->sent.gop_requests << std::endl;
+  }
+  std::cout << "jitter " << std::fixed << std::setprecision(1)
+            << on.received.jitter_ms << " ms, target "
+            << on.received.playout_target_ms << " ms" << std::endl;
+
+  bool smoother = on.interval_p90_ms < off.interval_p90_ms / 2;
+  bool bounded =
+      on.received.playout_delay.last_10s.p999 <= max_delay_ms * 1.05f;
+  bool delivered = on.pictures >= on.fed * 95 / 100;
+  bool no_gops = on.sent.gop_requests <= off.sent.gop_requests;
+  return printChecks({
+      {"smoother output", smoother},
+      {"delay within max", bounded},
+      {"95% of pictures out", delivered},
+      {"skips cost no gop", no_gops}});
+}
+
+typedef struct {
+  uint64_t fed;
+  uint64_t pictures;
+  // Feed to handed out, ms, and the share of pictures that took more than
+  // hol_delayed_ms longer than the quickest.
+  double latency_p50_ms;
+  double latency_p99_ms;
+  double delayed;
+  vrts::vrts_stat_t received;
+  vrts::vrts_stat_t sent;
+} hol_result_t;
+
+static constexpr double hol_delayed_ms = 20;
+
+/// 10 s of the clip into each of stream_count streams, handed out as soon
+/// as complete. With non_reference, every other picture is relabelled
+/// TRAIL_N as in jitterSession().
+static hol_result_t holSession(const std::vector<std::vector<uint8_t>> &units,
+                               const vrts::sim_path_t &path,
+                               uint8_t stream_count, bool non_reference) {
+  vrts::SimLink link(clip_start, 7);
+  std::vector<double> latencies;
+  hol_result_t result = {};
+  result.fed = clipSession(
+      link, units, 300, path, std::chrono::milliseconds(500),
+      [&](size_t i, std::vector<uint8_t> &unit) {
+        if (non_reference && i % 2) {
+          dropReference(unit);
+        }
+        return stream_count;
+      },
+      [&](int64_t, double latency_ms) { latencies.push_back(latency_ms); });
+  link.endpoint(vrts::SIM_SIDE_B).getStatistics(result.received);
+  link.endpoint(vrts::SIM_SIDE_A).getStatistics(result.sent);
+
+  result.pictures = latencies.size();
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    result.latency_p50_ms = latencies[latencies.size() / 2];
+    result.latency_p99_ms = latencies[latencies.size() * 99 / 100];
+    result.delayed =
+        double(latencies.end() -
+               std::upper_bound(latencies.begin(), latencies.end(),
+                                latencies.front() + hol_delayed_ms)) /
+        latencies.size();
+  }
+  return result;
+}
+
+/// Complete pictures behind an incomplete one on a lossy link. A second
+/// stream should see no more delay than one on its own, and pictures behind
+/// one nothing refers to should not wait for its repair.
+static bool benchHol(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== hol: reassembly behind incomplete chains" << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = 40000;
+  path.loss_good = 0.03f;
+  path.rate_kbps = 20000;
+  path.queue_bytes = 1 << 20;
+  auto one = holSession(units, path, 1, false);
+  auto two = holSession(units, path, 2, false);
+  auto non_ref = holSession(units, path, 1, true);
+  tracer.setLevel(level);
+
+  std::cout << std::setw(12) << "session" << std::setw(10) << "pictures"
+            << std::setw(8) << "p50 ms" << std::setw(8) << "p99 ms"
+            << std::setw(10) << "delayed" << std::setw(10) << "bypassed"
+            << std::setw(9) << "skipped" << std::setw(6) << "gops"
+            << std::endl;
+  std::pair<const char *, hol_result_t *> rows[] = {
+      {"one stream", &one}, {"two streams", &two}, {"trail_n", &non_ref}};
+  for (auto &row : rows) {
+    auto *r = row.second;
+    std::cout << std::setw(12) << row.first << std::setw(10) << r->pictures
+              << std::fixed << std::setprecision(1) << std::setw(8)
+              << r->latency_p50_ms << std::setw(8) << r->latency_p99_ms
+              << std::setw(9) << r->delayed * 100 << "%" << std::setw(10)
+              << r->received.hol_bypassed << std::setw(9)
+              << r->received.playout_skipped << std::setw(6)
+              << r->sent.gop_requests << std::endl;
+  }
+
+  // What got bypassed would have waited; the rest should be about as
+  // delayed as on its own, with the other stream's losses left out.
+  bool streams_apart = two.received.hol_bypassed > 0 &&
+                       two.delayed <= one.delayed * 1.5;
+  bool no_repair_wait = non_ref.received.hol_bypassed > 0 &&
+                        non_ref.delayed < one.delayed;
+  bool skips_no_gop = non_ref.sent.gop_requests <= one.sent.gop_requests;
+  return printChecks({
+      {"streams don't wait", streams_apart},
+      {"trail_n not waited for", no_repair_wait},
+      {"skips cost no gop", skips_no_gop}});
+}
+
+typedef struct {
+  // Data bytes each stream got onto the link in the window after the burst.
+  uint64_t bytes[2];
+  // The sender's targets for both streams once the burst was fed, kbit/s.
+  uint32_t target_kbps[2];
+} weight_result_t;
+
+static constexpr size_t weight_warm_units = 45;
+static constexpr size_t weight_burst_units = 60;
+
+/// Two virtual link sessions 10 ms apart, stepped in 1 ms, the sender's
+/// streams weighted 3:1 behind a 6 Mbit/s pacer. The clip's start goes into
+/// both at 30 fps, then the next two seconds of it are queued at once into
+/// stream 0 and, with both, into stream 1 too; otherwise stream 1 is left
+/// idle long enough to give up its share first. Counted for window, well
+/// before either burst is sent, so whoever is fed has data waiting
+/// throughout.
+static weight_result_t
+weightSession(const std::vector<std::vector<uint8_t>> &units, bool both,
+              std::chrono::milliseconds window) {
+  const auto delay = std::chrono::milliseconds(10);
+  vrts::vrts_clock_time_t now = clip_start;
+  auto burst_start = vrts::vrts_clock_time_t::max();
+  std::deque<bench_datagram_t> to_b, to_a;
+  std::set<uint32_t> counted;
+  weight_result_t result = {};
+  vrts::VRTS a(
+      [&](const uint8_t *data, size_t len) {
+        vrts::vrts_packetheader_t header;
+        size_t header_bytes;
+        if (now >= burst_start && now < burst_start + window &&
+            vrts::decodeHeader(data, len, header, header_bytes) &&
+            header.packet_type == vrts::VRTS_DATA && header.stream_id < 2 &&
+            counted.insert(header.packet_id).second) {
+          result.bytes[header.stream_id] += len;
+        }
+        to_b.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  vrts::VRTS b(
+      [&](const uint8_t *data, size_t len) {
+        to_a.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  a.updateStreamWeight(0, 3);
+  a.updateStreamWeight(1, 1);
+  a.updatePacingRate(6000);
+
+  auto run = [&](std::chrono::milliseconds duration) {
+    for (auto end = now + duration; now < end;
+         now += std::chrono::milliseconds(1)) {
+      while (!to_b.empty() && to_b.front().deliver_at <= now) {
+        b.receive(to_b.front().data.data(), to_b.front().data.size(), now);
+        to_b.pop_front();
+      }
+      while (!to_a.empty() && to_a.front().deliver_at <= now) {
+        a.receive(to_a.front().data.data(), to_a.front().data.size(), now);
+        to_a.pop_front();
+      }
+      a.step(now);
+      b.step(now);
+      std::vector<uint8_t> nal;
+      for (uint8_t stream_id = 0; stream_id < 2; stream_id++) {
+        while (b.popData(nal, stream_id)) {
+        }
+      }
+    }
+  };
+  std::vector<uint8_t> unit;
+  for (size_t i = 0; i < weight_warm_units; i++) {
+    for (uint8_t stream_id = 0; stream_id < 2; stream_id++) {
+      unit = units[i];
+      a.parse(unit.data(), unit.size(), stream_id);
+    }
+    run(std::chrono::milliseconds(33));
+  }
+  run(both ? std::chrono::milliseconds(500) : std::chrono::milliseconds(1500));
+
+  burst_start = now;
+  uint8_t aud[] = {0, 0, 0, 1, 0x46, 0x01, 0x50};
+  for (uint8_t stream_id = 0; stream_id < (both ? 2 : 1); stream_id++) {
+    for (size_t i = weight_warm_units;
+         i < weight_warm_units + weight_burst_units; i++) {
+      unit = units[i];
+      a.parse(unit.data(), unit.size(), stream_id);
+    }
+    a.parse(aud, sizeof(aud), stream_id);
+  }
+  result.target_kbps[0] = a.getTargetBitrate(0);
+  result.target_kbps[1] = a.getTargetBitrate(1);
+  run(window);
+  return result;
+}
+
+/// Two streams weighted 3:1 with data waiting behind the pacer should get
+/// about 3:1 of it. With one of them idle the other should get all of it,
+/// and its target should take the idle one's share too.
+static bool benchWeights(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== weights: streams sharing the pacer by weight" << std::endl;
+  if (units.size() < weight_warm_units + weight_burst_units) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  const auto window = std::chrono::milliseconds(100);
+  auto both = weightSession(units, true, window);
+  auto alone = weightSession(units, false, window);
+  tracer.setLevel(level);
+
+  std::cout << std::setw(10) << "session" << std::setw(10) << "bytes 0"
+            << std::setw(10) << "bytes 1" << std::setw(10) << "kbps 0"
+            << std::setw(10) << "target 0" << std::setw(10) << "target 1"
+            << std::endl;
+  std::pair<const char *, weight_result_t *> rows[] = {{"both", &both},
+                                                       {"one idle", &alone}};
+  for (auto &row : rows) {
+    auto *r = row.second;
+    std::cout << std::setw(10) << row.first << std::setw(10) << r->bytes[0]
+              << std::setw(10) << r->bytes[1] << std::setw(10)
+              << r->bytes[0] * 8 / window.count() << std::setw(10)
+              << r->target_kbps[0] << std::setw(10) << r->target_kbps[1]
+              << std::endl;
+  }
+
+  double ratio = both.bytes[1] ? double(both.bytes[0]) / both.bytes[1] : 0;
+  bool shared = ratio > 2.5 && ratio < 3.5;
+  // Stream 0 had 3/4 of the pacer and should now have all of it.
+  bool idle_taken = alone.bytes[1] == 0 &&
+                    alone.bytes[0] * 3 > both.bytes[0] * 4 * 9 / 10;
+  // An idle stream's target still counts itself, so stream 0's is 4 times
+  // it rather than 3.
+  auto share = [](const weight_result_t &r) {
+    return r.target_kbps[1] ? double(r.target_kbps[0]) / r.target_kbps[1] : 0;
+  };
+  bool targets = std::abs(share(both) - 3) < 0.1 &&
+                 std::abs(share(alone) - 4) < 0.1;
+  return printChecks({{"shared 3:1", shared},
+                      {"idle share taken", idle_taken},
+                      {"targets by weight", targets}});
+}
+
+typedef struct {
+  uint64_t pictures;
+  // Feed to handed out, ms, for pictures fed in the second from the GOP
+  // start on.
+  double latency_p50_ms;
+  bool irap_out;
+  vrts::vrts_stat_t received;
+  vrts::vrts_stat_t sent;
+} gop_result_t;
+
+/// The clip over path until a second past the GOP start at gop_unit, with
+/// the sender cut off for the outage_units before it.
+static gop_result_t gopSession(const std::vector<std::vector<uint8_t>> &units,
+                               const vrts::sim_path_t &path, size_t gop_unit,
+                               size_t outage_units) {
+  vrts::SimLink link(clip_start, 3);
+  gop_result_t result = {};
+  int64_t gop_us = 0;
+  std::vector<double> latencies;
+  auto outage = path;
+  outage.loss_good = 1;
+  clipSession(
+      link, units, gop_unit + 30, path, std::chrono::seconds(2),
+      [&](size_t i, std::vector<uint8_t> &) {
+        if (outage_units && i + outage_units == gop_unit) {
+          link.setProfile(vrts::SIM_SIDE_A, outage);
+        }
+        if (i == gop_unit) {
+          link.setProfile(vrts::SIM_SIDE_A, path);
+          gop_us = vrts::toMicroseconds(link.now());
+        }
+        return 1;
+      },
+      [&](int64_t fed_us, double latency_ms) {
+        result.pictures++;
+        if (!gop_us || fed_us < gop_us || fed_us >= gop_us + 1000000) {
+          return;
+        }
+        result.irap_out |= fed_us == gop_us;
+        latencies.push_back(latency_ms);
+      });
+  link.endpoint(vrts::SIM_SIDE_B).getStatistics(result.received);
+  link.endpoint(vrts::SIM_SIDE_A).getStatistics(result.sent);
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    result.latency_p50_ms = latencies[latencies.size() / 2];
+  }
+  return result;
+}
+
+/// The sender cut off for the 0.6 s before a GOP start, so a backlog of
+/// unsent and unrepaired frames is left in the tx store when it comes. The
+/// new GOP should go out as if there were none, without asking for another.
+static bool benchGop(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== gop: tx backlog at a GOP start" << std::endl;
+  if (units.size() < 280) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = 20000;
+  path.rate_kbps = 2000;
+  path.queue_bytes = 1 << 20;
+  auto clean = gopSession(units, path, 250, 0);
+  auto cut = gopSession(units, path, 250, 20);
+  tracer.setLevel(level);
+
+  std::cout << std::setw(10) << "session" << std::setw(10) << "pictures"
+            << std::setw(10) << "gop ms" << std::setw(10) << "obsolete"
+            << std::setw(6) << "gops" << std::endl;
+  std::pair<const char *, gop_result_t *> rows[] = {{"clean", &clean},
+                                                    {"outage", &cut}};
+  for (auto &row : rows) {
+    auto *r = row.second;
+    std::cout << std::setw(10) << row.first << std::setw(10) << r->pictures
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << r->latency_p50_ms << std::setw(10) << r->sent.obsolete_frames
+              << std::setw(6) << r->sent.gop_requests << std::endl;
+  }
+
+  bool dropped = cut.sent.obsolete_frames > 0;
+  bool not_queued = cut.irap_out && clean.irap_out &&
+                    cut.latency_p50_ms <= clean.latency_p50_ms * 1.25;
+  bool no_gops = cut.sent.gop_requests == 0;
+  return printChecks({
+      {"backlog dropped", dropped},
+      {"new gop not queued", not_queued},
+      {"no gop asked for", no_gops}});
+}
+
+typedef struct {
+  uint64_t fed;
+  uint64_t pictures;
+  // Pictures handed out that were fed after the lost one and before the
+  // GOP start, and whether that GOP start was.
+  uint64_t between;
+  bool gop_out;
+  vrts::vrts_stat_t received;
+  vrts::vrts_stat_t sent;
+} deps_result_t;
+
+/// NAL type of the first slice in an access unit, -1 if it has none.
+static int pictureType(const std::vector<uint8_t> &data) {
+  for (size_t i = 0; i + 3 < data.size(); i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      int nal_type = (data[i + 3] >> 1) & 0x3f;
+      if (nal_type < 32) {
+        return nal_type;
+      }
+      i += 2;
+    }
+  }
+  return -1;
+}
+
+/// Moves the slices of an access unit to another temporal layer.
+static void relabelLayer(std::vector<uint8_t> &unit, uint8_t temporal_id) {
+  for (size_t k = 0; k + 4 < unit.size(); k++) {
+    if (unit[k] == 0 && unit[k + 1] == 0 && unit[k + 2] == 1 &&
+        ((unit[k + 3] >> 1) & 0x3f) < 32) {
+      unit[k + 4] = (unit[k + 4] & 0xf8) | (temporal_id + 1);
+      k += 2;
+    }
+  }
+}
+
+typedef struct {
+  // Picture lost for good, and the class given neither repairs nor time
+  // for them while it is sent.
+  size_t lost_unit;
+  vrts::nal_class_t lost_class;
+  // Where the clip starts its next GOP, 0 if none is expected.
+  size_t gop_unit;
+  // Units after the lost one sent with the given loss on top.
+  size_t lossy_units;
+  float lossy_loss;
+  bool buffered;
+  bool discard;
+} deps_case_t;
+
+/// 300 units of a clip with the sender cut off while it sends the lost
+/// picture, so it is lost for good.
+static deps_result_t depsSession(const std::vector<std::vector<uint8_t>> &units,
+                                 const vrts::sim_path_t &path,
+                                 const deps_case_t &c) {
+  vrts::SimLink link(clip_start, 5);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  link.endpoint(vrts::SIM_SIDE_B).updateDependencyDiscard(c.discard);
+  link.endpoint(vrts::SIM_SIDE_B).updateJitterBuffer(c.buffered);
+  deps_result_t result = {};
+  int64_t lost_us = 0;
+  int64_t gop_us = 0;
+  auto outage = path;
+  outage.loss_good = 1;
+  auto lossy = path;
+  lossy.loss_good = c.lossy_loss;
+  bool non_ref = c.lost_class == vrts::NAL_CLASS_NON_REFERENCE;
+  result.fed = clipSession(
+      link, units, 300, path, std::chrono::milliseconds(500),
+      [&](size_t i, std::vector<uint8_t> &) {
+        // A unit goes out once the next one starts, so the link is set
+        // for it along with that one.
+        if (i == c.lost_unit + 1) {
+          sender.updateClassReTXLimit(c.lost_class, 0);
+          sender.updateClassAgeRemovalThreshold(c.lost_class, 10);
+          link.setProfile(vrts::SIM_SIDE_A, outage);
+        } else if (i == c.lost_unit + 2) {
+          // Back to the defaults of VRTS.cpp once the lost packets aged out.
+          sender.updateClassReTXLimit(c.lost_class, non_ref ? 1 : 4);
+          sender.updateClassAgeRemovalThreshold(c.lost_class,
+                                                non_ref ? 100 : 200);
+          link.setProfile(vrts::SIM_SIDE_A, c.lossy_units ? lossy : path);
+        } else if (i == c.lost_unit + 2 + c.lossy_units) {
+          link.setProfile(vrts::SIM_SIDE_A, path);
+        }
+        if (i == c.lost_unit) {
+          lost_us = vrts::toMicroseconds(link.now());
+        }
+        if (c.gop_unit && i == c.gop_unit) {
+          gop_us = vrts::toMicroseconds(link.now());
+        }
+        return 1;
+      },
+      [&](int64_t fed_us, double) {
+        result.pictures++;
+        result.between +=
+            lost_us && fed_us > lost_us && (!gop_us || fed_us < gop_us);
+        result.gop_out |= gop_us && fed_us == gop_us;
+      });
+  link.endpoint(vrts::SIM_SIDE_B).getStatistics(result.received);
+  sender.getStatistics(result.sent);
+  return result;
+}
+
+/// One picture lost for good on an otherwise clean link. If nothing refers
+/// to it, that should be all it costs. If later pictures do, they should be
+/// dropped rather than handed to the decoder, and a new GOP asked for if it
+/// was in the base layer. Above it, the pictures referring to it should be
+/// dropped as they come in, with what is missing of them cancelled rather
+/// than repaired.
+static bool benchDeps(void) {
+  // A hierarchical clip with TRAIL_N pictures nothing refers to, and one
+  // where each picture refers to the one before, with IDRs every 250.
+  auto pyramid =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/foo.265");
+  auto chain =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== deps: pictures depending on a lost one" << std::endl;
+  if (pyramid.size() < 300 || chain.size() < 300) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  size_t non_ref_unit = 100;
+  while (non_ref_unit < pyramid.size() &&
+         pictureType(pyramid[non_ref_unit]) != h265nal::NalUnitType::TRAIL_N) {
+    non_ref_unit++;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = 20000;
+  path.rate_kbps = 20000;
+  path.queue_bytes = 1 << 20;
+  auto non_ref = depsSession(pyramid, path,
+                             {non_ref_unit, vrts::NAL_CLASS_NON_REFERENCE, 0,
+                              0, 0, false, true});
+  auto ref = depsSession(
+      chain, path, {101, vrts::NAL_CLASS_REFERENCE, 250, 0, 0, false, true});
+  // The pictures of the second clip from 200 up to the IDR moved to
+  // temporal layer 1, as if the base layer paused there, and 30% loss on
+  // most of them. Losing the first costs no GOP, and each of the others
+  // refers to it through the one before.
+  auto layered = chain;
+  for (size_t i = 200; i < 250; i++) {
+    relabelLayer(layered[i], 1);
+  }
+  deps_case_t upper = {200, vrts::NAL_CLASS_REFERENCE, 250, 40, 0.3f, true,
+                       true};
+  auto layer = depsSession(layered, path, upper);
+  upper.discard = false;
+  auto layer_off = depsSession(layered, path, upper);
+  tracer.setLevel(level);
+
+  std::cout << std::setw(12) << "lost" << std::setw(10) << "pictures"
+            << std::setw(9) << "between" << std::setw(13) << "undecodable"
+            << std::setw(11) << "cancelled" << std::setw(7) << "retx"
+            << std::setw(6) << "gops" << std::endl;
+  std::pair<const char *, deps_result_t *> rows[] = {
+      {"trail_n", &non_ref},
+      {"trail_r", &ref},
+      {"tid 1", &layer},
+      {"tid 1, off", &layer_off}};
+  for (auto &row : rows) {
+    auto *r = row.second;
+    std::cout << std::setw(12) << row.first << std::setw(10) << r->pictures
+              << std::setw(9) << r->between << std::setw(13)
+              << r->received.undecodable_pictures << std::setw(11)
+              << r->sent.cancelled_packets << std::setw(7)
+              << r->sent.retx_total << std::setw(6) << r->sent.gop_requests
+              << std::endl;
+  }
+
+  bool one_picture = non_ref.pictures + 1 == non_ref.fed &&
+                     non_ref.received.undecodable_pictures == 0 &&
+                     non_ref.sent.gop_requests == 0;
+  bool dependents_dropped = ref.between == 0 &&
+                            ref.received.undecodable_pictures > 0 &&
+                            ref.sent.gop_requests > 0 && ref.gop_out;
+  bool repairs_cancelled = layer.between == 0 && layer.gop_out &&
+                           layer.sent.cancelled_packets > 0 &&
+                           layer.sent.retx_total < layer_off.sent.retx_total &&
+                           layer.sent.gop_requests == 0;
+  return printChecks({{"trail_n costs one", one_picture},
+                      {"dependents dropped", dependents_dropped},
+                      {"repairs cancelled", repairs_cancelled}});
+}
+
+/// Path MTU discovery over a link that only carries smaller datagrams than
+/// the sender starts out with, then shrinks further.
+static bool benchPmtu(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== pmtu: fragment size on a 1300 byte path, then 1250"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  const uint32_t first_mtu = 1300;
+  const uint32_t second_mtu = 1250;
+  const uint16_t header = sizeof(vrts::vrts_packetheader_t);
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+
+  vrts::vrts_clock_time_t start{std::chrono::seconds(1700000000)};
+  vrts::SimLink link(start);
+  vrts::sim_path_t path = vrts::sim_path_ideal;
+  path.delay_us = 5000;
+  path.rate_kbps = 20000;
+  path.queue_bytes = 1 << 20;
+  path.mtu_bytes = first_mtu;
+  link.setProfile(vrts::SIM_SIDE_A, path);
+  link.setProfile(vrts::SIM_SIDE_B, path);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  vrts::vrts_stat_t found = {}, shrunk = {}, limited = {};
+  uint64_t blocks = 0;
+  link.setOutput(
+      [&](vrts::sim_side_t side, uint8_t, std::vector<uint8_t> &) {
+        blocks += side == vrts::SIM_SIDE_B;
+      });
+  std::vector<uint8_t> unit;
+  // The whole clip, GOPs start every 250 units. The last unit is the AUD
+  // that flushes the one before.
+  size_t count = units.size();
+  for (size_t i = 0; i < count; i++) {
+    unit = units[i];
+    sender.parse(unit.data(), unit.size());
+    link.runFor(std::chrono::milliseconds(10));
+  }
+  link.runFor(std::chrono::milliseconds(500));
+  sender.getStatistics(found);
+  uint64_t oversize_found = link.path(vrts::SIM_SIDE_A).stats().oversize;
+
+  // Only the periodic search notices a path that got smaller.
+  path.mtu_bytes = second_mtu;
+  link.setProfile(vrts::SIM_SIDE_A, path);
+  link.runFor(std::chrono::seconds(35));
+  sender.getStatistics(shrunk);
+
+  bool rejects_large = !sender.setMtu(1472 - header + 1);
+  bool rejects_small = !sender.setMtu(4);
+  bool accepts = sender.setMtu(1000);
+  link.runFor(std::chrono::seconds(1));
+  sender.getStatistics(limited);
+  tracer.setLevel(level);
+
+  auto within = [](uint32_t found_bytes, uint32_t path_bytes) {
+    return found_bytes <= path_bytes &&
+           found_bytes + vrts::PmtuSearch::resolution >= path_bytes;
+  };
+  std::cout << std::setw(12) << "path" << std::setw(12) << "found"
+            << std::setw(12) << "fragment" << std::endl;
+  std::cout << std::setw(12) << first_mtu << std::setw(12)
+            << found.path_mtu_bytes << std::setw(12) << found.fragment_bytes
+            << std::endl;
+  std::cout << std::setw(12) << second_mtu << std::setw(12)
+            << shrunk.path_mtu_bytes << std::setw(12) << shrunk.fragment_bytes
+            << std::endl;
+  std::cout << std::setw(12) << "setMtu 1000" << std::setw(12)
+            << limited.path_mtu_bytes << std::setw(12)
+            << limited.fragment_bytes << std::endl;
+  std::cout << "  " << blocks << " blocks delivered, " << oversize_found
+            << " datagrams too large for the path" << std::endl;
+
+  return printChecks({
+      {"finds the path mtu", within(found.path_mtu_bytes, first_mtu) &&
+                                 found.fragment_bytes + header ==
+                                     found.path_mtu_bytes},
+      // Until the peer answers probes, key frames are too large for the
+      // path, so the first GOP is lost. The ones after it get through.
+      {"video gets through", blocks + 250 >= count - 1},
+      {"follows it down", within(shrunk.path_mtu_bytes, second_mtu) &&
+                              shrunk.fragment_bytes + header ==
+                                  shrunk.path_mtu_bytes},
+      {"setMtu bounds", rejects_large && rejects_small && accepts},
+      {"setMtu caps search", limited.fragment_bytes == 1000 &&
+                                 limited.path_mtu_bytes == 1000u + header}});
+}
+
+// ---------------------------------------------------------------------------
+// NAL classes: send order and repairs of a backlog behind the pacer.
+// ---------------------------------------------------------------------------
+
+/// The class VRTS gives a chain: the highest among the NAL headers in its
+/// first fragment.
+static vrts::nal_class_t chainClass(const uint8_t *data, size_t len) {
+  auto chain_class = vrts::NAL_CLASS_NON_REFERENCE;
+  for (size_t i = 0; i + 3 < len; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+    uint8_t type = (data[i + 3] >> 1) & 0x3f;
+    auto nal_class = vrts::NAL_CLASS_NON_REFERENCE;
+    if (type >= h265nal::NalUnitType::VPS_NUT &&
+        type <= h265nal::NalUnitType::PPS_NUT) {
+      nal_class = vrts::NAL_CLASS_PARAMETER_SETS;
+    } else if (type >= h265nal::NalUnitType::BLA_W_LP &&
+               type <= h265nal::NalUnitType::RSV_IRAP_VCL23) {
+      nal_class = vrts::NAL_CLASS_IRAP;
+    } else if (type < h265nal::NalUnitType::BLA_W_LP && (type & 1)) {
+      nal_class = vrts::NAL_CLASS_REFERENCE;
+    }
+    chain_class = std::max(chain_class, nal_class);
+    i += 2;
+  }
+  return chain_class;
+}
+
+typedef struct {
+  // Classes of the data fragments in the order they first went out.
+  std::vector<vrts::nal_class_t> order;
+  // Per class: fragments sent, lost on the link, resent, and lost ones
+  // that never got through.
+  uint64_t sent[vrts::NAL_CLASS_COUNT];
+  uint64_t lost[vrts::NAL_CLASS_COUNT];
+  uint64_t retx[vrts::NAL_CLASS_COUNT];
+  uint64_t unrepaired[vrts::NAL_CLASS_COUNT];
+  // Per class: the most times one fragment was resent.
+  uint64_t max_retx[vrts::NAL_CLASS_COUNT];
+} class_result_t;
+
+/// Two virtual link sessions 10 ms apart, stepped in 1 ms. Units up to from
+/// are streamed at 30 fps, then those up to to are fed at once, so they
+/// wait for a pacer set to rate_kbps. From then on every 8th data datagram
+/// is lost, resends included. Only the backlog is counted.
+static class_result_t
+classSession(const std::vector<std::vector<uint8_t>> &units, size_t from,
+             size_t to, uint32_t rate_kbps) {
+  const auto delay = std::chrono::milliseconds(10);
+  vrts::vrts_clock_time_t now = clip_start;
+  std::deque<bench_datagram_t> to_b, to_a;
+  // Per data fragment of the backlog sent: its class, and whether it got
+  // through.
+  std::map<uint32_t, vrts::nal_class_t> classes;
+  std::map<uint32_t, bool> delivered;
+  std::map<uint32_t, uint64_t> resends;
+  bool backlog = false;
+  uint64_t data_sent = 0;
+  class_result_t result = {};
+  vrts::VRTS a(
+      [&](const uint8_t *data, size_t len) {
+        vrts::vrts_packetheader_t header;
+        size_t header_bytes;
+        if (backlog && vrts::decodeHeader(data, len, header, header_bytes) &&
+            header.packet_type == vrts::VRTS_DATA) {
+          uint32_t id = header.packet_id;
+          auto sent = delivered.find(id);
+          if (sent == delivered.end()) {
+            // A chain's first fragment goes out before the rest of it.
+            auto first = classes.find(id - header.parent_id_offset);
+            classes[id] =
+                first != classes.end()
+                    ? first->second
+                    : chainClass(data + header_bytes, header.length);
+            result.order.push_back(classes[id]);
+            result.sent[classes[id]]++;
+            sent = delivered.emplace(id, false).first;
+          } else {
+            result.retx[classes[id]]++;
+            auto &max_retx = result.max_retx[classes[id]];
+            max_retx = std::max(max_retx, ++resends[id]);
+          }
+          if (++data_sent % 8 == 0) {
+            result.lost[classes[id]]++;
+            return;
+          }
+          sent->second = true;
+        }
+        to_b.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  vrts::VRTS b(
+      [&](const uint8_t *data, size_t len) {
+        to_a.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  a.updatePacingRate(rate_kbps);
+  // Repairs only, no parity to rebuild from.
+  for (int c = 0; c < vrts::NAL_CLASS_COUNT; c++) {
+    a.updateFecRedundancy(static_cast<vrts::nal_class_t>(c), 0);
+  }
+
+  std::vector<uint8_t> unit, nal;
+  size_t fed = 0;
+  auto next_feed = now;
+  for (auto end = now + std::chrono::seconds(4); now < end;
+       now += std::chrono::milliseconds(1)) {
+    if (fed < from && now >= next_feed) {
+      unit = units[fed++];
+      a.parse(unit.data(), unit.size());
+      next_feed += std::chrono::microseconds(33333);
+    } else if (fed == from && now >= next_feed + std::chrono::seconds(1)) {
+      // Whatever of the first part is still in flight goes out lossless.
+      for (; fed < to; fed++) {
+        unit = units[fed];
+        a.parse(unit.data(), unit.size());
+      }
+      uint8_t aud[] = {0, 0, 0, 1, 0x46, 0x01, 0x50};
+      a.parse(aud, sizeof(aud));
+      backlog = true;
+    }
+    while (!to_b.empty() && to_b.front().deliver_at <= now) {
+      b.receive(to_b.front().data.data(), to_b.front().data.size(), now);
+      to_b.pop_front();
+    }
+    while (!to_a.empty() && to_a.front().deliver_at <= now) {
+      a.receive(to_a.front().data.data(), to_a.front().data.size(), now);
+      to_a.pop_front();
+    }
+    a.step(now);
+    b.step(now);
+    while (b.popData(nal)) {
+    }
+  }
+  for (auto &entry : delivered) {
+    if (!entry.second) {
+      result.unrepaired[classes[entry.first]]++;
+    }
+  }
+  return result;
+}
+
+/// A GOP's worth of a hierarchical clip queued at once behind the pacer,
+/// with loss. At 8 Mbit/s all of it goes out, parameter sets first and
+/// TRAIL_N last; at 2 Mbit/s TRAIL_N ages out before its turn. Either way
+/// everything a later picture needs gets repaired, and no fragment is
+/// resent more often than its class allows.
+static bool benchClasses(void) {
+  auto units = vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/foo.265");
+  std::cout << "== classes: a backlog sent and repaired by NAL class"
+            << std::endl;
+  if (units.size() < 53) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  const char *names[vrts::NAL_CLASS_COUNT] = {"non_ref", "ref", "irap",
+                                              "params"};
+  // VRTS's default retransmit limits.
+  const uint64_t retx_limits[vrts::NAL_CLASS_COUNT] = {1, 4, 8, 8};
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  std::cout << std::setw(6) << "kbps" << std::setw(10) << "class"
+            << std::setw(8) << "sent" << std::setw(8) << "lost"
+            << std::setw(8) << "retx" << std::setw(10) << "max_retx"
+            << std::setw(12) << "unrepaired" << std::endl;
+  bool in_order = false, trail_n_waits = false;
+  bool repaired = true, within_limits = true;
+  for (uint32_t rate_kbps : {8000u, 2000u}) {
+    // The clip's second GOP runs from 24 to 53.
+    auto r = classSession(units, 24, 53, rate_kbps);
+    for (int c = vrts::NAL_CLASS_COUNT - 1; c >= 0; c--) {
+      std::cout << std::setw(6) << rate_kbps << std::setw(10) << names[c]
+                << std::setw(8) << r.sent[c] << std::setw(8) << r.lost[c]
+                << std::setw(8) << r.retx[c] << std::setw(10) << r.max_retx[c]
+                << std::setw(12) << r.unrepaired[c] << std::endl;
+      if (c >= vrts::NAL_CLASS_REFERENCE) {
+        repaired = repaired && r.unrepaired[c] == 0;
+      }
+      within_limits = within_limits && r.max_retx[c] <= retx_limits[c];
+    }
+    if (rate_kbps == 8000) {
+      in_order = r.sent[vrts::NAL_CLASS_NON_REFERENCE] > 0 &&
+                 std::is_sorted(r.order.begin(), r.order.end(),
+                                std::greater<vrts::nal_class_t>());
+    } else {
+      trail_n_waits = r.sent[vrts::NAL_CLASS_REFERENCE] > 0 &&
+                      r.sent[vrts::NAL_CLASS_NON_REFERENCE] == 0;
+    }
+  }
+  tracer.setLevel(level);
+  return printChecks({{"sent by class", in_order},
+                      {"trail_n waits", trail_n_waits},
+                      {"references repaired", repaired},
+                      {"resends within limits", within_limits}});
+}
+
+// ---------------------------------------------------------------------------
+// Reconnect: one side of a session restarts, as a drone power-cycling does.
+// ---------------------------------------------------------------------------
+
+/// Whether an access unit or NAL block has a PPS, i.e. a decoder can start
+/// from it.
+static bool hasParameterSets(const std::vector<uint8_t> &data) {
+  for (size_t i = 0; i + 3 < data.size(); i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1 &&
+        ((data[i + 3] >> 1) & 0x3f) == h265nal::NalUnitType::PPS_NUT) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Rewrite a datagram into the legacy header of a VRTS_VERSION_PMTU peer,
+/// which knows nothing of epochs. Hellos are dropped, such a peer never
+/// sends them. @returns false if the datagram is to be dropped.
+static bool olderPeer(std::vector<uint8_t> &datagram) {
+  vrts::vrts_packetheader_t header;
+  size_t header_bytes;
+  if (!vrts::decodeHeader(datagram.data(), datagram.size(), header,
+                          header_bytes) ||
+      header.packet_type == vrts::VRTS_HELLO) {
+    return false;
+  }
+  header.version = vrts::VRTS_VERSION_PMTU;
+  header.epoch_tag = 0;
+  std::vector<uint8_t> legacy(sizeof(header) + header.length);
+  memcpy(legacy.data(), &header, sizeof(header));
+  memcpy(legacy.data() + sizeof(header), datagram.data() + header_bytes,
+         header.length);
+  datagram = std::move(legacy);
+  return true;
+}
+
+typedef struct {
+  // From the restart, or the start without one, to the first block the
+  // receiver can decode from. Negative if none came.
+  double decodable_ms;
+  uint32_t peer_restarts;
+  uint32_t stale_epoch_drops;
+} reconnect_result_t;
+
+/// A clip streamed at 30 fps over a lossless path with a fixed one-way
+/// delay. The sender side plays the encoder too: it starts over from the
+/// last GOP start whenever a new GOP is asked for, and after a restart.
+/// restart_frame 0 runs without a restart.
+static reconnect_result_t
+reconnectSession(const std::vector<std::vector<uint8_t>> &units,
+                 std::chrono::microseconds delay, size_t restart_frame,
+                 bool restart_upstream, bool older_peers) {
+  const auto frame_interval = std::chrono::microseconds(33333);
+  const auto tick = std::chrono::microseconds(250);
+  const auto window = std::chrono::seconds(3);
+  vrts::vrts_clock_time_t now{std::chrono::seconds(1700000000)};
+  std::deque<bench_datagram_t> to_downstream, to_upstream;
+  auto sink = [&](std::deque<bench_datagram_t> &path) {
+    return [&](const uint8_t *data, size_t len) {
+      std::vector<uint8_t> datagram(data, data + len);
+      if (!older_peers || olderPeer(datagram)) {
+        path.push_back({now + delay, std::move(datagram)});
+      }
+    };
+  };
+  std::unique_ptr<vrts::VRTS> upstream(
+      new vrts::VRTS(sink(to_downstream), now));
+  std::unique_ptr<vrts::VRTS> downstream(
+      new vrts::VRTS(sink(to_upstream), now));
+
+  std::vector<size_t> gop_starts;
+  for (size_t i = 0; i < units.size(); i++) {
+    if (hasParameterSets(units[i])) {
+      gop_starts.push_back(i);
+    }
+  }
+  auto gopStart = [&](size_t unit) {
+    size_t start = gop_starts.empty() ? 0 : gop_starts.front();
+    for (auto gop : gop_starts) {
+      if (gop <= unit) {
+        start = gop;
+      }
+    }
+    return start;
+  };
+
+  reconnect_result_t result = {-1, 0, 0};
+  auto origin = now;
+  auto end = now + frame_interval * restart_frame + window;
+  auto next_feed = now;
+  size_t frame = 0;
+  size_t unit = 0;
+  std::vector<uint8_t> feed, nal;
+  for (; now < end; now += tick) {
+    while (!to_downstream.empty() && to_downstream.front().deliver_at <= now) {
+      auto &datagram = to_downstream.front();
+      downstream->receive(datagram.data.data(), datagram.data.size(),
+                          datagram.deliver_at);
+      to_downstream.pop_front();
+    }
+    while (!to_upstream.empty() && to_upstream.front().deliver_at <= now) {
+      auto &datagram = to_upstream.front();
+      upstream->receive(datagram.data.data(), datagram.data.size(),
+                        datagram.deliver_at);
+      to_upstream.pop_front();
+    }
+    if (now >= next_feed) {
+      if (restart_frame && frame == restart_frame) {
+        // What is on the path stays there and reaches the new session.
+        auto &restarted = restart_upstream ? upstream : downstream;
+        auto &path = restart_upstream ? to_downstream : to_upstream;
+        restarted.reset(new vrts::VRTS(sink(path), now));
+        if (restart_upstream) {
+          unit = gopStart(unit);
+        }
+        origin = now;
+        result.decodable_ms = -1;
+      }
+      if (upstream->newGOPRequested()) {
+        unit = gopStart(unit);
+      }
+      if (unit + 1 < units.size()) {
+        feed = units[unit];
+        upstream->parse(feed.data(), feed.size());
+        unit++;
+      }
+      frame++;
+      next_feed += frame_interval;
+    }
+    upstream->step(now);
+    downstream->step(now);
+    while (downstream->popData(nal)) {
+      if (result.decodable_ms < 0 && hasParameterSets(nal)) {
+        result.decodable_ms =
+            std::chrono::duration<double, std::milli>(now - origin).count();
+      }
+    }
+  }
+  // The side that stayed up is the one to notice.
+  vrts::vrts_stat_t stats = {};
+  (restart_upstream ? downstream : upstream)->getStatistics(stats);
+  result.peer_restarts = stats.peer_restarts;
+  result.stale_epoch_drops = stats.stale_epoch_drops;
+  return result;
+}
+
+/// Either side restarts 2 s into a session, or the upstream 0.3 s in when
+/// its ids haven't got far yet. Time to the first decodable block is
+/// compared with that of a fresh session, with epochs and between peers
+/// that predate them.
+static bool benchReconnect(void) {
+  auto units =
+      vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/nvenc.265");
+  std::cout << "== reconnect: time to a decodable block after a restart"
+            << std::endl;
+  if (units.empty()) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  struct {
+    const char *name;
+    size_t restart_frame;
+    bool restart_upstream;
+  } cases[] = {{"fresh start", 0, false},
+               {"upstream", 60, true},
+               {"upstream early", 9, true},
+               {"downstream", 60, false}};
+  const std::chrono::microseconds delays[] = {std::chrono::microseconds(100),
+                                              std::chrono::milliseconds(20)};
+  std::cout << std::setw(16) << "restart" << std::setw(10) << "delay ms"
+            << std::setw(12) << "epochs ms" << std::setw(12) << "older ms"
+            << std::setw(10) << "restarts" << std::setw(8) << "stale"
+            << std::endl;
+  bool noticed = true;
+  bool fast = true;
+  bool no_slower = true;
+  for (auto delay : delays) {
+    double fresh_ms = 0;
+    for (auto &c : cases) {
+      auto epochs = reconnectSession(units, delay, c.restart_frame,
+                                     c.restart_upstream, false);
+      auto older = reconnectSession(units, delay, c.restart_frame,
+                                    c.restart_upstream, true);
+      auto ms = [](double value) {
+        std::ostringstream out;
+        if (value < 0) {
+          out << "never";
+        } else {
+          out << std::fixed << std::setprecision(1) << value;
+        }
+        return out.str();
+      };
+      std::cout << std::setw(16) << c.name << std::setw(10) << std::fixed
+                << std::setprecision(1) << delay.count() / 1000.0
+                << std::setw(12) << ms(epochs.decodable_ms) << std::setw(12)
+                << ms(older.decodable_ms) << std::setw(10)
+                << epochs.peer_restarts << std::setw(8)
+                << epochs.stale_epoch_drops << std::endl;
+      if (c.restart_frame == 0) {
+        fresh_ms = epochs.decodable_ms;
+        continue;
+      }
+      noticed &= epochs.peer_restarts == 1;
+      // Back as quickly as a new session, give or take the frames until
+      // the encoder hears of it and a round trip for the hellos.
+      fast &= epochs.decodable_ms >= 0 &&
+              epochs.decodable_ms <=
+                  fresh_ms + 2 * 33.3 + 4 * delay.count() / 1000.0;
+      no_slower &= older.decodable_ms < 0 ||
+                   epochs.decodable_ms <= older.decodable_ms + 33.3;
+    }
+  }
+  tracer.setLevel(level);
+
+  return printChecks({
+      {"restart noticed once", noticed},
+      {"back as fast as fresh", fast},
+      {"no slower than before", no_slower}});
+}
+
+// ---------------------------------------------------------------------------
+// Overflow: a consumer that stops taking blocks off its output queue.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint32_t drops;
+  uint32_t reference_drops;
+  // Asked of the sender.
+  uint32_t gop_requests;
+} overflow_result_t;
+
+/// A hierarchical clip streamed at 30 fps over a lossless 10 ms path, the
+/// sender starting over from the last GOP start when a new one is asked
+/// for. 2 s in the consumer stops taking blocks for stall, then catches up.
+static overflow_result_t
+overflowSession(const std::vector<std::vector<uint8_t>> &units,
+                std::chrono::milliseconds stall) {
+  const auto delay = std::chrono::milliseconds(10);
+  vrts::vrts_clock_time_t now = clip_start;
+  std::deque<bench_datagram_t> to_b, to_a;
+  vrts::VRTS a(
+      [&](const uint8_t *data, size_t len) {
+        to_b.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  vrts::VRTS b(
+      [&](const uint8_t *data, size_t len) {
+        to_a.push_back({now + delay, std::vector<uint8_t>(data, data + len)});
+      },
+      now);
+  size_t gop_start = 0;
+  size_t unit = 0;
+  auto next_feed = now;
+  auto stall_from = now + std::chrono::seconds(2);
+  auto stall_to = stall_from + stall;
+  overflow_result_t result = {};
+  std::vector<uint8_t> feed, nal;
+  for (auto end = stall_to + std::chrono::seconds(1); now < end;
+       now += std::chrono::milliseconds(1)) {
+    if (now >= next_feed) {
+      if (a.newGOPRequested()) {
+        unit = gop_start;
+      }
+      if (hasParameterSets(units[unit])) {
+        gop_start = unit;
+      }
+      feed = units[unit];
+      a.parse(feed.data(), feed.size());
+      unit = (unit + 1) % units.size();
+      next_feed += std::chrono::microseconds(33333);
+    }
+    while (!to_b.empty() && to_b.front().deliver_at <= now) {
+      b.receive(to_b.front().data.data(), to_b.front().data.size(), now);
+      to_b.pop_front();
+    }
+    while (!to_a.empty() && to_a.front().deliver_at <= now) {
+      a.receive(to_a.front().data.data(), to_a.front().data.size(), now);
+      to_a.pop_front();
+    }
+    a.step(now);
+    b.step(now);
+    if (now >= stall_from && now < stall_to) {
+      continue;
+    }
+    while (b.popData(nal)) {
+    }
+  }
+  vrts::vrts_stat_t stats = {};
+  b.getStatistics(stats);
+  result.drops = stats.output_queue_drops;
+  result.reference_drops = stats.output_reference_drops;
+  a.getStatistics(stats);
+  result.gop_requests = stats.gop_requests;
+  return result;
+}
+
+/// The consumer stalls for longer than its output queue holds. A short
+/// overrun sheds pictures nothing refers to and costs no GOP; a long one
+/// has to give up references too, and then asks for a new GOP to resume
+/// from rather than hand the decoder pictures it can't decode.
+static bool benchOverflow(void) {
+  auto units = vrts::loadAccessUnits(std::string(VRTS_MEDIA_DIR) + "/foo.265");
+  std::cout << "== overflow: a stalled consumer's output queue" << std::endl;
+  if (units.size() < 300) {
+    std::cout << "no media in " << VRTS_MEDIA_DIR << ", skipped" << std::endl;
+    return true;
+  }
+  auto &tracer = vrts::Tracer::instance();
+  auto level = tracer.level();
+  tracer.setLevel(vrts::TRACE_LEVEL_ERROR);
+  std::cout << std::setw(10) << "stall ms" << std::setw(8) << "drops"
+            << std::setw(8) << "refs" << std::setw(8) << "gops" << std::endl;
+  // The queue holds 128 blocks, a little over 4.2 s of the clip. Past that
+  // its run of TRAIL_N pictures lasts until about 4.4 s.
+  const std::chrono::milliseconds stalls[] = {std::chrono::milliseconds(0),
+                                              std::chrono::milliseconds(4350),
+                                              std::chrono::milliseconds(6000)};
+  overflow_result_t r[3];
+  for (int i = 0; i < 3; i++) {
+    r[i] = overflowSession(units, stalls[i]);
+    std::cout << std::setw(10) << stalls[i].count() << std::setw(8)
+              << r[i].drops << std::setw(8) << r[i].reference_drops
+              << std::setw(8) << r[i].gop_requests << std::endl;
+  }
+  tracer.setLevel(level);
+  bool none = r[0].drops == 0 && r[0].gop_requests == 0;
+  bool shed_non_ref = r[1].drops > 0 && r[1].reference_drops == 0 &&
+                      r[1].gop_requests == 0;
+  bool refs_ask = r[2].reference_drops > 0 &&
+                  r[2].drops > r[2].reference_drops &&
+                  r[2].gop_requests >= r[2].reference_drops;
+  return printChecks({{"keeping up drops nothing", none},
+                      {"trail_n shed for free", shed_non_ref},
+                      {"lost refs ask for a GOP", refs_ask}});
+}
+
+// ---------------------------------------------------------------------------
+// Congestion control against a simulated bottleneck.
+// ---------------------------------------------------------------------------
+
+// Checks rather than timings: each scenario prints its numbers and whether
+// they meet the bar, and vrts-bench exits non-zero if one doesn't.
+
+typedef struct {
+  uint64_t sent_us;
+  uint64_t arrive_us;
+  uint32_t bytes;
+  int flow;
+} sim_packet_t;
+
+typedef struct {
+  uint64_t at_us;
+  std::vector<sim_packet_t> packets;
+} sim_feedback_t;
+
+/// One sender with a controller, a pacer and an encoder that follows the
+/// target bitrate at 30fps, as VRTS and the drone encoder would.
+struct SimFlow {
+  vrts::CongestionController cc{400000 / 8, 4000000 / 8, 50000000 / 8};
+  vrts::Pacer pacer;
+  uint64_t start_us = 0;
+  uint64_t next_frame_us = 0;
+  double backlog_bytes = 0;
+  std::vector<sim_packet_t> received;
+  std::deque<sim_feedback_t> feedback;
+  std::deque<uint64_t> losses;
+  uint64_t bin_bytes = 0;
+  std::vector<double> throughput_kbps;
+};
+
+/// Bottleneck FIFO with a byte limit, then a fixed propagation delay each way.
+/// capacity_kbps(t_us) gives the link rate over time.
+template <typename C>
+static void simulateLink(std::vector<SimFlow> &flows, uint64_t duration_us,
+                         uint64_t one_way_us, C &&capacity_kbps,
+                         std::vector<double> &queue_ms) {
+  const uint64_t tick_us = 250;
+  const uint64_t ack_period_us = 10000;
+  const uint64_t bin_us = 500000;
+  const uint32_t packet_bytes = 1200;
+  const auto t0 = vrts::Pacer::time_point(std::chrono::seconds(1000));
+  auto at = [&](uint64_t us) { return t0 + std::chrono::microseconds(us); };
+
+  std::deque<sim_packet_t> queue;
+  std::deque<sim_packet_t> propagating;
+  uint64_t queue_bytes = 0;
+  double link_credit = 0;
+  double queue_ms_sum = 0;
+  uint32_t queue_ms_samples = 0;
+
+  for (uint64_t now = 0; now < duration_us; now += tick_us) {
+    double rate = capacity_kbps(now) * 1000.0 / 8.0;
+    uint64_t queue_limit = static_cast<uint64_t>(rate * 0.5);
+
+    for (size_t f = 0; f < flows.size(); f++) {
+      auto &flow = flows[f];
+      if (now < flow.start_us) {
+        continue;
+      }
+      while (!flow.feedback.empty() && flow.feedback.front().at_us <= now) {
+        for (auto &packet : flow.feedback.front().packets) {
+          flow.cc.onAck(packet.bytes, at(packet.sent_us), at(now), false);
+        }
+        flow.cc.onFeedback(at(now));
+        flow.feedback.pop_front();
+      }
+      while (!flow.losses.empty() && flow.losses.front() <= now) {
+        flow.cc.onLoss();
+        flow.losses.pop_front();
+      }
+      if (now >= flow.next_frame_us) {
+        flow.backlog_bytes += flow.cc.targetRate() / 30.0;
+        flow.next_frame_us = now + 1000000 / 30;
+      }
+      flow.pacer.setRate(flow.cc.targetRate() * 5 / 2);
+      flow.pacer.setBurst(8 * packet_bytes);
+      while (flow.backlog_bytes >= 1 && flow.pacer.ready(at(now))) {
+        uint32_t bytes = static_cast<uint32_t>(
+            std::min<double>(packet_bytes, flow.backlog_bytes));
+        flow.backlog_bytes -= bytes;
+        flow.pacer.consume(bytes);
+        if (queue_bytes + bytes > queue_limit) {
+          // Tail drop, the sender hears about it through a NACK an RTT on.
+          flow.losses.push_back(now + 2 * one_way_us);
+          continue;
+        }
+        queue.push_back(sim_packet_t{now, 0, bytes, static_cast<int>(f)});
+        queue_bytes += bytes;
+      }
+    }
+
+    link_credit += rate * tick_us / 1e6;
+    while (!queue.empty() && link_credit >= queue.front().bytes) {
+      auto packet = queue.front();
+      queue.pop_front();
+      queue_bytes -= packet.bytes;
+      link_credit -= packet.bytes;
+      packet.arrive_us = now + one_way_us;
+      propagating.push_back(packet);
+    }
+    if (queue.empty()) {
+      link_credit = std::min<double>(link_credit, packet_bytes);
+    }
+    while (!propagating.empty() && propagating.front().arrive_us <= now) {
+      auto &packet = propagating.front();
+      flows[packet.flow].received.push_back(packet);
+      flows[packet.flow].bin_bytes += packet.bytes;
+      propagating.pop_front();
+    }
+
+    if (now % ack_period_us == 0) {
+      for (auto &flow : flows) {
+        if (!flow.received.empty()) {
+          flow.feedback.push_back(
+              sim_feedback_t{now + one_way_us, std::move(flow.received)});
+          flow.received.clear();
+        }
+      }
+    }
+
+    queue_ms_sum += queue_bytes / rate * 1000.0;
+    queue_ms_samples++;
+    if ((now + tick_us) % bin_us == 0) {
+      for (auto &flow : flows) {
+        flow.throughput_kbps.push_back(flow.bin_bytes * 8.0 / bin_us * 1000.0);
+        flow.bin_bytes = 0;
+      }
+      queue_ms.push_back(queue_ms_sum / queue_ms_samples);
+      queue_ms_sum = 0;
+      queue_ms_samples = 0;
+    }
+  }
+}
+
+static double meanOver(const std::vector<double> &bins, size_t first,
+                       size_t last) {
+  double sum = 0;
+  for (size_t i = first; i < last; i++) {
+    sum += bins[i];
+  }
+  return sum / (last - first);
+}
+
+/// Link rate steps 4 -> 1.5 -> 6 Mbit/s. After each step the sender has to
+/// settle within 20s at 70% or more of the link with less than 100ms queued.
+static bool benchCcConvergence(void) {
+  const uint64_t phase_us = 30000000;
+  const double phases_kbps[] = {4000, 1500, 6000};
+  const size_t bins_per_phase = phase_us / 500000;
+  std::vector<SimFlow> flows(1);
+  std::vector<double> queue_ms;
+  simulateLink(
+      flows, 3 * phase_us, 20000,
+      [&](uint64_t now) { return phases_kbps[now / phase_us]; }, queue_ms);
+
+  std::cout << "== congestion control: convergence, one flow, 40ms RTT"
+            << std::endl;
+  std::cout << std::setw(10) << "link kbps" << std::setw(12) << "settle s"
+            << std::setw(12) << "util %" << std::setw(12) << "queue ms"
+            << std::setw(8) << "" << std::endl;
+  bool pass = true;
+  auto &bins = flows[0].throughput_kbps;
+  for (size_t p = 0; p < 3; p++) {
+    size_t first = p * bins_per_phase, last = first + bins_per_phase;
+    double capacity = phases_kbps[p];
+    // Settled once a 2s average stays in band to the end of the phase.
+    double settle_s = -1;
+    for (size_t b = first; b + 4 <= last; b++) {
+      bool settled = true;
+      for (size_t c = b; c + 4 <= last; c++) {
+        double avg = meanOver(bins, c, c + 4);
+        if (avg < 0.6 * capacity || avg > 1.05 * capacity) {
+          settled = false;
+          break;
+        }
+      }
+      if (settled) {
+        settle_s = (b - first) * 0.5;
+        break;
+      }
+    }
+    double util = 100.0 * meanOver(bins, last - 10, last) / capacity;
+    double queue = meanOver(queue_ms, last - 10, last);
+    bool ok = settle_s >= 0 && settle_s <= 20 && util >= 70 && queue < 100;
+    pass &= ok;
+    std::cout << std::setw(10) << capacity << std::setw(12) << std::fixed
+              << std::setprecision(1) << settle_s << std::setw(12) << util
+              << std::setw(12) << queue << std::setw(8)
+              << (ok ? "ok" : "FAIL") << std::endl;
+  }
+  return pass;
+}
+
+/// Two flows share a 6 Mbit/s link, the second joins 10s in. Over the last
+/// 20s their shares have to reach a Jain index of 0.9 with 80% of the link
+/// used between them.
+static bool benchCcFairness(void) {
+  const uint64_t duration_us = 60000000;
+  const double capacity = 6000;
+  std::vector<SimFlow> flows(2);
+  flows[1].start_us = 10000000;
+  flows[1].next_frame_us = flows[1].start_us;
+  std::vector<double> queue_ms;
+  simulateLink(
+      flows, duration_us, 20000, [&](uint64_t) { return capacity; }, queue_ms);
+
+  size_t last = flows[0].throughput_kbps.size(), first = last - 40;
+  double a = meanOver(flows[0].throughput_kbps, first, last);
+  double b = meanOver(flows[1].throughput_kbps, first, last);
+  double jain = (a + b) * (a + b) / (2 * (a * a + b * b));
+  double util = 100.0 * (a + b) / capacity;
+  double queue = meanOver(queue_ms, first, last);
+  bool ok = jain >= 0.9 && util >= 80;
+
+  std::cout << "== congestion control: fairness, two flows, 40ms RTT"
+            << std::endl;
+  std::cout << std::setw(10) << "flow a" << std::setw(10) << "flow b"
+            << std::setw(8) << "jain" << std::setw(10) << "util %"
+            << std::setw(10) << "queue ms" << std::setw(8) << "" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(10) << a
+            << std::setw(10) << b << std::setprecision(3) << std::setw(8)
+            << jain << std::setprecision(1) << std::setw(10) << util
+            << std::setw(10) << queue << std::setw(8) << (ok ? "ok" : "FAIL")
+            << std::endl;
+  return ok;
+}
+
+int main(int argc, const char *argv[]) {
+  argparse::ArgumentParser parser("vrts-bench", "VRTS microbenchmarks.");
+  parser.add_argument("-s", "--store", "store", false)
+      .description("packet store ACK/NACK/scan cost, std::map vs PacketRing");
+  parser.add_argument("-k", "--sack", "sack", false)
+      .description("ACK/NACK bytes per video byte, id lists vs SACK");
+  parser.add_argument("-w", "--header", "header", false)
+      .description("wire header encode / decode, legacy vs compact");
+  parser.add_argument("-e", "--reconnect", "reconnect", false)
+      .description("time to recover from either side restarting");
+  parser.add_argument("-f", "--fec", "fec", false)
+      .description("FEC encode / rebuild throughput, scalar vs SIMD");
+  parser.add_argument("-c", "--cc", "cc", false)
+      .description("congestion control convergence / fairness on a sim link");
+  parser.add_argument("-i", "--ingest", "ingest", false)
+      .description("encoder buffer to datagrams, copy vs scatter-gather");
+  parser.add_argument("-q", "--queue", "queue", false)
+      .description("output queue hand-off between threads, with shedding, "
+                   "and a stalled consumer's queue overflowing");
+  parser.add_argument("-m", "--metrics", "metrics", false)
+      .description("sharded counters and latency histogram windows");
+  parser.add_argument("-t", "--trace", "trace", false)
+      .description("log line cost, formatted on the spot vs trace records");
+  parser.add_argument("-r", "--replay", "replay", false)
+      .description("capture a lossy session and replay it deterministically");
+  parser.add_argument("-l", "--sim", "sim", false)
+      .description("link simulator models and repeatable simulated sessions");
+  parser.add_argument("-g", "--glass", "glass", false)
+      .description("glass to glass stage latencies between skewed clocks");
+  parser.add_argument("-p", "--pmtu", "pmtu", false)
+      .description("path MTU discovery and fragment sizing on a sim link");
+  parser.add_argument("-j", "--jitter", "jitter", false)
+      .description("jitter buffer playout on a jittery, lossy sim link");
+  parser.add_argument("-o", "--hol", "hol", false)
+      .description("reassembly behind incomplete chains on a lossy sim link");
+  parser.add_argument("-b", "--weights", "weights", false)
+      .description("streams sharing the pacer by weight");
+  parser.add_argument("-n", "--gop", "gop", false)
+      .description("tx backlog dropped at a GOP start on a slow sim link");
+  parser.add_argument("-d", "--deps", "deps", false)
+      .description("pictures depending on a lost one, dropped and cancelled");
+  parser.add_argument("-a", "--classes", "classes", false)
+      .description("a paced backlog sent and repaired by NAL class");
+
+  parser.enable_help();
+  auto err = parser.parse(argc, argv);
+  if (err) {
+    std::cout << err << std::endl;
+    return -1;
+  }
+
+  if (parser.exists("help")) {
+    parser.print_help();
+    return 0;
+  }
+
+  bool run_all = !parser.exists("store") && !parser.exists("sack") &&
+                 !parser.exists("header") && !parser.exists("reconnect") &&
+                 !parser.exists("fec") && !parser.exists("cc") &&
+                 !parser.exists("ingest") && !parser.exists("queue") &&
+                 !parser.exists("metrics") && !parser.exists("trace") &&
+                 !parser.exists("replay") && !parser.exists("sim") &&
+                 !parser.exists("glass") && !parser.exists("pmtu") &&
+                 !parser.exists("jitter") && !parser.exists("hol") &&
+                 !parser.exists("weights") &&
+                 !parser.exists("gop") && !parser.exists("deps") &&
+                 !parser.exists("classes");
+
+  if (run_all || parser.exists("store")) {
+    benchPacketStore();
+  }
+  bool pass = true;
+  if (run_all || parser.exists("sack")) {
+    pass &= benchAckFormat();
+  }
+  if (run_all || parser.exists("fec")) {
+    benchFec();
+  }
+  if (run_all || parser.exists("ingest")) {
+    benchIngest();
+  }
+  if (run_all || parser.exists("header")) {
+    pass &= benchHeader();
+  }
+  if (run_all || parser.exists("queue")) {
+    pass &= benchOutputQueue();
+    pass &= benchOverflow();
+  }
+  if (run_all || parser.exists("metrics")) {
+    pass &= benchMetrics();
+  }
+  if (run_all || parser.exists("trace")) {
+    pass &= benchTrace();
+  }
+  if (run_all || parser.exists("replay")) {
+    pass &= benchReplay();
+  }
+  if (run_all || parser.exists("sim")) {
+    pass &= benchSim();
+  }
+  if (run_all || parser.exists("glass")) {
+    pass &= benchGlass();
+  }
+  if (run_all || parser.exists("pmtu")) {
+    pass &= benchPmtu();
+  }
+  if (run_all || parser.exists("jitter")) {
+    pass &= benchJitter();
+  }
+  if (run_all || parser.exists("hol")) {
+    pass &= benchHol();
+  }
+  if (run_all || parser.exists("weights")) {
+    pass &= benchWeights();
+  }
+  if (run_all || parser.exists("gop")) {
+    pass &= benchGop();
+  }
+  if (run_all || parser.exists("deps")) {
+    pass &= benchDeps();
+  }
+  if (run_all || parser.exists("classes")) {
+    pass &= benchClasses();
+  }
+  if (run_all || parser.exists("reconnect")) {
+    pass &= benchReconnect();
+  }
+  if (run_all || parser.exists("cc")) {
+    pass &= benchCcConvergence();
+    pass &= benchCcFairness();
+  }
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include "argparse.h"
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <string>
+
+#include "Replay.h"
+
+// Replays a capture written by VRTS::startCapture() into a session on a
+// virtual link and prints what it did. Runs as fast as the machine allows,
+// with the same result every time.
+//
+//   ./vrts-replay --file vrts.pcapng
+//   ./vrts-replay --file vrts.pcapng --output stream0.265 --age 200
+
+int main(int argc, const char *argv[]) {
+  argparse::ArgumentParser parser("vrts-replay",
+                                  "Replay a VRTS capture under virtual time.");
+  parser.add_argument("-f", "--file", "file", true)
+      .description("pcapng capture to replay");
+  parser.add_argument("-o", "--output", "output", false)
+      .description("write the NAL blocks of stream 0 to this file");
+  parser.add_argument("-s", "--sync", "sync", false)
+      .description("ACK rate of the session in Hz, 100 by default");
+  parser.add_argument("-a", "--age", "age", false)
+      .description("removal age threshold in ms");
+  parser.add_argument("-q", "--quiet", "quiet", false)
+      .description("don't print VRTS trace to stdout");
+
+  parser.enable_help();
+  auto err = parser.parse(argc, argv);
+  if (err) {
+    std::cout << err << std::endl;
+    return -1;
+  }
+
+  if (parser.exists("help")) {
+    parser.print_help();
+    return 0;
+  }
+
+  vrts::Tracer::instance().setEcho(!parser.exists("quiet"));
+
+  uint16_t sync_hz = 100;
+  if (parser.exists("sync")) {
+    sync_hz = std::stoi(parser.get<std::string>("sync"));
+  }
+  vrts::CaptureReplay replay(sync_hz);
+  if (parser.exists("age")) {
+    uint32_t age_ms = std::stoi(parser.get<std::string>("age"));
+    replay.setConfigure([age_ms](vrts::VRTS &session) {
+      session.updateAgeRemovalThreshold(age_ms);
+    });
+  }
+  std::ofstream output;
+  if (parser.exists("output")) {
+    output.open(parser.get<std::string>("output"), std::ios::binary);
+    replay.setOutput([&output](uint8_t stream_id,
+                               const std::vector<uint8_t> &nal) {
+      if (stream_id == 0) {
+        output.write(reinterpret_cast<const char *>(nal.data()), nal.size());
+      }
+    });
+  }
+
+  std::string path = parser.get<std::string>("file");
+  vrts::replay_result_t result;
+  if (!replay.run(path, result)) {
+    std::cerr << path << " is not a VRTS capture or is empty" << std::endl;
+    return 1;
+  }
+  vrts::Tracer::instance().flush();
+
+  auto &stats = result.stats;
+  printf("capture: %llu received, %llu sent, %llu input buffers\n",
+         (unsigned long long)result.captured_rx,
+         (unsigned long long)result.captured_tx,
+         (unsigned long long)result.captured_input);
+  printf("replay:  %llu ms, %llu datagrams / %llu bytes sent\n",
+         (unsigned long long)result.duration_ms,
+         (unsigned long long)result.sent_datagrams,
+         (unsigned long long)result.sent_bytes);
+  printf("output:  %llu NAL blocks, %llu bytes, hash %016llx\n",
+         (unsigned long long)result.nal_blocks,
+         (unsigned long long)result.nal_bytes,
+         (unsigned long long)result.output_hash);
+  printf("stats:   acks %u nacks %u retx %u fec recovered %u gop requests "
+         "%u output drops %u (%u references)\n",
+         stats.ack_total, stats.nack_total, stats.retx_total,
+         stats.fec_recovered, stats.gop_requests, stats.output_queue_drops,
+         stats.output_reference_drops);
+  auto &reassembly = stats.reassembly_latency.last_60s;
+  printf("latency: reassembly p50 %.2f p99 %.2f ms over %u chains, ack "
+         "delay p50 %.2f ms\n",
+         reassembly.p50, reassembly.p99, reassembly.samples,
+         stats.ack_delay.last_60s.p50);
+  // Captured from a receiver of stamped frames.
+  if (stats.encode_latency.last_60s.samples) {
+    printf("%s", vrts::latencyReport(stats).c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,286 @@
+#include "argparse.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "SimLink.h"
+
+// Streams a clip between two VRTS sessions over simulated links, faster than
+// real time. Each run draws a random link profile from its seed and is
+// repeated for every combination of the tunables given, one CSV line per
+// session on stdout and a summary per combination on stderr.
+//
+//   ./vrts-sim --runs 1000 --age 100,200,400 --unacked 50,200 > sweep.csv
+//   ./vrts-sim --runs 1 --seed 42 --realtime
+
+#ifndef VRTS_MEDIA_DIR
+#define VRTS_MEDIA_DIR "h265nal/media"
+#endif
+
+typedef struct {
+  uint32_t age_ms;
+  uint32_t max_unacked;
+  uint32_t retx_limit;
+} sim_tunables_t;
+
+typedef struct {
+  uint64_t nal_blocks;
+  uint64_t nal_bytes;
+  uint64_t restarts;
+  vrts::vrts_stat_t sent;
+  vrts::vrts_stat_t received;
+  vrts::sim_path_stats_t forward;
+} sim_result_t;
+
+typedef struct {
+  uint64_t sessions;
+  double delivered_percent;
+  double latency_p99_ms;
+  double retx;
+} sim_summary_t;
+
+static std::vector<uint32_t> parseList(const std::string &text) {
+  std::vector<uint32_t> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(std::stoul(item));
+    }
+  }
+  return values;
+}
+
+static double pick(std::mt19937 &random, double low, double high) {
+  return low + (random() >> 5) * (1.0 / 134217728.0) * (high - low);
+}
+
+/// A radio link somewhere between clean and awful.
+static vrts::sim_path_t randomProfile(std::mt19937 &random) {
+  vrts::sim_path_t path;
+  path.loss_good = pick(random, 0, 0.02);
+  path.loss_bad = pick(random, 0.3, 1.0);
+  path.to_bad = pick(random, 0, 0.05);
+  path.to_good = pick(random, 0.1, 0.6);
+  path.rate_kbps = pick(random, 3000, 30000);
+  path.queue_bytes = pick(random, 16 * 1024, 256 * 1024);
+  path.delay_us = pick(random, 1000, 40000);
+  path.jitter_us = pick(random, 0, 10000);
+  path.reorder = pick(random, 0, 0.02);
+  path.reorder_us = pick(random, 1000, 10000);
+  path.duplicate = pick(random, 0, 0.01);
+  return path;
+}
+
+/// Whether an access unit carries a PPS, as the ones opening a GOP do.
+static bool startsGOP(const std::vector<uint8_t> &unit) {
+  for (size_t i = 0; i + 3 < unit.size(); i++) {
+    if (unit[i] == 0 && unit[i + 1] == 0 && unit[i + 2] == 1 &&
+        ((unit[i + 3] >> 1) & 0x3f) == 34) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// One session: unit_count access units at 100 fps, then a second for
+/// retransmits to settle. The clip loops, and a GOP request restarts it at
+/// the last GOP fed, standing in for an encoder forcing a key frame.
+static sim_result_t
+runSession(const std::vector<std::vector<uint8_t>> &units, size_t unit_count,
+           const vrts::sim_path_t &forward, const vrts::sim_path_t &reverse,
+           const sim_tunables_t &tunables, uint32_t seed, bool real_time) {
+  const auto frame_interval = std::chrono::milliseconds(10);
+  const auto linger = std::chrono::seconds(1);
+  vrts::vrts_clock_time_t start{std::chrono::seconds(1700000000)};
+  vrts::SimLink link(start, seed);
+  link.setProfile(vrts::SIM_SIDE_A, forward);
+  link.setProfile(vrts::SIM_SIDE_B, reverse);
+  link.setRealTime(real_time);
+  auto &sender = link.endpoint(vrts::SIM_SIDE_A);
+  auto &receiver = link.endpoint(vrts::SIM_SIDE_B);
+  for (auto *session : {&sender, &receiver}) {
+    session->updateAgeRemovalThreshold(tunables.age_ms);
+    session->updateMaxUnACKedPacketsInTransit(tunables.max_unacked);
+    session->updateReTXLimitPerPacket(tunables.retx_limit);
+  }
+  sim_result_t result = {};
+  link.setOutput(
+      [&](vrts::sim_side_t side, uint8_t, std::vector<uint8_t> &nal) {
+        if (side == vrts::SIM_SIDE_B) {
+          result.nal_blocks++;
+          result.nal_bytes += nal.size();
+        }
+      });
+  std::vector<uint8_t> unit;
+  // The last unit is the lone AUD that flushes the clip.
+  const size_t clip_units = units.size() - 1;
+  size_t source = 0;
+  size_t gop_start = 0;
+  for (size_t i = 0; i < unit_count; i++) {
+    if (sender.newGOPRequested() && !startsGOP(units[source])) {
+      source = gop_start;
+      result.restarts++;
+    }
+    if (startsGOP(units[source])) {
+      gop_start = source;
+    }
+    unit = units[source];
+    source = (source + 1) % clip_units;
+    sender.parse(unit.data(), unit.size());
+    link.runFor(frame_interval);
+  }
+  // The last unit only goes out once another AUD follows it.
+  unit = units.back();
+  sender.parse(unit.data(), unit.size());
+  link.runFor(linger);
+
+  sender.getStatistics(result.sent);
+  receiver.getStatistics(result.received);
+  result.forward = link.path(vrts::SIM_SIDE_A).stats();
+  return result;
+}
+
+int main(int argc, const char *argv[]) {
+  argparse::ArgumentParser parser("vrts-sim",
+                                  "Sweep VRTS tunables over simulated links.");
+  parser.add_argument("-f", "--file", "file", false)
+      .description("Annex B H.265 clip to stream, nvenc.265 by default");
+  parser.add_argument("-n", "--runs", "runs", false)
+      .description("link profiles to draw, 10 by default");
+  parser.add_argument("-s", "--seed", "seed", false)
+      .description("seed of the first profile, 1 by default");
+  parser.add_argument("-u", "--units", "units", false)
+      .description("access units per session, 300 by default");
+  parser.add_argument("-a", "--age", "age", false)
+      .description("removal age thresholds in ms, comma separated");
+  parser.add_argument("-m", "--unacked", "unacked", false)
+      .description("max unACKed packets in transit, comma separated");
+  parser.add_argument("-x", "--retx", "retx", false)
+      .description("retransmit limits per packet, comma separated");
+  parser.add_argument("-r", "--realtime", "realtime", false)
+      .description("pace the simulation to the wall clock");
+
+  parser.enable_help();
+  auto err = parser.parse(argc, argv);
+  if (err) {
+    std::cout << err << std::endl;
+    return -1;
+  }
+  if (parser.exists("help")) {
+    parser.print_help();
+    return 0;
+  }
+
+  // stdout is for the CSV.
+  vrts::Tracer::instance().setEcho(false);
+
+  std::string clip = std::string(VRTS_MEDIA_DIR) + "/nvenc.265";
+  if (parser.exists("file")) {
+    clip = parser.get<std::string>("file");
+  }
+  auto units = vrts::loadAccessUnits(clip);
+  if (units.size() < 2) {
+    std::cerr << "no access units in " << clip << std::endl;
+    return 1;
+  }
+  uint32_t runs = 10;
+  if (parser.exists("runs")) {
+    runs = std::stoul(parser.get<std::string>("runs"));
+  }
+  uint32_t first_seed = 1;
+  if (parser.exists("seed")) {
+    first_seed = std::stoul(parser.get<std::string>("seed"));
+  }
+  size_t unit_count = 300;
+  if (parser.exists("units")) {
+    unit_count = std::stoul(parser.get<std::string>("units"));
+  }
+
+  std::vector<uint32_t> ages{200}, unacked{200}, retx{8};
+  if (parser.exists("age")) {
+    ages = parseList(parser.get<std::string>("age"));
+  }
+  if (parser.exists("unacked")) {
+    unacked = parseList(parser.get<std::string>("unacked"));
+  }
+  if (parser.exists("retx")) {
+    retx = parseList(parser.get<std::string>("retx"));
+  }
+  std::vector<sim_tunables_t> combinations;
+  for (auto age : ages) {
+    for (auto max_unacked : unacked) {
+      for (auto retx_limit : retx) {
+        combinations.push_back({age, max_unacked, retx_limit});
+      }
+    }
+  }
+  if (combinations.empty()) {
+    std::cerr << "no tunables to try" << std::endl;
+    return 1;
+  }
+
+  bool real_time = parser.exists("realtime");
+  // What arrives over a perfect link, to measure the others against.
+  auto ideal = runSession(units, unit_count, vrts::sim_path_ideal,
+                          vrts::sim_path_ideal, {200, 200, 8}, first_seed,
+                          false);
+  if (ideal.nal_blocks == 0) {
+    std::cerr << "nothing arrives over an ideal link" << std::endl;
+    return 1;
+  }
+
+  std::map<size_t, sim_summary_t> summaries;
+  printf("seed,age_ms,max_unacked,retx_limit,loss_good,loss_bad,to_bad,"
+         "to_good,rate_kbps,queue_bytes,delay_us,jitter_us,reorder,"
+         "duplicate,link_lost,link_queue_drops,nal_blocks,delivered_percent,"
+         "nal_latency_p50_ms,nal_latency_p99_ms,reassembly_p99_ms,retx,"
+         "nacks,gop_restarts\n");
+  for (uint32_t run = 0; run < runs; run++) {
+    uint32_t seed = first_seed + run;
+    std::mt19937 random(seed);
+    vrts::sim_path_t forward = randomProfile(random);
+    vrts::sim_path_t reverse = randomProfile(random);
+    for (size_t c = 0; c < combinations.size(); c++) {
+      auto &tunables = combinations[c];
+      auto result = runSession(units, unit_count, forward, reverse, tunables,
+                               seed, real_time);
+      double delivered = 100.0 * result.nal_blocks / ideal.nal_blocks;
+      auto &latency = result.sent.nal_latency.last_60s;
+      printf("%u,%u,%u,%u,%.4f,%.3f,%.4f,%.3f,%u,%u,%u,%u,%.4f,%.4f,%llu,"
+             "%llu,%llu,%.2f,%.2f,%.2f,%.2f,%u,%u,%llu\n",
+             seed, tunables.age_ms, tunables.max_unacked, tunables.retx_limit,
+             forward.loss_good, forward.loss_bad, forward.to_bad,
+             forward.to_good, forward.rate_kbps, forward.queue_bytes,
+             forward.delay_us, forward.jitter_us, forward.reorder,
+             forward.duplicate, (unsigned long long)result.forward.lost,
+             (unsigned long long)result.forward.queue_drops,
+             (unsigned long long)result.nal_blocks, delivered, latency.p50,
+             latency.p99, result.received.reassembly_latency.last_60s.p99,
+             result.sent.retx_total, result.sent.nack_total,
+             (unsigned long long)result.restarts);
+      auto &summary = summaries[c];
+      summary.sessions++;
+      summary.delivered_percent += delivered;
+      summary.latency_p99_ms += latency.p99;
+      summary.retx += result.sent.retx_total;
+    }
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "%8s %12s %10s %11s %12s %8s\n", "age_ms", "max_unacked",
+          "retx_limit", "delivered%", "p99 latency", "retx");
+  for (size_t c = 0; c < combinations.size(); c++) {
+    auto &summary = summaries[c];
+    double n = summary.sessions ? summary.sessions : 1;
+    fprintf(stderr, "%8u %12u %10u %11.2f %12.2f %8.1f\n",
+            combinations[c].age_ms, combinations[c].max_unacked,
+            combinations[c].retx_limit, summary.delivered_percent / n,
+            summary.latency_p99_ms / n, summary.retx / n);
+  }
+  return 0;
+}
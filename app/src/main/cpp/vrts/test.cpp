@@ -13,7 +13,6 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 
-#include "FakeRadioLink.h"
 #include "VRTS.h"
 
 // Set up a second loopback: ifconfig lo:2 128.0.0.1 netmask 255.0.0.0 up
@@ -21,7 +20,6 @@
 // Test source: gst-launch-1.0 -v videotestsrc ! videoconvert ! videoscale ! video/x-raw,width=1280,height=720 ! x265enc bitrate=1000 ! option-string="bframes=0:intra-refresh=1:keyint=60:no-open-gop=1:repeat-headers=1" ! udpsink host=127.0.0.1 port=10000
 // Test sink: GST_DEBUG=4 gst-launch-1.0 udpsrc address=127.0.0.1 port=10001 ! h265parse ! avdec_h265 ! autovideosink sync=false
 bool keep_running = true;
-FakeRadioLink *fake_link = nullptr;
 vrts::VRTS *ts1 = nullptr;
 
 typedef struct {
@@ -111,6 +109,15 @@ int main(int argc, const char *argv[]) {
   parser.add_argument("-p", "--port", "port", true)
       .description("port to listen to for elementary stream input");
   parser.add_argument("-g", "--gcs", "gcs", false).description("act as host/gcs");
+  parser.add_argument("-t", "--trace", "trace", false)
+      .description("write a binary trace for vrts-tracedump to this file");
+  parser.add_argument("-q", "--quiet", "quiet", false)
+      .description("don't print VRTS trace to stdout");
+  parser.add_argument("-c", "--capture", "capture", false)
+      .description("record the session to this pcapng file for vrts-replay");
+  parser.add_argument("-l", "--latency", "latency", false)
+      .description("stamp frames when sending, print stage latencies every "
+                   "5 s when acting as gcs");
 
   parser.enable_help();
   auto err = parser.parse(argc, argv);
@@ -126,20 +133,27 @@ int main(int argc, const char *argv[]) {
 
   signal(SIGINT, signalCallbackHandler);
 
+  vrts::Tracer::instance().setEcho(!parser.exists("quiet"));
+  if (parser.exists("trace")) {
+    vrts::Tracer::instance().openTraceFile(parser.get<std::string>("trace"));
+  }
+
   if (parser.exists("gcs")) {
-    fake_link =
-        new FakeRadioLink("127.0.0.1", 30001, "192.168.1.66", 30000);
-    fake_link->setLossProbability(.05); // 5% packet loss probability
-    fake_link->setMinMaxLatency(0, 0); // 0 - x mS latency per packet burst - needs work (not accurate at all)
     ts1 = new vrts::VRTS(20000, 30000, "192.168.20.30", "192.168.20.4", 100);
   } else {
-    fake_link =
-        new FakeRadioLink("127.0.0.1", 20001, "192.168.1.236", 20000);
-    fake_link->setLossProbability(.05); // 5% packet loss probability
-    fake_link->setMinMaxLatency(0, 0); // 0 - x mS latency per packet burst - needs work (not accurate at all)
     ts1 = new vrts::VRTS(30000, 20000, "192.168.20.4", "192.168.20.30", 100);
   }
 
+  if (parser.exists("capture")) {
+    ts1->startCapture(parser.get<std::string>("capture"));
+  }
+
+  bool latency_report = parser.exists("latency");
+  if (latency_report && !parser.exists("gcs")) {
+    ts1->updateTimestampSei(true);
+  }
+  auto next_report = std::chrono::steady_clock::now();
+
   uint16_t port = 0;
   if (parser.exists("port")) {
     port = std::stoi(parser.get<std::string>("port"));
@@ -166,6 +180,13 @@ int main(int argc, const char *argv[]) {
         ts1->parse(data, len);
       }
     }
+    if (latency_report && parser.exists("gcs") &&
+        std::chrono::steady_clock::now() >= next_report) {
+      next_report += std::chrono::seconds(5);
+      vrts::vrts_stat_t stats;
+      ts1->getStatistics(stats);
+      std::cout << vrts::latencyReport(stats);
+    }
     std::this_thread::sleep_for(std::chrono::milliseconds(2));
   }
 
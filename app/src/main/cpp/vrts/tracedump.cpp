@@ -0,0 +1,117 @@
+#include "argparse.h"
+#include <iostream>
+#include <map>
+#include <stdio.h>
+#include <string>
+
+#include "Trace.h"
+
+// Prints a binary trace file written by Tracer::openTraceFile() as text.
+//
+//   ./vrts-tracedump --file vrts.trace
+//   ./vrts-tracedump --file vrts.trace --level 2
+
+typedef struct {
+  std::string file;
+  std::string text;
+  vrts::trace_format_t format;
+} dump_format_t;
+
+template <typename T> static bool readValue(FILE *in, T &value) {
+  return fread(&value, sizeof(value), 1, in) == 1;
+}
+
+static bool readString(FILE *in, std::string &text, uint16_t len) {
+  text.resize(len);
+  return len == 0 || fread(&text[0], 1, len, in) == len;
+}
+
+int main(int argc, const char *argv[]) {
+  argparse::ArgumentParser parser("vrts-tracedump",
+                                  "Print a VRTS binary trace file.");
+  parser.add_argument("-f", "--file", "file", true)
+      .description("trace file to read");
+  parser.add_argument("-l", "--level", "level", false)
+      .description("lowest level to print, 0 debug .. 3 error");
+
+  parser.enable_help();
+  auto err = parser.parse(argc, argv);
+  if (err) {
+    std::cout << err << std::endl;
+    return -1;
+  }
+
+  if (parser.exists("help")) {
+    parser.print_help();
+    return 0;
+  }
+
+  int min_level = 0;
+  if (parser.exists("level")) {
+    min_level = std::stoi(parser.get<std::string>("level"));
+  }
+
+  std::string path = parser.get<std::string>("file");
+  FILE *in = fopen(path.c_str(), "rb");
+  if (!in) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  char magic[8];
+  if (fread(magic, sizeof(magic), 1, in) != 1 ||
+      memcmp(magic, "VRTSTRC1", sizeof(magic)) != 0) {
+    std::cerr << path << " is not a VRTS trace file" << std::endl;
+    fclose(in);
+    return 1;
+  }
+
+  std::map<uint16_t, dump_format_t> formats;
+  uint64_t records = 0;
+  bool truncated = false;
+  int kind;
+  while ((kind = fgetc(in)) != EOF) {
+    if (kind == 'F') {
+      uint16_t id, line, file_len, format_len;
+      uint8_t level;
+      dump_format_t entry;
+      if (!readValue(in, id) || !readValue(in, level) ||
+          !readValue(in, line) || !readValue(in, file_len) ||
+          !readValue(in, format_len) || !readString(in, entry.file, file_len) ||
+          !readString(in, entry.text, format_len)) {
+        truncated = true;
+        break;
+      }
+      auto &stored = formats[id] = std::move(entry);
+      stored.format = {static_cast<vrts::trace_level_t>(level), line,
+                       stored.file.c_str(), stored.text.c_str()};
+    } else if (kind == 'R') {
+      vrts::trace_record_t record;
+      if (!readValue(in, record)) {
+        truncated = true;
+        break;
+      }
+      records++;
+      auto it = formats.find(record.format_id);
+      if (it == formats.end()) {
+        std::cout << "<record of unknown format " << record.format_id << ">"
+                  << std::endl;
+        continue;
+      }
+      if (it->second.format.level < min_level) {
+        continue;
+      }
+      std::cout << vrts::Tracer::format(record, it->second.format) << '\n';
+    } else {
+      std::cerr << "unexpected entry 0x" << std::hex << kind << std::endl;
+      truncated = true;
+      break;
+    }
+  }
+  fclose(in);
+  std::cout.flush();
+  if (truncated) {
+    std::cerr << "trace ends early after " << records << " records"
+              << std::endl;
+  }
+  return 0;
+}